@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <app.h>
 #include <platform.h>
 #include <kernel/thread.h>
@@ -274,6 +275,169 @@ static void validate_memset(void) {
     }
 }
 
+/* byte at a time reference versions of the scanning routines */
+static int c_memcmp(const void *cs, const void *ct, size_t count) {
+    const unsigned char *su1 = cs, *su2 = ct;
+
+    for (; count > 0; su1++, su2++, count--) {
+        if (*su1 != *su2)
+            return *su1 - *su2;
+    }
+    return 0;
+}
+
+static size_t c_strlen(const char *s) {
+    size_t i = 0;
+
+    while (s[i])
+        i++;
+    return i;
+}
+
+static void *c_memchr(const void *buf, int c, size_t len) {
+    const unsigned char *b = buf;
+
+    for (size_t i = 0; i < len; i++) {
+        if (b[i] == (unsigned char)c)
+            return (void *)(b + i);
+    }
+    return NULL;
+}
+
+static int c_strcmp(const char *cs, const char *ct) {
+    const unsigned char *s1 = (const unsigned char *)cs;
+    const unsigned char *s2 = (const unsigned char *)ct;
+
+    for (; *s1 == *s2 && *s1; s1++, s2++)
+        ;
+    return *s1 - *s2;
+}
+
+static int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+/* fill with bytes that are never zero or the memchr target */
+static void fillbuf_nonzero(void *ptr, size_t len, uint32_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        ((unsigned char *)ptr)[i] = 1 + (seed % 0x7f);
+        seed *= 0x1234567;
+        seed += 1;
+    }
+}
+
+static void validate_strings(void) {
+    const size_t maxsize = 128;
+    const size_t maxalign = 16;
+    uint errors = 0;
+
+    printf("testing memcmp, strcmp, strlen and memchr for correctness\n");
+
+    /* strlen and memchr: every length at every alignment. the bytes past the
+     * end are nonzero and the bytes before are the target, so reading either
+     * side of the range shows up */
+    for (size_t align = 0; align < 64; align++) {
+        for (size_t size = 0; size < maxsize * 2; size++) {
+            fillbuf_nonzero(src, maxsize * 4, 567 + size);
+            src[align + size] = 0;
+            if (strlen((char *)src + align) != c_strlen((char *)src + align)) {
+                printf("error! strlen align %zu, size %zu\n", align, size);
+                errors++;
+            }
+
+            fillbuf_nonzero(src, maxsize * 4, 123 + size);
+            if (align > 0)
+                src[align - 1] = 0xff;
+            src[align + size] = 0xff;
+            for (size_t pos = 0; pos <= size; pos++) {
+                if (pos < size)
+                    src[align + pos] = 0xff;
+                if (memchr(src + align, 0xff, size) != c_memchr(src + align, 0xff, size)) {
+                    printf("error! memchr align %zu, size %zu, pos %zu\n", align, size, pos);
+                    errors++;
+                }
+                if (pos < size)
+                    src[align + pos] = 1;
+            }
+        }
+    }
+
+    /* memcmp and strcmp: every length at every pair of alignments, with the
+     * first difference at every position, in either direction */
+    for (size_t srcalign = 0; srcalign < maxalign; srcalign++) {
+        for (size_t dstalign = 0; dstalign < maxalign; dstalign++) {
+            for (size_t size = 0; size < maxsize; size++) {
+                uint8_t *a = src + srcalign;
+                uint8_t *b = dst + dstalign;
+
+                fillbuf_nonzero(a, size + 1, 4321 + size);
+                memcpy(b, a, size + 1);
+                a[size] = 0;
+                b[size] = 0;
+
+                for (size_t pos = 0; pos <= size; pos++) {
+                    uint8_t save = b[pos];
+                    for (int dir = 0; dir < 2; dir++) {
+                        if (pos < size)
+                            b[pos] = dir ? 0xff : 0;
+                        else if (dir)
+                            b[pos] = 0x80;
+
+                        if (sign(memcmp(a, b, size)) != sign(c_memcmp(a, b, size))) {
+                            printf("error! memcmp srcalign %zu, dstalign %zu, size %zu, pos %zu\n",
+                                   srcalign, dstalign, size, pos);
+                            errors++;
+                        }
+                        if (sign(strcmp((char *)a, (char *)b)) != sign(c_strcmp((char *)a, (char *)b))) {
+                            printf("error! strcmp srcalign %zu, dstalign %zu, size %zu, pos %zu\n",
+                                   srcalign, dstalign, size, pos);
+                            errors++;
+                        }
+                        b[pos] = save;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%u errors\n", errors);
+}
+
+static void bench_strings(void) {
+    const size_t len = BUFFER_SIZE - 1;
+    const int iterations = ITERATIONS / 4;
+    volatile size_t sink = 0;
+    lk_time_t t0, c, libc;
+
+    printf("string scan speed test, %zu bytes %d times\n", len, iterations);
+    thread_sleep(200); // let the debug string clear the serial port
+
+    fillbuf_nonzero(src, len, 567);
+    src[len] = 0;
+    memcpy(dst, src, len + 1);
+
+#define BENCH_SCAN(name, expr) \
+    t0 = current_time(); \
+    for (int i = 0; i < iterations; i++) \
+        sink += (size_t)(expr); \
+    name = current_time() - t0
+
+#define BENCH_PAIR(label, c_expr, libc_expr) \
+    BENCH_SCAN(c, c_expr); \
+    BENCH_SCAN(libc, libc_expr); \
+    printf("%s: c %u msecs, %llu bytes/sec; libc %u msecs, %llu bytes/sec\n", label, \
+           c, (uint64_t)len * iterations * 1000ULL / MAX(c, 1u), \
+           libc, (uint64_t)len * iterations * 1000ULL / MAX(libc, 1u))
+
+    BENCH_PAIR("strlen", c_strlen((char *)src), strlen((char *)src));
+    BENCH_PAIR("memchr", c_memchr(src, 0xff, len), memchr(src, 0xff, len));
+    BENCH_PAIR("memcmp", c_memcmp(src, dst, len), memcmp(src, dst, len));
+    BENCH_PAIR("strcmp", c_strcmp((char *)src, (char *)dst), strcmp((char *)src, (char *)dst));
+
+#undef BENCH_PAIR
+#undef BENCH_SCAN
+}
+
 static int string_tests(int argc, const console_cmd_args *argv) {
     src = memalign(64, BUFFER_SIZE + 256);
     dst = memalign(64, BUFFER_SIZE + 256);
@@ -301,12 +465,16 @@ usage:
             validate_memcpy();
         } else if (!strcmp(argv[2].str, "memset")) {
             validate_memset();
+        } else if (!strcmp(argv[2].str, "strings")) {
+            validate_strings();
         }
     } else if (!strcmp(argv[1].str, "bench")) {
         if (!strcmp(argv[2].str, "memcpy")) {
             bench_memcpy();
         } else if (!strcmp(argv[2].str, "memset")) {
             bench_memset();
+        } else if (!strcmp(argv[2].str, "strings")) {
+            bench_strings();
         }
     } else {
         goto usage;
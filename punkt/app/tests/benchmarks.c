@@ -17,10 +17,22 @@
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
 #include <platform.h>
+#include <arch/perf.h>
 
 const size_t BUFSIZE = (1024*1024);
 const uint ITER = 1024;
 
+/* print the counts the cpu has beyond cycles, per byte handled */
+static void print_perf(const struct arch_perf_sample *delta, size_t bytes) {
+    uint events = arch_perf_events();
+    for (uint i = ARCH_PERF_CYCLES + 1; i < ARCH_PERF_EVENT_COUNT; i++) {
+        if (events & (1u << i)) {
+            printf("\t%llu %s, %f per byte\n", delta->count[i], arch_perf_event_name(i),
+                   delta->count[i] / (double)bytes);
+        }
+    }
+}
+
 __NO_INLINE static void bench_set_overhead(void) {
     uint32_t *buf = malloc(BUFSIZE);
     if (!buf) {
@@ -46,16 +58,20 @@ __NO_INLINE static void bench_memset(void) {
         return;
     }
 
-    ulong count = arch_cycle_count();
+    struct arch_perf_sample start, end, delta;
+    arch_perf_read(&start);
     for (uint i = 0; i < ITER; i++) {
         memset(buf, 0, BUFSIZE);
     }
-    count = arch_cycle_count() - count;
+    arch_perf_read(&end);
+    arch_perf_elapsed(&delta, &start, &end);
+    ulong count = delta.count[ARCH_PERF_CYCLES];
 
     size_t total_bytes = BUFSIZE * ITER;
     double bytes_cycle = total_bytes / (double)count;
     printf("took %lu cycles to memset a buffer of size %zu %d times (%zu bytes), %f bytes/cycle\n",
            count, BUFSIZE, ITER, total_bytes, bytes_cycle);
+    print_perf(&delta, total_bytes);
 
     free(buf);
 }
@@ -127,20 +143,76 @@ __NO_INLINE static void bench_memcpy(void) {
         return;
     }
 
-    ulong count = arch_cycle_count();
+    struct arch_perf_sample start, end, delta;
+    arch_perf_read(&start);
     for (uint i = 0; i < ITER; i++) {
         memcpy(buf, buf + BUFSIZE / 2, BUFSIZE / 2);
     }
-    count = arch_cycle_count() - count;
+    arch_perf_read(&end);
+    arch_perf_elapsed(&delta, &start, &end);
+    ulong count = delta.count[ARCH_PERF_CYCLES];
 
     size_t total_bytes = (BUFSIZE / 2) * ITER;
     double bytes_cycle = total_bytes / (double)count;
     printf("took %lu cycles to memcpy a buffer of size %zu %d times (%zu source bytes), %f source bytes/cycle\n",
            count, BUFSIZE / 2, ITER, total_bytes, bytes_cycle);
+    print_perf(&delta, total_bytes);
 
     free(buf);
 }
 
+/* memcpy across the sizes the small, rep and non temporal paths each take,
+ * with the source and dest at a few alignments to each other */
+__NO_INLINE static void bench_memcpy_sweep(void) {
+    static const size_t sizes[] = { 8, 16, 31, 64, 128, 256, 1024, 4096, 16384, 65536, 256*1024, 1024*1024, 4*1024*1024 };
+    static const struct { uint src, dst; } aligns[] = { { 0, 0 }, { 0, 1 }, { 1, 0 }, { 3, 13 }, { 8, 0 } };
+
+    const size_t bufsize = 4*1024*1024 + 64;
+    uint8_t *src = malloc(bufsize);
+    uint8_t *dst = malloc(bufsize);
+    if (!src || !dst) {
+        printf("failed to allocate buffer\n");
+        free(src);
+        free(dst);
+        return;
+    }
+    memset(src, 0x99, bufsize);
+    memset(dst, 0, bufsize);
+
+    printf("memcpy bytes/cycle by size (rows) and src/dst misalignment (columns)\n");
+    printf("%10s", "size");
+    for (size_t a = 0; a < countof(aligns); a++) {
+        printf("    %2u/%-2u", aligns[a].src, aligns[a].dst);
+    }
+    printf("\n");
+
+    for (size_t s = 0; s < countof(sizes); s++) {
+        size_t len = sizes[s];
+
+        /* about 64MB of copying for each point, but at least a few rounds */
+        uint iter = MAX(4u, (uint)((64*1024*1024) / len));
+
+        printf("%10zu", len);
+        for (size_t a = 0; a < countof(aligns); a++) {
+            const uint8_t *s_ptr = src + aligns[a].src;
+            uint8_t *d_ptr = dst + aligns[a].dst;
+
+            ulong count = arch_cycle_count();
+            for (uint i = 0; i < iter; i++) {
+                memcpy(d_ptr, s_ptr, len);
+                __asm__ volatile("" ::: "memory");
+            }
+            count = arch_cycle_count() - count;
+
+            printf("  %7.2f", (double)len * iter / (double)MAX(count, 1ul));
+        }
+        printf("\n");
+    }
+
+    free(src);
+    free(dst);
+}
+
 #if ARCH_ARM
 __NO_INLINE static void arm_bench_cset_stm(void) {
     uint32_t *buf = malloc(BUFSIZE);
@@ -170,9 +242,16 @@ __NO_INLINE static void arm_bench_cset_stm(void) {
 #endif // ARCH_ARM
 
 int benchmarks(int argc, const console_cmd_args *argv) {
+    /* the perf counters are per cpu, so stay on this one */
+    thread_t *t = get_current_thread();
+    int old_pinned = thread_pinned_cpu(t);
+    thread_set_pinned_cpu(t, arch_curr_cpu_num());
+    thread_yield();
+
     bench_set_overhead();
     bench_memset();
     bench_memcpy();
+    bench_memcpy_sweep();
 
     bench_cset_uint8_t();
     bench_cset_uint16_t();
@@ -184,6 +263,8 @@ int benchmarks(int argc, const console_cmd_args *argv) {
     arm_bench_cset_stm();
 #endif
 
+    thread_set_pinned_cpu(t, old_pinned);
+
     return NO_ERROR;
 }
 
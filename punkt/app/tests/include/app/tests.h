@@ -16,6 +16,7 @@ int port_tests(int argc, const console_cmd_args *argv);
 int spinner(int argc, const console_cmd_args *argv);
 int thread_tests(int argc, const console_cmd_args *argv);
 int benchmarks(int argc, const console_cmd_args *argv);
+int kbench(int argc, const console_cmd_args *argv);
 int clock_tests(int argc, const console_cmd_args *argv);
 
 #endif
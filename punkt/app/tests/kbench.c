@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <app/tests.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/port.h>
+#include <kernel/semaphore.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if WITH_KERNEL_VM
+#include <vm/vm.h>
+#endif
+
+/*
+ * Kernel microbenchmarks. Each one times a single operation, a few warm up
+ * rounds and then the requested number of samples, and prints one line of
+ * key=value pairs in cycles:
+ *
+ * kbench: name=mutex_handoff iters=1000 min=812 median=840 p99=1460 max=9120 mean=871
+ *
+ * Ping-pong style benches run their partner thread at a higher priority,
+ * pinned to the same cpu, so that every handoff is an immediate switch.
+ */
+
+#define KBENCH_DEFAULT_ITERS 1000
+
+struct kbench_ctx {
+    size_t arg;
+    thread_t *partner;
+    volatile bool stop;
+    volatile ulong stamp; // set by the partner when it gets going
+    event_t ev[2];
+    mutex_t mutex;
+    semaphore_t sem;
+    timer_t timer;
+    port_t wport, rport;
+};
+
+struct kbench {
+    const char *name;
+    const char *desc;
+    status_t (*setup)(struct kbench_ctx *ctx);
+    ulong (*op)(struct kbench_ctx *ctx); // cycles for one operation
+    void (*teardown)(struct kbench_ctx *ctx);
+    size_t arg;
+};
+
+static status_t partner_start(struct kbench_ctx *ctx, int (*entry)(void *), int cpu) {
+    ctx->stop = false;
+    ctx->partner = thread_create("kbench partner", entry, ctx, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!ctx->partner)
+        return ERR_NO_MEMORY;
+
+    thread_set_pinned_cpu(ctx->partner, cpu);
+    thread_resume(ctx->partner);
+    return NO_ERROR;
+}
+
+static void partner_join(struct kbench_ctx *ctx) {
+    thread_join(ctx->partner, NULL, INFINITE_TIME);
+    ctx->partner = NULL;
+}
+
+static void events_init(struct kbench_ctx *ctx) {
+    event_init(&ctx->ev[0], false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&ctx->ev[1], false, EVENT_FLAG_AUTOUNSIGNAL);
+}
+
+static void events_destroy(struct kbench_ctx *ctx) {
+    event_destroy(&ctx->ev[0]);
+    event_destroy(&ctx->ev[1]);
+}
+
+/* stop a partner parked in event_wait on ev[0] */
+static void event_partner_stop(struct kbench_ctx *ctx) {
+    ctx->stop = true;
+    event_signal(&ctx->ev[0], true);
+    partner_join(ctx);
+    events_destroy(ctx);
+}
+
+static ulong bench_cycle_overhead(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    return arch_cycle_count() - t0;
+}
+
+/* context switch ping-pong, two switches per sample */
+static int ctxsw_partner(void *arg) {
+    struct kbench_ctx *ctx = arg;
+    for (;;) {
+        event_wait(&ctx->ev[0]);
+        if (ctx->stop)
+            break;
+        event_signal(&ctx->ev[1], true);
+    }
+    return 0;
+}
+
+static status_t ctxsw_setup(struct kbench_ctx *ctx) {
+    events_init(ctx);
+    return partner_start(ctx, &ctxsw_partner, arch_curr_cpu_num());
+}
+
+static ulong bench_ctxsw(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    event_signal(&ctx->ev[0], true);
+    event_wait(&ctx->ev[1]);
+    return arch_cycle_count() - t0;
+}
+
+/* release of a mutex to the waiter running with it */
+static int mutex_partner(void *arg) {
+    struct kbench_ctx *ctx = arg;
+    for (;;) {
+        event_wait(&ctx->ev[0]);
+        if (ctx->stop)
+            break;
+        mutex_acquire(&ctx->mutex);
+        ctx->stamp = arch_cycle_count();
+        mutex_release(&ctx->mutex);
+    }
+    return 0;
+}
+
+static status_t mutex_setup(struct kbench_ctx *ctx) {
+    mutex_init(&ctx->mutex);
+    events_init(ctx);
+    return partner_start(ctx, &mutex_partner, arch_curr_cpu_num());
+}
+
+static ulong bench_mutex_handoff(struct kbench_ctx *ctx) {
+    /* let the partner block on the mutex before timing the release */
+    mutex_acquire(&ctx->mutex);
+    event_signal(&ctx->ev[0], true);
+
+    ulong t0 = arch_cycle_count();
+    mutex_release(&ctx->mutex);
+    return ctx->stamp - t0;
+}
+
+static void mutex_teardown(struct kbench_ctx *ctx) {
+    event_partner_stop(ctx);
+    mutex_destroy(&ctx->mutex);
+}
+
+/* post of a semaphore to the waiter running */
+static int sem_partner(void *arg) {
+    struct kbench_ctx *ctx = arg;
+    for (;;) {
+        sem_wait(&ctx->sem);
+        if (ctx->stop)
+            break;
+        ctx->stamp = arch_cycle_count();
+    }
+    return 0;
+}
+
+static status_t sem_setup(struct kbench_ctx *ctx) {
+    sem_init(&ctx->sem, 0);
+    return partner_start(ctx, &sem_partner, arch_curr_cpu_num());
+}
+
+static ulong bench_sem_handoff(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    sem_post(&ctx->sem, true);
+    return ctx->stamp - t0;
+}
+
+static void sem_teardown(struct kbench_ctx *ctx) {
+    ctx->stop = true;
+    sem_post(&ctx->sem, true);
+    partner_join(ctx);
+    sem_destroy(&ctx->sem);
+}
+
+/* signal of an event to the waiter running */
+static int event_partner(void *arg) {
+    struct kbench_ctx *ctx = arg;
+    for (;;) {
+        event_wait(&ctx->ev[0]);
+        if (ctx->stop)
+            break;
+        ctx->stamp = arch_cycle_count();
+    }
+    return 0;
+}
+
+static status_t event_setup(struct kbench_ctx *ctx) {
+    events_init(ctx);
+    return partner_start(ctx, &event_partner, arch_curr_cpu_num());
+}
+
+static ulong bench_event_signal(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    event_signal(&ctx->ev[0], true);
+    return ctx->stamp - t0;
+}
+
+/* wake a thread on another cpu and have it wake us back, both cpus idle in
+ * between so each leg is an ipi */
+static int ipi_partner(void *arg) {
+    struct kbench_ctx *ctx = arg;
+    for (;;) {
+        event_wait(&ctx->ev[0]);
+        if (ctx->stop)
+            break;
+        event_signal(&ctx->ev[1], false);
+    }
+    return 0;
+}
+
+static status_t ipi_setup(struct kbench_ctx *ctx) {
+    uint cpu = arch_curr_cpu_num();
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i != cpu && mp_is_cpu_active(i)) {
+            events_init(ctx);
+            return partner_start(ctx, &ipi_partner, i);
+        }
+    }
+    return ERR_NOT_SUPPORTED;
+}
+
+static ulong bench_ipi_roundtrip(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    event_signal(&ctx->ev[0], false);
+    event_wait(&ctx->ev[1]);
+    return arch_cycle_count() - t0;
+}
+
+/* a packet written and read straight back on the same thread */
+static status_t port_setup(struct kbench_ctx *ctx) {
+    status_t err = port_create("kbench", PORT_MODE_UNICAST, &ctx->wport);
+    if (err < 0)
+        return err;
+
+    err = port_open("kbench", NULL, &ctx->rport);
+    if (err < 0) {
+        port_close(ctx->wport);
+        port_destroy(ctx->wport);
+    }
+    return err;
+}
+
+static ulong bench_port_roundtrip(struct kbench_ctx *ctx) {
+    static const port_packet_t packet = {{ 1, 2, 3, 4, 5, 6, 7, 8 }};
+    port_result_t result;
+
+    ulong t0 = arch_cycle_count();
+    port_write(ctx->wport, &packet, 1);
+    port_read(ctx->rport, 0, &result);
+    return arch_cycle_count() - t0;
+}
+
+static void port_teardown(struct kbench_ctx *ctx) {
+    port_close(ctx->rport);
+    port_close(ctx->wport);
+    port_destroy(ctx->wport);
+}
+
+static enum handler_return timer_nop(struct timer *t, lk_time_t now, void *arg) {
+    return INT_NO_RESCHEDULE;
+}
+
+static status_t timer_setup(struct kbench_ctx *ctx) {
+    timer_initialize(&ctx->timer);
+    return NO_ERROR;
+}
+
+static ulong bench_timer_set_cancel(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    timer_set_oneshot(&ctx->timer, 1000000, &timer_nop, NULL);
+    timer_cancel(&ctx->timer);
+    return arch_cycle_count() - t0;
+}
+
+static ulong bench_malloc_free(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    void *p = malloc(ctx->arg);
+    free(p);
+    return arch_cycle_count() - t0;
+}
+
+#if WITH_KERNEL_VM
+static ulong bench_pmm_page(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    vm_page_t *page = pmm_alloc_page(PMM_ALLOC_FLAG_ANY, NULL);
+    if (page)
+        pmm_free_page(page);
+    return arch_cycle_count() - t0;
+}
+
+static ulong bench_vmm_alloc(struct kbench_ctx *ctx) {
+    void *ptr;
+
+    ulong t0 = arch_cycle_count();
+    status_t err = vmm_alloc(vmm_get_kernel_aspace(), "kbench", ctx->arg, &ptr, 0, 0,
+                             ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+    if (err >= 0)
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+    return arch_cycle_count() - t0;
+}
+#endif
+
+static int thread_nop(void *arg) {
+    return 0;
+}
+
+static ulong bench_thread_create_join(struct kbench_ctx *ctx) {
+    ulong t0 = arch_cycle_count();
+    thread_t *t = thread_create("kbench", &thread_nop, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (t) {
+        thread_resume(t);
+        thread_join(t, NULL, INFINITE_TIME);
+    }
+    return arch_cycle_count() - t0;
+}
+
+static const struct kbench kbenches[] = {
+    { "cycle_overhead", "back to back cycle counter reads", NULL, &bench_cycle_overhead, NULL, 0 },
+    { "ctxsw_pingpong", "event ping-pong between two threads, two switches", &ctxsw_setup, &bench_ctxsw, &event_partner_stop, 0 },
+    { "mutex_handoff", "mutex release until the waiter runs", &mutex_setup, &bench_mutex_handoff, &mutex_teardown, 0 },
+    { "sem_handoff", "semaphore post until the waiter runs", &sem_setup, &bench_sem_handoff, &sem_teardown, 0 },
+    { "event_signal", "event signal until the waiter runs", &event_setup, &bench_event_signal, &event_partner_stop, 0 },
+    { "ipi_roundtrip", "wake a thread on another cpu and back", &ipi_setup, &bench_ipi_roundtrip, &event_partner_stop, 0 },
+    { "port_roundtrip", "port_write and port_read of one packet", &port_setup, &bench_port_roundtrip, &port_teardown, 0 },
+    { "timer_set_cancel", "timer_set_oneshot and timer_cancel", &timer_setup, &bench_timer_set_cancel, NULL, 0 },
+    { "malloc_16", "malloc and free", NULL, &bench_malloc_free, NULL, 16 },
+    { "malloc_256", "malloc and free", NULL, &bench_malloc_free, NULL, 256 },
+    { "malloc_4096", "malloc and free", NULL, &bench_malloc_free, NULL, 4096 },
+    { "malloc_65536", "malloc and free", NULL, &bench_malloc_free, NULL, 65536 },
+#if WITH_KERNEL_VM
+    { "pmm_page", "pmm_alloc_page and pmm_free_page", NULL, &bench_pmm_page, NULL, 0 },
+    { "vmm_alloc_4k", "vmm_alloc and vmm_free_region", NULL, &bench_vmm_alloc, NULL, PAGE_SIZE },
+    { "vmm_alloc_64k", "vmm_alloc and vmm_free_region", NULL, &bench_vmm_alloc, NULL, 16 * PAGE_SIZE },
+#endif
+    { "thread_create_join", "thread_create, thread_resume and thread_join", NULL, &bench_thread_create_join, NULL, 0 },
+};
+
+static int ulong_cmp(const void *a, const void *b) {
+    ulong ua = *(const ulong *)a;
+    ulong ub = *(const ulong *)b;
+    return (ua > ub) - (ua < ub);
+}
+
+static status_t kbench_run(const struct kbench *b, uint iters) {
+    ulong *samples = malloc(iters * sizeof(ulong));
+    if (!samples)
+        return ERR_NO_MEMORY;
+
+    struct kbench_ctx ctx = { .arg = b->arg };
+    if (b->setup) {
+        status_t err = b->setup(&ctx);
+        if (err < 0) {
+            printf("kbench: name=%s skipped=%d\n", b->name, err);
+            free(samples);
+            return err;
+        }
+    }
+
+    uint warmup = MAX(iters / 10, 10u);
+    for (uint i = 0; i < warmup; i++) {
+        b->op(&ctx);
+    }
+    for (uint i = 0; i < iters; i++) {
+        samples[i] = b->op(&ctx);
+    }
+
+    if (b->teardown)
+        b->teardown(&ctx);
+
+    uint64_t total = 0;
+    for (uint i = 0; i < iters; i++) {
+        total += samples[i];
+    }
+    qsort(samples, iters, sizeof(ulong), &ulong_cmp);
+
+    printf("kbench: name=%s iters=%u min=%lu median=%lu p99=%lu max=%lu mean=%llu\n",
+           b->name, iters, samples[0], samples[iters / 2], samples[(iters * 99) / 100],
+           samples[iters - 1], total / iters);
+
+    free(samples);
+    return NO_ERROR;
+}
+
+int kbench(int argc, const console_cmd_args *argv) {
+    const char *filter = NULL;
+    uint iters = KBENCH_DEFAULT_ITERS;
+
+    if (argc > 1 && !strcmp(argv[1].str, "list")) {
+        for (size_t i = 0; i < countof(kbenches); i++) {
+            printf("%-20s %s\n", kbenches[i].name, kbenches[i].desc);
+        }
+        return NO_ERROR;
+    }
+    if (argc > 1 && !strcmp(argv[1].str, "help")) {
+        printf("usage:\n");
+        printf("%s [name prefix] [iterations]   run all benchmarks or the matching ones\n", argv[0].str);
+        printf("%s list\n", argv[0].str);
+        return NO_ERROR;
+    }
+    if (argc > 1)
+        filter = argv[1].str;
+    if (argc > 2)
+        iters = argv[2].u;
+    if (iters == 0) {
+        printf("need at least one iteration\n");
+        return ERR_INVALID_ARGS;
+    }
+
+    /* cycle counts only compare on the one cpu, so stay on this one */
+    thread_t *t = get_current_thread();
+    int old_pinned = thread_pinned_cpu(t);
+    thread_set_pinned_cpu(t, arch_curr_cpu_num());
+    thread_yield();
+
+    uint ran = 0;
+    for (size_t i = 0; i < countof(kbenches); i++) {
+        const struct kbench *b = &kbenches[i];
+        if (filter && strncmp(b->name, filter, strlen(filter)))
+            continue;
+        kbench_run(b, iters);
+        ran++;
+    }
+
+    thread_set_pinned_cpu(t, old_pinned);
+
+    if (!ran) {
+        printf("no benchmark matches '%s'\n", filter);
+        return ERR_NOT_FOUND;
+    }
+    return NO_ERROR;
+}
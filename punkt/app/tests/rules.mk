@@ -7,6 +7,7 @@ MODULE_SRCS := \
     $(LOCAL_DIR)/cbuf_tests.c \
     $(LOCAL_DIR)/clock_tests.c \
     $(LOCAL_DIR)/fibo.c \
+    $(LOCAL_DIR)/kbench.c \
     $(LOCAL_DIR)/mem_tests.c \
     $(LOCAL_DIR)/tests.c \
     $(LOCAL_DIR)/thread_tests.c \
@@ -17,6 +17,7 @@ STATIC_COMMAND("thread_tests", "test the scheduler", &thread_tests)
 STATIC_COMMAND("port_tests", "test the ports", &port_tests)
 STATIC_COMMAND("clock_tests", "test clocks", &clock_tests)
 STATIC_COMMAND("bench", "miscellaneous benchmarks", &benchmarks)
+STATIC_COMMAND("kbench", "kernel microbenchmarks", &kbench)
 STATIC_COMMAND("fibo", "threaded fibonacci", &fibo)
 STATIC_COMMAND("spinner", "create a spinning thread", &spinner)
 STATIC_COMMAND("cbuf_tests", "test lib/cbuf", &cbuf_tests)
@@ -9,6 +9,7 @@
 #include <lk/bits.h>
 #include <arch/arm.h>
 #include <kernel/thread.h>
+#include <lib/io.h>
 #include <platform.h>
 #include <stdlib.h>
 
@@ -88,6 +89,7 @@ static void dump_iframe(struct arm_iframe *frame) {
 }
 
 static void exception_die(struct arm_fault_frame *frame, const char *msg) {
+    console_output_sync();
     dprintf(CRITICAL, msg);
     dump_fault_frame(frame);
 
@@ -96,6 +98,7 @@ static void exception_die(struct arm_fault_frame *frame, const char *msg) {
 }
 
 static void exception_die_iframe(struct arm_iframe *frame, const char *msg) {
+    console_output_sync();
     dprintf(CRITICAL, msg);
     dump_iframe(frame);
 
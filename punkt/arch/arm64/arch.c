@@ -31,6 +31,9 @@ static void arm64_cpu_early_init(void) {
     /* set the vector base */
     ARM64_WRITE_SYSREG(VBAR_EL1, (uint64_t)&arm64_exception_base);
     arch_enable_fiqs();
+
+    /* start the perf counters */
+    arm64_pmu_init_percpu();
 }
 
 void arch_early_init(void) {
@@ -10,6 +10,8 @@
 #include <lk/bits.h>
 #include <arch/arch_ops.h>
 #include <arch/arm64.h>
+#include <arch/perf.h>
+#include <kernel/ktrace.h>
 
 #define SHUTDOWN_ON_FATAL 1
 
@@ -153,6 +155,42 @@ static void dump_iframe(const struct arm64_iframe_long *iframe) {
     arch_stacktrace(iframe->r[29], iframe->elr);
 }
 
+extern enum handler_return platform_irq(struct arm64_iframe_short *frame);
+
+/* the irq being handled on each cpu, and the frame pointer it interrupted */
+static struct {
+    struct arm64_iframe_short *frame;
+    uint64_t fp;
+} irq_context[SMP_MAX_CPUS];
+
+/* called from the irq vectors */
+enum handler_return arm64_irq(struct arm64_iframe_short *frame);
+enum handler_return arm64_irq(struct arm64_iframe_short *frame) {
+    uint cpu = arch_curr_cpu_num();
+
+    /* the vectors leave x29 alone, so the frame pointer our frame record
+     * saved is the interrupted code's */
+    irq_context[cpu].fp = *(uint64_t *)__builtin_frame_address(0);
+    irq_context[cpu].frame = frame;
+
+    enum handler_return ret = platform_irq(frame);
+
+    irq_context[cpu].frame = NULL;
+    return ret;
+}
+
+bool arch_perf_irq_context(vaddr_t *pc, vaddr_t *fp, bool *user) {
+    uint cpu = arch_curr_cpu_num();
+    struct arm64_iframe_short *frame = irq_context[cpu].frame;
+    if (!frame)
+        return false;
+
+    *pc = frame->elr;
+    *fp = irq_context[cpu].fp;
+    *user = BITS(frame->spsr, 3, 0) == 0; // EL0t
+    return true;
+}
+
 __WEAK void arm64_syscall(struct arm64_iframe_long *iframe, bool is_64bit) {
     panic("unhandled syscall vector\n");
 }
@@ -191,11 +229,13 @@ void arm64_sync_exception(struct arm64_iframe_long *iframe) {
 #endif
         case 0b100000: /* instruction abort from lower level */
         case 0b100001: /* instruction abort from same level */
+            KTRACE_PAGE_FAULT(iframe->elr, iframe->elr, iss);
             printf("instruction abort: PC at 0x%llx\n", iframe->elr);
             print_fault_msg(BITS(iss, 5, 0));
             break;
         case 0b100100: /* data abort from lower level */
         case 0b100101: { /* data abort from same level */
+            KTRACE_PAGE_FAULT(ARM64_READ_SYSREG(far_el1), iframe->elr, iss);
             for (fault_handler = __fault_handler_table_start;
                     fault_handler < __fault_handler_table_end;
                     fault_handler++) {
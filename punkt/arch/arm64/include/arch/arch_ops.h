@@ -81,9 +81,13 @@ static inline void arch_spinloop_signal(void) {
 #define smp_rmb()   CF
 #endif
 
+/* set once the pmu's cycle counter is running, see perf.c */
+extern bool arm64_pmu_cycles;
+
 static inline ulong arch_cycle_count(void) {
-//#warning no arch_cycle_count implementation
-    return 0;
+    if (likely(arm64_pmu_cycles))
+        return ARM64_READ_SYSREG(pmccntr_el0);
+    return ARM64_READ_SYSREG(cntvct_el0);
 }
 
 /* use the cpu local thread context pointer to store current_thread */
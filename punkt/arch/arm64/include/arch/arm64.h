@@ -83,6 +83,8 @@ void arm64_syscall(struct arm64_iframe_long *iframe, bool is_64bit);
  * These routines clean or invalidate the cache from the point of view
  * of a single cpu to the point of coherence.
  */
+void arm64_pmu_init_percpu(void);
+
 void arm64_local_invalidate_cache_all(void);
 void arm64_local_clean_invalidate_cache_all(void);
 void arm64_local_clean_cache_all(void);
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <arch/perf.h>
+
+#include <arch/arm64.h>
+#include <lk/bits.h>
+#include <lk/debug.h>
+#include <lk/trace.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * The perf events on PMUv3. Cycles come from the dedicated cycle counter, run
+ * 64 bits wide, and the rest from the first three event counters, which are
+ * 32 bits. Without a PMU, arch_cycle_count() falls back to the generic timer's
+ * virtual count.
+ */
+
+#define PMCR_E  (1u << 0) // enable
+#define PMCR_P  (1u << 1) // reset the event counters
+#define PMCR_C  (1u << 2) // reset the cycle counter
+#define PMCR_LC (1u << 6) // 64 bit cycle counter
+
+#define PMCNTEN_CYCLES (1u << 31)
+
+/* common event numbers, which double as their bit in pmceid0_el0 */
+#define PMU_EVENT_L1D_CACHE_REFILL 0x03
+#define PMU_EVENT_INST_RETIRED     0x08
+#define PMU_EVENT_BR_MIS_PRED      0x10
+
+bool arm64_pmu_cycles;
+static uint perf_events;
+
+void arm64_pmu_init_percpu(void) {
+    uint pmuver = BITS_SHIFT(ARM64_READ_SYSREG(id_aa64dfr0_el1), 11, 8);
+    if (pmuver == 0 || pmuver == 0xf)
+        return; // none, or not the architected one
+
+    uint64_t pmcr = ARM64_READ_SYSREG(pmcr_el0);
+    uint counters = BITS_SHIFT(pmcr, 15, 11);
+    uint64_t ceid = ARM64_READ_SYSREG(pmceid0_el0);
+
+    uint events = 1u << ARCH_PERF_CYCLES;
+    uint32_t enable = PMCNTEN_CYCLES;
+
+    /* count at EL0 and EL1 */
+    ARM64_WRITE_SYSREG(pmccfiltr_el0, 0ul);
+    if (counters > 0 && (ceid & (1u << PMU_EVENT_INST_RETIRED))) {
+        ARM64_WRITE_SYSREG(pmevtyper0_el0, (uint64_t)PMU_EVENT_INST_RETIRED);
+        enable |= 1u << 0;
+        events |= 1u << ARCH_PERF_INSTRUCTIONS;
+    }
+    if (counters > 1 && (ceid & (1u << PMU_EVENT_L1D_CACHE_REFILL))) {
+        ARM64_WRITE_SYSREG(pmevtyper1_el0, (uint64_t)PMU_EVENT_L1D_CACHE_REFILL);
+        enable |= 1u << 1;
+        events |= 1u << ARCH_PERF_CACHE_MISSES;
+    }
+    if (counters > 2 && (ceid & (1u << PMU_EVENT_BR_MIS_PRED))) {
+        ARM64_WRITE_SYSREG(pmevtyper2_el0, (uint64_t)PMU_EVENT_BR_MIS_PRED);
+        enable |= 1u << 2;
+        events |= 1u << ARCH_PERF_BRANCH_MISSES;
+    }
+
+    ARM64_WRITE_SYSREG(pmcntenset_el0, (uint64_t)enable);
+    ARM64_WRITE_SYSREG(pmcr_el0, pmcr | PMCR_E | PMCR_P | PMCR_C | PMCR_LC);
+
+    LTRACEF("pmuver %u, %u counters, events %#x\n", pmuver, counters, events);
+
+    perf_events = events;
+    arm64_pmu_cycles = true;
+}
+
+uint arch_perf_events(void) {
+    return perf_events | (1u << ARCH_PERF_CYCLES);
+}
+
+void arch_perf_read(struct arch_perf_sample *sample) {
+    sample->count[ARCH_PERF_CYCLES] = arch_cycle_count();
+    sample->count[ARCH_PERF_INSTRUCTIONS] =
+        (perf_events & (1u << ARCH_PERF_INSTRUCTIONS)) ? ARM64_READ_SYSREG(pmevcntr0_el0) : 0;
+    sample->count[ARCH_PERF_CACHE_MISSES] =
+        (perf_events & (1u << ARCH_PERF_CACHE_MISSES)) ? ARM64_READ_SYSREG(pmevcntr1_el0) : 0;
+    sample->count[ARCH_PERF_BRANCH_MISSES] =
+        (perf_events & (1u << ARCH_PERF_BRANCH_MISSES)) ? ARM64_READ_SYSREG(pmevcntr2_el0) : 0;
+}
+
+void arch_perf_elapsed(struct arch_perf_sample *delta, const struct arch_perf_sample *start,
+                       const struct arch_perf_sample *end) {
+    delta->count[ARCH_PERF_CYCLES] = end->count[ARCH_PERF_CYCLES] - start->count[ARCH_PERF_CYCLES];
+    for (uint i = ARCH_PERF_CYCLES + 1; i < ARCH_PERF_EVENT_COUNT; i++) {
+        delta->count[i] = (uint32_t)(end->count[i] - start->count[i]);
+    }
+}
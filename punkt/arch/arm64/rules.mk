@@ -5,6 +5,7 @@ MODULE := $(LOCAL_DIR)
 GLOBAL_DEFINES += \
 	ARM64_CPU_$(ARM_CPU)=1 \
 	ARM_ISA_ARMV8=1 \
+	ARCH_HAS_PERF=1 \
 	IS_64BIT=1
 
 MODULE_SRCS += \
@@ -13,6 +14,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/exceptions.S \
 	$(LOCAL_DIR)/exceptions_c.c \
 	$(LOCAL_DIR)/fpu.c \
+	$(LOCAL_DIR)/perf.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/spinlock.S \
 	$(LOCAL_DIR)/start.S \
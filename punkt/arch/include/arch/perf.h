@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+
+__BEGIN_CDECLS
+
+/*
+ * A small portable view of the cpu's performance counters.
+ *
+ * Arches that have them (ARCH_HAS_PERF) program a counter for each event they
+ * can count on every cpu as it comes up, and leave them running. Reading the
+ * counters before and after a region gives what it cost:
+ *
+ *  struct arch_perf_sample start, end, delta;
+ *  arch_perf_read(&start);
+ *  ...
+ *  arch_perf_read(&end);
+ *  arch_perf_elapsed(&delta, &start, &end);
+ *
+ * The counters are per cpu, so both reads need to happen on the same one:
+ * with interrupts off, or in a thread pinned to a cpu. Events the cpu can't
+ * count read as zero, arch_perf_events() says which ones are live.
+ *
+ * Arches without counters fall back to arch_cycle_count() for the cycles.
+ */
+enum arch_perf_event {
+    ARCH_PERF_CYCLES,
+    ARCH_PERF_INSTRUCTIONS,
+    ARCH_PERF_CACHE_MISSES,
+    ARCH_PERF_BRANCH_MISSES,
+
+    ARCH_PERF_EVENT_COUNT
+};
+
+struct arch_perf_sample {
+    uint64_t count[ARCH_PERF_EVENT_COUNT];
+};
+
+static inline const char *arch_perf_event_name(enum arch_perf_event event) {
+    switch (event) {
+        case ARCH_PERF_CYCLES: return "cycles";
+        case ARCH_PERF_INSTRUCTIONS: return "instructions";
+        case ARCH_PERF_CACHE_MISSES: return "cache misses";
+        case ARCH_PERF_BRANCH_MISSES: return "branch misses";
+        default: return "unknown";
+    }
+}
+
+#if ARCH_HAS_PERF
+
+/* a bit for each event that has a counter on the current cpu */
+uint arch_perf_events(void);
+
+/* snapshot the current cpu's counters */
+void arch_perf_read(struct arch_perf_sample *sample);
+
+/* counts between two samples, allowing for the counters' widths */
+void arch_perf_elapsed(struct arch_perf_sample *delta, const struct arch_perf_sample *start,
+                       const struct arch_perf_sample *end);
+
+/* from inside an interrupt handler, the pc and frame pointer of the code the
+ * interrupt came in on top of and whether it was user code. false when not
+ * handling an interrupt. */
+bool arch_perf_irq_context(vaddr_t *pc, vaddr_t *fp, bool *user);
+
+#else
+
+static inline uint arch_perf_events(void) {
+    return 1u << ARCH_PERF_CYCLES;
+}
+
+static inline void arch_perf_read(struct arch_perf_sample *sample) {
+    for (uint i = 0; i < ARCH_PERF_EVENT_COUNT; i++) {
+        sample->count[i] = 0;
+    }
+    sample->count[ARCH_PERF_CYCLES] = arch_cycle_count();
+}
+
+static inline void arch_perf_elapsed(struct arch_perf_sample *delta, const struct arch_perf_sample *start,
+                                     const struct arch_perf_sample *end) {
+    for (uint i = 0; i < ARCH_PERF_EVENT_COUNT; i++) {
+        delta->count[i] = 0;
+    }
+    delta->count[ARCH_PERF_CYCLES] = (ulong)(end->count[ARCH_PERF_CYCLES] - start->count[ARCH_PERF_CYCLES]);
+}
+
+static inline bool arch_perf_irq_context(vaddr_t *pc, vaddr_t *fp, bool *user) {
+    return false;
+}
+
+#endif
+
+__END_CDECLS
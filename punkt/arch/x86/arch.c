@@ -72,6 +72,7 @@ void x86_early_init_percpu(void) {
 
     x86_mmu_early_init_percpu();
     x86_fpu_early_init_percpu();
+    x86_perf_early_init_percpu();
 }
 
 /* early initialization of the system, on the boot cpu, usually before any sort of
@@ -81,6 +82,7 @@ void arch_early_init(void) {
     x86_feature_early_init();
     x86_mmu_early_init();
     x86_fpu_early_init();
+    x86_perf_early_init();
     x86_early_init_percpu();
 }
 
@@ -10,7 +10,10 @@
 #include <lk/trace.h>
 #include <arch/x86.h>
 #include <arch/fpu.h>
+#include <arch/perf.h>
+#include <kernel/ktrace.h>
 #include <kernel/thread.h>
+#include <lib/io.h>
 
 /* exceptions */
 #define INT_DIVIDE_0        0x00
@@ -49,6 +52,7 @@ static void dump_fault_frame(x86_iframe_t *frame) {
 }
 
 static void exception_die(x86_iframe_t *frame, const char *msg) {
+    console_output_sync();
     dprintf(CRITICAL, "%s", msg);
     dump_fault_frame(frame);
 
@@ -81,6 +85,8 @@ static void x86_pfe_handler(x86_iframe_t *frame) {
     thread_t *current_thread;
     error_code = frame->err_code;
 
+    KTRACE_PAGE_FAULT(x86_get_cr2(), frame->ip, error_code);
+
 #ifdef PAGE_FAULT_DEBUG_INFO
     addr_t v_addr, ssp, esp, ip, rip;
     v_addr = x86_get_cr2();
@@ -139,6 +145,24 @@ static void x86_pfe_handler(x86_iframe_t *frame) {
     }
 }
 
+/* the frame of the irq being handled on each cpu */
+static x86_iframe_t *irq_frame[SMP_MAX_CPUS];
+
+bool x86_in_int_handler(void) {
+    return irq_frame[arch_curr_cpu_num()] != NULL;
+}
+
+bool arch_perf_irq_context(vaddr_t *pc, vaddr_t *fp, bool *user) {
+    x86_iframe_t *frame = irq_frame[arch_curr_cpu_num()];
+    if (!frame)
+        return false;
+
+    *pc = frame->ip;
+    *fp = frame->bp;
+    *user = (frame->cs & 3) != 0;
+    return true;
+}
+
 /* top level x86 exception handler for most exceptions and irqs, called from asm */
 void x86_exception_handler(x86_iframe_t *frame);
 void x86_exception_handler(x86_iframe_t *frame) {
@@ -191,8 +215,14 @@ void x86_exception_handler(x86_iframe_t *frame) {
             break;
 
         /* pass the rest of the irq vectors to the platform */
-        case 0x20 ... 255:
+        case 0x20 ... 255: {
+            uint cpu = arch_curr_cpu_num();
+            irq_frame[cpu] = frame;
+            KTRACE_IRQ_ENTER(vector);
             ret = platform_irq(frame);
+            KTRACE_IRQ_EXIT(vector);
+            irq_frame[cpu] = NULL;
+        }
     }
 
     if (ret != INT_NO_RESCHEDULE)
@@ -45,6 +45,7 @@ struct x86_cpuid_leaf saved_cpuids_ext[__X86_MAX_SUPPORTED_CPUID_EXT - X86_CPUID
 uint32_t max_cpuid_leaf = 0;
 uint32_t max_cpuid_leaf_hyp = 0;
 uint32_t max_cpuid_leaf_ext = 0;
+uint32_t x86_string_features = 0;
 
 static enum x86_cpu_vendor match_cpu_vendor_string(const char *str) {
     // from table at https://www.sandpile.org/x86/cpuid.htm#level_0000_0000h
@@ -186,6 +187,14 @@ void x86_feature_early_init(void) {
                     &saved_cpuids_hyp[index].d);
         }
     }
+
+    // let memcpy and memset pick their strategy
+    if (x86_feature_test(X86_FEATURE_ERMS)) {
+        x86_string_features |= X86_STRING_ERMS;
+    }
+    if (x86_feature_test(X86_FEATURE_FSRM)) {
+        x86_string_features |= X86_STRING_FSRM;
+    }
 }
 
 static void x86_feature_dump_cpuid(void) {
@@ -23,22 +23,60 @@
 
 #include <lk/trace.h>
 #include <lk/bits.h>
+#include <arch/ops.h>
 #include <arch/x86.h>
 #include <arch/x86/feature.h>
 #include <arch/fpu.h>
+#include <assert.h>
 #include <string.h>
+#include <kernel/spinlock.h>
 #include <kernel/thread.h>
 
 #define LOCAL_TRACE 0
 
 #define FPU_MASK_ALL_EXCEPTIONS 1
 
-/* CPUID EAX = 1 return values */
+/*
+ * Fpu state is switched lazily. Each cpu remembers which thread's state its
+ * registers hold, and CR0.TS is left set while that isn't the running thread,
+ * so the first fpu instruction the thread runs traps (#NM) and loads its state
+ * then. Threads that never touch the fpu never pay for a save or a restore.
+ *
+ * While TS is clear the registers belong to the running thread, so it is saved
+ * on the way out, with xsaves or xsaveopt where there is one so that parts left
+ * unmodified since the last restore are skipped. A thread switched back in on
+ * the cpu whose registers still hold its state gets TS cleared and no restore.
+ * The save always happens on the switch out, so a thread that moves to another
+ * cpu finds its state in memory.
+ */
+
+/* xsave state components enabled in XCR0 */
+#define XSTATE_X87 (1u << 0)
+#define XSTATE_SSE (1u << 1)
+#define XSTATE_AVX (1u << 2)
 
 static bool fp_supported;
 
-/* FXSAVE area comprises 512 bytes starting with 16-byte aligned */
-static uint8_t __ALIGNED(16) fpu_init_states[512]= {0};
+/* how thread state is saved and restored */
+static enum {
+    FPU_SAVE_FXSAVE,
+    FPU_SAVE_XSAVE,
+    FPU_SAVE_XSAVEOPT,
+    FPU_SAVE_XSAVES,
+} fpu_save_mode;
+
+static uint64_t xstate_mask;
+static size_t fpu_state_size = 512;
+
+/* the state new threads start with, in the format fpu_save_mode saves */
+static uint8_t __ALIGNED(64) fpu_init_states[X86_FPU_STATE_SIZE]= {0};
+
+/* the thread whose state each cpu's registers hold, if any */
+static thread_t *fpu_owner[SMP_MAX_CPUS];
+
+/* interrupt state to put back at kernel_fpu_end(), and whether a section is open */
+static spin_lock_saved_state_t kernel_fpu_state[SMP_MAX_CPUS];
+static bool kernel_fpu_active[SMP_MAX_CPUS];
 
 /* saved copy of some feature bits */
 typedef struct {
@@ -56,6 +94,7 @@ typedef struct {
     bool with_xsaveopt;
     bool with_xsavec;
     bool with_xsaves;
+    bool with_avx;
 } fpu_features_t;
 
 static fpu_features_t fpu_features;
@@ -65,7 +104,49 @@ static void disable_fpu(void) {
 }
 
 static void enable_fpu(void) {
-    x86_set_cr0(x86_get_cr0() & ~X86_CR0_TS);
+    x86_clts();
+}
+
+static bool fpu_enabled(void) {
+    return !(x86_get_cr0() & X86_CR0_TS);
+}
+
+static void fpu_save(void *states) {
+    uint32_t lo = (uint32_t)xstate_mask;
+    uint32_t hi = (uint32_t)(xstate_mask >> 32);
+
+    switch (fpu_save_mode) {
+        case FPU_SAVE_FXSAVE:
+            __asm__ __volatile__("fxsave (%0)" :: "r"(states) : "memory");
+            break;
+        case FPU_SAVE_XSAVE:
+            __asm__ __volatile__("xsave (%0)" :: "r"(states), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_SAVE_XSAVEOPT:
+            __asm__ __volatile__("xsaveopt (%0)" :: "r"(states), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_SAVE_XSAVES:
+            __asm__ __volatile__("xsaves (%0)" :: "r"(states), "a"(lo), "d"(hi) : "memory");
+            break;
+    }
+}
+
+static void fpu_restore(const void *states) {
+    uint32_t lo = (uint32_t)xstate_mask;
+    uint32_t hi = (uint32_t)(xstate_mask >> 32);
+
+    switch (fpu_save_mode) {
+        case FPU_SAVE_FXSAVE:
+            __asm__ __volatile__("fxrstor (%0)" :: "r"(states) : "memory");
+            break;
+        case FPU_SAVE_XSAVE:
+        case FPU_SAVE_XSAVEOPT:
+            __asm__ __volatile__("xrstor (%0)" :: "r"(states), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_SAVE_XSAVES:
+            __asm__ __volatile__("xrstors (%0)" :: "r"(states), "a"(lo), "d"(hi) : "memory");
+            break;
+    }
 }
 
 /* called per cpu as they're brought up */
@@ -98,9 +179,18 @@ void x86_fpu_early_init_percpu(void) {
     x = x86_get_cr4();
     x |= X86_CR4_OSXMMEXPT; // supports exceptions
     x |= X86_CR4_OSFXSR;    // supports fxsave
-    x &= ~X86_CR4_OSXSAVE;  // no support for xsave (currently)
+    if (fpu_save_mode != FPU_SAVE_FXSAVE)
+        x |= X86_CR4_OSXSAVE;
+    else
+        x &= ~X86_CR4_OSXSAVE;
     x86_set_cr4(x);
 
+    if (fpu_save_mode != FPU_SAVE_FXSAVE) {
+        x86_xsetbv(0, xstate_mask);
+        if (fpu_save_mode == FPU_SAVE_XSAVES)
+            write_msr(X86_MSR_IA32_XSS, 0);
+    }
+
     uint32_t mxcsr;
     __asm__ __volatile__("stmxcsr %0" : "=m" (mxcsr));
 #if FPU_MASK_ALL_EXCEPTIONS
@@ -113,9 +203,17 @@ void x86_fpu_early_init_percpu(void) {
     __asm__ __volatile__("ldmxcsr %0" : : "m" (mxcsr));
 
     /* save fpu initial states, and used when new thread creates */
-    __asm__ __volatile__("fxsave %0" : "=m" (fpu_init_states));
+    if (arch_curr_cpu_num() == 0) {
+        if (fpu_save_mode == FPU_SAVE_XSAVEOPT)
+            __asm__ __volatile__("xsave (%0)" :: "r"(fpu_init_states),
+                                 "a"((uint32_t)xstate_mask), "d"((uint32_t)(xstate_mask >> 32)) : "memory");
+        else
+            fpu_save(fpu_init_states);
+    }
 
-    enable_fpu();
+    /* nothing is loaded yet, the first thread to use the fpu here traps */
+    fpu_owner[arch_curr_cpu_num()] = NULL;
+    disable_fpu();
 }
 
 /* called on the first cpu before the kernel is initialized. printfs may not work here */
@@ -133,6 +231,7 @@ void x86_fpu_early_init(void) {
     fpu_features.with_sse4a = x86_feature_test(X86_FEATURE_SSE4A);
     fpu_features.with_fxsave = x86_feature_test(X86_FEATURE_FXSR);
     fpu_features.with_xsave = x86_feature_test(X86_FEATURE_XSAVE);
+    fpu_features.with_avx = x86_feature_test(X86_FEATURE_AVX);
 
     // these are the mandatory ones to continue (for the moment)
     if (!fpu_features.with_fpu || !fpu_features.with_sse || !fpu_features.with_fxsave) {
@@ -142,7 +241,6 @@ void x86_fpu_early_init(void) {
     fp_supported = true;
 
     // detect and save some xsave information
-    // NOTE: currently unused
     fpu_features.with_xsaveopt = false;
     fpu_features.with_xsavec = false;
     fpu_features.with_xsaves = false;
@@ -150,24 +248,44 @@ void x86_fpu_early_init(void) {
         LTRACEF("X86: XSAVE detected\n");
         struct x86_cpuid_leaf leaf;
         if (x86_get_cpuid_subleaf(X86_CPUID_XSAVE, 0, &leaf)) {
+            // components the cpu can save, of the ones the save area has room for
+            xstate_mask = leaf.a & (XSTATE_X87 | XSTATE_SSE);
+            if (fpu_features.with_avx)
+                xstate_mask |= leaf.a & XSTATE_AVX;
+            LTRACEF("xsave leaf 0: %#x %#x %#x %#x\n", leaf.a, leaf.b, leaf.c, leaf.d);
+        }
+        if (x86_get_cpuid_subleaf(X86_CPUID_XSAVE, 1, &leaf)) {
             fpu_features.with_xsaveopt = BIT(leaf.a, 0);
             fpu_features.with_xsavec = BIT(leaf.a, 1);
             fpu_features.with_xsaves = BIT(leaf.a, 3);
             LTRACEF("xsaveopt %u xsavec %u xsaves %u\n", fpu_features.with_xsaveopt, fpu_features.with_xsavec, fpu_features.with_xsaves);
-            LTRACEF("xsave leaf 0: %#x %#x %#x %#x\n", leaf.a, leaf.b, leaf.c, leaf.d);
-        }
-        if (x86_get_cpuid_subleaf(X86_CPUID_XSAVE, 1, &leaf)) {
             LTRACEF("xsave leaf 1: %#x %#x %#x %#x\n", leaf.a, leaf.b, leaf.c, leaf.d);
         }
 
+        // the standard format puts each component at a fixed offset, compacted
+        // formats are never larger
+        size_t size = 512 + 64;
         for (int i = 2; i < 64; i++) {
             if (x86_get_cpuid_subleaf(X86_CPUID_XSAVE, i, &leaf)) {
                 if (leaf.a > 0) {
                     LTRACEF("xsave leaf %d: %#x %#x %#x %#x\n", i, leaf.a, leaf.b, leaf.c, leaf.d);
                     LTRACEF("\tstate %d: size required %u offset %u\n", i, leaf.a, leaf.b);
+                    if (xstate_mask & (1ull << i))
+                        size = MAX(size, (size_t)leaf.a + leaf.b);
                 }
             }
         }
+
+        if ((xstate_mask & (XSTATE_X87 | XSTATE_SSE)) == (XSTATE_X87 | XSTATE_SSE) &&
+                size <= X86_FPU_STATE_SIZE) {
+            fpu_state_size = size;
+            if (fpu_features.with_xsaves)
+                fpu_save_mode = FPU_SAVE_XSAVES;
+            else if (fpu_features.with_xsaveopt)
+                fpu_save_mode = FPU_SAVE_XSAVEOPT;
+            else
+                fpu_save_mode = FPU_SAVE_XSAVE;
+        }
     }
 }
 
@@ -208,49 +326,119 @@ void x86_fpu_init(void) {
         }
     }
 
+    if (fp_supported) {
+        static const char *const save_names[] = { "fxsave", "xsave", "xsaveopt", "xsaves" };
+        dprintf(SPEW, "X86: fpu state saved with %s, %zu bytes, xstate mask %#llx\n",
+                save_names[fpu_save_mode], fpu_state_size, xstate_mask);
+    }
 }
 
 void fpu_init_thread_states(thread_t *t) {
-    t->arch.fpu_states = (vaddr_t *)ROUNDUP(((vaddr_t)t->arch.fpu_buffer), 16);
-    memcpy(t->arch.fpu_states, fpu_init_states, sizeof(fpu_init_states));
+    t->arch.fpu_states = (vaddr_t *)ROUNDUP(((vaddr_t)t->arch.fpu_buffer), 64);
+    t->arch.fpu_cpu = -1;
+    memcpy(t->arch.fpu_states, fpu_init_states, fpu_state_size);
 }
 
+/* called with interrupts disabled */
 void fpu_context_switch(thread_t *old_thread, thread_t *new_thread) {
     if (!fp_supported)
         return;
 
     DEBUG_ASSERT(old_thread != new_thread);
 
-    LTRACEF("cpu %u old %p new %p\n", arch_curr_cpu_num(), old_thread, new_thread);
-    LTRACEF("old fpu_states %p new fpu_states %p\n",
-            old_thread->arch.fpu_states, new_thread->arch.fpu_states);
-
-    // TODO: use the appropriate versions of fpu state save/restore based on the
-    // features of the CPU. For the moment, we assume that the CPU supports
-    // FXSAVE and that the threads have been initialized with FXSAVE state.
-
-    // save the old thread's fpu state if it has one and restore the new thread's
-    // fpu state if it has one. Remember if the old thread had a valid FPU state
-    // so that we can enable the FPU if it was disabled.
-    bool old_fpu_enabled = false;
-    if (likely(old_thread->arch.fpu_states)) {
-        __asm__ __volatile__("fxsave %0" : "=m" (*old_thread->arch.fpu_states));
-        old_fpu_enabled = true;
-    }
-    if (likely(new_thread->arch.fpu_states)) {
-        if (!old_fpu_enabled) {
-            enable_fpu();
+    uint cpu = arch_curr_cpu_num();
+    bool enabled = fpu_enabled();
+
+    LTRACEF("cpu %u old %p new %p, fpu %s, owner %p\n", cpu, old_thread, new_thread,
+            enabled ? "enabled" : "disabled", fpu_owner[cpu]);
+
+    // the old thread used the fpu since it was switched in, so its state is in
+    // the registers and newer than what it has saved
+    if (enabled) {
+        if (likely(old_thread->arch.fpu_states)) {
+            fpu_save(old_thread->arch.fpu_states);
+            fpu_owner[cpu] = old_thread;
+            old_thread->arch.fpu_cpu = cpu;
+        } else {
+            fpu_owner[cpu] = NULL;
         }
-        __asm__ __volatile__("fxrstor %0" : : "m" (*new_thread->arch.fpu_states));
-    } else {
-        // if switching to a thread that does not have FPU state, disable the FPU.
+    }
+
+    // let the new thread straight at the registers if they still hold its state
+    bool valid = fpu_owner[cpu] == new_thread && new_thread->arch.fpu_cpu == (int)cpu;
+    if (valid && !enabled) {
+        enable_fpu();
+    } else if (!valid && enabled) {
         disable_fpu();
     }
 }
 
+/* the running thread touched the fpu with CR0.TS set, called with interrupts disabled */
 void fpu_dev_na_handler(void) {
-    TRACEF("cpu %u\n", arch_curr_cpu_num());
+    uint cpu = arch_curr_cpu_num();
+    thread_t *t = get_current_thread();
+
+    LTRACEF("cpu %u thread %p, owner %p\n", cpu, t, fpu_owner[cpu]);
 
-    panic("FPU not available on this CPU\n");
+    if (unlikely(!fp_supported)) {
+        panic("FPU not available on this CPU\n");
+    }
+    if (unlikely(x86_in_int_handler())) {
+        panic("floating point code in irq context without kernel_fpu_begin()\n");
+    }
+
+    enable_fpu();
+
+    // threads without a save area, early in boot, get whatever is in there
+    if (unlikely(!t || !t->arch.fpu_states)) {
+        fpu_owner[cpu] = NULL;
+        return;
+    }
+
+    if (fpu_owner[cpu] != t || t->arch.fpu_cpu != (int)cpu) {
+        fpu_restore(t->arch.fpu_states);
+        fpu_owner[cpu] = t;
+        t->arch.fpu_cpu = cpu;
+    }
+}
+
+/*
+ * Interrupts stay disabled until kernel_fpu_end(), so the thread can't be
+ * switched out with the scratch values in the registers, and no irq handler
+ * can open a section of its own over them.
+ */
+void kernel_fpu_begin(void) {
+    DEBUG_ASSERT(fp_supported);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    DEBUG_ASSERT(!kernel_fpu_active[cpu]);
+    kernel_fpu_active[cpu] = true;
+    kernel_fpu_state[cpu] = state;
+    if (fpu_enabled()) {
+        // the registers hold the running or interrupted thread's live state
+        thread_t *t = get_current_thread();
+        if (likely(t && t->arch.fpu_states))
+            fpu_save(t->arch.fpu_states);
+    } else {
+        enable_fpu();
+    }
+
+    // about to be clobbered, whoever they belonged to reloads them next time
+    fpu_owner[cpu] = NULL;
 }
 
+void kernel_fpu_end(void) {
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    uint cpu = arch_curr_cpu_num();
+    DEBUG_ASSERT(kernel_fpu_active[cpu]);
+    kernel_fpu_active[cpu] = false;
+
+    fpu_owner[cpu] = NULL;
+    disable_fpu();
+
+    arch_interrupt_restore(kernel_fpu_state[cpu], SPIN_LOCK_FLAG_INTERRUPTS);
+}
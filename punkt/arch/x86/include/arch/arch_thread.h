@@ -10,13 +10,18 @@
 
 #include <sys/types.h>
 
+/* largest fpu save area in use: the 512 byte legacy area, the 64 byte xsave
+ * header and the 256 bytes of AVX upper halves */
+#define X86_FPU_STATE_SIZE (512 + 64 + 256)
+
 struct arch_thread {
     vaddr_t sp;
     vaddr_t fs_base;
     vaddr_t gs_base;
 
     vaddr_t *fpu_states;
-    uint8_t fpu_buffer[512 + 16];
+    int fpu_cpu; // cpu whose registers were last loaded from fpu_states, -1 if none
+    uint8_t fpu_buffer[X86_FPU_STATE_SIZE + 64];
 
     /* if non-NULL, address to return to on page fault */
     void *page_fault_resume;
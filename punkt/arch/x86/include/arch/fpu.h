@@ -31,4 +31,16 @@ void fpu_init_thread_states(thread_t *t);
 void fpu_context_switch(thread_t *old_thread, thread_t *new_thread);
 void fpu_dev_na_handler(void);
 
+/*
+ * Bracket kernel code that uses the fpu or simd registers, such as a vectorized
+ * memcpy or checksum built from a MODULE_FLOAT_SRCS file. Whatever state the
+ * registers held is saved first and reloaded when its thread next touches the
+ * fpu. Interrupts are disabled from begin to end, so keep the section short and
+ * don't block in it. Usable from threads and irq handlers alike. The code in
+ * between must leave the control words (mxcsr, x87 fcw) as it found them.
+ * Doesn't nest.
+ */
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
 /* End of file */
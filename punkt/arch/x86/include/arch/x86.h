@@ -146,12 +146,14 @@ typedef tss_64_t tss_t;
 #define X86_MSR_IA32_APIC_BASE          0x0000001b /* APIC base physical address */
 #define X86_MSR_IA32_TSC_ADJUST         0x0000003b /* TSC adjust */
 #define X86_MSR_IA32_BIOS_SIGN_ID       0x0000008b /* BIOS update signature */
+#define X86_MSR_IA32_PMC0               0x000000c1 /* general purpose performance counter 0 */
 #define X86_MSR_IA32_MTRRCAP            0x000000fe /* MTRR capability */
 #define X86_MSR_IA32_SYSENTER_CS        0x00000174 /* SYSENTER CS */
 #define X86_MSR_IA32_SYSENTER_ESP       0x00000175 /* SYSENTER ESP */
 #define X86_MSR_IA32_SYSENTER_EIP       0x00000176 /* SYSENTER EIP */
 #define X86_MSR_IA32_MCG_CAP            0x00000179 /* global machine check capability */
 #define X86_MSR_IA32_MCG_STATUS         0x0000017a /* global machine check status */
+#define X86_MSR_IA32_PERFEVTSEL0        0x00000186 /* performance event select 0 */
 #define X86_MSR_IA32_MISC_ENABLE        0x000001a0 /* enable/disable misc processor features */
 #define X86_MSR_IA32_TEMPERATURE_TARGET 0x000001a2 /* Temperature target */
 #define X86_MSR_IA32_MTRR_PHYSBASE0     0x00000200 /* MTRR PhysBase0 */
@@ -164,11 +166,13 @@ typedef tss_64_t tss_t;
 #define X86_MSR_IA32_MTRR_FIX4K_C0000   0x00000268 /* MTRR FIX4K_C0000 */
 #define X86_MSR_IA32_MTRR_FIX4K_F8000   0x0000026f /* MTRR FIX4K_F8000 */
 #define X86_MSR_IA32_PAT                0x00000277 /* PAT */
+#define X86_MSR_IA32_PERF_GLOBAL_CTRL   0x0000038f /* performance counter global enable */
 #define X86_MSR_IA32_TSC_DEADLINE       0x000006e0 /* TSC deadline */
 #define X86_MSR_IA32_PM_ENABLE          0x00000770 /* enable/disable HWP */
 #define X86_MSR_IA32_HWP_CAPABILITIES   0x00000771 /* HWP performance range enumeration */
 #define X86_MSR_IA32_HWP_REQUEST        0x00000774 /* power manage control hints */
 #define X86_MSR_IA32_X2APIC_BASE        0x00000800 /* X2APIC base register */
+#define X86_MSR_IA32_XSS                0x00000da0 /* supervisor xsave state components */
 #define X86_MSR_IA32_EFER               0xc0000080 /* EFER */
 #define X86_MSR_IA32_STAR               0xc0000081 /* system call address */
 #define X86_MSR_IA32_LSTAR              0xc0000082 /* long mode call address */
@@ -458,6 +462,18 @@ static inline void write_msr (uint32_t msr_id, uint64_t msr_write_val) {
         : : "c" (msr_id), "a" (low_val), "d"(high_val));
 }
 
+static inline uint64_t x86_xgetbv(uint32_t reg) {
+    uint32_t low_val;
+    uint32_t high_val;
+
+    __asm__ __volatile__("xgetbv" : "=a"(low_val), "=d"(high_val) : "c"(reg));
+    return ((uint64_t)high_val << 32) | low_val;
+}
+
+static inline void x86_xsetbv(uint32_t reg, uint64_t val) {
+    __asm__ __volatile__("xsetbv" :: "c"(reg), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
 #pragma GCC diagnostic push
 /* The dereference of offset in the inline asm below generates this warning in GCC */
 #pragma GCC diagnostic ignored "-Warray-bounds"
@@ -526,5 +542,8 @@ static inline void tlbsync_local(vaddr_t address) {
 }
 
 void x86_early_init_percpu(void);
+bool x86_in_int_handler(void);
+void x86_perf_early_init(void);
+void x86_perf_early_init_percpu(void);
 
 __END_CDECLS
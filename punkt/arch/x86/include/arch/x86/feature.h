@@ -131,6 +131,12 @@ extern uint32_t max_cpuid_leaf;
 extern uint32_t max_cpuid_leaf_hyp;
 extern uint32_t max_cpuid_leaf_ext;
 
+/* string instruction features, sampled once at early init for the libc
+ * memcpy and memset, which test these bits on every call */
+#define X86_STRING_ERMS (1u << 0) // enhanced rep movsb/stosb
+#define X86_STRING_FSRM (1u << 1) // fast short rep movsb
+extern uint32_t x86_string_features;
+
 /* Retrieve the specified subleaf.  This function is not cached.
  * Returns false if leaf num is invalid */
 bool x86_get_cpuid_subleaf(enum x86_cpuid_leaf_num, uint32_t subleaf, struct x86_cpuid_leaf *);
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <arch/perf.h>
+
+#include <arch/x86.h>
+#include <arch/x86/feature.h>
+#include <lk/bits.h>
+#include <lk/debug.h>
+#include <lk/trace.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * The perf events on the architectural performance monitoring counters that
+ * cpuid leaf 0xa describes, which Intel cpus have had since Core. Each event
+ * gets a general purpose counter of its own, programmed the same on every cpu.
+ * Without them, cycles come from the tsc and the rest aren't counted.
+ */
+
+#define PERFEVTSEL_USR (1u << 16)
+#define PERFEVTSEL_OS  (1u << 17)
+#define PERFEVTSEL_EN  (1u << 22)
+
+static const struct {
+    uint8_t event;
+    uint8_t umask;
+    uint8_t unavail_bit; // set in leaf 0xa ebx if the event isn't there
+} perf_event_sel[ARCH_PERF_EVENT_COUNT] = {
+    [ARCH_PERF_CYCLES]        = { 0x3c, 0x00, 0 }, // unhalted core cycles
+    [ARCH_PERF_INSTRUCTIONS]  = { 0xc0, 0x00, 1 }, // instructions retired
+    [ARCH_PERF_CACHE_MISSES]  = { 0x2e, 0x41, 4 }, // last level cache misses
+    [ARCH_PERF_BRANCH_MISSES] = { 0xc5, 0x00, 6 }, // branch mispredicts retired
+};
+
+static uint perf_version;
+static uint perf_events;                          // events with a counter
+static uint8_t perf_counter[ARCH_PERF_EVENT_COUNT]; // which counter each is on
+static uint64_t perf_counter_mask;                // the counters' width
+
+/* work out which events we can count, on the boot cpu */
+void x86_perf_early_init(void) {
+    const struct x86_cpuid_leaf *leaf = x86_get_cpuid_leaf(X86_CPUID_PERFORMANCE_MONITORING);
+    if (!leaf || x86_get_cpu_vendor() != X86_CPU_VENDOR_INTEL)
+        return;
+
+    perf_version = BITS(leaf->a, 7, 0);
+    uint counters = BITS_SHIFT(leaf->a, 15, 8);
+    uint width = BITS_SHIFT(leaf->a, 23, 16);
+    uint ebx_len = BITS_SHIFT(leaf->a, 31, 24);
+    if (perf_version == 0 || counters == 0 || width == 0)
+        return;
+
+    perf_counter_mask = (width >= 64) ? ~0ull : ((1ull << width) - 1);
+
+    uint next = 0;
+    for (uint i = 0; i < ARCH_PERF_EVENT_COUNT && next < counters; i++) {
+        uint bit = perf_event_sel[i].unavail_bit;
+        if (bit < ebx_len && (leaf->b & (1u << bit)))
+            continue;
+        perf_counter[i] = next++;
+        perf_events |= 1u << i;
+    }
+
+    LTRACEF("version %u, %u counters %u bits wide, events %#x\n", perf_version, counters, width, perf_events);
+}
+
+/* program and start the counters, on every cpu as it comes up */
+void x86_perf_early_init_percpu(void) {
+    if (!perf_events)
+        return;
+
+    uint64_t enable = 0;
+    for (uint i = 0; i < ARCH_PERF_EVENT_COUNT; i++) {
+        if (!(perf_events & (1u << i)))
+            continue;
+
+        uint ctr = perf_counter[i];
+        write_msr(X86_MSR_IA32_PERFEVTSEL0 + ctr, 0);
+        write_msr(X86_MSR_IA32_PMC0 + ctr, 0);
+        write_msr(X86_MSR_IA32_PERFEVTSEL0 + ctr,
+                  perf_event_sel[i].event | (perf_event_sel[i].umask << 8) |
+                  PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+        enable |= 1ull << ctr;
+    }
+
+    /* version 2 added a global enable on top of the per counter ones */
+    if (perf_version >= 2) {
+        write_msr(X86_MSR_IA32_PERF_GLOBAL_CTRL, read_msr(X86_MSR_IA32_PERF_GLOBAL_CTRL) | enable);
+    }
+}
+
+static inline uint64_t rdpmc(uint32_t ctr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(ctr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint arch_perf_events(void) {
+    return perf_events | (1u << ARCH_PERF_CYCLES);
+}
+
+void arch_perf_read(struct arch_perf_sample *sample) {
+    for (uint i = 0; i < ARCH_PERF_EVENT_COUNT; i++) {
+        if (perf_events & (1u << i))
+            sample->count[i] = rdpmc(perf_counter[i]);
+        else
+            sample->count[i] = 0;
+    }
+    if (!(perf_events & (1u << ARCH_PERF_CYCLES)))
+        sample->count[ARCH_PERF_CYCLES] = arch_cycle_count();
+}
+
+void arch_perf_elapsed(struct arch_perf_sample *delta, const struct arch_perf_sample *start,
+                       const struct arch_perf_sample *end) {
+    for (uint i = 0; i < ARCH_PERF_EVENT_COUNT; i++) {
+        uint64_t d = end->count[i] - start->count[i];
+        if (perf_events & (1u << i))
+            d &= perf_counter_mask;
+        delta->count[i] = d;
+    }
+}
@@ -31,6 +31,7 @@ GLOBAL_DEFINES += \
 	USER_ASPACE_SIZE=$(USER_ASPACE_SIZE) \
 	WITH_SMP=1 \
 	X86_WITH_FPU=1 \
+	ARCH_HAS_PERF=1 \
 	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
 
 MODULE_SRCS += \
@@ -50,6 +51,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/feature.c \
 	$(LOCAL_DIR)/lapic.c \
 	$(LOCAL_DIR)/mp.c \
+	$(LOCAL_DIR)/perf.c \
 	$(LOCAL_DIR)/pv.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/user_copy.c \
@@ -0,0 +1,978 @@
+//
+// Copyright (c) 2021 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#include <arch/atomic.h>
+#include <arch/ops.h>
+#include <lk/init.h>
+#include <lk/err.h>
+#include <lk/cpp.h>
+#include <lk/trace.h>
+#include <lk/list.h>
+#include <dev/bus/pci.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <vm/vm.h>
+#include <lib/bio.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nvme_hw.h"
+
+#define LOCAL_TRACE 0
+
+// Driver for NVM Express controllers found on the pci bus.
+//
+// One io submission/completion queue pair is created per online cpu, each with its own
+// msi-x vector steered at that cpu. Requests are queued on the pair belonging to the
+// submitting cpu, so the fast path only contends with the completion handler for the
+// same queue. Namespace 1 is published as a block device that also implements the
+// asynchronous bio hooks.
+
+class nvme;
+
+// bdev wrapper so the bio hooks can find their way back to the driver
+struct nvme_bdev {
+    bdev_t dev;
+    nvme *n;
+};
+
+class nvme {
+public:
+    nvme() = default;
+    ~nvme();
+
+    DISALLOW_COPY_ASSIGN_AND_MOVE(nvme);
+
+    status_t init_device(pci_location_t loc);
+
+    // queue an io of count blocks, calling callback when it completes
+    status_t queue_io(bool write, void *buf, uint64_t block, uint count,
+                      bio_async_callback_t callback, void *callback_context);
+
+    // queue an io and block until it completes
+    ssize_t sync_io(bool write, void *buf, uint64_t block, uint count);
+
+    size_t block_shift() const { return block_shift_; }
+
+private:
+    static const size_t queue_depth_max = 32;
+
+    // one outstanding request, larger requests are issued as back to back
+    // commands out of the same slot
+    struct request {
+        bool in_use;
+        bool write;
+        uint8_t *buf;
+        uint64_t lba;
+        uint blocks_left;
+        uint chunk_blocks;
+        size_t bytes_done;
+        bio_async_callback_t callback;
+        void *callback_context;
+
+        // per slot prp list page
+        uint64_t *prp_list;
+        paddr_t prp_list_phys;
+    };
+
+    // submission/completion queue pair
+    struct queue {
+        nvme *dev;
+        uint16_t qid;
+        uint16_t depth;
+        spin_lock_t lock;
+
+        nvme_sqe *sq;
+        volatile nvme_cqe *cq;
+        uint16_t sq_tail;
+        uint16_t cq_head;
+        uint16_t phase;
+        volatile uint32_t *sq_doorbell;
+        volatile uint32_t *cq_doorbell;
+
+        // the submission queue can hold depth - 1 entries, so at most that many
+        // requests may be outstanding
+        request reqs[queue_depth_max - 1];
+        size_t busy;
+    };
+
+    uint32_t read_reg(nvme_reg reg);
+    void write_reg(nvme_reg reg, uint32_t val);
+    uint64_t read_reg64(nvme_reg reg);
+    void write_reg64(nvme_reg reg, uint64_t val);
+    status_t wait_ready(bool ready);
+
+    status_t alloc_queue(queue *q, uint16_t qid, bool io);
+    void free_queue(queue *q);
+    status_t admin_cmd(nvme_sqe *cmd, uint32_t *dw0);
+    status_t identify(uint32_t nsid, uint32_t cns);
+    status_t setup_interrupts(size_t *num_queues);
+    status_t create_io_queue(queue *q, uint16_t vector);
+
+    void submit_chunk_locked(queue *q, size_t slot);
+    handler_return process_completions(queue *q);
+    handler_return process_all_completions();
+
+    // counter of configured devices
+    static volatile int global_count_;
+    int unit_ = 0;
+
+    // configuration
+    pci_location_t loc_ = {};
+    void *bar0_regs_ = nullptr;
+    uint32_t doorbell_stride_ = 0;
+    lk_time_t timeout_ = 0;
+    uint16_t depth_ = 0;
+    size_t max_xfer_blocks_ = 0;
+    size_t block_size_ = 0;
+    size_t block_shift_ = 0;
+    uint64_t block_count_ = 0;
+
+    // page used for identify data
+    uint8_t *id_buf_ = nullptr;
+    paddr_t id_buf_phys_ = 0;
+
+    // admin and io queues
+    queue *admin_q_ = nullptr;
+    queue *io_q_[SMP_MAX_CPUS] = {};
+    size_t num_io_queues_ = 0;
+    uint8_t cpu_to_queue_[SMP_MAX_CPUS] = {};
+
+    // interrupt vectors, one per io queue with msi-x, otherwise a single shared one
+    uint irqs_[SMP_MAX_CPUS] = {};
+    size_t num_irqs_ = 0;
+    bool msix_ = false;
+    bool msi_ = false;
+    bool irqs_registered_ = false;
+
+    // threads waiting for a free request slot
+    volatile int slot_waiters_ = 0;
+    event_t slot_event_ = EVENT_INITIAL_VALUE(slot_event_, 0, EVENT_FLAG_AUTOUNSIGNAL);
+
+    // bounce page for buffers that are not dword aligned
+    mutex_t bounce_lock_ = MUTEX_INITIAL_VALUE(bounce_lock_);
+    uint8_t *bounce_buf_ = nullptr;
+
+    nvme_bdev bdev_ = {};
+};
+
+volatile int nvme::global_count_ = 0;
+
+nvme::~nvme() {
+    // stop taking interrupts before anything they touch goes away
+    if (irqs_registered_) {
+        for (size_t i = 0; i < num_irqs_; i++) {
+            mask_interrupt(irqs_[i]);
+        }
+        if (!msix_ && !msi_) {
+            register_int_handler(irqs_[0], nullptr, nullptr);
+        }
+    }
+
+    // disabling the controller deletes its queues and stops any dma into them
+    if (bar0_regs_ && (read_reg(nvme_reg::CC) & NVME_CC_EN)) {
+        write_reg(nvme_reg::CC, read_reg(nvme_reg::CC) & ~NVME_CC_EN);
+        if (wait_ready(false) != NO_ERROR) {
+            printf("nvme %d: timed out disabling controller\n", unit_);
+        }
+    }
+
+    // returning the vectors drops their handlers
+    if (msix_) {
+        pci_bus_mgr_free_msix(loc_, num_irqs_, irqs_);
+    } else if (msi_) {
+        pci_bus_mgr_free_msi(loc_, irqs_[0]);
+    }
+
+    for (auto &q : io_q_) {
+        free_queue(q);
+        q = nullptr;
+    }
+    free_queue(admin_q_);
+    admin_q_ = nullptr;
+
+    if (id_buf_) {
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)id_buf_);
+    }
+    free(bounce_buf_);
+    if (bar0_regs_) {
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)bar0_regs_);
+    }
+}
+
+uint32_t nvme::read_reg(nvme_reg reg) {
+    volatile uint32_t *r = (volatile uint32_t *)((uintptr_t)bar0_regs_ + (size_t)reg);
+
+    return *r;
+}
+
+void nvme::write_reg(nvme_reg reg, uint32_t val) {
+    volatile uint32_t *r = (volatile uint32_t *)((uintptr_t)bar0_regs_ + (size_t)reg);
+
+    *r = val;
+}
+
+// 64bit registers are accessed as two halves, low word first
+uint64_t nvme::read_reg64(nvme_reg reg) {
+    volatile uint32_t *r = (volatile uint32_t *)((uintptr_t)bar0_regs_ + (size_t)reg);
+
+    uint64_t lo = r[0];
+    uint64_t hi = r[1];
+    return (hi << 32) | lo;
+}
+
+void nvme::write_reg64(nvme_reg reg, uint64_t val) {
+    volatile uint32_t *r = (volatile uint32_t *)((uintptr_t)bar0_regs_ + (size_t)reg);
+
+    r[0] = val & 0xffffffff;
+    r[1] = val >> 32;
+}
+
+// wait for CSTS.RDY to reach the requested state
+status_t nvme::wait_ready(bool ready) {
+    lk_time_t start = current_time();
+    for (;;) {
+        uint32_t csts = read_reg(nvme_reg::CSTS);
+        if (csts & NVME_CSTS_CFS) {
+            printf("nvme %d: controller fatal status\n", unit_);
+            return ERR_IO;
+        }
+        if (!!(csts & NVME_CSTS_RDY) == ready) {
+            return NO_ERROR;
+        }
+        if (current_time() - start > timeout_) {
+            return ERR_TIMED_OUT;
+        }
+        thread_sleep(1);
+    }
+}
+
+status_t nvme::alloc_queue(queue *q, uint16_t qid, bool io) {
+    char str[32];
+
+    q->dev = this;
+    q->qid = qid;
+    q->depth = depth_;
+    spin_lock_init(&q->lock);
+
+    snprintf(str, sizeof(str), "nvme %d sq %u", unit_, qid);
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), str, ROUNDUP(depth_ * sizeof(nvme_sqe), PAGE_SIZE),
+                                        (void **)&q->sq, 0, 0, ARCH_MMU_FLAG_UNCACHED);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    memset(q->sq, 0, depth_ * sizeof(nvme_sqe));
+
+    snprintf(str, sizeof(str), "nvme %d cq %u", unit_, qid);
+    void *cq;
+    err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), str, ROUNDUP(depth_ * sizeof(nvme_cqe), PAGE_SIZE),
+                               &cq, 0, 0, ARCH_MMU_FLAG_UNCACHED);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    memset(cq, 0, depth_ * sizeof(nvme_cqe));
+    q->cq = (volatile nvme_cqe *)cq;
+
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+
+    uintptr_t doorbells = (uintptr_t)bar0_regs_ + (size_t)nvme_reg::DOORBELL_BASE;
+    q->sq_doorbell = (volatile uint32_t *)(doorbells + (2 * qid) * (4u << doorbell_stride_));
+    q->cq_doorbell = (volatile uint32_t *)(doorbells + (2 * qid + 1) * (4u << doorbell_stride_));
+
+    if (io) {
+        // one prp list page per request slot
+        const size_t num_reqs = depth_ - 1u;
+        uint8_t *prp_lists;
+        snprintf(str, sizeof(str), "nvme %d prp %u", unit_, qid);
+        err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), str, num_reqs * NVME_PAGE_SIZE,
+                                   (void **)&prp_lists, 0, 0, ARCH_MMU_FLAG_UNCACHED);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        for (size_t i = 0; i < num_reqs; i++) {
+            q->reqs[i].prp_list = (uint64_t *)(prp_lists + i * NVME_PAGE_SIZE);
+            q->reqs[i].prp_list_phys = vaddr_to_paddr(q->reqs[i].prp_list);
+        }
+    }
+
+    LTRACEF("queue %u: sq %p cq %p depth %u\n", qid, q->sq, cq, depth_);
+
+    return NO_ERROR;
+}
+
+// free whatever alloc_queue got as far as allocating, and the queue itself
+void nvme::free_queue(queue *q) {
+    if (!q) {
+        return;
+    }
+
+    if (q->sq) {
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)q->sq);
+    }
+    if (q->cq) {
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)q->cq);
+    }
+    if (q->reqs[0].prp_list) {
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)q->reqs[0].prp_list);
+    }
+
+    delete q;
+}
+
+// issue a command on the admin queue and poll for its completion. only used
+// during initialization, so no locking is needed.
+status_t nvme::admin_cmd(nvme_sqe *cmd, uint32_t *dw0) {
+    queue *q = admin_q_;
+
+    cmd->cid = q->sq_tail;
+    memcpy(&q->sq[q->sq_tail], cmd, sizeof(*cmd));
+    if (++q->sq_tail == q->depth) {
+        q->sq_tail = 0;
+    }
+    mb();
+    *q->sq_doorbell = q->sq_tail;
+
+    lk_time_t start = current_time();
+    uint16_t status;
+    for (;;) {
+        status = q->cq[q->cq_head].status;
+        if (NVME_CQE_PHASE(status) == q->phase) {
+            break;
+        }
+        if (current_time() - start > timeout_) {
+            printf("nvme %d: admin command %#x timed out\n", unit_, cmd->opcode);
+            return ERR_TIMED_OUT;
+        }
+    }
+    uint32_t result = q->cq[q->cq_head].dw0;
+
+    if (++q->cq_head == q->depth) {
+        q->cq_head = 0;
+        q->phase ^= 1;
+    }
+    *q->cq_doorbell = q->cq_head;
+
+    if (NVME_CQE_SC(status) != 0) {
+        LTRACEF("admin command %#x failed, status %#x\n", cmd->opcode, NVME_CQE_SC(status));
+        return ERR_IO;
+    }
+
+    if (dw0) {
+        *dw0 = result;
+    }
+    return NO_ERROR;
+}
+
+status_t nvme::identify(uint32_t nsid, uint32_t cns) {
+    nvme_sqe cmd = {};
+    cmd.opcode = NVME_ADMIN_OP_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = id_buf_phys_;
+    cmd.cdw10 = cns;
+
+    return admin_cmd(&cmd, nullptr);
+}
+
+status_t nvme::create_io_queue(queue *q, uint16_t vector) {
+    // completion queue first, physically contiguous, interrupts enabled
+    nvme_sqe cmd = {};
+    cmd.opcode = NVME_ADMIN_OP_CREATE_IO_CQ;
+    cmd.prp1 = vaddr_to_paddr((void *)q->cq);
+    cmd.cdw10 = ((uint32_t)(q->depth - 1) << 16) | q->qid;
+    cmd.cdw11 = ((uint32_t)vector << 16) | (1u << 1) | (1u << 0);
+    status_t err = admin_cmd(&cmd, nullptr);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    // submission queue bound to it
+    cmd = {};
+    cmd.opcode = NVME_ADMIN_OP_CREATE_IO_SQ;
+    cmd.prp1 = vaddr_to_paddr(q->sq);
+    cmd.cdw10 = ((uint32_t)(q->depth - 1) << 16) | q->qid;
+    cmd.cdw11 = ((uint32_t)q->qid << 16) | (1u << 0);
+    return admin_cmd(&cmd, nullptr);
+}
+
+// try to get a msi-x vector per queue, falling back to a single msi or legacy
+// interrupt shared by all of the queues. trims num_queues to what was allocated.
+status_t nvme::setup_interrupts(size_t *num_queues) {
+    size_t msix_count;
+    if (pci_bus_mgr_get_msix_count(loc_, &msix_count) == NO_ERROR) {
+        size_t count = MIN(*num_queues, msix_count);
+
+        // steer each vector at the cpu its queue is serving
+        uint target_cpus[SMP_MAX_CPUS];
+        size_t q = 0;
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS && q < count; cpu++) {
+#if WITH_SMP
+            if (!mp_is_cpu_active(cpu)) {
+                continue;
+            }
+#endif
+            target_cpus[q++] = cpu;
+        }
+        count = q;
+
+        if (pci_bus_mgr_allocate_msix(loc_, count, target_cpus, irqs_) == NO_ERROR) {
+            msix_ = true;
+            num_irqs_ = count;
+            *num_queues = count;
+            return NO_ERROR;
+        }
+    }
+
+    status_t err = pci_bus_mgr_allocate_msi(loc_, 1, &irqs_[0]);
+    if (err == NO_ERROR) {
+        msi_ = true;
+    } else {
+        // fall back to regular IRQs
+        err = pci_bus_mgr_allocate_irq(loc_, &irqs_[0]);
+        if (err != NO_ERROR) {
+            printf("nvme %d: unable to allocate IRQ\n", unit_);
+            return err;
+        }
+    }
+    num_irqs_ = 1;
+
+    return NO_ERROR;
+}
+
+status_t nvme::init_device(pci_location_t loc) {
+    loc_ = loc;
+    char str[32];
+
+    LTRACEF("pci location %s\n", pci_loc_string(loc_, str));
+
+    pci_bar_t bars[6];
+    status_t err = pci_bus_mgr_read_bars(loc_, bars);
+    if (err != NO_ERROR) return err;
+
+    LTRACEF("nvme BARS:\n");
+    if (LOCAL_TRACE) pci_dump_bars(bars, 6);
+
+    if (!bars[0].valid || bars[0].io || bars[0].addr == 0) {
+        return ERR_NOT_FOUND;
+    }
+
+    // allocate a unit number
+    unit_ = atomic_add(&global_count_, 1);
+
+    // map bar 0, registers followed by the doorbells
+    snprintf(str, sizeof(str), "nvme %d bar0", unit_);
+    err = vmm_alloc_physical(vmm_get_kernel_aspace(), str, ROUNDUP(bars[0].size, PAGE_SIZE), &bar0_regs_, 0,
+                             bars[0].addr, /* vmm_flags */ 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err != NO_ERROR) {
+        return ERR_NOT_FOUND;
+    }
+
+    LTRACEF("bar 0 regs mapped to %p\n", bar0_regs_);
+
+    pci_bus_mgr_enable_device(loc_);
+
+    const uint64_t cap = read_reg64(nvme_reg::CAP);
+    const uint32_t vs = read_reg(nvme_reg::VS);
+    LTRACEF("cap %#llx vs %#x\n", cap, vs);
+
+    if (NVME_CAP_MPSMIN(cap) > 0) {
+        printf("nvme %d: controller does not support 4K pages\n", unit_);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    doorbell_stride_ = NVME_CAP_DSTRD(cap);
+    timeout_ = (NVME_CAP_TO(cap) + 1) * 500;
+    depth_ = MIN(queue_depth_max, NVME_CAP_MQES(cap) + 1u);
+
+    // reset the controller
+    write_reg(nvme_reg::CC, read_reg(nvme_reg::CC) & ~NVME_CC_EN);
+    err = wait_ready(false);
+    if (err != NO_ERROR) {
+        printf("nvme %d: timed out disabling controller\n", unit_);
+        return err;
+    }
+
+    // set up the admin queue
+    admin_q_ = new queue();
+    if (!admin_q_) {
+        return ERR_NO_MEMORY;
+    }
+    err = alloc_queue(admin_q_, 0, false);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    write_reg(nvme_reg::AQA, ((uint32_t)(depth_ - 1) << 16) | (depth_ - 1u));
+    write_reg64(nvme_reg::ASQ, vaddr_to_paddr(admin_q_->sq));
+    write_reg64(nvme_reg::ACQ, vaddr_to_paddr((void *)admin_q_->cq));
+
+    // enable it with 64 byte submission and 16 byte completion entries
+    write_reg(nvme_reg::CC, NVME_CC_EN | NVME_CC_CSS_NVM | NVME_CC_MPS(0) | NVME_CC_AMS_RR |
+                            NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4));
+    err = wait_ready(true);
+    if (err != NO_ERROR) {
+        printf("nvme %d: timed out enabling controller\n", unit_);
+        return err;
+    }
+
+    // identify the controller
+    snprintf(str, sizeof(str), "nvme %d identify", unit_);
+    err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), str, PAGE_SIZE, (void **)&id_buf_, 0, 0, ARCH_MMU_FLAG_UNCACHED);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    id_buf_phys_ = vaddr_to_paddr(id_buf_);
+
+    err = identify(0, NVME_IDENTIFY_CONTROLLER);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    char model[41];
+    memcpy(model, id_buf_ + NVME_ID_CTRL_MN, 40);
+    model[40] = 0;
+    for (int i = 39; i >= 0 && model[i] == ' '; i--) {
+        model[i] = 0;
+    }
+
+    const uint8_t mdts = id_buf_[NVME_ID_CTRL_MDTS];
+    uint32_t nn;
+    memcpy(&nn, id_buf_ + NVME_ID_CTRL_NN, sizeof(nn));
+    if (nn == 0) {
+        return ERR_NOT_FOUND;
+    }
+
+    // identify namespace 1
+    err = identify(1, NVME_IDENTIFY_NAMESPACE);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    memcpy(&block_count_, id_buf_ + NVME_ID_NS_NSZE, sizeof(block_count_));
+    const uint8_t flbas = id_buf_[NVME_ID_NS_FLBAS] & 0xf;
+    block_shift_ = id_buf_[NVME_ID_NS_LBAF + flbas * 4 + 2];
+    if (block_shift_ < 9 || block_shift_ > NVME_PAGE_SHIFT) {
+        printf("nvme %d: unsupported block size shift %zu\n", unit_, block_shift_);
+        return ERR_NOT_SUPPORTED;
+    }
+    block_size_ = 1u << block_shift_;
+
+    // largest transfer is bounded by the controller and by what a single prp list page can describe
+    size_t max_xfer = NVME_PAGE_SIZE * (NVME_PAGE_SIZE / sizeof(uint64_t));
+    if (mdts != 0 && mdts < 20) {
+        max_xfer = MIN(max_xfer, (size_t)NVME_PAGE_SIZE << mdts);
+    }
+    max_xfer_blocks_ = max_xfer >> block_shift_;
+
+    // one io queue pair per online cpu
+    size_t num_queues = 1;
+#if WITH_SMP
+    num_queues = __builtin_popcount(mp.active_cpus);
+#endif
+
+    // ask for that many queues, the controller may grant fewer
+    nvme_sqe cmd = {};
+    cmd.opcode = NVME_ADMIN_OP_SET_FEATURES;
+    cmd.cdw10 = NVME_FEATURE_NUM_QUEUES;
+    cmd.cdw11 = ((uint32_t)(num_queues - 1) << 16) | (uint32_t)(num_queues - 1);
+    uint32_t granted;
+    err = admin_cmd(&cmd, &granted);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    num_queues = MIN(num_queues, (size_t)MIN(granted & 0xffff, granted >> 16) + 1);
+
+    err = setup_interrupts(&num_queues);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    // create the io queues, one vector per queue if we have them
+    for (size_t i = 0; i < num_queues; i++) {
+        queue *q = new queue();
+        if (!q) {
+            return ERR_NO_MEMORY;
+        }
+        io_q_[i] = q;
+        err = alloc_queue(q, i + 1, true);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        err = create_io_queue(q, msix_ ? i : 0);
+        if (err != NO_ERROR) {
+            printf("nvme %d: failed to create io queue %zu\n", unit_, i + 1);
+            return err;
+        }
+    }
+    num_io_queues_ = num_queues;
+
+    // map cpus to queues, each online cpu gets the queue whose vector targets it
+    size_t next = 0;
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cpu_to_queue_[cpu] = next++ % num_io_queues_;
+#if WITH_SMP
+        if (!mp_is_cpu_active(cpu)) {
+            next--;
+            cpu_to_queue_[cpu] = cpu % num_io_queues_;
+        }
+#endif
+    }
+
+    bounce_buf_ = (uint8_t *)memalign(PAGE_SIZE, PAGE_SIZE);
+    if (!bounce_buf_) {
+        return ERR_NO_MEMORY;
+    }
+
+    // hook up the interrupts
+    if (msix_) {
+        auto irq_handler_wrapper = [](void *arg) -> handler_return {
+            queue *q = (queue *)arg;
+            return q->dev->process_completions(q);
+        };
+        for (size_t i = 0; i < num_irqs_; i++) {
+            register_int_handler_msi(irqs_[i], irq_handler_wrapper, io_q_[i], true);
+            unmask_interrupt(irqs_[i]);
+        }
+    } else {
+        auto irq_handler_wrapper = [](void *arg) -> handler_return {
+            nvme *n = (nvme *)arg;
+            return n->process_all_completions();
+        };
+        register_int_handler(irqs_[0], irq_handler_wrapper, this);
+        unmask_interrupt(irqs_[0]);
+    }
+    irqs_registered_ = true;
+    LTRACEF("%zu io queues, %zu irqs (%s)\n", num_io_queues_, num_irqs_, msix_ ? "msi-x" : "shared");
+
+    printf("nvme %d: '%s' %llu blocks of %zu bytes, %zu io queues\n", unit_, model,
+           block_count_, block_size_, num_io_queues_);
+
+    // publish namespace 1
+    auto read_block = [](bdev_t *dev, void *buf, bnum_t block, uint count) -> ssize_t {
+        nvme *n = ((nvme_bdev *)dev)->n;
+        return n->sync_io(false, buf, block, count);
+    };
+    auto write_block = [](bdev_t *dev, const void *buf, bnum_t block, uint count) -> ssize_t {
+        nvme *n = ((nvme_bdev *)dev)->n;
+        return n->sync_io(true, (void *)buf, block, count);
+    };
+    auto read_async = [](bdev_t *dev, void *buf, off_t offset, size_t len,
+                         bio_async_callback_t callback, void *callback_context) -> status_t {
+        nvme *n = ((nvme_bdev *)dev)->n;
+        return n->queue_io(false, buf, offset >> n->block_shift(), len >> n->block_shift(),
+                           callback, callback_context);
+    };
+    auto write_async = [](bdev_t *dev, const void *buf, off_t offset, size_t len,
+                          bio_async_callback_t callback, void *callback_context) -> status_t {
+        nvme *n = ((nvme_bdev *)dev)->n;
+        return n->queue_io(true, (void *)buf, offset >> n->block_shift(), len >> n->block_shift(),
+                           callback, callback_context);
+    };
+
+    bnum_t count = (block_count_ > UINT32_MAX) ? UINT32_MAX : (bnum_t)block_count_;
+
+    snprintf(str, sizeof(str), "nvme%d", unit_);
+    bdev_.n = this;
+    bio_initialize_bdev(&bdev_.dev, str, block_size_, count, 0, nullptr, BIO_FLAGS_NONE);
+    bdev_.dev.read_block = read_block;
+    bdev_.dev.write_block = write_block;
+    bdev_.dev.read_async = read_async;
+    bdev_.dev.write_async = write_async;
+    bio_register_device(&bdev_.dev);
+
+    return NO_ERROR;
+}
+
+// build and post the command for the next piece of the request in this slot
+void nvme::submit_chunk_locked(queue *q, size_t slot) {
+    request *r = &q->reqs[slot];
+
+    r->chunk_blocks = MIN(r->blocks_left, max_xfer_blocks_);
+    const size_t len = (size_t)r->chunk_blocks << block_shift_;
+    const uintptr_t va = (uintptr_t)r->buf;
+
+    if (r->write) {
+        arch_clean_cache_range(va, len);
+    } else {
+        arch_clean_invalidate_cache_range(va, len);
+    }
+
+    // first prp covers up to the end of the page the buffer starts in. the rest of the
+    // transfer is either a second page or a list of pages.
+    uint64_t prp1 = vaddr_to_paddr((void *)va);
+    uint64_t prp2 = 0;
+    const size_t first_len = NVME_PAGE_SIZE - (va & (NVME_PAGE_SIZE - 1));
+    if (len > first_len) {
+        const uintptr_t rest = va + first_len;
+        const size_t rest_len = len - first_len;
+        if (rest_len <= NVME_PAGE_SIZE) {
+            prp2 = vaddr_to_paddr((void *)rest);
+        } else {
+            const size_t pages = ROUNDUP(rest_len, NVME_PAGE_SIZE) / NVME_PAGE_SIZE;
+            for (size_t i = 0; i < pages; i++) {
+                r->prp_list[i] = vaddr_to_paddr((void *)(rest + i * NVME_PAGE_SIZE));
+            }
+            prp2 = r->prp_list_phys;
+        }
+    }
+
+    nvme_sqe *cmd = &q->sq[q->sq_tail];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->opcode = r->write ? NVME_NVM_OP_WRITE : NVME_NVM_OP_READ;
+    cmd->cid = slot;
+    cmd->nsid = 1;
+    cmd->prp1 = prp1;
+    cmd->prp2 = prp2;
+    cmd->cdw10 = r->lba & 0xffffffff;
+    cmd->cdw11 = r->lba >> 32;
+    cmd->cdw12 = r->chunk_blocks - 1;
+
+    if (++q->sq_tail == q->depth) {
+        q->sq_tail = 0;
+    }
+    mb();
+    *q->sq_doorbell = q->sq_tail;
+}
+
+status_t nvme::queue_io(bool write, void *buf, uint64_t block, uint count,
+                        bio_async_callback_t callback, void *callback_context) {
+    LTRACEF("%s buf %p block %llu count %u\n", write ? "write" : "read", buf, block, count);
+
+    // prps must be dword aligned
+    if (!IS_ALIGNED((uintptr_t)buf, 4)) {
+        return ERR_INVALID_ARGS;
+    }
+    if (count == 0 || block + count > block_count_) {
+        return ERR_OUT_OF_RANGE;
+    }
+
+    // start at this cpu's queue, moving on to the others if it is full
+    const size_t start = cpu_to_queue_[arch_curr_cpu_num()];
+    for (size_t i = 0; i < num_io_queues_; i++) {
+        queue *q = io_q_[(start + i) % num_io_queues_];
+
+        AutoSpinLock guard(&q->lock);
+
+        if (q->busy == q->depth - 1u) {
+            continue;
+        }
+
+        size_t slot;
+        for (slot = 0; slot < q->depth - 1u; slot++) {
+            if (!q->reqs[slot].in_use) {
+                break;
+            }
+        }
+        DEBUG_ASSERT(slot < q->depth - 1u);
+
+        request *r = &q->reqs[slot];
+        r->in_use = true;
+        r->write = write;
+        r->buf = (uint8_t *)buf;
+        r->lba = block;
+        r->blocks_left = count;
+        r->bytes_done = 0;
+        r->callback = callback;
+        r->callback_context = callback_context;
+        q->busy++;
+
+        submit_chunk_locked(q, slot);
+        return NO_ERROR;
+    }
+
+    return ERR_BUSY;
+}
+
+handler_return nvme::process_completions(queue *q) {
+    struct {
+        bio_async_callback_t callback;
+        void *callback_context;
+        ssize_t result;
+    } done[queue_depth_max];
+    size_t done_count = 0;
+
+    {
+        AutoSpinLockNoIrqSave guard(&q->lock);
+
+        bool consumed = false;
+        for (;;) {
+            const uint16_t status = q->cq[q->cq_head].status;
+            if (NVME_CQE_PHASE(status) != q->phase) {
+                break;
+            }
+            const uint16_t cid = q->cq[q->cq_head].cid;
+
+            if (++q->cq_head == q->depth) {
+                q->cq_head = 0;
+                q->phase ^= 1;
+            }
+            consumed = true;
+
+            if (cid >= q->depth - 1u || !q->reqs[cid].in_use) {
+                printf("nvme %d: spurious completion cid %u on queue %u\n", unit_, cid, q->qid);
+                continue;
+            }
+
+            request *r = &q->reqs[cid];
+            ssize_t result;
+            if (NVME_CQE_SC(status) != 0) {
+                LTRACEF("io failed, status %#x\n", NVME_CQE_SC(status));
+                result = ERR_IO;
+            } else {
+                const size_t len = (size_t)r->chunk_blocks << block_shift_;
+                if (!r->write) {
+                    arch_invalidate_cache_range((addr_t)r->buf, len);
+                }
+                r->buf += len;
+                r->lba += r->chunk_blocks;
+                r->blocks_left -= r->chunk_blocks;
+                r->bytes_done += len;
+
+                if (r->blocks_left > 0) {
+                    // keep the slot and send the next piece
+                    submit_chunk_locked(q, cid);
+                    continue;
+                }
+                result = r->bytes_done;
+            }
+
+            done[done_count].callback = r->callback;
+            done[done_count].callback_context = r->callback_context;
+            done[done_count].result = result;
+            done_count++;
+
+            r->in_use = false;
+            q->busy--;
+        }
+
+        if (consumed) {
+            *q->cq_doorbell = q->cq_head;
+        }
+    }
+
+    if (done_count == 0) {
+        return INT_NO_RESCHEDULE;
+    }
+
+    if (slot_waiters_ > 0) {
+        event_signal(&slot_event_, false);
+    }
+
+    // run the callbacks with the queue unlocked so they can queue more io
+    for (size_t i = 0; i < done_count; i++) {
+        done[i].callback(done[i].callback_context, &bdev_.dev, done[i].result);
+    }
+
+    return INT_RESCHEDULE;
+}
+
+handler_return nvme::process_all_completions() {
+    handler_return ret = INT_NO_RESCHEDULE;
+    for (size_t i = 0; i < num_io_queues_; i++) {
+        if (process_completions(io_q_[i]) == INT_RESCHEDULE) {
+            ret = INT_RESCHEDULE;
+        }
+    }
+    return ret;
+}
+
+ssize_t nvme::sync_io(bool write, void *buf, uint64_t block, uint count) {
+    LTRACEF("%s buf %p block %llu count %u\n", write ? "write" : "read", buf, block, count);
+
+    if (!IS_ALIGNED((uintptr_t)buf, 4)) {
+        // go through the bounce page a page at a time
+        mutex_acquire(&bounce_lock_);
+        const uint per_page = PAGE_SIZE >> block_shift_;
+        ssize_t total = 0;
+        while (count > 0) {
+            const uint n = MIN(count, per_page);
+            const size_t len = (size_t)n << block_shift_;
+            if (write) {
+                memcpy(bounce_buf_, (uint8_t *)buf + total, len);
+            }
+            ssize_t err = sync_io(write, bounce_buf_, block, n);
+            if (err < 0) {
+                mutex_release(&bounce_lock_);
+                return err;
+            }
+            if (!write) {
+                memcpy((uint8_t *)buf + total, bounce_buf_, len);
+            }
+            total += len;
+            block += n;
+            count -= n;
+        }
+        mutex_release(&bounce_lock_);
+        return total;
+    }
+
+    struct sync_op {
+        event_t event;
+        ssize_t result;
+    } op;
+    event_init(&op.event, false, 0);
+    op.result = 0;
+
+    auto callback = [](void *context, bdev_t *, ssize_t result) {
+        sync_op *o = (sync_op *)context;
+        o->result = result;
+        event_signal(&o->event, false);
+    };
+
+    status_t err;
+    for (;;) {
+        // register as a waiter before trying so a slot freed in between is not missed
+        atomic_add(&slot_waiters_, 1);
+        err = queue_io(write, buf, block, count, callback, &op);
+        if (err != ERR_BUSY) {
+            atomic_add(&slot_waiters_, -1);
+            break;
+        }
+        event_wait(&slot_event_);
+        atomic_add(&slot_waiters_, -1);
+    }
+
+    if (err == NO_ERROR) {
+        event_wait(&op.event);
+        err = op.result;
+    }
+    event_destroy(&op.event);
+
+    return err;
+}
+
+static void nvme_init(uint level) {
+    LTRACE_ENTRY;
+
+    auto ac = lk::make_auto_call([]() { LTRACE_EXIT; });
+
+    // probe pci for mass storage, non volatile memory, nvm express devices
+    for (size_t i = 0; ; i++) {
+        pci_location_t loc;
+        status_t err = pci_bus_mgr_find_device_by_class(&loc, 0x1, 0x8, 0x2, i);
+        if (err != NO_ERROR) {
+            break;
+        }
+
+        auto n = new nvme;
+        err = n->init_device(loc);
+        if (err != NO_ERROR) {
+            char str[14];
+            printf("nvme: device at %s failed to initialize\n", pci_loc_string(loc, str));
+            delete n;
+            continue;
+        }
+    }
+}
+
+LK_INIT_HOOK(nvme, &nvme_init, LK_INIT_LEVEL_PLATFORM + 1);
@@ -0,0 +1,109 @@
+//
+// Copyright (c) 2021 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stdint.h>
+#include <lk/compiler.h>
+
+// controller registers, from NVM Express Base Specification 1.4 section 3.1
+enum class nvme_reg {
+    CAP = 0x0,      // 64 bit
+    VS = 0x8,
+    INTMS = 0xc,
+    INTMC = 0x10,
+    CC = 0x14,
+    CSTS = 0x1c,
+    NSSR = 0x20,
+    AQA = 0x24,
+    ASQ = 0x28,     // 64 bit
+    ACQ = 0x30,     // 64 bit
+
+    DOORBELL_BASE = 0x1000,
+};
+
+// CAP fields
+#define NVME_CAP_MQES(cap)      ((uint32_t)((cap) & 0xffff))
+#define NVME_CAP_TO(cap)        ((uint32_t)(((cap) >> 24) & 0xff))
+#define NVME_CAP_DSTRD(cap)     ((uint32_t)(((cap) >> 32) & 0xf))
+#define NVME_CAP_MPSMIN(cap)    ((uint32_t)(((cap) >> 48) & 0xf))
+
+// CC fields
+#define NVME_CC_EN              (1u << 0)
+#define NVME_CC_CSS_NVM         (0u << 4)
+#define NVME_CC_MPS(n)          ((uint32_t)(n) << 7)
+#define NVME_CC_AMS_RR          (0u << 11)
+#define NVME_CC_IOSQES(n)       ((uint32_t)(n) << 16)
+#define NVME_CC_IOCQES(n)       ((uint32_t)(n) << 20)
+
+// CSTS fields
+#define NVME_CSTS_RDY           (1u << 0)
+#define NVME_CSTS_CFS           (1u << 1)
+
+// the driver always runs the controller with 4K memory pages
+#define NVME_PAGE_SHIFT         12
+#define NVME_PAGE_SIZE          (1u << NVME_PAGE_SHIFT)
+
+// admin opcodes
+#define NVME_ADMIN_OP_CREATE_IO_SQ  0x01
+#define NVME_ADMIN_OP_CREATE_IO_CQ  0x05
+#define NVME_ADMIN_OP_IDENTIFY      0x06
+#define NVME_ADMIN_OP_SET_FEATURES  0x09
+
+// identify CNS values
+#define NVME_IDENTIFY_NAMESPACE     0x00
+#define NVME_IDENTIFY_CONTROLLER    0x01
+
+// features
+#define NVME_FEATURE_NUM_QUEUES     0x07
+
+// nvm command set opcodes
+#define NVME_NVM_OP_WRITE           0x01
+#define NVME_NVM_OP_READ            0x02
+
+// submission queue entry, 64 bytes
+struct nvme_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsvd;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __PACKED;
+static_assert(sizeof(nvme_sqe) == 64, "");
+
+// completion queue entry, 16 bytes
+struct nvme_cqe {
+    uint32_t dw0;
+    uint32_t dw1;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status; // bit 0 is the phase tag
+} __PACKED;
+static_assert(sizeof(nvme_cqe) == 16, "");
+
+#define NVME_CQE_PHASE(status)  ((status) & 0x1)
+#define NVME_CQE_SC(status)     (((status) >> 1) & 0x7fff)
+
+// offsets into the identify controller data structure
+#define NVME_ID_CTRL_MN         24  // model number, 40 bytes
+#define NVME_ID_CTRL_MDTS       77
+#define NVME_ID_CTRL_NN         516
+
+// offsets into the identify namespace data structure
+#define NVME_ID_NS_NSZE         0
+#define NVME_ID_NS_FLBAS        26
+#define NVME_ID_NS_LBAF         128 // 16 4 byte entries, LBADS is byte 2 of each
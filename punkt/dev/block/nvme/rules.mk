@@ -0,0 +1,10 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += $(LOCAL_DIR)/nvme.cpp
+
+MODULE_DEPS += dev/bus/pci
+MODULE_DEPS += lib/bio
+
+include make/module.mk
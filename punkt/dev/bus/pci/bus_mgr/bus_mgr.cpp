@@ -310,6 +310,63 @@ status_t pci_bus_mgr_allocate_msi(const pci_location_t loc, size_t num_requested
     return d->allocate_msi(num_requested, irqbase);
 }
 
+status_t pci_bus_mgr_get_msix_count(const pci_location_t loc, size_t *count) {
+    *count = 0;
+
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return ERR_NOT_FOUND;
+    }
+
+    if (!d->has_msix()) {
+        return ERR_NO_RESOURCES;
+    }
+
+    *count = d->msix_table_size();
+    return NO_ERROR;
+}
+
+status_t pci_bus_mgr_allocate_msix(const pci_location_t loc, size_t num_requested,
+                                   const uint *target_cpus, uint *irqs) {
+    char str[14];
+    LTRACEF("%s num_request %zu\n", pci_loc_string(loc, str), num_requested);
+
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return ERR_NOT_FOUND;
+    }
+
+    if (!d->has_msix()) {
+        return ERR_NO_RESOURCES;
+    }
+
+    return d->allocate_msix(num_requested, target_cpus, irqs);
+}
+
+status_t pci_bus_mgr_free_msi(const pci_location_t loc, uint irqbase) {
+    char str[14];
+    LTRACEF("%s irq %u\n", pci_loc_string(loc, str), irqbase);
+
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return ERR_NOT_FOUND;
+    }
+
+    return d->free_msi(irqbase);
+}
+
+status_t pci_bus_mgr_free_msix(const pci_location_t loc, size_t count, const uint *irqs) {
+    char str[14];
+    LTRACEF("%s count %zu\n", pci_loc_string(loc, str), count);
+
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return ERR_NOT_FOUND;
+    }
+
+    return d->free_msix(count, irqs);
+}
+
 status_t pci_bus_mgr_allocate_irq(const pci_location_t loc, uint *irqbase) {
     char str[14];
     LTRACEF("%s\n", pci_loc_string(loc, str));
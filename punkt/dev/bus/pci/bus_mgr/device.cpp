@@ -21,6 +21,7 @@
 #include <string.h>
 #include <assert.h>
 #include <platform/interrupts.h>
+#include <vm/vm.h>
 
 #define LOCAL_TRACE 0
 
@@ -250,6 +251,17 @@ status_t device::init_msix_capability(capability *cap) {
     pci_read_config_word(loc(), cap->config_offset + 8, &cap_buf[2]);
     //hexdump(cap_buf, sizeof(cap_buf));
 
+    // decode the table size and location, the pending bit array is not used
+    msix_table_size_ = ((cap_buf[0] >> 16) & 0x7ff) + 1;
+    msix_table_bar_ = cap_buf[1] & 0x7;
+    msix_table_offset_ = cap_buf[1] & ~0x7U;
+
+    LTRACEF("table size %u bar %u offset %#x\n", msix_table_size_, msix_table_bar_, msix_table_offset_);
+
+    if (msix_table_bar_ >= countof(bars_)) {
+        return ERR_NOT_VALID;
+    }
+
     return NO_ERROR;
 }
 
@@ -292,7 +304,7 @@ status_t device::allocate_msi(size_t num_requested, uint *msi_base) {
     uint16_t msi_data = 0;
     err = platform_compute_msi_values(vector_base, 0, true, &msi_address, &msi_data);
     if (err != NO_ERROR) {
-        // TODO: return the allocated msi
+        platform_free_interrupts(vector_base, 1);
         return err;
     }
 
@@ -324,6 +336,131 @@ status_t device::allocate_msi(size_t num_requested, uint *msi_base) {
     return NO_ERROR;
 }
 
+// allocate a separate platform vector for each of the first num_requested msi-x
+// table entries, optionally steering entry i at target_cpus[i]
+status_t device::allocate_msix(size_t num_requested, const uint *target_cpus, uint *irqs) {
+    LTRACEF("num_requested %zu\n", num_requested);
+
+    if (!has_msix()) {
+        return ERR_NOT_SUPPORTED;
+    }
+
+    DEBUG_ASSERT(msix_cap_ && msix_cap_->is_msix());
+
+    if (num_requested == 0 || num_requested > msix_table_size_) {
+        return ERR_INVALID_ARGS;
+    }
+
+    // map the table out of the bar it lives in
+    if (!msix_table_) {
+        const pci_bar_t &bar = bars_[msix_table_bar_];
+        if (!bar.valid || bar.io || bar.addr == 0) {
+            return ERR_NOT_FOUND;
+        }
+
+        const paddr_t pa = bar.addr + msix_table_offset_;
+        const paddr_t pa_page = ROUNDDOWN(pa, PAGE_SIZE);
+        const size_t size = ROUNDUP(pa - pa_page + msix_table_size_ * 16u, PAGE_SIZE);
+
+        void *ptr;
+        status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "pci msix", size, &ptr, 0,
+                                          pa_page, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        msix_table_ = (volatile uint32_t *)((uintptr_t)ptr + (pa - pa_page));
+    }
+
+    // hold the whole function masked while the table is being written
+    const uint16_t cap_offset = msix_cap_->config_offset;
+    uint16_t control;
+    pci_read_config_half(loc(), cap_offset + 2, &control);
+    control |= (1u << 15) | (1u << 14); // enable, function mask
+    pci_write_config_half(loc(), cap_offset + 2, control);
+
+    for (size_t i = 0; i < num_requested; i++) {
+        uint vector;
+        status_t err = platform_allocate_interrupts(1, 0, true, &vector);
+        if (err != NO_ERROR) {
+            free_msix(i, irqs);
+            return err;
+        }
+
+        const uint cpu = target_cpus ? target_cpus[i] : 0;
+        uint64_t msi_address = 0;
+        uint16_t msi_data = 0;
+        err = platform_compute_msi_values(vector, cpu, true, &msi_address, &msi_data);
+        if (err != NO_ERROR) {
+            platform_free_interrupts(vector, 1);
+            free_msix(i, irqs);
+            return err;
+        }
+
+        LTRACEF("entry %zu vector %u cpu %u address %#llx data %#x\n", i, vector, cpu, msi_address, msi_data);
+
+        volatile uint32_t *entry = msix_table_ + i * 4;
+        entry[0] = msi_address & 0xffff'ffff;
+        entry[1] = msi_address >> 32;
+        entry[2] = msi_data;
+        entry[3] = 0; // unmask the vector
+
+        irqs[i] = vector;
+    }
+
+    // legacy INTx is not used alongside msi-x
+    uint16_t command;
+    pci_read_config_half(loc(), PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc(), PCI_CONFIG_COMMAND, command | PCI_COMMAND_INT_DISABLE);
+
+    control &= ~(1u << 14); // clear function mask
+    pci_write_config_half(loc(), cap_offset + 2, control);
+
+    return NO_ERROR;
+}
+
+status_t device::free_msi(uint msi_base) {
+    LTRACEF("msi_base %u\n", msi_base);
+
+    if (!has_msi()) {
+        return ERR_NOT_SUPPORTED;
+    }
+
+    // disable it in the capability before the vector can be reused
+    const uint16_t cap_offset = msi_cap_->config_offset;
+    uint16_t control;
+    pci_read_config_half(loc(), cap_offset + 2, &control);
+    pci_write_config_half(loc(), cap_offset + 2, control & ~(0x1));
+
+    return platform_free_interrupts(msi_base, 1);
+}
+
+// mask the first count table entries, return their vectors and turn msi-x back off
+status_t device::free_msix(size_t count, const uint *irqs) {
+    LTRACEF("count %zu\n", count);
+
+    if (!has_msix() || !msix_table_ || count > msix_table_size_) {
+        return ERR_INVALID_ARGS;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        volatile uint32_t *entry = msix_table_ + i * 4;
+        entry[3] = 1; // mask the vector
+        platform_free_interrupts(irqs[i], 1);
+    }
+
+    const uint16_t cap_offset = msix_cap_->config_offset;
+    uint16_t control;
+    pci_read_config_half(loc(), cap_offset + 2, &control);
+    control &= ~((1u << 15) | (1u << 14)); // disable, clear function mask
+    pci_write_config_half(loc(), cap_offset + 2, control);
+
+    uint16_t command;
+    pci_read_config_half(loc(), PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc(), PCI_CONFIG_COMMAND, command & ~PCI_COMMAND_INT_DISABLE);
+
+    return NO_ERROR;
+}
+
 status_t device::load_bars() {
     size_t num_bars;
 
@@ -34,6 +34,9 @@ public:
 
     status_t allocate_irq(uint *irq);
     status_t allocate_msi(size_t num_requested, uint *msi_base);
+    status_t allocate_msix(size_t num_requested, const uint *target_cpus, uint *irqs);
+    status_t free_msi(uint msi_base);
+    status_t free_msix(size_t count, const uint *irqs);
     status_t load_config();
     status_t load_bars();
 
@@ -93,6 +96,7 @@ public:
 
     bool has_msi() const { return msi_cap_; }
     bool has_msix() const { return msix_cap_; }
+    size_t msix_table_size() const { return msix_table_size_; }
 
     virtual void dump(size_t indent = 0);
 
@@ -111,6 +115,12 @@ protected:
     list_node capability_list_ = LIST_INITIAL_VALUE(capability_list_);
     capability *msi_cap_ = nullptr;
     capability *msix_cap_ = nullptr;
+
+    // msi-x table location, decoded out of the capability
+    uint16_t msix_table_size_ = 0;
+    uint8_t msix_table_bar_ = 0;
+    uint32_t msix_table_offset_ = 0;
+    volatile uint32_t *msix_table_ = nullptr;
 };
 
 struct capability {
@@ -3,3 +3,7 @@
 MODULES += dev/bus/pci
 
 MODULES += dev/net/e1000
+MODULES += dev/block/nvme
+MODULES += dev/virtio/pci
+MODULES += dev/virtio/block
+MODULES += dev/virtio/net
@@ -95,6 +95,20 @@ status_t pci_bus_mgr_read_bars(const pci_location_t loc, pci_bar_t bar[6]);
 // try to allocate one or more msi vectors for this device
 status_t pci_bus_mgr_allocate_msi(const pci_location_t loc, size_t num_requested, uint *irqbase);
 
+// return the number of msi-x table entries the device exposes
+status_t pci_bus_mgr_get_msix_count(const pci_location_t loc, size_t *count);
+
+// allocate an individual msi-x vector for each of the first num_requested table entries.
+// if target_cpus is non null, entry i is steered at cpu target_cpus[i].
+// the platform vectors are returned in irqs[0 ... num_requested - 1]
+status_t pci_bus_mgr_allocate_msix(const pci_location_t loc, size_t num_requested,
+                                   const uint *target_cpus, uint *irqs);
+
+// return vectors from pci_bus_mgr_allocate_msi or _msix, disabling msi or msi-x
+// on the device. handlers registered on them are dropped.
+status_t pci_bus_mgr_free_msi(const pci_location_t loc, uint irqbase);
+status_t pci_bus_mgr_free_msix(const pci_location_t loc, size_t count, const uint *irqs);
+
 // allocate a regular irq for this device and return it in irqbase
 status_t pci_bus_mgr_allocate_irq(const pci_location_t loc, uint *irqbase);
 
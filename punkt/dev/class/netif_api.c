@@ -6,8 +6,24 @@
  * https://opensource.org/licenses/MIT
  */
 
+#include <assert.h>
 #include <lk/err.h>
+#include <lk/console_cmd.h>
+#include <lk/list.h>
+#include <lk/trace.h>
 #include <dev/class/netif.h>
+#include <kernel/mutex.h>
+#include <platform/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/* how long a stretch of polling the packet rate is measured over */
+#ifndef NETIF_POLL_WINDOW_USECS
+#define NETIF_POLL_WINDOW_USECS 50000
+#endif
 
 status_t class_netif_set_state(struct device *dev, struct netstack_state *state) {
     struct netif_ops *ops = device_get_driver_ops(dev, struct netif_ops, std);
@@ -75,3 +91,240 @@ status_t class_netif_mcast_filter(struct device *dev, const uint8_t *mac, int ac
         return ERR_NOT_SUPPORTED;
 }
 
+
+/* polling */
+static struct list_node netif_poll_list = LIST_INITIAL_VALUE(netif_poll_list);
+static mutex_t netif_poll_lock = MUTEX_INITIAL_VALUE(netif_poll_lock);
+
+/* what new devices start out with, the console can change it */
+static struct netif_coalesce netif_default_coalesce = {
+    .adaptive = true,
+    .usecs = 100,
+    .min_usecs = 20,
+    .max_usecs = 200,
+    .low_pps = 10000,
+    .high_pps = 200000,
+};
+static int netif_default_budget = NETIF_POLL_BUDGET;
+
+static uint32_t netif_coalesce_target(const struct netif_coalesce *c, uint32_t pps) {
+    if (!c->adaptive)
+        return c->usecs;
+    if (pps <= c->low_pps || c->max_usecs <= c->min_usecs)
+        return c->min_usecs;
+    if (pps >= c->high_pps)
+        return c->max_usecs;
+
+    return c->min_usecs + (uint64_t)(c->max_usecs - c->min_usecs) * (pps - c->low_pps) / (c->high_pps - c->low_pps);
+}
+
+static void netif_poll_apply_coalesce(struct netif_poll *np, uint32_t usecs) {
+    if (!np->ops->set_coalesce || usecs == np->coalesce_usecs)
+        return;
+
+    LTRACEF("%s: %u usecs at %u pps\n", np->name, usecs, np->last_pps);
+
+    np->coalesce_usecs = usecs;
+    np->ops->set_coalesce(np, usecs);
+}
+
+/* track the packet rate and move the moderation along with it, in steps big
+ * enough not to be reprogramming the device every window */
+static void netif_poll_adapt(struct netif_poll *np, int count) {
+    np->window_packets += count;
+
+    if (!np->coalesce.adaptive)
+        return;
+
+    lk_bigtime_t now = current_time_hires();
+    lk_bigtime_t elapsed = now - np->window_start;
+    if (elapsed < NETIF_POLL_WINDOW_USECS)
+        return;
+
+    np->last_pps = (uint64_t)np->window_packets * 1000000 / elapsed;
+    np->window_start = now;
+    np->window_packets = 0;
+
+    uint32_t target = netif_coalesce_target(&np->coalesce, np->last_pps);
+    uint32_t cur = np->coalesce_usecs;
+    uint32_t diff = (target > cur) ? target - cur : cur - target;
+    if (diff * 4 > cur || target == np->coalesce.min_usecs || target == np->coalesce.max_usecs)
+        netif_poll_apply_coalesce(np, target);
+}
+
+static int netif_poll_thread(void *arg) {
+    struct netif_poll *np = arg;
+
+    for (;;) {
+        event_wait(&np->event);
+
+        for (;;) {
+            int count = np->ops->poll(np, np->budget);
+
+            np->polls++;
+            np->packets += count;
+            netif_poll_adapt(np, count);
+
+            if (count >= np->budget) {
+                /* still busy, give everything else on this cpu a turn first */
+                np->budget_exhausted++;
+                thread_yield();
+                continue;
+            }
+
+            if (!np->ops->irq_enable(np))
+                break;
+        }
+    }
+
+    return 0;
+}
+
+void netif_poll_init(struct netif_poll *np, const char *name, const struct netif_poll_ops *ops, void *priv) {
+    DEBUG_ASSERT(np && ops && ops->poll && ops->irq_enable);
+
+    memset(np, 0, sizeof(*np));
+    strlcpy(np->name, name, sizeof(np->name));
+    np->ops = ops;
+    np->priv = priv;
+    mutex_acquire(&netif_poll_lock);
+    np->budget = netif_default_budget;
+    mutex_release(&netif_poll_lock);
+    event_init(&np->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    np->coalesce_usecs = UINT32_MAX; // unknown until the first set
+}
+
+status_t netif_poll_start(struct netif_poll *np, int cpu) {
+    if (np->thread)
+        return ERR_ALREADY_STARTED;
+
+    np->thread = thread_create(np->name, &netif_poll_thread, np, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!np->thread)
+        return ERR_NO_MEMORY;
+    if (cpu >= 0)
+        thread_set_pinned_cpu(np->thread, cpu);
+
+    mutex_acquire(&netif_poll_lock);
+    list_add_tail(&netif_poll_list, &np->node);
+    struct netif_coalesce c = netif_default_coalesce;
+    mutex_release(&netif_poll_lock);
+
+    np->window_start = current_time_hires();
+    netif_poll_set_coalesce(np, &c);
+
+    thread_resume(np->thread);
+
+    return NO_ERROR;
+}
+
+enum handler_return netif_poll_schedule(struct netif_poll *np) {
+    np->schedules++;
+    event_signal(&np->event, false);
+
+    return INT_RESCHEDULE;
+}
+
+void netif_poll_set_coalesce(struct netif_poll *np, const struct netif_coalesce *c) {
+    np->coalesce = *c;
+    netif_poll_apply_coalesce(np, netif_coalesce_target(c, np->last_pps));
+}
+
+#if WITH_LIB_CONSOLE
+
+static void netif_poll_dump(const struct netif_poll *np) {
+    const struct netif_coalesce *c = &np->coalesce;
+
+    printf("%s: budget %d, %llu schedules, %llu polls, %llu packets, budget exhausted %llu\n",
+           np->name, np->budget, np->schedules, np->polls, np->packets, np->budget_exhausted);
+    printf("\tcoalesce %u usecs at %u pps, %s", np->coalesce_usecs, np->last_pps,
+           np->ops->set_coalesce ? "" : "(unsupported) ");
+    if (c->adaptive)
+        printf("adaptive %u-%u usecs over %u-%u pps\n", c->min_usecs, c->max_usecs, c->low_pps, c->high_pps);
+    else
+        printf("fixed %u usecs\n", c->usecs);
+}
+
+static status_t netif_coalesce_set_param(struct netif_coalesce *c, int *budget, const char *param, unsigned long val) {
+    if (!strcmp(param, "adaptive")) {
+        c->adaptive = val;
+    } else if (!strcmp(param, "usecs")) {
+        c->usecs = val;
+        c->adaptive = false;
+    } else if (!strcmp(param, "min_usecs")) {
+        c->min_usecs = val;
+    } else if (!strcmp(param, "max_usecs")) {
+        c->max_usecs = val;
+    } else if (!strcmp(param, "low_pps")) {
+        c->low_pps = val;
+    } else if (!strcmp(param, "high_pps")) {
+        c->high_pps = val;
+    } else if (!strcmp(param, "budget")) {
+        if (val == 0)
+            return ERR_INVALID_ARGS;
+        *budget = val;
+    } else {
+        return ERR_INVALID_ARGS;
+    }
+
+    return NO_ERROR;
+}
+
+static int cmd_netpoll(int argc, const console_cmd_args *argv) {
+    if (argc < 2 || !strcmp(argv[1].str, "list")) {
+        mutex_acquire(&netif_poll_lock);
+        struct netif_poll *np;
+        list_for_every_entry(&netif_poll_list, np, struct netif_poll, node) {
+            netif_poll_dump(np);
+        }
+        mutex_release(&netif_poll_lock);
+        return 0;
+    }
+
+    if (!strcmp(argv[1].str, "set") && argc == 5) {
+        /* all also changes the defaults for devices that come along later */
+        bool all = !strcmp(argv[2].str, "all");
+        status_t err = NO_ERROR;
+        bool found = false;
+
+        mutex_acquire(&netif_poll_lock);
+        if (all)
+            err = netif_coalesce_set_param(&netif_default_coalesce, &netif_default_budget, argv[3].str, argv[4].u);
+
+        struct netif_poll *np;
+        list_for_every_entry(&netif_poll_list, np, struct netif_poll, node) {
+            if (err < 0)
+                break;
+            if (!all && strcmp(np->name, argv[2].str))
+                continue;
+
+            found = true;
+            struct netif_coalesce c = np->coalesce;
+            err = netif_coalesce_set_param(&c, &np->budget, argv[3].str, argv[4].u);
+            if (err == NO_ERROR)
+                netif_poll_set_coalesce(np, &c);
+        }
+        mutex_release(&netif_poll_lock);
+
+        if (err < 0) {
+            printf("bad parameter '%s'\n", argv[3].str);
+            return -1;
+        }
+        if (!all && !found) {
+            printf("no poller named '%s'\n", argv[2].str);
+            return -1;
+        }
+        return 0;
+    }
+
+    printf("usage:\n");
+    printf("%s [list]\n", argv[0].str);
+    printf("%s set <name|all> <param> <value>\n", argv[0].str);
+    printf("\tparams: adaptive, usecs, min_usecs, max_usecs, low_pps, high_pps, budget\n");
+    return -1;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("netpoll", "network device polling and interrupt moderation", &cmd_netpoll)
+STATIC_COMMAND_END(netpoll);
+
+#endif
@@ -10,6 +10,9 @@
 #include <lk/list.h>
 #include <lk/compiler.h>
 #include <dev/driver.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+#include <sys/types.h>
 
 struct netstack_state;
 struct pbuf;
@@ -27,6 +30,67 @@ struct netif_ops {
     status_t (*mcast_filter)(struct device *dev, const uint8_t *mac, int action);
 };
 
+/*
+ * napi style polling. A driver masks its interrupts when one fires and calls
+ * netif_poll_schedule, then a thread calls poll with a budget until a round
+ * comes up short of it, at which point irq_enable unmasks them again. A device
+ * that keeps the budget full is yielded between rounds instead of taking an
+ * interrupt per packet.
+ */
+struct netif_poll;
+
+struct netif_poll_ops {
+    /* process up to budget packets, returning how many were */
+    int (*poll)(struct netif_poll *np, int budget);
+
+    /* unmask the device's interrupts. returning true means work came in while
+     * they were masked, in which case they should be left masked and polling
+     * carries on */
+    bool (*irq_enable)(struct netif_poll *np);
+
+    /* optional, program the device's interrupt moderation to usecs */
+    void (*set_coalesce)(struct netif_poll *np, uint32_t usecs);
+};
+
+/* interrupt moderation. adaptive picks an interval between min_usecs and
+ * max_usecs, growing with the packet rate between low_pps and high_pps */
+struct netif_coalesce {
+    bool adaptive;
+    uint32_t usecs; // fixed interval, when not adaptive
+    uint32_t min_usecs;
+    uint32_t max_usecs;
+    uint32_t low_pps;
+    uint32_t high_pps;
+};
+
+struct netif_poll {
+    struct list_node node;
+    char name[32];
+    const struct netif_poll_ops *ops;
+    void *priv;
+
+    int budget;
+    event_t event;
+    thread_t *thread;
+
+    /* moderation settings, and the rate they are currently adapted to */
+    struct netif_coalesce coalesce;
+    uint32_t coalesce_usecs;
+    lk_bigtime_t window_start;
+    uint32_t window_packets;
+    uint32_t last_pps;
+
+    /* stats */
+    uint64_t schedules;
+    uint64_t polls;
+    uint64_t packets;
+    uint64_t budget_exhausted;
+};
+
+#ifndef NETIF_POLL_BUDGET
+#define NETIF_POLL_BUDGET 64
+#endif
+
 __BEGIN_CDECLS
 
 /* netif API */
@@ -44,5 +108,17 @@ status_t class_netstack_input(struct device *dev, struct netstack_state *state,
 
 status_t class_netstack_wait_for_network(lk_time_t timeout);
 
+/* polling API - called by drivers */
+void netif_poll_init(struct netif_poll *np, const char *name, const struct netif_poll_ops *ops, void *priv);
+
+/* start the poll thread, pinned to cpu unless it is -1, and apply the default
+ * moderation settings */
+status_t netif_poll_start(struct netif_poll *np, int cpu);
+
+/* called from the interrupt handler with the device's interrupts masked */
+enum handler_return netif_poll_schedule(struct netif_poll *np);
+
+void netif_poll_set_coalesce(struct netif_poll *np, const struct netif_coalesce *c);
+
 __END_CDECLS
 
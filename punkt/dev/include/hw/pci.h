@@ -71,6 +71,7 @@ __BEGIN_CDECLS
 #define PCI_COMMAND_AD_STEP_EN      0x0080
 #define PCI_COMMAND_SERR_EN         0x0100
 #define PCI_COMMAND_FAST_B2B_EN     0x0200
+#define PCI_COMMAND_INT_DISABLE     0x0400
 
 /*
  * PCI status register bits
@@ -13,7 +13,7 @@
 #include <dev/interrupt/arm_gic.h>
 #include <lk/reg.h>
 #include <kernel/thread.h>
-#include <kernel/debug.h>
+#include <kernel/ktrace.h>
 #include <lk/init.h>
 #include <platform/interrupts.h>
 #include <arch/ops.h>
@@ -341,7 +341,7 @@ enum handler_return __platform_irq(struct iframe *frame) {
     }
 
     THREAD_STATS_INC(interrupts);
-    KEVLOG_IRQ_ENTER(vector);
+    KTRACE_IRQ_ENTER(vector);
 
     uint cpu = arch_curr_cpu_num();
 
@@ -360,7 +360,7 @@ enum handler_return __platform_irq(struct iframe *frame) {
 
     LTRACEF_LEVEL(2, "cpu %u exit %d\n", cpu, ret);
 
-    KEVLOG_IRQ_EXIT(vector);
+    KTRACE_IRQ_EXIT(vector);
 
     return ret;
 }
@@ -12,7 +12,7 @@
 #include <lk/debug.h>
 #include <lk/reg.h>
 #include <lk/trace.h>
-#include <kernel/debug.h>
+#include <kernel/ktrace.h>
 #include <kernel/thread.h>
 #include <platform/interrupts.h>
 
@@ -142,7 +142,7 @@ enum handler_return riscv_platform_irq(void) {
     }
 
     THREAD_STATS_INC(interrupts);
-    KEVLOG_IRQ_ENTER(vector);
+    KTRACE_IRQ_ENTER(vector);
 
     enum handler_return ret = INT_NO_RESCHEDULE;
     if (handlers[vector].handler) {
@@ -152,7 +152,7 @@ enum handler_return riscv_platform_irq(void) {
     // ack the interrupt
     *REG32(PLIC_COMPLETE(riscv_current_hart())) = vector;
 
-    KEVLOG_IRQ_EXIT(vector);
+    KTRACE_IRQ_EXIT(vector);
 
     return ret;
 }
@@ -12,6 +12,7 @@
 #include <lk/trace.h>
 #include <lk/list.h>
 #include <dev/bus/pci.h>
+#include <dev/class/netif.h>
 #include <kernel/event.h>
 #include <kernel/thread.h>
 #include <vm/vm.h>
@@ -82,8 +83,14 @@ private:
 
     handler_return irq_handler();
 
+    // napi style polling of both rings
+    int poll(int budget);
+    bool irq_enable();
+    void set_coalesce(uint32_t usecs);
+
     void add_pktbuf_to_rxring(pktbuf_t *pkt);
     void add_pktbuf_to_rxring_locked(pktbuf_t *pkt);
+    size_t reclaim_tx_locked(pktbuf_t **done);
 
     // counter of configured deices
     static volatile int global_count_;
@@ -105,11 +112,9 @@ private:
     pktbuf_t *rx_pktbuf_[rxring_len] = {};
     uint8_t *rx_buf_ = nullptr; // rxbuffer_len * rxring_len byte buffer that rx_pktbuf[] points to
 
-    // rx worker thread
-    list_node rx_queue_ = LIST_INITIAL_VALUE(rx_queue_);
-    event_t rx_event_ = EVENT_INITIAL_VALUE(rx_event_, 0, EVENT_FLAG_AUTOUNSIGNAL);
-    thread_t *rx_worker_thread_ = nullptr;
-    int rx_worker_routine();
+    // poller, and the interrupts it masks: TXDW, TXQE, RXO, RXT0
+    static const uint32_t poll_irqs = (1<<0) | (1<<1) | (1<<6) | (1<<7);
+    netif_poll poll_ = {};
 
     // tx ring
     tdesc *txring_ = nullptr;
@@ -165,31 +170,44 @@ handler_return e1000::irq_handler() {
 
     LTRACEF("icr %#x\n", icr);
 
-    AutoSpinLockNoIrqSave guard(&lock_);
-
-    handler_return ret = INT_NO_RESCHEDULE;
-
-    if (icr & (1<<0)) { // TXDW - transmit descriptor written back
-        PANIC_UNIMPLEMENTED;
-    }
-    if (icr & (1<<1)) { // TXQE - transmit queue empty
-        //PANIC_UNIMPLEMENTED;
-        // nothing to really do here
-    }
     if (icr & (1<<6)) {
         printf("e1000: RX OVERRUN\n");
     }
-    if (icr & (1<<7)) { // RXTO - rx timer interrupt
-        // rx timer fired, packets are probably ready
-        auto rdh = read_reg(e1000_reg::RDH);
-        auto rdt = read_reg(e1000_reg::RDT);
 
-        while (rx_last_head_ != rdh) {
+    if (icr & poll_irqs) {
+        // mask the ring interrupts and leave the rings to the poller, any causes
+        // that come up meanwhile stay latched in ICR until they are unmasked
+        write_reg(e1000_reg::IMC, poll_irqs);
+        return netif_poll_schedule(&poll_);
+    }
+
+    return INT_NO_RESCHEDULE;
+}
+
+// reap finished tx descriptors and up to budget received packets, with the ring interrupts masked
+int e1000::poll(int budget) {
+    pktbuf_t *done[txring_len];
+    size_t done_count;
+    list_node rx_list = LIST_INITIAL_VALUE(rx_list);
+    int count = 0;
+
+    {
+        AutoSpinLock guard(&lock_);
+
+        done_count = reclaim_tx_locked(done);
+
+        // walk the descriptors the nic has written back, stopping short of the
+        // ones we haven't handed it yet
+        while (count < budget && rx_last_head_ != rx_tail_) {
             // copy the current rx descriptor locally for better cache performance
             rdesc rxd;
             copy(&rxd, rxring_ + rx_last_head_);
 
-            LTRACEF("last_head %#x RDH %#x RDT %#x\n", rx_last_head_, rdh, rdt);
+            if ((rxd.status & (1 << 0)) == 0) { // descriptor done, we own it now
+                break;
+            }
+
+            LTRACEF("last_head %#x RDT %#x\n", rx_last_head_, rx_tail_);
             if (LOCAL_TRACE) rxd.dump();
 
             // recover the pktbuf we queued in this spot
@@ -198,71 +216,85 @@ handler_return e1000::irq_handler() {
             pktbuf_t *pkt = rx_pktbuf_[rx_last_head_];
 
             bool consumed_pkt = false;
-            if (rxd.status & (1 << 0)) { // descriptor done, we own it now
-                if (rxd.status & (1<<1)) { // end of packet
-                    if (rxd.errors == 0) {
-                        // good packet, trim data len according to the rx descriptor
-                        pkt->dlen = rxd.length;
-                        pkt->flags |= PKTBUF_FLAG_EOF; // just to make sure
-
-                        // queue it in the rx queue
-                        list_add_tail(&rx_queue_, &pkt->list);
-
-                        // wake up the rx worker
-                        event_signal(&rx_event_, false);
-                        ret = INT_RESCHEDULE;
-                        consumed_pkt = true;
+            if (rxd.status & (1<<1)) { // end of packet
+                if (rxd.errors == 0) {
+                    // good packet, trim data len according to the rx descriptor
+                    pkt->dlen = rxd.length;
+                    pkt->flags = PKTBUF_FLAG_EOF;
+
+                    // pass along any checksums the nic checked, errors would have been flagged above
+                    if ((rxd.status & (1<<2)) == 0) { // !IXSM
+                        if (rxd.status & (1<<6)) { // IPCS
+                            pkt->flags |= PKTBUF_FLAG_CKSUM_IP_GOOD;
+                        }
+                        if (rxd.status & (1<<5)) { // TCPCS, covers udp too
+                            pkt->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+                        }
                     }
+
+                    list_add_tail(&rx_list, &pkt->list);
+                    consumed_pkt = true;
                 }
             }
             if (!consumed_pkt) {
-                // TODO: return the pkt to the ring
+                // return the pkt to the ring
                 add_pktbuf_to_rxring_locked(pkt);
             }
 
             rx_last_head_ = (rx_last_head_ + 1) % rxring_len;
+            count++;
         }
     }
-    return ret;
-}
 
-int e1000::rx_worker_routine() {
-    for (;;) {
-        event_wait(&rx_event_);
+    // free outside of the spinlock, it may wake up threads blocked on the pool
+    pktbuf_free_batch(done, done_count, true);
 
-        // pull some packets from the received queue
-        for (;;) {
-            pktbuf_t *p;
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&rx_list, pktbuf_t, list))) {
+        if (LOCAL_TRACE) {
+            LTRACEF("got packet: ");
+            pktbuf_dump(p);
+        }
 
-            {
-                AutoSpinLock guard(&lock_);
+        // push it up the stack
+        minip_rx_driver_callback(p);
 
-                p = list_remove_head_type(&rx_queue_, pktbuf_t, list);
-            }
+        // we own the pktbuf again
 
-            if (!p) {
-                break; // nothing left in the queue, go back to waiting
-            }
+        // set the data pointer to the start of the buffer and set dlen to 0
+        pktbuf_reset(p, 0);
 
-            if (LOCAL_TRACE) {
-                LTRACEF("got packet: ");
-                pktbuf_dump(p);
-            }
+        // add it back to the rx ring at the current tail
+        add_pktbuf_to_rxring(p);
+    }
 
-            // push it up the stack
-            minip_rx_driver_callback(p);
+    return count;
+}
 
-            // we own the pktbuf again
+bool e1000::irq_enable() {
+    // anything that finished while masked is latched in ICR and interrupts
+    // right away, so there is nothing to recheck
+    write_reg(e1000_reg::IMS, poll_irqs);
 
-            // set the data pointer to the start of the buffer and set dlen to 0
-            pktbuf_reset(p, 0);
+    return false;
+}
 
-            // add it back to the rx ring at the current tail
-            add_pktbuf_to_rxring(p);
-        }
+void e1000::set_coalesce(uint32_t usecs) {
+    // ITR counts in 256ns units, the rx delay timers in 1.024us ones
+    uint32_t itr = usecs * 1000 / 256;
+    write_reg(e1000_reg::ITR, itr);
+    if (is_e1000e()) {
+        write_reg(e1000_reg::EITR0, itr);
+        write_reg(e1000_reg::EITR1, itr);
+        write_reg(e1000_reg::EITR2, itr);
+        write_reg(e1000_reg::EITR3, itr);
+        write_reg(e1000_reg::EITR4, itr);
     }
 
-    return 0;
+    // hold the rx interrupt back a bit past a packet for more to pile up behind
+    // it, with the absolute timer putting a bound on it
+    write_reg(e1000_reg::RDTR, usecs / 4);
+    write_reg(e1000_reg::RADV, usecs);
 }
 
 int e1000::tx(pktbuf_t *p) {
@@ -271,23 +303,69 @@ int e1000::tx(pktbuf_t *p) {
         pktbuf_dump(p);
     }
 
-    // build a tx descriptor and stuff it in the tx ring
-    tdesc td = {};
-    td.addr = pktbuf_data_phys(p);
-    td.length = p->dlen;
-    td.cmd = (1<<0); // end of packet (EOP)
-    copy(&txring_[tx_tail_], &td);
+    pktbuf_t *done[txring_len];
+    size_t done_count;
+    status_t err = NO_ERROR;
+
+    {
+        AutoSpinLock guard(&lock_);
+
+        // reclaim the pktbufs of any descriptors the nic has moved past
+        done_count = reclaim_tx_locked(done);
+
+        if ((tx_tail_ + 1) % txring_len == tx_last_head_) {
+            // ring is full
+            err = ERR_NO_MEMORY;
+        } else {
+            // build a tx descriptor and stuff it in the tx ring
+            tdesc td = {};
+            td.addr = pktbuf_data_phys(p);
+            td.length = p->dlen;
+            td.cmd = (1<<0); // end of packet (EOP)
+            if (p->flags & PKTBUF_FLAG_CKSUM_TCP_PARTIAL) {
+                // sum from the tcp header to the end of the packet, into the seeded checksum field
+                size_t css = 14 + (p->data[14] & 0xf) * 4;
+                td.css = css;
+                td.cso = css + 16;
+                td.cmd |= (1<<2); // insert checksum (IC)
+            }
+            copy(&txring_[tx_tail_], &td);
 
-    // save a copy of the pktbuf in our list
-    tx_pktbuf_[tx_tail_] = p;
+            // save a copy of the pktbuf in our list
+            tx_pktbuf_[tx_tail_] = p;
 
-    // bump tail forward
-    tx_tail_ = (tx_tail_ + 1) % txring_len;
-    write_reg(e1000_reg::TDT, tx_tail_);
+            // bump tail forward
+            tx_tail_ = (tx_tail_ + 1) % txring_len;
+            write_reg(e1000_reg::TDT, tx_tail_);
 
-    LTRACEF("TDH %#x TDT %#x\n", read_reg(e1000_reg::TDH), read_reg(e1000_reg::TDT));
+            LTRACEF("TDH %#x TDT %#x\n", read_reg(e1000_reg::TDH), read_reg(e1000_reg::TDT));
+        }
+    }
 
-    return NO_ERROR;
+    // free outside of the spinlock, it may wake up threads blocked on the pool
+    pktbuf_free_batch(done, done_count, true);
+    if (err < 0) {
+        pktbuf_free(p, true);
+    }
+
+    return err;
+}
+
+// collect the pktbufs of the descriptors the nic has moved past, returning the count
+size_t e1000::reclaim_tx_locked(pktbuf_t **done) {
+    auto tdh = read_reg(e1000_reg::TDH);
+    size_t count = 0;
+
+    while (tx_last_head_ != tdh) {
+        if (tx_pktbuf_[tx_last_head_]) {
+            done[count++] = tx_pktbuf_[tx_last_head_];
+            tx_pktbuf_[tx_last_head_] = nullptr;
+        }
+
+        tx_last_head_ = (tx_last_head_ + 1) % txring_len;
+    }
+
+    return count;
 }
 
 void e1000::add_pktbuf_to_rxring_locked(pktbuf_t *p) {
@@ -402,16 +480,8 @@ status_t e1000::init_device(pci_location_t loc, const e1000_id_features *id) {
         write_reg(e1000_reg::IAM, 0); // set such that no IMS bits are auto cleared
     }
 
-    // set the interrupt treshold reg
-    const uint32_t irq_rate = 10000; // max 10k irqs/sec
-    write_reg(e1000_reg::ITR, 1000000 / irq_rate * 4);
-    if (is_e1000e()) {
-        write_reg(e1000_reg::EITR0, 1000000 / irq_rate * 4);
-        write_reg(e1000_reg::EITR1, 1000000 / irq_rate * 4);
-        write_reg(e1000_reg::EITR2, 1000000 / irq_rate * 4);
-        write_reg(e1000_reg::EITR3, 1000000 / irq_rate * 4);
-        write_reg(e1000_reg::EITR4, 1000000 / irq_rate * 4);
-    }
+    // interrupt throttling and the rx delay timers are left to the poller's
+    // moderation settings, see set_coalesce()
 
     // disable tx and rx
     write_reg(e1000_reg::RCTL, 0);
@@ -453,9 +523,6 @@ status_t e1000::init_device(pci_location_t loc, const e1000_id_features *id) {
     write_reg(e1000_reg::RDH, 0);
     write_reg(e1000_reg::RDT, 0);
 
-    // disable receive delay timer and absolute delay timer
-    write_reg(e1000_reg::RDTR, 0);
-    write_reg(e1000_reg::RADV, 0);
     // disable small packet detect
     write_reg(e1000_reg::RSRPD, 0);
 
@@ -478,14 +545,24 @@ status_t e1000::init_device(pci_location_t loc, const e1000_id_features *id) {
     }
     //hexdump(rxring_, rxring_len * sizeof(rdesc));
 
-    // start rx worker thread
-    auto wrapper_lambda = [](void *arg) -> int {
-        e1000 *e = (e1000 *)arg;
-        return e->rx_worker_routine();
+    // start the poller, which also programs the interrupt moderation
+    static const netif_poll_ops poll_ops = {
+        .poll = [](netif_poll *np, int budget) -> int {
+            return static_cast<e1000 *>(np->priv)->poll(budget);
+        },
+        .irq_enable = [](netif_poll *np) -> bool {
+            return static_cast<e1000 *>(np->priv)->irq_enable();
+        },
+        .set_coalesce = [](netif_poll *np, uint32_t usecs) {
+            static_cast<e1000 *>(np->priv)->set_coalesce(usecs);
+        },
     };
-    snprintf(str, sizeof(str), "e1000 %d rx worker", unit_);
-    rx_worker_thread_ = thread_create(str, wrapper_lambda, this, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
-    thread_resume(rx_worker_thread_);
+    snprintf(str, sizeof(str), "e1000 %d", unit_);
+    netif_poll_init(&poll_, str, &poll_ops, this);
+    netif_poll_start(&poll_, -1);
+
+    // check ip and tcp/udp checksums on receive
+    write_reg(e1000_reg::RXCSUM, (1<<8) | (1<<9)); // IPOFL, TUOFL
 
     // start receiver
     // enable RX, unicast permiscuous, multicast permiscuous, broadcast accept, BSIZE 2048
@@ -493,7 +570,7 @@ status_t e1000::init_device(pci_location_t loc, const e1000_id_features *id) {
 
     // unmask receive irq
     auto ims = read_reg(e1000_reg::IMS);
-    write_reg(e1000_reg::IMS, ims | (1<<7) | (1<<6)); // RXO, RXTO
+    write_reg(e1000_reg::IMS, ims | (1<<7) | (1<<6)); // RXO, RXT0
 
     // set up the tx path
     write_reg(e1000_reg::TDH, 0);
@@ -529,6 +606,7 @@ status_t e1000_register_with_minip() {
 
     if (the_e) {
         minip_set_eth(tx_routine, the_e, the_e->mac_addr());
+        minip_set_eth_offloads(MINIP_OFFLOAD_TX_TCP_CKSUM);
         return NO_ERROR;
     }
 
@@ -198,7 +198,8 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
                              VIRTIO_BLK_F_BLK_SIZE |
                              VIRTIO_BLK_F_TOPOLOGY |
                              VIRTIO_BLK_F_DISCARD |
-                             VIRTIO_BLK_F_WRITE_ZEROES);
+                             VIRTIO_BLK_F_WRITE_ZEROES |
+                             (1u << VIRTIO_RING_F_EVENT_IDX));
     virtio_set_guest_features(dev, 0, bdev->guest_features);
 
     /* TODO: handle a RO feature */
@@ -17,9 +17,12 @@
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[], size_t stride);
 
-#define MAX_VIRTIO_RINGS 4
+/* enough for a multiqueue net device with 15 queue pairs and its control ring */
+#define MAX_VIRTIO_RINGS 32
 
 struct virtio_mmio_config;
+struct virtio_pci_transport;
+struct virtio_transport_ops;
 
 struct virtio_device {
     bool valid;
@@ -27,22 +30,39 @@ struct virtio_device {
     uint index;
     uint irq;
 
+    /* transport the device was found on */
+    const struct virtio_transport_ops *ops;
     volatile struct virtio_mmio_config *mmio_config;
+    struct virtio_pci_transport *pci;
     void *config_ptr;
 
+    /* VIRTIO_F_VERSION_1 is in use, affects some device specific layouts */
+    bool modern;
+
+    /* VIRTIO_RING_F_EVENT_IDX was negotiated */
+    bool event_idx;
+
     void *priv; /* a place for the driver to put private data */
 
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
     enum handler_return (*config_change_callback)(struct virtio_device *dev);
 
+    /* rings the driver polls, their interrupts just mask the ring and call this */
+    enum handler_return (*ring_poll_callback)(struct virtio_device *dev, uint ring);
+    uint32_t polled_rings_bitmap;
+
     /* virtio rings */
     uint32_t active_rings_bitmap;
     struct vring ring[MAX_VIRTIO_RINGS];
+
+    /* the cpu the transport steers the interrupts of each ring at */
+    uint8_t ring_cpu[MAX_VIRTIO_RINGS];
 };
 
 void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 uint32_t virtio_read_host_feature_word(struct virtio_device *dev, uint32_t word);
+/* negotiation finishes with word 0, so any other word has to be set before it */
 void virtio_set_guest_features(struct virtio_device *dev, uint32_t word, uint32_t features);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
@@ -70,4 +90,12 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
 
 void virtio_kick(struct virtio_device *dev, uint ring_idnex);
 
+/* interrupt suppression and polling of the used ring, for drivers that mark the
+ * ring in polled_rings_bitmap. enabling returns true if entries are already
+ * waiting, polling runs irq_driver_callback on up to budget of them and returns
+ * the count. the caller keeps the ring's interrupt from running alongside. */
+void virtio_ring_disable_interrupts(struct virtio_device *dev, uint ring_index);
+bool virtio_ring_enable_interrupts(struct virtio_device *dev, uint ring_index);
+uint virtio_poll_ring(struct virtio_device *dev, uint ring_index, uint budget);
+
 
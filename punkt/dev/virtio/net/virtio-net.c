@@ -7,6 +7,8 @@
  */
 #include <dev/virtio/net.h>
 
+#include <dev/class/netif.h>
+
 #include <stdlib.h>
 #include <inttypes.h>
 #include <lk/debug.h>
@@ -18,6 +20,8 @@
 #include <lk/err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
 #include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
 #include <lib/minip.h>
@@ -101,13 +105,97 @@ STATIC_ASSERT(sizeof(struct virtio_net_hdr) == 12);
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-#define TX_RING_SIZE 16
-#define RX_RING_SIZE 16
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4   (1<<0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4  (1<<1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4  (1<<2)
+
+/* control virtqueue commands, a header, the command data and an ack byte */
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+};
+STATIC_ASSERT(sizeof(struct virtio_net_ctrl_hdr) == 2);
+
+#define VIRTIO_NET_OK                       0
+#define VIRTIO_NET_ERR                      1
+
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG       1
+
+#define VIRTIO_NET_CTRL_NOTF_COAL           6
+#define VIRTIO_NET_CTRL_NOTF_COAL_TX_SET    0
+#define VIRTIO_NET_CTRL_NOTF_COAL_RX_SET    1
+#define VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET    2
+
+struct virtio_net_ctrl_coal {
+    uint32_t max_packets;
+    uint32_t max_usecs;
+};
+STATIC_ASSERT(sizeof(struct virtio_net_ctrl_coal) == 8);
+
+struct virtio_net_ctrl_coal_vq {
+    uint16_t vq_index;
+    uint16_t reserved;
+    struct virtio_net_ctrl_coal coal;
+};
+STATIC_ASSERT(sizeof(struct virtio_net_ctrl_coal_vq) == 12);
+
+/* with a moderation interval set, notify early after this many packets anyway */
+#define VIRTIO_NET_COAL_MAX_PACKETS 64
+
+/* room for a tso packet of header, headers and PKTBUF_MAX_FRAGS of payload in
+ * the tx ring, and for a 64K mergeable receive in the rx one */
+#ifndef VIRTIO_NET_TX_RING_SIZE
+#define VIRTIO_NET_TX_RING_SIZE 128
+#endif
+#ifndef VIRTIO_NET_RX_RING_SIZE
+#define VIRTIO_NET_RX_RING_SIZE 64
+#endif
+#define CTRL_RING_SIZE 16
+
+/* rx and tx rings of queue pair q, the control ring comes after all the pairs
+ * the device has */
+#define RING_RX(q) ((q) * 2)
+#define RING_TX(q) ((q) * 2 + 1)
+
+/* size of the rss indirection table we program, and the default toeplitz key */
+#define RSS_TABLE_SIZE 128
+#define RSS_KEY_SIZE 40
+
+static const uint8_t rss_default_key[RSS_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+    0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+    0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+    0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+struct virtio_net_dev;
 
-#define RING_RX 0
-#define RING_TX 1
+/* a rx/tx ring pair, with its interrupts and poll thread on one cpu */
+struct virtio_net_queue {
+    struct virtio_net_dev *ndev;
+    uint index;
 
-#define VIRTIO_NET_MSS 1514
+    /* both rings are drained by the poller with their interrupts masked */
+    struct netif_poll poll;
+
+    /* rx buffers posted to the ring, and the ones the device has filled */
+    spin_lock_t rx_lock;
+    pktbuf_t *pending_rx_packet[VIRTIO_NET_RX_RING_SIZE];
+    struct list_node completed_rx_queue;
+
+    /* rx poll state, a mergeable packet waiting on the rest of its buffers */
+    pktbuf_t *rx_partial;
+    uint rx_partial_left;
+    bool rx_partial_drop; // too long to hold on to
+    minip_gro_t gro;
+
+    /* active tx packets to be freed at irq time */
+    spin_lock_t tx_lock;
+    pktbuf_t *pending_tx_packet[VIRTIO_NET_TX_RING_SIZE];
+    uint tx_pending_count;
+};
 
 struct virtio_net_dev {
     struct virtio_device *dev;
@@ -115,20 +203,46 @@ struct virtio_net_dev {
 
     struct virtio_net_config *config;
 
-    spin_lock_t lock;
-    event_t rx_event;
-
-    /* list of active tx/rx packets to be freed at irq time */
-    pktbuf_t *pending_tx_packet[TX_RING_SIZE];
-    pktbuf_t *pending_rx_packet[RX_RING_SIZE];
-
-    uint tx_pending_count;
-    struct list_node completed_rx_queue;
+    /* size of the header in front of every packet, num_buffers is only there with VERSION_1 */
+    size_t hdr_len;
+
+    /* negotiated offloads */
+    bool tx_csum;
+    bool rx_csum;
+    bool tso;
+    bool mrg_rxbuf; // a received packet may take num_buffers rx buffers
+    bool mq;
+    bool rss;
+    bool ctrl_vq;
+    bool notf_coal; // interrupt moderation for all rx and all tx rings
+    bool vq_notf_coal; // and per ring
+
+    /* queue pairs set up, and how many of them the device is using */
+    uint num_queues;
+    uint active_queues;
+    struct virtio_net_queue *queues;
+
+    /* control ring, one command at a time */
+    uint ctrl_ring;
+    mutex_t ctrl_lock;
+    spin_lock_t ctrl_spin;
+    event_t ctrl_event;
+    pktbuf_t *ctrl_buf;
+
+    /* flow hashing, which the device steers rx by if it has rss and we steer
+     * tx by either way so a flow sticks to one queue pair */
+    uint32_t rss_hash_types;
+    uint rss_key_len;
+    uint rss_table_len;
+    uint8_t rss_key[RSS_KEY_SIZE];
+    uint16_t rss_table[RSS_TABLE_SIZE];
 };
 
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
-static int virtio_net_rx_worker(void *arg);
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p);
+static enum handler_return virtio_net_ring_poll_callback(struct virtio_device *dev, uint ring);
+static const struct netif_poll_ops virtio_net_poll_ops;
+static const struct netif_poll_ops virtio_net_poll_coal_ops;
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p);
 
 // XXX remove need for this
 static struct virtio_net_dev *the_ndev;
@@ -172,6 +286,184 @@ static void dump_feature_bits(uint64_t feature) {
     printf("\n");
 }
 
+static void virtio_net_queue_init(struct virtio_net_dev *ndev, struct virtio_net_queue *q, uint index) {
+    q->ndev = ndev;
+    q->index = index;
+
+    q->rx_lock = SPIN_LOCK_INITIAL_VALUE;
+    list_initialize(&q->completed_rx_queue);
+    minip_gro_init(&q->gro);
+
+    q->tx_lock = SPIN_LOCK_INITIAL_VALUE;
+}
+
+/* the standard toeplitz hash, as the device computes it for rss */
+static uint32_t toeplitz_hash(const uint8_t *key, size_t key_len, const uint8_t *in, size_t len) {
+    uint32_t hash = 0;
+    uint32_t v = (uint32_t)key[0] << 24 | (uint32_t)key[1] << 16 | (uint32_t)key[2] << 8 | key[3];
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t next = (i + 4 < key_len) ? key[i + 4] : 0;
+        for (int b = 7; b >= 0; b--) {
+            if (in[i] & (1u << b))
+                hash ^= v;
+            v = (v << 1) | ((next >> b) & 1);
+        }
+    }
+
+    return hash;
+}
+
+/* hash the flow of an outgoing frame the way the device would hash the replies
+ * coming in, so the source is the remote end. false if it isn't ip. */
+static bool virtio_net_flow_hash(struct virtio_net_dev *ndev, const pktbuf_t *p, uint32_t *hash) {
+    const uint8_t *pkt = p->data;
+
+    if (p->dlen < 14 + 20 || pkt[12] != 0x08 || pkt[13] != 0x00)
+        return false;
+
+    const uint8_t *ip = pkt + 14;
+    size_t ihl = (ip[0] & 0xf) * 4;
+    if ((ip[0] >> 4) != 4 || ihl < 20)
+        return false;
+
+    uint8_t in[12];
+    memcpy(&in[0], ip + 16, 4); // our destination is its source
+    memcpy(&in[4], ip + 12, 4);
+    size_t len = 8;
+
+    /* ports if the device would hash them, fragments only ever get the addresses */
+    bool fragment = ((ip[6] & 0x3f) | ip[7]) != 0;
+    bool l4 = (ip[9] == 6 /* tcp */ && (ndev->rss_hash_types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) ||
+              (ip[9] == 17 /* udp */ && (ndev->rss_hash_types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4));
+    if (l4 && !fragment && p->dlen >= 14 + ihl + 4) {
+        const uint8_t *ports = ip + ihl;
+        memcpy(&in[8], ports + 2, 2);
+        memcpy(&in[10], ports, 2);
+        len = 12;
+    } else if (!(ndev->rss_hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv4)) {
+        return false;
+    }
+
+    *hash = toeplitz_hash(ndev->rss_key, ndev->rss_key_len, in, len);
+    return true;
+}
+
+static struct virtio_net_queue *virtio_net_select_tx_queue(struct virtio_net_dev *ndev, const pktbuf_t *p) {
+    uint32_t hash;
+
+    if (ndev->active_queues <= 1 || !virtio_net_flow_hash(ndev, p, &hash))
+        return &ndev->queues[0];
+
+    return &ndev->queues[ndev->rss_table[hash & (ndev->rss_table_len - 1)]];
+}
+
+/* run a command on the control ring and wait for the device to ack it */
+static status_t virtio_net_ctrl_cmd(struct virtio_net_dev *ndev, uint8_t class, uint8_t cmd, const void *data, size_t len) {
+    struct virtio_device *vdev = ndev->dev;
+
+    mutex_acquire(&ndev->ctrl_lock);
+
+    /* gone if an earlier command never came back */
+    pktbuf_t *p = ndev->ctrl_buf;
+    if (!p) {
+        mutex_release(&ndev->ctrl_lock);
+        return ERR_NOT_READY;
+    }
+    DEBUG_ASSERT(sizeof(struct virtio_net_ctrl_hdr) + len + 1 <= p->blen);
+
+    /* header and data read by the device, followed by the ack it writes */
+    p->data = p->buffer;
+    p->dlen = 0;
+    struct virtio_net_ctrl_hdr *hdr = pktbuf_append(p, sizeof(*hdr));
+    hdr->class = class;
+    hdr->cmd = cmd;
+    memcpy(pktbuf_append(p, len), data, len);
+    volatile uint8_t *ack = pktbuf_append(p, 1);
+    *ack = VIRTIO_NET_ERR;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&ndev->ctrl_spin, state);
+
+    uint16_t i;
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ndev->ctrl_ring, 2, &i);
+    DEBUG_ASSERT(desc);
+
+    desc->addr = pktbuf_data_phys(p);
+    desc->len = p->dlen - 1;
+    desc->flags |= VRING_DESC_F_NEXT;
+
+    desc = virtio_desc_index_to_desc(vdev, ndev->ctrl_ring, desc->next);
+    desc->addr = pktbuf_data_phys(p) + p->dlen - 1;
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    virtio_submit_chain(vdev, ndev->ctrl_ring, i);
+    virtio_kick(vdev, ndev->ctrl_ring);
+
+    spin_unlock_irqrestore(&ndev->ctrl_spin, state);
+
+    /* the device is expected to answer promptly, if it doesn't the buffer stays
+     * with it and the command counts as failed */
+    status_t err = event_wait_timeout(&ndev->ctrl_event, 1000);
+    if (err < 0) {
+        TRACEF("control command %u/%u timed out\n", class, cmd);
+        ndev->ctrl_buf = NULL;
+    } else if (*ack != VIRTIO_NET_OK) {
+        err = ERR_IO;
+    }
+
+    mutex_release(&ndev->ctrl_lock);
+
+    return err;
+}
+
+/* spread the flows over the active queue pairs, and if the device does rss have
+ * it steer rx the same way */
+static status_t virtio_net_setup_queues(struct virtio_net_dev *ndev, uint count) {
+    for (uint i = 0; i < ndev->rss_table_len; i++)
+        ndev->rss_table[i] = i % count;
+
+    status_t err;
+    if (ndev->rss) {
+        uint8_t buf[4 + 2 + 2 + RSS_TABLE_SIZE * 2 + 2 + 1 + RSS_KEY_SIZE];
+        uint8_t *ptr = buf;
+        uint16_t val16;
+
+        memcpy(ptr, &ndev->rss_hash_types, 4);
+        ptr += 4;
+        val16 = ndev->rss_table_len - 1; // indirection_table_mask
+        memcpy(ptr, &val16, 2);
+        ptr += 2;
+        val16 = 0; // unclassified_queue
+        memcpy(ptr, &val16, 2);
+        ptr += 2;
+        memcpy(ptr, ndev->rss_table, ndev->rss_table_len * 2);
+        ptr += ndev->rss_table_len * 2;
+        val16 = count; // max_tx_vq
+        memcpy(ptr, &val16, 2);
+        ptr += 2;
+        *ptr++ = ndev->rss_key_len;
+        memcpy(ptr, ndev->rss_key, ndev->rss_key_len);
+        ptr += ndev->rss_key_len;
+
+        err = virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, buf, ptr - buf);
+    } else {
+        /* the device steers rx by the queue each flow last went out on */
+        uint16_t pairs = count;
+        err = virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs));
+    }
+
+    if (err < 0) {
+        TRACEF("failed to enable %u queue pairs, err %d\n", count, err);
+        return err;
+    }
+
+    ndev->active_queues = count;
+
+    return NO_ERROR;
+}
+
 status_t virtio_net_init(struct virtio_device *dev) {
     LTRACEF("dev %p\n", dev);
 
@@ -184,9 +476,9 @@ status_t virtio_net_init(struct virtio_device *dev) {
     dev->priv = ndev;
     ndev->started = false;
 
-    ndev->lock = SPIN_LOCK_INITIAL_VALUE;
-    event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-    list_initialize(&ndev->completed_rx_queue);
+    mutex_init(&ndev->ctrl_lock);
+    ndev->ctrl_spin = SPIN_LOCK_INITIAL_VALUE;
+    event_init(&ndev->ctrl_event, false, EVENT_FLAG_AUTOUNSIGNAL);
 
     ndev->config = (struct virtio_net_config *)dev->config_ptr;
 
@@ -197,16 +489,108 @@ status_t virtio_net_init(struct virtio_device *dev) {
     uint64_t host_features = virtio_read_host_feature_word(dev, 0) | (uint64_t)virtio_read_host_feature_word(dev, 1) << 32;
     dump_feature_bits(host_features);
 
-    /* set our irq handler */
+    /* ask for the mac address, link status, checksum and segmentation offload both
+     * ways, mergeable rx buffers, interrupt suppression by ring index and multiple
+     * queues with rss and interrupt moderation */
+    uint64_t features = VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
+                        VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_MRG_RXBUF |
+                        VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ | VIRTIO_NET_F_RSS |
+                        VIRTIO_NET_F_NOTF_COAL | VIRTIO_NET_F_VQ_NOTF_COAL |
+                        (1u << VIRTIO_RING_F_EVENT_IDX);
+    features &= host_features;
+
+    /* tso needs the checksum offload under it, and large receives need mergeable
+     * buffers since ours only hold a frame each */
+    if (!(features & VIRTIO_NET_F_CSUM))
+        features &= ~VIRTIO_NET_F_HOST_TSO4;
+    if (!(features & VIRTIO_NET_F_GUEST_CSUM) || !(features & VIRTIO_NET_F_MRG_RXBUF))
+        features &= ~VIRTIO_NET_F_GUEST_TSO4;
+
+    /* multiple queues and moderation are configured over the control ring, which
+     * sits after all of the device's queue pairs and so has to fit in our rings */
+    if (!(features & VIRTIO_NET_F_CTRL_VQ))
+        features &= ~(VIRTIO_NET_F_MQ | VIRTIO_NET_F_RSS | VIRTIO_NET_F_NOTF_COAL | VIRTIO_NET_F_VQ_NOTF_COAL);
+    uint max_pairs = 1;
+    if (features & VIRTIO_NET_F_MQ)
+        max_pairs = ndev->config->max_virtqueue_pairs;
+    if (max_pairs <= 1 || max_pairs * 2 >= MAX_VIRTIO_RINGS) {
+        features &= ~(VIRTIO_NET_F_MQ | VIRTIO_NET_F_RSS);
+        max_pairs = 1;
+    }
+    if (!(features & (VIRTIO_NET_F_MQ | VIRTIO_NET_F_NOTF_COAL | VIRTIO_NET_F_VQ_NOTF_COAL)))
+        features &= ~VIRTIO_NET_F_CTRL_VQ;
+
+    virtio_set_guest_features(dev, 1, features >> 32);
+    virtio_set_guest_features(dev, 0, features);
+
+    ndev->tx_csum = features & VIRTIO_NET_F_CSUM;
+    ndev->rx_csum = features & VIRTIO_NET_F_GUEST_CSUM;
+    ndev->tso = features & VIRTIO_NET_F_HOST_TSO4;
+    ndev->mrg_rxbuf = features & VIRTIO_NET_F_MRG_RXBUF;
+    ndev->mq = features & VIRTIO_NET_F_MQ;
+    ndev->rss = features & VIRTIO_NET_F_RSS;
+    ndev->ctrl_vq = features & VIRTIO_NET_F_CTRL_VQ;
+    ndev->notf_coal = features & VIRTIO_NET_F_NOTF_COAL;
+    ndev->vq_notf_coal = features & VIRTIO_NET_F_VQ_NOTF_COAL;
+    ndev->hdr_len = (dev->modern || ndev->mrg_rxbuf) ? sizeof(struct virtio_net_hdr) : sizeof(struct virtio_net_hdr) - 2;
+
+    /* a queue pair per cpu, as far as the device goes */
+    uint cpus = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            cpus++;
+    }
+    ndev->num_queues = MAX(1u, MIN(max_pairs, cpus));
+    ndev->active_queues = 1;
+
+    /* hash what the device can, and everything if only we are going to */
+    ndev->rss_hash_types = VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | VIRTIO_NET_RSS_HASH_TYPE_UDPv4;
+    ndev->rss_key_len = RSS_KEY_SIZE;
+    ndev->rss_table_len = RSS_TABLE_SIZE;
+    if (ndev->rss) {
+        ndev->rss_hash_types &= ndev->config->supported_hash_types;
+        ndev->rss_key_len = MIN(ndev->rss_key_len, ndev->config->rss_max_key_size);
+        while (ndev->rss_table_len > ndev->config->rss_max_indirection_table_length)
+            ndev->rss_table_len /= 2;
+        if (ndev->rss_table_len == 0 || ndev->rss_key_len == 0)
+            ndev->rss = false;
+    }
+    memcpy(ndev->rss_key, rss_default_key, ndev->rss_key_len);
+
+    ndev->queues = calloc(ndev->num_queues, sizeof(struct virtio_net_queue));
+    if (!ndev->queues)
+        return ERR_NO_MEMORY;
+    for (uint q = 0; q < ndev->num_queues; q++)
+        virtio_net_queue_init(ndev, &ndev->queues[q], q);
+
+    /* set our irq handlers, the queue rings get polled once started */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
+    dev->ring_poll_callback = &virtio_net_ring_poll_callback;
+
+    /* allocate the rings, the device has to see them before DRIVER_OK */
+    status_t err = NO_ERROR;
+    for (uint q = 0; q < ndev->num_queues && err == NO_ERROR; q++) {
+        err = virtio_alloc_ring(dev, RING_RX(q), VIRTIO_NET_RX_RING_SIZE);
+        if (err == NO_ERROR)
+            err = virtio_alloc_ring(dev, RING_TX(q), VIRTIO_NET_TX_RING_SIZE);
+    }
+    if (err == NO_ERROR && ndev->ctrl_vq) {
+        ndev->ctrl_ring = max_pairs * 2;
+        err = virtio_alloc_ring(dev, ndev->ctrl_ring, CTRL_RING_SIZE);
+        if (err == NO_ERROR) {
+            ndev->ctrl_buf = pktbuf_alloc();
+            if (!ndev->ctrl_buf)
+                err = ERR_NO_MEMORY;
+        }
+    }
+    if (err < 0) {
+        TRACEF("failed to allocate rings, err %d\n", err);
+        return err;
+    }
 
     /* set DRIVER_OK */
     virtio_status_driver_ok(dev);
 
-    /* allocate a pair of virtio rings */
-    virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
-    virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
-
     the_ndev = ndev;
 
     return NO_ERROR;
@@ -218,22 +602,50 @@ status_t virtio_net_start(void) {
 
     the_ndev->started = true;
 
-    /* start the rx worker thread */
-    thread_resume(thread_create("virtio_net_rx", &virtio_net_rx_worker, (void *)the_ndev, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
-
-    /* queue up a bunch of rxes */
-    for (uint i = 0; i < RX_RING_SIZE - 1; i++) {
-        pktbuf_t *p = pktbuf_alloc();
-        if (p) {
-            virtio_net_queue_rx(the_ndev, p);
+    /* let the stack leave tcp checksums and segmentation to the device */
+    uint32_t offloads = 0;
+    if (the_ndev->tx_csum)
+        offloads |= MINIP_OFFLOAD_TX_TCP_CKSUM;
+    if (the_ndev->tso)
+        offloads |= MINIP_OFFLOAD_TX_TCP_TSO;
+    minip_set_eth_offloads(offloads);
+
+    const struct netif_poll_ops *ops = &virtio_net_poll_ops;
+    if (the_ndev->notf_coal || the_ndev->vq_notf_coal)
+        ops = &virtio_net_poll_coal_ops;
+
+    for (uint i = 0; i < the_ndev->num_queues; i++) {
+        struct virtio_net_queue *q = &the_ndev->queues[i];
+
+        /* start polling the pair, on the cpu its interrupts go to */
+        char name[32];
+        snprintf(name, sizeof(name), "virtio-net q%u", i);
+        netif_poll_init(&q->poll, name, ops, q);
+        the_ndev->dev->polled_rings_bitmap |= (1u << RING_RX(i)) | (1u << RING_TX(i));
+        netif_poll_start(&q->poll, the_ndev->dev->ring_cpu[RING_RX(i)]);
+
+        /* queue up a bunch of rxes */
+        pktbuf_t *rx[VIRTIO_NET_RX_RING_SIZE - 1];
+        size_t count = pktbuf_alloc_batch(rx, countof(rx));
+        for (size_t j = 0; j < count; j++) {
+            virtio_net_queue_rx(q, rx[j]);
         }
     }
 
+    /* the device only uses the first pair until told otherwise */
+    if (the_ndev->num_queues > 1)
+        virtio_net_setup_queues(the_ndev, the_ndev->num_queues);
+
+    printf("virtio-net: %u of %u queue pair%s active%s\n", the_ndev->active_queues, the_ndev->num_queues,
+           the_ndev->num_queues > 1 ? "s" : "", the_ndev->rss ? ", rss" : "");
+
     return NO_ERROR;
 }
 
-static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t *p2) {
+static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_queue *q, pktbuf_t *p2) {
+    struct virtio_net_dev *ndev = q->ndev;
     struct virtio_device *vdev = ndev->dev;
+    const uint ring = RING_TX(q->index);
 
     uint16_t i;
     pktbuf_t *p;
@@ -245,106 +657,111 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
         return ERR_NO_MEMORY;
 
     /* point our header to the base of the first pktbuf */
-    struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
+    struct virtio_net_hdr *hdr = pktbuf_append(p, ndev->hdr_len);
     memset(hdr, 0, p->dlen);
 
+    if (p2->flags & (PKTBUF_FLAG_CKSUM_TCP_PARTIAL | PKTBUF_FLAG_GSO_TCP)) {
+        /* the device sums from the tcp header on, into the seeded checksum field */
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = 14 + (p2->data[14] & 0xf) * 4;
+        hdr->csum_offset = 16;
+    }
+
+    if (p2->flags & PKTBUF_FLAG_GSO_TCP) {
+        /* and cuts the payload after the headers into gso_size segments */
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = p2->gso_size;
+        hdr->hdr_len = hdr->csum_start + (p2->data[hdr->csum_start + 12] >> 4) * 4;
+    }
+
+    /* the header, the packet and whatever it continues into */
+    uint ndesc = 2 + p2->nfrags;
+
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->tx_lock, state);
 
     /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
+    if (q->tx_pending_count + ndesc > VIRTIO_NET_TX_RING_SIZE)
         goto nodesc;
 
     /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ring, ndesc, &i);
     if (!desc) {
-        spin_unlock_irqrestore(&ndev->lock, state);
+        spin_unlock_irqrestore(&q->tx_lock, state);
 
 nodesc:
-        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
+        TRACEF("out of virtio tx descriptors on queue %u, tx_pending_count %u\n", q->index, q->tx_pending_count);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
+    q->tx_pending_count += ndesc;
 
-    /* save a pointer to our pktbufs for the irq handler to free */
+    /* save a pointer to our pktbufs for the irq handler to free, the frags go
+     * along with p2 */
     LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
-    DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
-    ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[desc->next] = p2;
+    DEBUG_ASSERT(q->pending_tx_packet[i] == NULL);
+    DEBUG_ASSERT(q->pending_tx_packet[desc->next] == NULL);
+    q->pending_tx_packet[i] = p;
+    q->pending_tx_packet[desc->next] = p2;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
     desc->len = p->dlen;
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+    /* and the ones pointing to the buffers */
+    for (uint j = 0; j <= p2->nfrags; j++) {
+        pktbuf_t *b = (j == 0) ? p2 : p2->frags[j - 1];
+
+        desc = virtio_desc_index_to_desc(vdev, ring, desc->next);
+        desc->addr = pktbuf_data_phys(b);
+        desc->len = b->dlen;
+        if (j < p2->nfrags)
+            desc->flags |= VRING_DESC_F_NEXT;
+        else
+            desc->flags = 0;
+    }
 
     /* submit the transfer */
-    virtio_submit_chain(vdev, RING_TX, i);
+    virtio_submit_chain(vdev, ring, i);
 
     /* kick it off */
-    virtio_kick(vdev, RING_TX);
+    virtio_kick(vdev, ring);
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->tx_lock, state);
 
     return NO_ERROR;
 }
 
-/* variant of the above function that copies the buffer into a pktbuf before sending */
-static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf, size_t len) {
-    DEBUG_ASSERT(ndev);
-    DEBUG_ASSERT(buf);
-
-    pktbuf_t *p = pktbuf_alloc();
-    if (!p)
-        return ERR_NO_MEMORY;
-
-    /* copy the outgoing packet into the pktbuf */
-    p->data = p->buffer;
-    p->dlen = len;
-    memcpy(p->data, buf, len);
-
-    /* call through to the variant of the function that takes a pre-populated pktbuf */
-    status_t err = virtio_net_queue_tx_pktbuf(ndev, p);
-    if (err < 0) {
-        pktbuf_free(p, true);
-    }
-
-    return err;
-}
-
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p) {
+static status_t virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t *p) {
+    struct virtio_net_dev *ndev = q->ndev;
     struct virtio_device *vdev = ndev->dev;
+    const uint ring = RING_RX(q->index);
 
     DEBUG_ASSERT(ndev);
     DEBUG_ASSERT(p);
 
-    /* point our header to the base of the pktbuf */
+    /* point our header to the base of the pktbuf, the rest of it is for the frame
+     * or, with mergeable buffers, as much of a large one as fits */
     p->data = p->buffer;
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
+    memset(hdr, 0, ndev->hdr_len);
 
-    p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+    p->dlen = p->blen;
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->rx_lock, state);
 
     /* allocate a chain of descriptors for our transfer */
     uint16_t i;
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_RX, 1, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ring, 1, &i);
     DEBUG_ASSERT(desc); /* shouldn't be possible not to have a descriptor ready */
 
     /* save a pointer to our pktbufs for the irq handler to use */
-    DEBUG_ASSERT(ndev->pending_rx_packet[i] == NULL);
-    ndev->pending_rx_packet[i] = p;
+    DEBUG_ASSERT(q->pending_rx_packet[i] == NULL);
+    q->pending_rx_packet[i] = p;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
@@ -352,22 +769,56 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p) {
     desc->flags = VRING_DESC_F_WRITE;
 
     /* submit the transfer */
-    virtio_submit_chain(vdev, RING_RX, i);
+    virtio_submit_chain(vdev, ring, i);
 
     /* kick it off */
-    virtio_kick(vdev, RING_RX);
+    virtio_kick(vdev, ring);
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->rx_lock, state);
 
     return NO_ERROR;
 }
 
+static enum handler_return virtio_net_ctrl_irq(struct virtio_net_dev *ndev, const struct vring_used_elem *e) {
+    struct virtio_device *dev = ndev->dev;
+
+    spin_lock(&ndev->ctrl_spin);
+
+    /* the command is done with, hand the chain back and wake the caller */
+    uint16_t i = e->id;
+    for (;;) {
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, ndev->ctrl_ring, i);
+        int next = (desc->flags & VRING_DESC_F_NEXT) ? desc->next : -1;
+
+        virtio_free_desc(dev, ndev->ctrl_ring, i);
+
+        if (next < 0)
+            break;
+        i = next;
+    }
+
+    spin_unlock(&ndev->ctrl_spin);
+
+    event_signal(&ndev->ctrl_event, false);
+
+    return INT_RESCHEDULE;
+}
+
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e) {
     struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    spin_lock(&ndev->lock);
+    if (ndev->ctrl_vq && ring == ndev->ctrl_ring)
+        return virtio_net_ctrl_irq(ndev, e);
+
+    struct virtio_net_queue *q = &ndev->queues[ring / 2];
+    const bool rx = (ring == RING_RX(q->index));
+    spin_lock_t *lock = rx ? &q->rx_lock : &q->tx_lock;
+
+    /* the queue rings are reaped from the poll thread */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(lock, state);
 
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
@@ -384,33 +835,34 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
         virtio_free_desc(dev, ring, i);
 
-        if (ring == RING_RX) {
+        if (rx) {
             /* put the freed rx buffer in a queue */
-            pktbuf_t *p = ndev->pending_rx_packet[i];
-            ndev->pending_rx_packet[i] = NULL;
+            pktbuf_t *p = q->pending_rx_packet[i];
+            q->pending_rx_packet[i] = NULL;
 
             DEBUG_ASSERT(p);
             LTRACEF("rx pktbuf %p filled\n", p);
 
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > p->blen) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
                 p->dlen = e->len;
             }
 
-            list_add_tail(&ndev->completed_rx_queue, &p->list);
-        } else { // ring == RING_TX
-            /* free the pktbuf associated with the tx packet we just consumed */
-            pktbuf_t *p = ndev->pending_tx_packet[i];
-            ndev->pending_tx_packet[i] = NULL;
-            ndev->tx_pending_count--;
-
-            DEBUG_ASSERT(p);
-            LTRACEF("freeing pktbuf %p\n", p);
-
-            pktbuf_free(p, false);
+            list_add_tail(&q->completed_rx_queue, &p->list);
+        } else {
+            /* free the pktbuf associated with the tx packet we just consumed, frags
+             * have no entry of their own */
+            pktbuf_t *p = q->pending_tx_packet[i];
+            q->pending_tx_packet[i] = NULL;
+            q->tx_pending_count--;
+
+            if (p) {
+                LTRACEF("freeing pktbuf %p\n", p);
+                pktbuf_free(p, false);
+            }
         }
 
         if (next < 0)
@@ -418,48 +870,163 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
         i = next;
     }
 
-    spin_unlock(&ndev->lock);
+    spin_unlock_irqrestore(lock, state);
 
-    /* if rx ring, signal our event */
-    if (ring == 0) {
-        event_signal(&ndev->rx_event, false);
-    }
-
-    return INT_RESCHEDULE;
+    return INT_NO_RESCHEDULE;
 }
 
-static int virtio_net_rx_worker(void *arg) {
-    struct virtio_net_dev *ndev = (struct virtio_net_dev *)arg;
+static pktbuf_t *virtio_net_rx_dequeue(struct virtio_net_queue *q) {
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->rx_lock, state);
 
-    for (;;) {
-        event_wait(&ndev->rx_event);
+    pktbuf_t *p = list_remove_head_type(&q->completed_rx_queue, pktbuf_t, list);
+
+    spin_unlock_irqrestore(&q->rx_lock, state);
 
-        /* pull some packets from the received queue */
-        for (;;) {
-            spin_lock_saved_state_t state;
-            spin_lock_irqsave(&ndev->lock, state);
+    return p;
+}
+
+/* requeue the pktbuf of a received packet in the rx queue, along with any frags */
+static void virtio_net_rx_requeue(struct virtio_net_queue *q, pktbuf_t *p) {
+    for (uint i = 0; i < p->nfrags; i++)
+        virtio_net_queue_rx(q, p->frags[i]);
+    p->nfrags = 0;
 
-            pktbuf_t *p = list_remove_head_type(&ndev->completed_rx_queue, pktbuf_t, list);
+    virtio_net_queue_rx(q, p);
+}
 
-            spin_unlock_irqrestore(&ndev->lock, state);
+/* hand what has been received up the stack */
+static void virtio_net_rx_drain(struct virtio_net_queue *q) {
+    struct virtio_net_dev *ndev = q->ndev;
 
+    for (;;) {
+        pktbuf_t *p = q->rx_partial;
+        if (!p) {
+            p = virtio_net_rx_dequeue(q);
             if (!p)
-                break; /* nothing left in the queue, go back to waiting */
+                break; /* nothing left in the queue */
 
-            LTRACEF("got packet len %u\n", p->dlen);
+            LTRACEF("queue %u got packet len %u\n", q->index, p->dlen);
 
-            /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
-            if (hdr) {
-                /* call up into the stack */
-                minip_rx_driver_callback(p);
+            struct virtio_net_hdr *hdr = pktbuf_consume(p, ndev->hdr_len);
+            if (!hdr) {
+                virtio_net_queue_rx(q, p);
+                continue;
             }
 
-            /* requeue the pktbuf in the rx queue */
-            virtio_net_queue_rx(ndev, p);
+            /* a partially summed packet comes from the host itself and can't be bad */
+            p->flags = PKTBUF_FLAG_EOF;
+            if (ndev->rx_csum && (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)))
+                p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+
+            q->rx_partial_left = (ndev->mrg_rxbuf && hdr->num_buffers > 1) ? hdr->num_buffers - 1 : 0;
+            q->rx_partial_drop = false;
+        }
+
+        /* a large packet continues in the next buffers, which the device hands
+         * back together but may be past the end of this round's budget */
+        while (q->rx_partial_left > 0) {
+            pktbuf_t *f = virtio_net_rx_dequeue(q);
+            if (!f)
+                break;
+
+            q->rx_partial_left--;
+            if (p->nfrags < PKTBUF_MAX_FRAGS) {
+                pktbuf_add_frag(p, f);
+            } else {
+                virtio_net_queue_rx(q, f);
+                q->rx_partial_drop = true;
+            }
+        }
+        if (q->rx_partial_left > 0) {
+            q->rx_partial = p;
+            break;
         }
+        q->rx_partial = NULL;
+
+        /* call up into the stack, holding back bulk tcp to hand up in one go */
+        if (!q->rx_partial_drop)
+            minip_gro_receive(&q->gro, p);
+
+        virtio_net_rx_requeue(q, p);
+    }
+
+    /* the end of the batch, nothing more to merge with */
+    minip_gro_flush(&q->gro);
+}
+
+static int virtio_net_poll(struct netif_poll *np, int budget) {
+    struct virtio_net_queue *q = np->priv;
+    struct virtio_device *dev = q->ndev->dev;
+
+    /* free whatever has gone out */
+    virtio_poll_ring(dev, RING_TX(q->index), VIRTIO_NET_TX_RING_SIZE);
+
+    /* take up to budget filled rx buffers off the ring and pass them on */
+    uint count = virtio_poll_ring(dev, RING_RX(q->index), budget);
+    virtio_net_rx_drain(q);
+
+    return count;
+}
+
+static bool virtio_net_irq_enable(struct netif_poll *np) {
+    struct virtio_net_queue *q = np->priv;
+    struct virtio_device *dev = q->ndev->dev;
+
+    /* keep the pair's own interrupt out while the rings are being flipped */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->rx_lock, state);
+
+    bool pending = virtio_ring_enable_interrupts(dev, RING_RX(q->index));
+    pending |= virtio_ring_enable_interrupts(dev, RING_TX(q->index));
+    if (pending) {
+        virtio_ring_disable_interrupts(dev, RING_RX(q->index));
+        virtio_ring_disable_interrupts(dev, RING_TX(q->index));
+    }
+
+    spin_unlock_irqrestore(&q->rx_lock, state);
+
+    return pending;
+}
+
+/* moderate the pair's rings if the device can do it per ring, otherwise queue 0
+ * sets it for all of them */
+static void virtio_net_set_coalesce(struct netif_poll *np, uint32_t usecs) {
+    struct virtio_net_queue *q = np->priv;
+    struct virtio_net_dev *ndev = q->ndev;
+
+    struct virtio_net_ctrl_coal coal = {
+        .max_packets = usecs ? VIRTIO_NET_COAL_MAX_PACKETS : 0,
+        .max_usecs = usecs,
+    };
+
+    if (ndev->vq_notf_coal) {
+        struct virtio_net_ctrl_coal_vq vq = { .vq_index = RING_RX(q->index), .coal = coal };
+        virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_NOTF_COAL, VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET, &vq, sizeof(vq));
+        vq.vq_index = RING_TX(q->index);
+        virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_NOTF_COAL, VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET, &vq, sizeof(vq));
+    } else if (ndev->notf_coal && q->index == 0) {
+        virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_NOTF_COAL, VIRTIO_NET_CTRL_NOTF_COAL_RX_SET, &coal, sizeof(coal));
+        virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_NOTF_COAL, VIRTIO_NET_CTRL_NOTF_COAL_TX_SET, &coal, sizeof(coal));
     }
-    return 0;
+}
+
+static const struct netif_poll_ops virtio_net_poll_ops = {
+    .poll = virtio_net_poll,
+    .irq_enable = virtio_net_irq_enable,
+};
+
+static const struct netif_poll_ops virtio_net_poll_coal_ops = {
+    .poll = virtio_net_poll,
+    .irq_enable = virtio_net_irq_enable,
+    .set_coalesce = virtio_net_set_coalesce,
+};
+
+/* a queue ring's interrupt, which virtio has already masked */
+static enum handler_return virtio_net_ring_poll_callback(struct virtio_device *dev, uint ring) {
+    struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
+
+    return netif_poll_schedule(&ndev->queues[ring / 2].poll);
 }
 
 int virtio_net_found(void) {
@@ -487,12 +1054,14 @@ status_t virtio_net_send_minip_pkt(void *arg, pktbuf_t *p) {
         return ERR_NOT_IMPLEMENTED;
     }
 
+    /* keep each flow on the queue pair its replies come in on */
+    struct virtio_net_queue *q = virtio_net_select_tx_queue(the_ndev, p);
+
     /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
-    status_t err = virtio_net_queue_tx_pktbuf(the_ndev, p);
+    status_t err = virtio_net_queue_tx_pktbuf(q, p);
     if (err < 0) {
         pktbuf_free(p, true);
     }
 
     return err;
 }
-
@@ -0,0 +1,12 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/virtio-pci.c
+
+MODULE_DEPS += \
+	dev/bus/pci \
+	dev/virtio
+
+include make/module.mk
@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <dev/virtio.h>
+#include <dev/virtio/virtio_ring.h>
+
+#include <lk/debug.h>
+#include <assert.h>
+#include <lk/trace.h>
+#include <lk/compiler.h>
+#include <lk/err.h>
+#include <lk/init.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <dev/bus/pci.h>
+#include <kernel/mp.h>
+#include <platform/interrupts.h>
+#include <vm/vm.h>
+
+#include "../virtio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/*
+ * Modern (virtio 1.0) pci transport. The device exposes its register blocks through
+ * vendor specific pci capabilities pointing into its bars. With msi-x every ring gets
+ * its own vector, steered round robin across the online cpus, so completions on
+ * different rings are handled in parallel without scanning the other rings.
+ * Legacy (io port only) devices are not supported.
+ */
+
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+
+#define VIRTIO_PCI_CAP_COMMON_CFG   1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG   2
+#define VIRTIO_PCI_CAP_ISR_CFG      3
+#define VIRTIO_PCI_CAP_DEVICE_CFG   4
+
+#define VIRTIO_PCI_ISR_QUEUE        0x1
+#define VIRTIO_PCI_ISR_CONFIG       0x2
+
+#define VIRTIO_MSI_NO_VECTOR        0xffff
+
+struct virtio_pci_common_cfg {
+    /* 0x00 */
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    /* 0x10 */
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+
+    /* about a specific virtqueue */
+    uint16_t queue_select;
+    /* 0x18 */
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    /* 0x20 */
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    /* 0x30 */
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+};
+STATIC_ASSERT(sizeof(struct virtio_pci_common_cfg) == 0x38);
+
+/* one per allocated interrupt vector, vector 0 also carries config changes */
+struct virtio_pci_vector {
+    struct virtio_device *dev;
+    uint index;
+};
+
+struct virtio_pci_transport {
+    pci_location_t loc;
+
+    volatile struct virtio_pci_common_cfg *common;
+    volatile uint8_t *isr;
+    volatile uint8_t *notify_base;
+    uint32_t notify_off_multiplier;
+    uint16_t notify_off[MAX_VIRTIO_RINGS];
+
+    bool features_ok;
+    uint32_t driver_features_hi; // word 1, written again along with word 0
+
+    /* mapped bars, capabilities point into these */
+    void *bar_map[6];
+
+    /* interrupts, either one msi-x vector per ring plus one for config or a single legacy irq */
+    bool msix;
+    uint num_vectors;
+    uint irqs[1 + MAX_VIRTIO_RINGS];
+    struct virtio_pci_vector vectors[1 + MAX_VIRTIO_RINGS];
+    uint16_t ring_vector[MAX_VIRTIO_RINGS];
+};
+
+/* devices we know how to drive, modern ids are 0x1040 + virtio device id */
+static const uint16_t virtio_pci_ids[] = {
+    0x1000, // transitional net
+    0x1001, // transitional block
+    0x1041, // net
+    0x1042, // block
+    0x1050, // gpu
+};
+
+static uint virtio_pci_device_count;
+
+static void virtio_pci_reset(struct virtio_device *dev) {
+    struct virtio_pci_transport *t = dev->pci;
+
+    t->common->device_status = 0;
+
+    /* reset is complete when the status reads back as 0 */
+    while (t->common->device_status != 0)
+        ;
+
+    t->features_ok = false;
+    t->driver_features_hi = 0;
+
+    /* the config vector is forgotten on reset */
+    if (t->msix)
+        t->common->msix_config = 0;
+}
+
+static uint8_t virtio_pci_get_status(struct virtio_device *dev) {
+    return dev->pci->common->device_status;
+}
+
+static void virtio_pci_set_status(struct virtio_device *dev, uint8_t status) {
+    dev->pci->common->device_status = status;
+}
+
+static uint32_t virtio_pci_read_host_feature_word(struct virtio_device *dev, uint32_t word) {
+    struct virtio_pci_transport *t = dev->pci;
+
+    t->common->device_feature_select = word;
+    return t->common->device_feature;
+}
+
+/* VERSION_1 has to be accepted before the device will take FEATURES_OK, which
+ * is set along with word 0 */
+static void virtio_pci_set_guest_features(struct virtio_device *dev, uint32_t word, uint32_t features) {
+    struct virtio_pci_transport *t = dev->pci;
+
+    if (word == 1) {
+        t->driver_features_hi = features;
+        return;
+    }
+
+    t->common->driver_feature_select = word;
+    t->common->driver_feature = features;
+
+    if (word == 0) {
+        t->common->driver_feature_select = 1;
+        t->common->driver_feature = t->driver_features_hi | 1u << (VIRTIO_F_VERSION_1 - 32);
+    }
+
+    t->common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    t->features_ok = (t->common->device_status & VIRTIO_STATUS_FEATURES_OK) != 0;
+    if (!t->features_ok) {
+        printf("virtio-pci: device did not accept features %#x in word %u\n", features, word);
+    }
+}
+
+static status_t virtio_pci_setup_ring(struct virtio_device *dev, uint index, uint16_t len, paddr_t pa) {
+    struct virtio_pci_transport *t = dev->pci;
+    struct vring *ring = &dev->ring[index];
+
+    /* drivers that never negotiated anything still need VERSION_1 accepted */
+    if (!t->features_ok)
+        virtio_pci_set_guest_features(dev, 0, 0);
+
+    t->common->queue_select = index;
+
+    uint16_t max = t->common->queue_size;
+    if (max == 0)
+        return ERR_NOT_FOUND;
+    if (len > max)
+        return ERR_INVALID_ARGS;
+
+    t->common->queue_size = len;
+
+    /* the three parts of the ring are in one physically contiguous block */
+    uint64_t desc = pa;
+    uint64_t driver = pa + ((uintptr_t)ring->avail - (uintptr_t)ring->desc);
+    uint64_t device = pa + ((uintptr_t)ring->used - (uintptr_t)ring->desc);
+    t->common->queue_desc_lo = desc;
+    t->common->queue_desc_hi = desc >> 32;
+    t->common->queue_driver_lo = driver;
+    t->common->queue_driver_hi = driver >> 32;
+    t->common->queue_device_lo = device;
+    t->common->queue_device_hi = device >> 32;
+
+    if (t->msix) {
+        t->common->queue_msix_vector = t->ring_vector[index];
+        if (t->common->queue_msix_vector != t->ring_vector[index]) {
+            LTRACEF("ring %u: device rejected vector %u\n", index, t->ring_vector[index]);
+            return ERR_NO_RESOURCES;
+        }
+    }
+
+    t->notify_off[index] = t->common->queue_notify_off;
+    t->common->queue_enable = 1;
+
+    LTRACEF("ring %u: len %u desc %#llx vector %u notify off %u\n", index, len, desc,
+            t->msix ? t->ring_vector[index] : 0, t->notify_off[index]);
+
+    return NO_ERROR;
+}
+
+static void virtio_pci_notify(struct virtio_device *dev, uint index) {
+    struct virtio_pci_transport *t = dev->pci;
+
+    volatile uint16_t *notify =
+        (volatile uint16_t *)(t->notify_base + t->notify_off[index] * t->notify_off_multiplier);
+    *notify = index;
+}
+
+static const struct virtio_transport_ops virtio_pci_ops = {
+    .reset = virtio_pci_reset,
+    .get_status = virtio_pci_get_status,
+    .set_status = virtio_pci_set_status,
+    .read_host_feature_word = virtio_pci_read_host_feature_word,
+    .set_guest_features = virtio_pci_set_guest_features,
+    .setup_ring = virtio_pci_setup_ring,
+    .notify = virtio_pci_notify,
+};
+
+static enum handler_return virtio_pci_config_change(struct virtio_device *dev) {
+    if (!dev->config_change_callback)
+        return INT_NO_RESCHEDULE;
+
+    return dev->config_change_callback(dev);
+}
+
+/* msi-x: only look at the rings routed to this vector */
+static enum handler_return virtio_pci_msix_irq(void *arg) {
+    struct virtio_pci_vector *v = arg;
+    struct virtio_device *dev = v->dev;
+    struct virtio_pci_transport *t = dev->pci;
+
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+        if ((dev->active_rings_bitmap & (1u << r)) && t->ring_vector[r] == v->index)
+            ret |= virtio_process_ring(dev, r);
+    }
+
+    /* vector 0 is the config vector, it may be shared with rings if vectors are scarce */
+    if (v->index == 0 && (*t->isr & VIRTIO_PCI_ISR_CONFIG))
+        ret |= virtio_pci_config_change(dev);
+
+    return ret;
+}
+
+/* legacy interrupt: reading isr acks it and says what happened */
+static enum handler_return virtio_pci_legacy_irq(void *arg) {
+    struct virtio_device *dev = arg;
+    struct virtio_pci_transport *t = dev->pci;
+
+    uint8_t isr = *t->isr;
+    LTRACEF("dev %p isr %#x\n", dev, isr);
+
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    if (isr & VIRTIO_PCI_ISR_QUEUE) {
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            if (dev->active_rings_bitmap & (1u << r))
+                ret |= virtio_process_ring(dev, r);
+        }
+    }
+    if (isr & VIRTIO_PCI_ISR_CONFIG)
+        ret |= virtio_pci_config_change(dev);
+
+    return ret;
+}
+
+static void *virtio_pci_map_bar(struct virtio_pci_transport *t, const pci_bar_t bars[6], uint bar) {
+    if (bar >= 6 || !bars[bar].valid || bars[bar].io || bars[bar].addr == 0)
+        return NULL;
+
+    if (!t->bar_map[bar]) {
+        char str[32];
+        snprintf(str, sizeof(str), "virtio-pci %u bar%u", virtio_pci_device_count, bar);
+        status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), str, ROUNDUP(bars[bar].size, PAGE_SIZE),
+                                          &t->bar_map[bar], 0, bars[bar].addr, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+        if (err < 0)
+            return NULL;
+    }
+
+    return t->bar_map[bar];
+}
+
+/* walk the vendor specific capabilities looking for the register blocks */
+static status_t virtio_pci_find_caps(struct virtio_device *dev, const pci_bar_t bars[6]) {
+    struct virtio_pci_transport *t = dev->pci;
+
+    uint16_t status;
+    pci_read_config_half(t->loc, PCI_CONFIG_STATUS, &status);
+    if ((status & PCI_STATUS_NEW_CAPS) == 0)
+        return ERR_NOT_FOUND;
+
+    uint8_t cap_ptr;
+    pci_read_config_byte(t->loc, PCI_CONFIG_CAPABILITIES, &cap_ptr);
+    while (cap_ptr != 0 && cap_ptr != 0xff) {
+        uint8_t id, cfg_type, bar;
+        uint32_t offset;
+        pci_read_config_byte(t->loc, cap_ptr, &id);
+
+        if (id == 0x9) { // vendor specific
+            pci_read_config_byte(t->loc, cap_ptr + 3, &cfg_type);
+            pci_read_config_byte(t->loc, cap_ptr + 4, &bar);
+            pci_read_config_word(t->loc, cap_ptr + 8, &offset);
+
+            LTRACEF("cap at %#x: type %u bar %u offset %#x\n", cap_ptr, cfg_type, bar, offset);
+
+            uint8_t *base = virtio_pci_map_bar(t, bars, bar);
+            if (base) {
+                switch (cfg_type) {
+                    case VIRTIO_PCI_CAP_COMMON_CFG:
+                        if (!t->common)
+                            t->common = (volatile struct virtio_pci_common_cfg *)(base + offset);
+                        break;
+                    case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                        if (!t->notify_base) {
+                            t->notify_base = base + offset;
+                            pci_read_config_word(t->loc, cap_ptr + 16, &t->notify_off_multiplier);
+                        }
+                        break;
+                    case VIRTIO_PCI_CAP_ISR_CFG:
+                        if (!t->isr)
+                            t->isr = base + offset;
+                        break;
+                    case VIRTIO_PCI_CAP_DEVICE_CFG:
+                        if (!dev->config_ptr)
+                            dev->config_ptr = base + offset;
+                        break;
+                }
+            }
+        }
+
+        pci_read_config_byte(t->loc, cap_ptr + 1, &cap_ptr);
+    }
+
+    if (!t->common || !t->notify_base || !t->isr)
+        return ERR_NOT_FOUND;
+
+    return NO_ERROR;
+}
+
+/* one vector for config changes and one per ring, falling back to a shared legacy irq */
+static status_t virtio_pci_setup_interrupts(struct virtio_device *dev) {
+    struct virtio_pci_transport *t = dev->pci;
+
+    size_t table_size;
+    if (pci_bus_mgr_get_msix_count(t->loc, &table_size) == NO_ERROR) {
+        uint num_rings = MIN(t->common->num_queues, MAX_VIRTIO_RINGS);
+        uint count = MIN(table_size, 1 + num_rings);
+
+        /* config vector on the boot cpu, ring vectors spread over the online cpus
+         * two at a time, so the rx and tx rings of a queue pair land together */
+        uint active_cpus[SMP_MAX_CPUS] = { 0 };
+        uint num_active = 1;
+#if WITH_SMP
+        num_active = 0;
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if (mp_is_cpu_active(cpu))
+                active_cpus[num_active++] = cpu;
+        }
+        if (num_active == 0)
+            num_active = 1;
+#endif
+        uint target_cpus[1 + MAX_VIRTIO_RINGS] = { 0 };
+        for (uint i = 1; i < count; i++) {
+            target_cpus[i] = active_cpus[((i - 1) / 2) % num_active];
+        }
+
+        if (count > 0 && pci_bus_mgr_allocate_msix(t->loc, count, target_cpus, t->irqs) == NO_ERROR) {
+            t->msix = true;
+            t->num_vectors = count;
+            for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+                t->ring_vector[r] = (count > 1) ? 1 + (r % (count - 1)) : 0;
+                dev->ring_cpu[r] = target_cpus[t->ring_vector[r]];
+            }
+            for (uint i = 0; i < count; i++) {
+                t->vectors[i].dev = dev;
+                t->vectors[i].index = i;
+                register_int_handler_msi(t->irqs[i], &virtio_pci_msix_irq, &t->vectors[i], true);
+            }
+            t->common->msix_config = 0;
+            dev->irq = t->irqs[0];
+            return NO_ERROR;
+        }
+    }
+
+    status_t err = pci_bus_mgr_allocate_irq(t->loc, &t->irqs[0]);
+    if (err != NO_ERROR) {
+        printf("virtio-pci: unable to allocate IRQ\n");
+        return err;
+    }
+    t->num_vectors = 1;
+    register_int_handler(t->irqs[0], &virtio_pci_legacy_irq, dev);
+    dev->irq = t->irqs[0];
+
+    return NO_ERROR;
+}
+
+/* undo a probe that got as far as mapping bars and possibly hooking up interrupts */
+static void virtio_pci_free(struct virtio_device *dev) {
+    struct virtio_pci_transport *t = dev->pci;
+
+    /* quiesce the device before its vectors and registers go away */
+    if (t->common)
+        virtio_pci_reset(dev);
+
+    if (t->msix) {
+        pci_bus_mgr_free_msix(t->loc, t->num_vectors, t->irqs);
+    } else if (t->num_vectors > 0) {
+        mask_interrupt(t->irqs[0]);
+        register_int_handler(t->irqs[0], NULL, NULL);
+    }
+
+    for (uint i = 0; i < countof(t->bar_map); i++) {
+        if (t->bar_map[i])
+            vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)t->bar_map[i]);
+    }
+
+    dev->pci = NULL;
+    free(t);
+    free(dev);
+}
+
+static status_t virtio_pci_probe(pci_location_t loc, uint16_t pci_device_id) {
+    char str[14];
+    pci_loc_string(loc, str);
+    LTRACEF("device %#x at %s\n", pci_device_id, str);
+
+    /* transitional devices carry the virtio device id in the subsystem id */
+    uint16_t device_id;
+    if (pci_device_id >= 0x1040) {
+        device_id = pci_device_id - 0x1040;
+    } else {
+        pci_read_config_half(loc, PCI_CONFIG_SUBSYS_ID, &device_id);
+    }
+
+    /* leave devices nothing will drive alone */
+    if (!virtio_has_driver(device_id)) {
+        LTRACEF("no driver for device id %u\n", device_id);
+        return ERR_NOT_FOUND;
+    }
+
+    pci_bar_t bars[6];
+    status_t err = pci_bus_mgr_read_bars(loc, bars);
+    if (err != NO_ERROR)
+        return err;
+
+    struct virtio_device *dev = calloc(1, sizeof(struct virtio_device));
+    struct virtio_pci_transport *t = calloc(1, sizeof(struct virtio_pci_transport));
+    if (!dev || !t) {
+        free(dev);
+        free(t);
+        return ERR_NO_MEMORY;
+    }
+
+    t->loc = loc;
+    dev->pci = t;
+    dev->ops = &virtio_pci_ops;
+    dev->modern = true;
+    dev->index = virtio_pci_device_count;
+
+    err = virtio_pci_find_caps(dev, bars);
+    if (err != NO_ERROR) {
+        printf("virtio-pci: device at %s has no modern interface\n", str);
+        goto fail;
+    }
+
+    pci_bus_mgr_enable_device(loc);
+
+    err = virtio_pci_setup_interrupts(dev);
+    if (err != NO_ERROR)
+        goto fail;
+
+    err = virtio_probe_driver(dev, device_id);
+    if (err < 0) {
+        printf("virtio-pci: driver for device id %u at %s failed, err %d\n", device_id, str, err);
+        goto fail;
+    }
+
+    for (uint i = 0; i < t->num_vectors; i++)
+        unmask_interrupt(t->irqs[i]);
+
+    virtio_start_driver(dev, device_id);
+
+    printf("virtio-pci: device id %u at %s, %u %s vector%s\n", device_id, str, t->num_vectors,
+           t->msix ? "msi-x" : "legacy", t->num_vectors > 1 ? "s" : "");
+
+    virtio_pci_device_count++;
+    return NO_ERROR;
+
+fail:
+    virtio_pci_free(dev);
+    return err;
+}
+
+static void virtio_pci_init(uint level) {
+    LTRACE_ENTRY;
+
+    for (size_t i = 0; i < countof(virtio_pci_ids); i++) {
+        for (size_t index = 0; ; index++) {
+            pci_location_t loc;
+            status_t err = pci_bus_mgr_find_device(&loc, virtio_pci_ids[i], VIRTIO_PCI_VENDOR_ID, index);
+            if (err != NO_ERROR)
+                break;
+
+            virtio_pci_probe(loc, virtio_pci_ids[i]);
+        }
+    }
+
+    LTRACE_EXIT;
+}
+
+LK_INIT_HOOK(virtio_pci, &virtio_pci_init, LK_INIT_LEVEL_PLATFORM + 1);
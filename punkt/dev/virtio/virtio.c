@@ -38,6 +38,8 @@
 
 static struct virtio_device *devices;
 
+static const struct virtio_transport_ops virtio_mmio_ops;
+
 static void dump_mmio_config(const volatile struct virtio_mmio_config *mmio) {
     printf("mmio at %p\n", mmio);
     printf("\tmagic 0x%x\n", mmio->magic);
@@ -63,6 +65,84 @@ void virtio_dump_desc(const struct vring_desc *desc) {
     printf("\tnext  0x%hx\n", desc->next);
 }
 
+void virtio_ring_disable_interrupts(struct virtio_device *dev, uint ring_index) {
+    struct vring *ring = &dev->ring[ring_index];
+
+    /* with event indexes the device ignores the flag, so park the event index
+     * behind everything it could still use */
+    ring->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+    if (dev->event_idx)
+        vring_used_event(ring) = ring->last_used - 1;
+    mb();
+}
+
+bool virtio_ring_enable_interrupts(struct virtio_device *dev, uint ring_index) {
+    struct vring *ring = &dev->ring[ring_index];
+
+    ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    if (dev->event_idx)
+        vring_used_event(ring) = ring->last_used;
+    mb();
+
+    /* anything that came in before the device saw it won't interrupt */
+    return ring->used->idx != ring->last_used;
+}
+
+uint virtio_poll_ring(struct virtio_device *dev, uint ring_index, uint budget) {
+    struct vring *ring = &dev->ring[ring_index];
+
+    uint16_t cur_idx = ring->used->idx;
+    mb();
+
+    uint count = 0;
+    for (; count < budget && ring->last_used != cur_idx; ring->last_used++, count++) {
+        struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+        LTRACEF("ring %u: id %u, len %u\n", ring_index, used_elem->id, used_elem->len);
+
+        dev->irq_driver_callback(dev, ring_index, used_elem);
+    }
+
+    return count;
+}
+
+enum handler_return virtio_process_ring(struct virtio_device *dev, uint ring_index) {
+    struct vring *ring = &dev->ring[ring_index];
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    if (dev->polled_rings_bitmap & (1u << ring_index)) {
+        virtio_ring_disable_interrupts(dev, ring_index);
+        return dev->ring_poll_callback(dev, ring_index);
+    }
+
+    for (;;) {
+        uint16_t cur_idx = ring->used->idx;
+        mb();
+
+        LTRACEF("ring %u: used flags 0x%hx idx 0x%hx last_used %u\n", ring_index, ring->used->flags, cur_idx, ring->last_used);
+
+        for (; ring->last_used != cur_idx; ring->last_used++) {
+            // process chain
+            struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+            LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+
+            DEBUG_ASSERT(dev->irq_driver_callback);
+            ret |= dev->irq_driver_callback(dev, ring_index, used_elem);
+        }
+
+        if (!dev->event_idx)
+            break;
+
+        /* ask to be interrupted on the next used entry, then recheck for any that
+         * slipped in before the device saw the new event index */
+        vring_used_event(ring) = ring->last_used;
+        mb();
+        if (ring->used->idx == ring->last_used)
+            break;
+    }
+
+    return ret;
+}
+
 static enum handler_return virtio_mmio_irq(void *arg) {
     struct virtio_device *dev = (struct virtio_device *)arg;
     LTRACEF("dev %p, index %u\n", dev, dev->index);
@@ -77,25 +157,10 @@ static enum handler_return virtio_mmio_irq(void *arg) {
 
         /* cycle through all the active rings */
         for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
-            if ((dev->active_rings_bitmap & (1<<r)) == 0)
+            if ((dev->active_rings_bitmap & (1u << r)) == 0)
                 continue;
 
-            struct vring *ring = &dev->ring[r];
-            LTRACEF("ring %u: used flags 0x%hx idx 0x%hx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
-
-            uint cur_idx = ring->used->idx;
-            for (uint i = ring->last_used; i != (cur_idx & ring->num_mask); i = (i + 1) & ring->num_mask) {
-                LTRACEF("looking at idx %u\n", i);
-
-                // process chain
-                struct vring_used_elem *used_elem = &ring->used->ring[i];
-                LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
-
-                DEBUG_ASSERT(dev->irq_driver_callback);
-                ret |= dev->irq_driver_callback(dev, r, used_elem);
-
-                ring->last_used = (ring->last_used + 1) & ring->num_mask;
-            }
+            ret |= virtio_process_ring(dev, r);
         }
     }
     if (irq_status & 0x2) { /* config change */
@@ -111,6 +176,64 @@ static enum handler_return virtio_mmio_irq(void *arg) {
     return ret;
 }
 
+bool virtio_has_driver(uint32_t device_id) {
+    switch (device_id) {
+#if WITH_DEV_VIRTIO_BLOCK
+        case 2: // block device
+            return true;
+#endif
+#if WITH_DEV_VIRTIO_NET
+        case 1: // network device
+            return true;
+#endif
+#if WITH_DEV_VIRTIO_GPU
+        case 0x10: // virtio-gpu
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+status_t virtio_probe_driver(struct virtio_device *dev, uint32_t device_id) {
+    status_t err = ERR_NOT_FOUND;
+
+#if WITH_DEV_VIRTIO_BLOCK
+    if (device_id == 2) { // block device
+        LTRACEF("found block device\n");
+
+        err = virtio_block_init(dev, virtio_read_host_feature_word(dev, 0));
+    }
+#endif // WITH_DEV_VIRTIO_BLOCK
+#if WITH_DEV_VIRTIO_NET
+    if (device_id == 1) { // network device
+        LTRACEF("found net device\n");
+
+        err = virtio_net_init(dev);
+    }
+#endif // WITH_DEV_VIRTIO_NET
+#if WITH_DEV_VIRTIO_GPU
+    if (device_id == 0x10) { // virtio-gpu
+        LTRACEF("found gpu device\n");
+
+        err = virtio_gpu_init(dev, virtio_read_host_feature_word(dev, 0));
+    }
+#endif // WITH_DEV_VIRTIO_GPU
+
+    if (err >= 0)
+        dev->valid = true;
+
+    return err;
+}
+
+void virtio_start_driver(struct virtio_device *dev, uint32_t device_id) {
+#if WITH_DEV_VIRTIO_GPU
+    if (device_id == 0x10) {
+        virtio_gpu_start(dev);
+    }
+#endif
+}
+
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[], size_t stride) {
     LTRACEF("ptr %p, count %u\n", ptr, count);
 
@@ -149,59 +272,19 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[], size_t stride)
         }
 #endif
 
-#if WITH_DEV_VIRTIO_BLOCK
-        if (mmio->device_id == 2) { // block device
-            LTRACEF("found block device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_block_init(dev, virtio_read_host_feature_word(dev, 0));
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_BLOCK
-#if WITH_DEV_VIRTIO_NET
-        if (mmio->device_id == 1) { // network device
-            LTRACEF("found net device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_net_init(dev);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_NET
-#if WITH_DEV_VIRTIO_GPU
-        if (mmio->device_id == 0x10) { // virtio-gpu
-            LTRACEF("found gpu device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
+        if (mmio->device_id == 0)
+            continue;
 
-            status_t err = virtio_gpu_init(dev, virtio_read_host_feature_word(dev, 0));
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
+        dev->ops = &virtio_mmio_ops;
+        dev->mmio_config = mmio;
+        dev->config_ptr = (void *)mmio->config;
 
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
+        if (virtio_probe_driver(dev, mmio->device_id) >= 0) {
+            if (dev->irq_driver_callback)
+                unmask_interrupt(dev->irq);
 
-                virtio_gpu_start(dev);
-            }
+            virtio_start_driver(dev, mmio->device_id);
         }
-#endif // WITH_DEV_VIRTIO_GPU
 
         if (dev->valid)
             found++;
@@ -281,10 +364,26 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
 }
 
 void virtio_kick(struct virtio_device *dev, uint ring_index) {
-    LTRACEF("dev %p, ring %u\n", dev, ring_index);
+    struct vring *ring = &dev->ring[ring_index];
 
-    dev->mmio_config->queue_notify = ring_index;
+    /* the new avail index has to be visible before looking at what the device asked for */
     mb();
+
+    uint16_t new_idx = ring->avail->idx;
+    uint16_t old_idx = ring->last_kick;
+    ring->last_kick = new_idx;
+
+    bool notify;
+    if (dev->event_idx) {
+        notify = vring_need_event(vring_avail_event(ring), new_idx, old_idx);
+    } else {
+        notify = !(ring->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+
+    LTRACEF("dev %p, ring %u, notify %u\n", dev, ring_index, notify);
+
+    if (notify)
+        dev->ops->notify(dev, ring_index);
 }
 
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) {
@@ -330,41 +429,88 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     }
 
     /* register the ring with the device */
-    DEBUG_ASSERT(dev->mmio_config);
-    dev->mmio_config->guest_page_size = PAGE_SIZE;
-    dev->mmio_config->queue_sel = index;
-    dev->mmio_config->queue_num = len;
-    dev->mmio_config->queue_align = PAGE_SIZE;
-    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+    err = dev->ops->setup_ring(dev, index, len, pa);
+    if (err < 0)
+        return err;
 
     /* mark the ring active */
-    dev->active_rings_bitmap |= (1 << index);
+    dev->active_rings_bitmap |= (1u << index);
 
     return NO_ERROR;
 }
 
 void virtio_reset_device(struct virtio_device *dev) {
-    dev->mmio_config->status = 0;
+    dev->ops->reset(dev);
 }
 
 void virtio_status_acknowledge_driver(struct virtio_device *dev) {
-    dev->mmio_config->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    dev->ops->set_status(dev, dev->ops->get_status(dev) | VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
 }
 
 void virtio_status_driver_ok(struct virtio_device *dev) {
-    dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
+    dev->ops->set_status(dev, dev->ops->get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
 }
 
 void virtio_set_guest_features(struct virtio_device *dev, uint32_t word, uint32_t features) {
+    if (word == 0)
+        dev->event_idx = !!(features & (1u << VIRTIO_RING_F_EVENT_IDX));
+
+    dev->ops->set_guest_features(dev, word, features);
+}
+
+uint32_t virtio_read_host_feature_word(struct virtio_device *dev, uint32_t word) {
+    return dev->ops->read_host_feature_word(dev, word);
+}
+
+/* legacy mmio transport */
+static void virtio_mmio_reset(struct virtio_device *dev) {
+    dev->mmio_config->status = 0;
+}
+
+static uint8_t virtio_mmio_get_status(struct virtio_device *dev) {
+    return dev->mmio_config->status;
+}
+
+static void virtio_mmio_set_status(struct virtio_device *dev, uint8_t status) {
+    dev->mmio_config->status = status;
+}
+
+static void virtio_mmio_set_guest_features(struct virtio_device *dev, uint32_t word, uint32_t features) {
     dev->mmio_config->guest_features_sel = word;
     dev->mmio_config->guest_features = features;
 }
 
-uint32_t virtio_read_host_feature_word(struct virtio_device *dev, uint32_t word) {
+static uint32_t virtio_mmio_read_host_feature_word(struct virtio_device *dev, uint32_t word) {
     dev->mmio_config->host_features_sel = word;
     return dev->mmio_config->host_features;
 }
 
+static status_t virtio_mmio_setup_ring(struct virtio_device *dev, uint index, uint16_t len, paddr_t pa) {
+    DEBUG_ASSERT(dev->mmio_config);
+    dev->mmio_config->guest_page_size = PAGE_SIZE;
+    dev->mmio_config->queue_sel = index;
+    dev->mmio_config->queue_num = len;
+    dev->mmio_config->queue_align = PAGE_SIZE;
+    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+
+    return NO_ERROR;
+}
+
+static void virtio_mmio_notify(struct virtio_device *dev, uint index) {
+    dev->mmio_config->queue_notify = index;
+    mb();
+}
+
+static const struct virtio_transport_ops virtio_mmio_ops = {
+    .reset = virtio_mmio_reset,
+    .get_status = virtio_mmio_get_status,
+    .set_status = virtio_mmio_set_status,
+    .read_host_feature_word = virtio_mmio_read_host_feature_word,
+    .set_guest_features = virtio_mmio_set_guest_features,
+    .setup_ring = virtio_mmio_setup_ring,
+    .notify = virtio_mmio_notify,
+};
+
 static void virtio_init(uint level) {
 }
 
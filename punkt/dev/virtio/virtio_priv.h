@@ -9,6 +9,8 @@
 
 #include <lk/compiler.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <platform/interrupts.h>
 
 // V1 config
 struct virtio_mmio_config {
@@ -52,9 +54,39 @@ STATIC_ASSERT(sizeof(struct virtio_mmio_config) == 0x100);
 
 #define VIRTIO_MMIO_MAGIC 0x74726976 // 'virt'
 
+#define VIRTIO_F_VERSION_1 32 // feature bit, word 1 bit 0
+
 #define VIRTIO_STATUS_ACKNOWLEDGE (1<<0)
 #define VIRTIO_STATUS_DRIVER      (1<<1)
 #define VIRTIO_STATUS_DRIVER_OK   (1<<2)
 #define VIRTIO_STATUS_FEATURES_OK (1<<3)
 #define VIRTIO_STATUS_DEVICE_NEEDS_RESET (1<<6)
 #define VIRTIO_STATUS_FAILED      (1<<7)
+
+struct virtio_device;
+struct vring_used_elem;
+
+/* per transport hooks, filled in by the mmio and pci front ends */
+struct virtio_transport_ops {
+    void (*reset)(struct virtio_device *dev);
+    uint8_t (*get_status)(struct virtio_device *dev);
+    void (*set_status)(struct virtio_device *dev, uint8_t status);
+    uint32_t (*read_host_feature_word)(struct virtio_device *dev, uint32_t word);
+    void (*set_guest_features)(struct virtio_device *dev, uint32_t word, uint32_t features);
+
+    /* tell the device about a freshly initialized ring at physical address pa */
+    status_t (*setup_ring)(struct virtio_device *dev, uint index, uint16_t len, paddr_t pa);
+    void (*notify)(struct virtio_device *dev, uint index);
+};
+
+/* whether a class driver for device_id is built in */
+bool virtio_has_driver(uint32_t device_id);
+
+/* hand a device found by a transport to the class driver for device_id */
+status_t virtio_probe_driver(struct virtio_device *dev, uint32_t device_id);
+
+/* called once the transport has enabled interrupts for a probed device */
+void virtio_start_driver(struct virtio_device *dev, uint32_t device_id);
+
+/* run the driver callback on every new used entry on a ring */
+enum handler_return virtio_process_ring(struct virtio_device *dev, uint ring_index);
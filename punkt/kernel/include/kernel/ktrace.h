@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Kernel event tracing.
+ *
+ * Tracepoints through the kernel and a few libraries record timestamped events
+ * into a ring buffer per cpu. A cpu only ever writes its own buffer, with
+ * interrupts off for the few stores it takes, so there are no locks or atomics
+ * on the way in. Each tracepoint belongs to a category and costs a load and a
+ * branch while its category is off in ktrace_mask.
+ *
+ * The buffers are exported merged by time, as ftrace style text or as Chrome
+ * trace event json that chrome://tracing and ui.perfetto.dev open directly.
+ */
+
+#ifndef KERNEL_TRACE
+#define KERNEL_TRACE (LK_DEBUGLEVEL > 1)
+#endif
+
+/* records per cpu, a power of two */
+#ifndef KTRACE_LEN
+#define KTRACE_LEN 4096
+#endif
+
+/* categories to start tracing at boot, none by default */
+#ifndef KTRACE_BOOT_MASK
+#define KTRACE_BOOT_MASK 0
+#endif
+
+/* categories */
+#define KTRACE_CAT_SCHED (1u << 0) // context switches, preempts, wakeups and blocks
+#define KTRACE_CAT_IRQ   (1u << 1) // interrupt entry and exit
+#define KTRACE_CAT_TIMER (1u << 2) // timer ticks and callbacks
+#define KTRACE_CAT_LOCK  (1u << 3) // mutex contention
+#define KTRACE_CAT_FAULT (1u << 4) // page faults
+#define KTRACE_CAT_BIO   (1u << 5) // block device requests
+#define KTRACE_CAT_NET   (1u << 6) // packets in and out of minip
+#define KTRACE_CAT_ALL   ((1u << 7) - 1)
+
+enum ktrace_event {
+    KTRACE_EV_NULL = 0,
+    KTRACE_EV_THREAD_SWITCH,    // prev thread, next thread
+    KTRACE_EV_THREAD_PREEMPT,   // thread
+    KTRACE_EV_THREAD_WAKEUP,    // thread, wait queue it was on if any
+    KTRACE_EV_THREAD_BLOCK,     // thread, wait queue
+    KTRACE_EV_IRQ_ENTER,        // vector
+    KTRACE_EV_IRQ_EXIT,         // vector
+    KTRACE_EV_TIMER_TICK,
+    KTRACE_EV_TIMER_CALL,       // callback, arg
+    KTRACE_EV_MUTEX_CONTEND,    // mutex, holder
+    KTRACE_EV_MUTEX_ACQUIRE,    // status, mutex; after having contended
+    KTRACE_EV_PAGE_FAULT,       // arch flags, address, pc
+    KTRACE_EV_BIO_READ,         // length, device, offset
+    KTRACE_EV_BIO_WRITE,        // length, device, offset
+    KTRACE_EV_BIO_ERASE,        // length, device, offset
+    KTRACE_EV_BIO_COMPLETE,     // result, device, offset
+    KTRACE_EV_NET_RX,           // length, pktbuf
+    KTRACE_EV_NET_TX,           // length, pktbuf
+
+    KTRACE_EV_COUNT
+};
+
+enum ktrace_format {
+    KTRACE_FORMAT_TEXT,
+    KTRACE_FORMAT_JSON,
+};
+
+#if KERNEL_TRACE
+
+/* categories currently being recorded */
+extern volatile uint32_t ktrace_mask;
+
+void ktrace_init(void);
+
+/* start recording the categories in mask, allocating the buffers the first time */
+status_t ktrace_start(uint32_t mask);
+void ktrace_stop(void);
+
+/* throw away everything recorded so far */
+void ktrace_clear(void);
+
+/* write out everything recorded so far, tracing is paused while it does */
+void ktrace_export(FILE *fp, enum ktrace_format format);
+
+void ktrace_add(uint event, int32_t arg0, uintptr_t arg1, uintptr_t arg2);
+
+#define KTRACE(cat, event, arg0, arg1, arg2) \
+    do { \
+        if (unlikely(ktrace_mask & (cat))) \
+            ktrace_add(event, (int32_t)(arg0), (uintptr_t)(arg1), (uintptr_t)(arg2)); \
+    } while (0)
+
+#else // !KERNEL_TRACE
+
+/* do nothing versions */
+static inline void ktrace_init(void) {}
+static inline status_t ktrace_start(uint32_t mask) { return ERR_NOT_SUPPORTED; }
+static inline void ktrace_stop(void) {}
+static inline void ktrace_clear(void) {}
+static inline void ktrace_export(FILE *fp, enum ktrace_format format) {}
+
+#define KTRACE(cat, event, arg0, arg1, arg2) do { } while (0)
+
+#endif
+
+/* tracepoints */
+#define KTRACE_THREAD_SWITCH(prev, next) KTRACE(KTRACE_CAT_SCHED, KTRACE_EV_THREAD_SWITCH, 0, prev, next)
+#define KTRACE_THREAD_PREEMPT(t) KTRACE(KTRACE_CAT_SCHED, KTRACE_EV_THREAD_PREEMPT, 0, t, 0)
+#define KTRACE_THREAD_WAKEUP(t, wait) KTRACE(KTRACE_CAT_SCHED, KTRACE_EV_THREAD_WAKEUP, 0, t, wait)
+#define KTRACE_THREAD_BLOCK(t, wait) KTRACE(KTRACE_CAT_SCHED, KTRACE_EV_THREAD_BLOCK, 0, t, wait)
+#define KTRACE_IRQ_ENTER(vector) KTRACE(KTRACE_CAT_IRQ, KTRACE_EV_IRQ_ENTER, vector, 0, 0)
+#define KTRACE_IRQ_EXIT(vector) KTRACE(KTRACE_CAT_IRQ, KTRACE_EV_IRQ_EXIT, vector, 0, 0)
+#define KTRACE_TIMER_TICK() KTRACE(KTRACE_CAT_TIMER, KTRACE_EV_TIMER_TICK, 0, 0, 0)
+#define KTRACE_TIMER_CALL(callback, arg) KTRACE(KTRACE_CAT_TIMER, KTRACE_EV_TIMER_CALL, 0, callback, arg)
+#define KTRACE_MUTEX_CONTEND(m, holder) KTRACE(KTRACE_CAT_LOCK, KTRACE_EV_MUTEX_CONTEND, 0, m, holder)
+#define KTRACE_MUTEX_ACQUIRE(m, status) KTRACE(KTRACE_CAT_LOCK, KTRACE_EV_MUTEX_ACQUIRE, status, m, 0)
+#define KTRACE_PAGE_FAULT(addr, pc, flags) KTRACE(KTRACE_CAT_FAULT, KTRACE_EV_PAGE_FAULT, flags, addr, pc)
+#define KTRACE_BIO_READ(dev, offset, len) KTRACE(KTRACE_CAT_BIO, KTRACE_EV_BIO_READ, len, dev, offset)
+#define KTRACE_BIO_WRITE(dev, offset, len) KTRACE(KTRACE_CAT_BIO, KTRACE_EV_BIO_WRITE, len, dev, offset)
+#define KTRACE_BIO_ERASE(dev, offset, len) KTRACE(KTRACE_CAT_BIO, KTRACE_EV_BIO_ERASE, len, dev, offset)
+#define KTRACE_BIO_COMPLETE(dev, offset, result) KTRACE(KTRACE_CAT_BIO, KTRACE_EV_BIO_COMPLETE, result, dev, offset)
+#define KTRACE_NET_RX(p, len) KTRACE(KTRACE_CAT_NET, KTRACE_EV_NET_RX, len, p, 0)
+#define KTRACE_NET_TX(p, len) KTRACE(KTRACE_CAT_NET, KTRACE_EV_NET_TX, len, p, 0)
+
+__END_CDECLS
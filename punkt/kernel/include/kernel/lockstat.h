@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Lock statistics.
+ *
+ * Built with LOCK_STATS, every spin lock and mutex counts its acquisitions,
+ * how many of those had to wait, how long they waited and how long the lock
+ * was then held. Spin locks are timed in cycles; mutexes in microseconds, as
+ * their waiters and holders can sleep and resume on another cpu, whose cycle
+ * counter need not agree. The counts live in a table keyed by the lock's
+ * address, so spin locks don't change size and statically initialized locks
+ * need no registering. They are only updated by the lock's holder, so the lock
+ * itself serializes them. Initializing or destroying a lock frees its slot.
+ *
+ * Mutexes carry a name, so mutex_t grows by a pointer; MUTEX_INITIAL_VALUE
+ * names them after the variable they were initialized from. Spin locks are
+ * named by spin_lock_set_name(), which keeps the name in the table. Either way
+ * the listing also shows where the lock was first taken.
+ */
+
+#ifndef LOCK_STATS
+#define LOCK_STATS 0
+#endif
+
+/* locks tracked, a power of two */
+#ifndef LOCKSTAT_SLOTS
+#define LOCKSTAT_SLOTS 256
+#endif
+
+/* slots looked at before a lock is given up on as untracked */
+#ifndef LOCKSTAT_MAX_PROBE
+#define LOCKSTAT_MAX_PROBE 16
+#endif
+
+enum lockstat_kind {
+    LOCKSTAT_SPIN,
+    LOCKSTAT_MUTEX,
+};
+
+#if LOCK_STATS
+
+/* the lock was just acquired at site, after waiting wait if contended: cycles
+ * for spin locks, microseconds for mutexes */
+void lockstat_acquired(const void *lock, enum lockstat_kind kind, const char *name,
+                       uintptr_t site, bool contended, ulong wait);
+
+/* the lock is about to be released */
+void lockstat_released(const void *lock);
+
+/* the lock is being destroyed or reinitialized, free its slot */
+void lockstat_forget(const void *lock);
+
+void lockstat_set_name(const void *lock, enum lockstat_kind kind, const char *name);
+
+void lockstat_reset(void);
+void lockstat_dump(uint top);
+
+#endif
+
+__END_CDECLS
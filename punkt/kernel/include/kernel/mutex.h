@@ -8,6 +8,7 @@
  */
 #pragma once
 
+#include <kernel/lockstat.h>
 #include <kernel/thread.h>
 #include <lk/compiler.h>
 #include <lk/debug.h>
@@ -22,14 +23,24 @@ typedef struct mutex {
     thread_t *holder;
     int count;
     wait_queue_t wait;
+#if LOCK_STATS
+    const char *name;
+#endif
 } mutex_t;
 
+#if LOCK_STATS
+#define MUTEX_INITIAL_NAME(m) .name = #m,
+#else
+#define MUTEX_INITIAL_NAME(m)
+#endif
+
 #define MUTEX_INITIAL_VALUE(m) \
 { \
     .magic = MUTEX_MAGIC, \
     .holder = NULL, \
     .count = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+    MUTEX_INITIAL_NAME(m) \
 }
 
 /* Rules for Mutexes:
@@ -46,6 +57,13 @@ static inline status_t mutex_acquire(mutex_t *m) {
     return mutex_acquire_timeout(m, INFINITE_TIME);
 }
 
+/* name the mutex in lock statistics */
+static inline void mutex_set_name(mutex_t *m, const char *name) {
+#if LOCK_STATS
+    m->name = name;
+#endif
+}
+
 /* does the current thread hold the mutex? */
 static bool is_mutex_held(const mutex_t *m) {
     return m->holder == get_current_thread();
@@ -8,33 +8,63 @@
 #pragma once
 
 #include <arch/spinlock.h>
+#include <kernel/lockstat.h>
 #include <lk/compiler.h>
 
 __BEGIN_CDECLS
 
+#if LOCK_STATS
+/* the counting versions, in kernel/lockstat.c */
+void lockstat_spin_lock(spin_lock_t *lock);
+int lockstat_spin_trylock(spin_lock_t *lock);
+void lockstat_spin_unlock(spin_lock_t *lock);
+#endif
+
 /* interrupts should already be disabled */
 static inline void spin_lock(spin_lock_t *lock) {
+#if LOCK_STATS
+    lockstat_spin_lock(lock);
+#else
     arch_spin_lock(lock);
+#endif
 }
 
 /* Returns 0 on success, non-0 on failure */
 static inline int spin_trylock(spin_lock_t *lock) {
+#if LOCK_STATS
+    return lockstat_spin_trylock(lock);
+#else
     return arch_spin_trylock(lock);
+#endif
 }
 
 /* interrupts should already be disabled */
 static inline void spin_unlock(spin_lock_t *lock) {
+#if LOCK_STATS
+    lockstat_spin_unlock(lock);
+#else
     arch_spin_unlock(lock);
+#endif
 }
 
 static inline void spin_lock_init(spin_lock_t *lock) {
     arch_spin_lock_init(lock);
+#if LOCK_STATS
+    lockstat_forget(lock);
+#endif
 }
 
 static inline bool spin_lock_held(spin_lock_t *lock) {
     return arch_spin_lock_held(lock);
 }
 
+/* name the lock in lock statistics */
+static inline void spin_lock_set_name(spin_lock_t *lock, const char *name) {
+#if LOCK_STATS
+    lockstat_set_name(lock, LOCKSTAT_SPIN, name);
+#endif
+}
+
 /* spin lock irq save flags: */
 
 /* Possible future flags:
@@ -7,7 +7,7 @@
  */
 #include <kernel/init.h>
 
-#include <kernel/debug.h>
+#include <kernel/ktrace.h>
 #include <kernel/mp.h>
 #include <kernel/port.h>
 #include <kernel/thread.h>
@@ -16,8 +16,8 @@
 #include <lk/debug.h>
 
 void kernel_init(void) {
-    // if enabled, configure the kernel's event log
-    kernel_evlog_init();
+    // if enabled, start tracing kernel events from boot
+    ktrace_init();
 
     // initialize the threading system
     dprintf(SPEW, "initializing mp\n");
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <kernel/ktrace.h>
+
+#include <arch/ops.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/trace.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if KERNEL_TRACE
+
+#define LOCAL_TRACE 0
+
+STATIC_ASSERT((KTRACE_LEN & (KTRACE_LEN - 1)) == 0);
+
+struct ktrace_record {
+    lk_bigtime_t ts;
+    uint16_t event;
+    int32_t arg0;
+    uintptr_t arg1;
+    uintptr_t arg2;
+};
+
+/* each cpu's ring. head counts every record written, the ring holds the last
+ * KTRACE_LEN of them. */
+static struct ktrace_cpu {
+    struct ktrace_record *buf;
+    uint head;
+} __ALIGNED(CACHE_LINE) ktrace_cpus[SMP_MAX_CPUS];
+
+volatile uint32_t ktrace_mask;
+
+static mutex_t ktrace_lock = MUTEX_INITIAL_VALUE(ktrace_lock);
+
+static const char *ktrace_category_names[] = {
+    "sched", "irq", "timer", "lock", "fault", "bio", "net",
+};
+
+/* arg0 is a number, the other two are addresses. NULL for the ones not recorded. */
+static const struct ktrace_event_info {
+    const char *name;
+    uint32_t category;
+    const char *args[3];
+} ktrace_events[KTRACE_EV_COUNT] = {
+    [KTRACE_EV_NULL]           = { "null", 0, { NULL, NULL, NULL } },
+    [KTRACE_EV_THREAD_SWITCH]  = { "sched_switch", KTRACE_CAT_SCHED, { NULL, "prev", "next" } },
+    [KTRACE_EV_THREAD_PREEMPT] = { "sched_preempt", KTRACE_CAT_SCHED, { NULL, "thread", NULL } },
+    [KTRACE_EV_THREAD_WAKEUP]  = { "sched_wakeup", KTRACE_CAT_SCHED, { NULL, "thread", "wait" } },
+    [KTRACE_EV_THREAD_BLOCK]   = { "sched_block", KTRACE_CAT_SCHED, { NULL, "thread", "wait" } },
+    [KTRACE_EV_IRQ_ENTER]      = { "irq_enter", KTRACE_CAT_IRQ, { "vector", NULL, NULL } },
+    [KTRACE_EV_IRQ_EXIT]       = { "irq_exit", KTRACE_CAT_IRQ, { "vector", NULL, NULL } },
+    [KTRACE_EV_TIMER_TICK]     = { "timer_tick", KTRACE_CAT_TIMER, { NULL, NULL, NULL } },
+    [KTRACE_EV_TIMER_CALL]     = { "timer_call", KTRACE_CAT_TIMER, { NULL, "callback", "arg" } },
+    [KTRACE_EV_MUTEX_CONTEND]  = { "mutex_contend", KTRACE_CAT_LOCK, { NULL, "mutex", "holder" } },
+    [KTRACE_EV_MUTEX_ACQUIRE]  = { "mutex_acquire", KTRACE_CAT_LOCK, { "status", "mutex", NULL } },
+    [KTRACE_EV_PAGE_FAULT]     = { "page_fault", KTRACE_CAT_FAULT, { "flags", "address", "pc" } },
+    [KTRACE_EV_BIO_READ]       = { "bio_read", KTRACE_CAT_BIO, { "len", "dev", "offset" } },
+    [KTRACE_EV_BIO_WRITE]      = { "bio_write", KTRACE_CAT_BIO, { "len", "dev", "offset" } },
+    [KTRACE_EV_BIO_ERASE]      = { "bio_erase", KTRACE_CAT_BIO, { "len", "dev", "offset" } },
+    [KTRACE_EV_BIO_COMPLETE]   = { "bio_complete", KTRACE_CAT_BIO, { "result", "dev", "offset" } },
+    [KTRACE_EV_NET_RX]         = { "net_rx", KTRACE_CAT_NET, { "len", "pktbuf", NULL } },
+    [KTRACE_EV_NET_TX]         = { "net_tx", KTRACE_CAT_NET, { "len", "pktbuf", NULL } },
+};
+
+void ktrace_add(uint event, int32_t arg0, uintptr_t arg1, uintptr_t arg2) {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct ktrace_cpu *cpu = &ktrace_cpus[arch_curr_cpu_num()];
+    if (likely(cpu->buf)) {
+        struct ktrace_record *r = &cpu->buf[cpu->head & (KTRACE_LEN - 1)];
+        r->ts = current_time_hires();
+        r->event = event;
+        r->arg0 = arg0;
+        r->arg1 = arg1;
+        r->arg2 = arg2;
+
+        /* an export on another cpu reads up to head */
+        smp_wmb();
+        cpu->head++;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* buffers for every active cpu, or every cpu there could be when tracing from
+ * boot before the others are up. they are never freed, a tracepoint that saw
+ * the mask just before it was cleared may still be writing. */
+static status_t ktrace_alloc(bool all_cpus) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct ktrace_cpu *cpu = &ktrace_cpus[i];
+        if (cpu->buf || (!all_cpus && !mp_is_cpu_active(i)))
+            continue;
+
+        struct ktrace_record *buf = calloc(KTRACE_LEN, sizeof(struct ktrace_record));
+        if (!buf)
+            return ERR_NO_MEMORY;
+        cpu->head = 0;
+        cpu->buf = buf;
+    }
+
+    /* the buffers have to be visible before the mask that lets anyone use them */
+    smp_wmb();
+    return NO_ERROR;
+}
+
+void ktrace_init(void) {
+    if (KTRACE_BOOT_MASK == 0)
+        return;
+
+    if (ktrace_alloc(true) == NO_ERROR)
+        ktrace_mask = KTRACE_BOOT_MASK;
+}
+
+status_t ktrace_start(uint32_t mask) {
+    LTRACEF("mask %#x\n", mask);
+
+    mutex_acquire(&ktrace_lock);
+    status_t err = ktrace_alloc(false);
+    if (err == NO_ERROR)
+        ktrace_mask = mask & KTRACE_CAT_ALL;
+    mutex_release(&ktrace_lock);
+
+    return err;
+}
+
+void ktrace_stop(void) {
+    ktrace_mask = 0;
+}
+
+void ktrace_clear(void) {
+    mutex_acquire(&ktrace_lock);
+    uint32_t mask = ktrace_mask;
+    ktrace_mask = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        ktrace_cpus[i].head = 0;
+    }
+
+    ktrace_mask = mask;
+    mutex_release(&ktrace_lock);
+}
+
+static void ktrace_print_text(FILE *fp, uint cpu, const struct ktrace_record *r) {
+    const struct ktrace_event_info *info = &ktrace_events[r->event];
+
+    fprintf(fp, "[%03u] %6llu.%06llu: %s:", cpu, r->ts / 1000000, r->ts % 1000000, info->name);
+    if (info->args[0])
+        fprintf(fp, " %s=%d", info->args[0], r->arg0);
+    if (info->args[1])
+        fprintf(fp, " %s=%#lx", info->args[1], r->arg1);
+    if (info->args[2])
+        fprintf(fp, " %s=%#lx", info->args[2], r->arg2);
+    fprintf(fp, "\n");
+}
+
+/*
+ * One trace event per record, on a track per cpu. Interrupts become slices,
+ * everything else an instant event with its args.
+ */
+static void ktrace_print_json(FILE *fp, uint cpu, const struct ktrace_record *r, bool first) {
+    const struct ktrace_event_info *info = &ktrace_events[r->event];
+    const char *cat = "";
+    for (uint i = 0; i < countof(ktrace_category_names); i++) {
+        if (info->category & (1u << i))
+            cat = ktrace_category_names[i];
+    }
+
+    /* instant events are scoped to their track, the cpu */
+    const char *phase = "\"ph\":\"i\",\"s\":\"t\"";
+    const char *name = info->name;
+    if (r->event == KTRACE_EV_IRQ_ENTER) {
+        phase = "\"ph\":\"B\"";
+        name = "irq";
+    } else if (r->event == KTRACE_EV_IRQ_EXIT) {
+        phase = "\"ph\":\"E\"";
+        name = "irq";
+    }
+
+    fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",%s,\"ts\":%llu,\"pid\":0,\"tid\":%u,\"args\":{",
+            first ? "" : ",\n", name, cat, phase, r->ts, cpu);
+    const char *sep = "";
+    if (info->args[0]) {
+        fprintf(fp, "\"%s\":%d", info->args[0], r->arg0);
+        sep = ",";
+    }
+    if (info->args[1]) {
+        fprintf(fp, "%s\"%s\":\"%#lx\"", sep, info->args[1], r->arg1);
+        sep = ",";
+    }
+    if (info->args[2])
+        fprintf(fp, "%s\"%s\":\"%#lx\"", sep, info->args[2], r->arg2);
+    fprintf(fp, "}}");
+}
+
+void ktrace_export(FILE *fp, enum ktrace_format format) {
+    mutex_acquire(&ktrace_lock);
+    uint32_t mask = ktrace_mask;
+    ktrace_mask = 0;
+
+    /* the range of records to read on each cpu. once a ring has wrapped, its
+     * oldest slot may be under a write that got in just before the mask was
+     * cleared, so leave that one out. */
+    uint next[SMP_MAX_CPUS], end[SMP_MAX_CPUS];
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const struct ktrace_cpu *cpu = &ktrace_cpus[i];
+        end[i] = cpu->buf ? cpu->head : 0;
+        next[i] = (end[i] > KTRACE_LEN) ? end[i] - KTRACE_LEN + 1 : 0;
+    }
+    smp_rmb();
+
+    if (format == KTRACE_FORMAT_JSON) {
+        fprintf(fp, "{\"traceEvents\":[\n");
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if (end[i] == 0)
+                continue;
+            fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"cpu %u\"}},\n",
+                    i, i);
+        }
+    } else {
+        fprintf(fp, "# tracer: ktrace\n#\n# CPU  TIMESTAMP      EVENT: ARGS\n");
+    }
+
+    /* the rings are each in time order, so merge them by picking the earliest
+     * head of any of them each time around */
+    bool first = true;
+    for (;;) {
+        uint cpu = SMP_MAX_CPUS;
+        const struct ktrace_record *r = NULL;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if (next[i] == end[i])
+                continue;
+            const struct ktrace_record *c = &ktrace_cpus[i].buf[next[i] & (KTRACE_LEN - 1)];
+            if (!r || c->ts < r->ts) {
+                r = c;
+                cpu = i;
+            }
+        }
+        if (!r)
+            break;
+        next[cpu]++;
+
+        if (r->event == KTRACE_EV_NULL || r->event >= KTRACE_EV_COUNT)
+            continue;
+
+        if (format == KTRACE_FORMAT_JSON) {
+            ktrace_print_json(fp, cpu, r, first);
+        } else {
+            ktrace_print_text(fp, cpu, r);
+        }
+        first = false;
+    }
+
+    if (format == KTRACE_FORMAT_JSON)
+        fprintf(fp, "\n]}\n");
+
+    ktrace_mask = mask;
+    mutex_release(&ktrace_lock);
+}
+
+static void ktrace_status(void) {
+    printf("categories:");
+    for (uint i = 0; i < countof(ktrace_category_names); i++) {
+        printf(" %s%s", (ktrace_mask & (1u << i)) ? "+" : "-", ktrace_category_names[i]);
+    }
+    printf("\n");
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const struct ktrace_cpu *cpu = &ktrace_cpus[i];
+        if (!cpu->buf)
+            continue;
+        uint head = cpu->head;
+        printf("cpu %u: %u records, %u overwritten\n", i,
+               MIN(head, KTRACE_LEN), (head > KTRACE_LEN) ? head - KTRACE_LEN : 0);
+    }
+}
+
+static int cmd_ktrace(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s start [category ...]\n", argv[0].str);
+        printf("%s stop\n", argv[0].str);
+        printf("%s clear\n", argv[0].str);
+        printf("%s status\n", argv[0].str);
+        printf("%s text [file]\n", argv[0].str);
+        printf("%s json [file]\n", argv[0].str);
+        printf("categories:");
+        for (uint i = 0; i < countof(ktrace_category_names); i++) {
+            printf(" %s", ktrace_category_names[i]);
+        }
+        printf(" all\n");
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "start")) {
+        uint32_t mask = (argc > 2) ? 0 : KTRACE_CAT_ALL;
+        for (int i = 2; i < argc; i++) {
+            uint c;
+            for (c = 0; c < countof(ktrace_category_names); c++) {
+                if (!strcmp(argv[i].str, ktrace_category_names[c]))
+                    break;
+            }
+            if (c < countof(ktrace_category_names)) {
+                mask |= 1u << c;
+            } else if (!strcmp(argv[i].str, "all")) {
+                mask |= KTRACE_CAT_ALL;
+            } else {
+                printf("unknown category '%s'\n", argv[i].str);
+                goto usage;
+            }
+        }
+
+        status_t err = ktrace_start(mask);
+        if (err < 0) {
+            printf("error %d starting trace\n", err);
+            return err;
+        }
+    } else if (!strcmp(argv[1].str, "stop")) {
+        ktrace_stop();
+    } else if (!strcmp(argv[1].str, "clear")) {
+        ktrace_clear();
+    } else if (!strcmp(argv[1].str, "status")) {
+        ktrace_status();
+    } else if (!strcmp(argv[1].str, "text") || !strcmp(argv[1].str, "json")) {
+        enum ktrace_format format = !strcmp(argv[1].str, "json") ? KTRACE_FORMAT_JSON : KTRACE_FORMAT_TEXT;
+        if (argc < 3) {
+            ktrace_export(stdout, format);
+            return NO_ERROR;
+        }
+
+        FILE *fp = fopen(argv[2].str, "w");
+        if (!fp) {
+            printf("error opening '%s'\n", argv[2].str);
+            return ERR_NOT_FOUND;
+        }
+        ktrace_export(fp, format);
+        fclose(fp);
+    } else {
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("ktrace", "kernel event trace", &cmd_ktrace)
+STATIC_COMMAND_END(ktrace);
+
+#endif // KERNEL_TRACE
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <kernel/lockstat.h>
+
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if LOCK_STATS
+
+STATIC_ASSERT((LOCKSTAT_SLOTS & (LOCKSTAT_SLOTS - 1)) == 0);
+
+/* waits are bucketed by powers of two of their unit, the last bucket takes the rest */
+#define LOCKSTAT_HIST_BUCKETS 32
+
+/* key of a slot given back by lockstat_forget(), reusable but not the end of a probe */
+#define LOCKSTAT_FREED ((const void *)1)
+
+struct lockstat {
+    const void *lock; // NULL while the slot was never used, LOCKSTAT_FREED once given back
+    const char *name;
+    uintptr_t site;   // where it was first taken
+    enum lockstat_kind kind;
+
+    uint64_t acquisitions;
+    uint64_t contentions;
+    uint64_t wait_total;
+    ulong wait_max;
+    uint64_t hold_total;
+    ulong hold_max;
+    ulong acquired_at;
+
+    uint32_t wait_hist[LOCKSTAT_HIST_BUCKETS];
+};
+
+static struct lockstat lockstats[LOCKSTAT_SLOTS];
+static uint lockstat_dropped; // acquisitions of locks that found no slot
+
+static uint lockstat_hash(const void *lock) {
+    uintptr_t a = (uintptr_t)lock;
+    return (uint)((a >> 3) ^ (a >> 11)) & (LOCKSTAT_SLOTS - 1);
+}
+
+static bool lockstat_in_use(const struct lockstat *s) {
+    return s->lock != NULL && s->lock != LOCKSTAT_FREED;
+}
+
+/* spin locks are held with interrupts off and so start and end on the same
+ * cpu, which the cycle counter needs. a mutex holder or waiter can sleep and
+ * wake up elsewhere, so those are timed in microseconds instead. */
+static ulong lockstat_now(enum lockstat_kind kind) {
+    if (kind == LOCKSTAT_MUTEX)
+        return (ulong)current_time_hires();
+    return arch_cycle_count();
+}
+
+static const char *lockstat_unit(enum lockstat_kind kind) {
+    return (kind == LOCKSTAT_MUTEX) ? "us" : "cycles";
+}
+
+/* the lock's slot, claiming one for it if insert is set. the probe stops at
+ * the first never used slot or after LOCKSTAT_MAX_PROBE, so a full table costs
+ * untracked locks a bounded search. slots are claimed with a compare and swap
+ * on the key, preferring the first given back one on the way. */
+static struct lockstat *lockstat_lookup(const void *lock, bool insert) {
+    for (;;) {
+        struct lockstat *claim = NULL;
+        const void *claim_key = NULL;
+
+        uint i = lockstat_hash(lock);
+        for (uint n = 0; n < MIN(LOCKSTAT_MAX_PROBE, LOCKSTAT_SLOTS); n++, i = (i + 1) & (LOCKSTAT_SLOTS - 1)) {
+            struct lockstat *s = &lockstats[i];
+            const void *key = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+            if (key == lock)
+                return s;
+            if (key == LOCKSTAT_FREED && !claim) {
+                claim = s;
+                claim_key = key;
+            }
+            if (key == NULL) {
+                if (!claim) {
+                    claim = s;
+                    claim_key = key;
+                }
+                break;
+            }
+        }
+
+        if (!insert)
+            return NULL;
+        if (!claim) {
+            __atomic_fetch_add(&lockstat_dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+
+        const void *key = claim_key;
+        if (__atomic_compare_exchange_n(&claim->lock, &key, lock, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return claim;
+        if (key == lock)
+            return claim;
+        /* another lock got there first, look again */
+    }
+}
+
+void lockstat_acquired(const void *lock, enum lockstat_kind kind, const char *name,
+                       uintptr_t site, bool contended, ulong wait) {
+    struct lockstat *s = lockstat_lookup(lock, true);
+    if (!s)
+        return;
+
+    if (!s->site) {
+        s->site = site;
+        s->kind = kind;
+    }
+    if (name)
+        s->name = name;
+
+    s->acquisitions++;
+    if (contended) {
+        s->contentions++;
+        s->wait_total += wait;
+        if (wait > s->wait_max)
+            s->wait_max = wait;
+
+        uint bucket = wait ? (sizeof(ulong) * 8 - 1 - __builtin_clzl(wait)) : 0;
+        s->wait_hist[MIN(bucket, LOCKSTAT_HIST_BUCKETS - 1)]++;
+    }
+
+    s->acquired_at = lockstat_now(kind);
+}
+
+void lockstat_released(const void *lock) {
+    struct lockstat *s = lockstat_lookup(lock, false);
+    if (!s || !s->acquisitions)
+        return;
+
+    ulong hold = lockstat_now(s->kind) - s->acquired_at;
+    s->hold_total += hold;
+    if (hold > s->hold_max)
+        s->hold_max = hold;
+}
+
+/* the lock is going away or being reinitialized, so whatever reuses its
+ * address starts from scratch rather than inheriting its counts and name */
+void lockstat_forget(const void *lock) {
+    struct lockstat *s = lockstat_lookup(lock, false);
+    if (!s)
+        return;
+
+    s->name = NULL;
+    s->site = 0;
+    s->kind = LOCKSTAT_SPIN;
+    s->acquisitions = s->contentions = 0;
+    s->wait_total = s->hold_total = 0;
+    s->wait_max = s->hold_max = 0;
+    memset(s->wait_hist, 0, sizeof(s->wait_hist));
+
+    __atomic_store_n(&s->lock, LOCKSTAT_FREED, __ATOMIC_RELEASE);
+}
+
+void lockstat_set_name(const void *lock, enum lockstat_kind kind, const char *name) {
+    struct lockstat *s = lockstat_lookup(lock, true);
+    if (s) {
+        s->kind = kind;
+        s->name = name;
+    }
+}
+
+void lockstat_spin_lock(spin_lock_t *lock) {
+    bool contended = false;
+    ulong wait = 0;
+
+    if (arch_spin_trylock(lock) != 0) {
+        ulong start = arch_cycle_count();
+        arch_spin_lock(lock);
+        wait = arch_cycle_count() - start;
+        contended = true;
+    }
+
+    lockstat_acquired(lock, LOCKSTAT_SPIN, NULL, (uintptr_t)__GET_CALLER(), contended, wait);
+}
+
+int lockstat_spin_trylock(spin_lock_t *lock) {
+    int ret = arch_spin_trylock(lock);
+    if (ret == 0)
+        lockstat_acquired(lock, LOCKSTAT_SPIN, NULL, (uintptr_t)__GET_CALLER(), false, 0);
+
+    return ret;
+}
+
+void lockstat_spin_unlock(spin_lock_t *lock) {
+    lockstat_released(lock);
+    arch_spin_unlock(lock);
+}
+
+/* leaves the keys, names and any hold in progress alone */
+void lockstat_reset(void) {
+    for (uint i = 0; i < LOCKSTAT_SLOTS; i++) {
+        struct lockstat *s = &lockstats[i];
+        s->acquisitions = s->contentions = 0;
+        s->wait_total = s->hold_total = 0;
+        s->wait_max = s->hold_max = 0;
+        memset(s->wait_hist, 0, sizeof(s->wait_hist));
+    }
+    lockstat_dropped = 0;
+}
+
+/* most contended first, then longest waited on, then most taken */
+static int lockstat_cmp(const void *a, const void *b) {
+    const struct lockstat *sa = *(const struct lockstat * const *)a;
+    const struct lockstat *sb = *(const struct lockstat * const *)b;
+
+    if (sa->contentions != sb->contentions)
+        return (sb->contentions > sa->contentions) ? 1 : -1;
+    if (sa->wait_total != sb->wait_total)
+        return (sb->wait_total > sa->wait_total) ? 1 : -1;
+    if (sa->acquisitions != sb->acquisitions)
+        return (sb->acquisitions > sa->acquisitions) ? 1 : -1;
+    return 0;
+}
+
+static void lockstat_print_name(const struct lockstat *s) {
+    if (s->name)
+        printf("%-20s", s->name);
+    else
+        printf("%-20p", s->lock);
+}
+
+void lockstat_dump(uint top) {
+    const struct lockstat **v = malloc(LOCKSTAT_SLOTS * sizeof(*v));
+    if (!v)
+        return;
+
+    uint count = 0;
+    for (uint i = 0; i < LOCKSTAT_SLOTS; i++) {
+        if (lockstat_in_use(&lockstats[i]) && lockstats[i].acquisitions)
+            v[count++] = &lockstats[i];
+    }
+    qsort(v, count, sizeof(*v), &lockstat_cmp);
+
+    printf("%u locks, %u untracked; times in cycles for spin locks, us for mutexes\n",
+           count, lockstat_dropped);
+    printf("%-20s %5s %10s %9s %12s %10s %10s %10s %18s\n", "lock", "kind", "acquired", "contended",
+           "wait total", "wait max", "hold avg", "hold max", "first taken at");
+    for (uint i = 0; i < count && i < top; i++) {
+        const struct lockstat *s = v[i];
+        lockstat_print_name(s);
+        printf(" %5s %10llu %9llu %12llu %10lu %10llu %10lu %#18lx\n",
+               (s->kind == LOCKSTAT_MUTEX) ? "mutex" : "spin",
+               s->acquisitions, s->contentions, s->wait_total, s->wait_max,
+               s->hold_total / s->acquisitions, s->hold_max, s->site);
+    }
+
+    free(v);
+}
+
+static void lockstat_dump_hist(const struct lockstat *s) {
+    lockstat_print_name(s);
+    printf(": %llu contended of %llu, wait in %s:\n", s->contentions, s->acquisitions,
+           lockstat_unit(s->kind));
+    for (uint i = 0; i < LOCKSTAT_HIST_BUCKETS; i++) {
+        if (!s->wait_hist[i])
+            continue;
+        uint pct = (uint)(s->wait_hist[i] * 10000ull / s->contentions);
+        if (i == LOCKSTAT_HIST_BUCKETS - 1)
+            printf("  %10lu and up   %8u %3u.%02u%%\n", 1ul << i, s->wait_hist[i], pct / 100, pct % 100);
+        else
+            printf("  %10lu-%-10lu %8u %3u.%02u%%\n", 1ul << i, (2ul << i) - 1, s->wait_hist[i],
+                   pct / 100, pct % 100);
+    }
+}
+
+static int cmd_lockstat(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+        lockstat_dump(20);
+    } else if (!strcmp(argv[1].str, "reset")) {
+        lockstat_reset();
+    } else if (!strcmp(argv[1].str, "all")) {
+        lockstat_dump(LOCKSTAT_SLOTS);
+    } else if (!strcmp(argv[1].str, "hist") && argc > 2) {
+        /* by name or address */
+        for (uint i = 0; i < LOCKSTAT_SLOTS; i++) {
+            const struct lockstat *s = &lockstats[i];
+            if (!lockstat_in_use(s))
+                continue;
+            if ((s->name && !strcmp(s->name, argv[2].str)) || (uintptr_t)s->lock == argv[2].u) {
+                lockstat_dump_hist(s);
+                return NO_ERROR;
+            }
+        }
+        printf("no lock '%s'\n", argv[2].str);
+        return ERR_NOT_FOUND;
+    } else {
+        printf("usage:\n");
+        printf("%s            the 20 most contended locks\n", argv[0].str);
+        printf("%s all\n", argv[0].str);
+        printf("%s hist <name or address>\n", argv[0].str);
+        printf("%s reset\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("lockstat", "lock contention statistics", &cmd_lockstat)
+STATIC_COMMAND_END(lockstat);
+
+#endif // LOCK_STATS
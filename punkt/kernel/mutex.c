@@ -18,10 +18,12 @@
 #include <kernel/mutex.h>
 
 #include <assert.h>
+#include <kernel/ktrace.h>
 #include <kernel/thread.h>
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/init.h>
+#include <platform.h>
 
 static bool mutex_threading_ready;
 
@@ -40,6 +42,10 @@ LK_INIT_HOOK(mutex_threading_ready, mutex_threading_ready_init_func, LK_INIT_LEV
  */
 void mutex_init(mutex_t *m) {
     *m = (mutex_t)MUTEX_INITIAL_VALUE(*m);
+    mutex_set_name(m, NULL);
+#if LOCK_STATS
+    lockstat_forget(m);
+#endif
 }
 
 /**
@@ -57,6 +63,10 @@ void mutex_destroy(mutex_t *m) {
               get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
 #endif
 
+#if LOCK_STATS
+    lockstat_forget(m);
+#endif
+
     THREAD_LOCK(state);
     m->magic = 0;
     m->count = 0;
@@ -86,9 +96,16 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout) {
 
     THREAD_LOCK(state);
 
+#if LOCK_STATS
+    bool contended = m->count > 0;
+    lk_bigtime_t wait_start = current_time_hires();
+#endif
+
     status_t ret = NO_ERROR;
     if (unlikely(++m->count > 1)) {
+        KTRACE_MUTEX_CONTEND(m, m->holder);
         ret = wait_queue_block(&m->wait, timeout);
+        KTRACE_MUTEX_ACQUIRE(m, ret);
         if (unlikely(ret < NO_ERROR)) {
             /* if the acquisition timed out, back out the acquire and exit */
             if (likely(ret == ERR_TIMED_OUT)) {
@@ -108,6 +125,11 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout) {
 
     m->holder = get_current_thread();
 
+#if LOCK_STATS
+    lockstat_acquired(m, LOCKSTAT_MUTEX, m->name, (uintptr_t)__GET_CALLER(),
+                      contended, contended ? (ulong)(current_time_hires() - wait_start) : 0);
+#endif
+
 err:
     THREAD_UNLOCK(state);
     return ret;
@@ -128,6 +150,10 @@ status_t mutex_release(mutex_t *m) {
 
     THREAD_LOCK(state);
 
+#if LOCK_STATS
+    lockstat_released(m);
+#endif
+
     m->holder = 0;
 
     if (unlikely(--m->count >= 1)) {
@@ -8,10 +8,17 @@ MODULE_DEPS := \
 	lib/heap \
 	vm
 
+# global, since mutex_t carries a name with it
+LOCK_STATS ?= 0
+
+GLOBAL_DEFINES += LOCK_STATS=$(LOCK_STATS)
+
 MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
 	$(LOCAL_DIR)/init.c \
+	$(LOCAL_DIR)/ktrace.c \
+	$(LOCAL_DIR)/lockstat.c \
 	$(LOCAL_DIR)/mutex.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
@@ -18,7 +18,7 @@
 #include <kernel/thread.h>
 
 #include <assert.h>
-#include <kernel/debug.h>
+#include <kernel/ktrace.h>
 #include <kernel/mp.h>
 #include <kernel/timer.h>
 #include <lib/heap.h>
@@ -291,6 +291,7 @@ status_t thread_resume(thread_t *t) {
     bool ints_disabled = arch_ints_disabled();
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
+        KTRACE_THREAD_WAKEUP(t, NULL);
         t->state = THREAD_READY;
         insert_in_run_queue_head(t);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
@@ -541,7 +542,7 @@ void thread_resched(void) {
     }
 #endif
 
-    KEVLOG_THREAD_SWITCH(oldthread, newthread);
+    KTRACE_THREAD_SWITCH(oldthread, newthread);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (thread_is_real_time_or_idle(newthread)) {
@@ -661,7 +662,7 @@ void thread_preempt(void) {
         THREAD_STATS_INC(preempts); /* only track when a meaningful preempt happens */
 #endif
 
-    KEVLOG_THREAD_PREEMPT(current_thread);
+    KTRACE_THREAD_PREEMPT(current_thread);
 
     THREAD_LOCK(state);
 
@@ -706,6 +707,7 @@ void thread_unblock(thread_t *t, bool resched) {
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
     DEBUG_ASSERT(!thread_is_idle(t));
 
+    KTRACE_THREAD_WAKEUP(t, NULL);
     t->state = THREAD_READY;
     insert_in_run_queue_head(t);
     wakeup_cpu_for_thread(t);
@@ -737,6 +739,7 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
 
     THREAD_LOCK(state);
 
+    KTRACE_THREAD_WAKEUP(t, NULL);
     t->state = THREAD_READY;
     insert_in_run_queue_head(t);
 
@@ -769,6 +772,7 @@ void thread_sleep(lk_time_t delay) {
     THREAD_LOCK(state);
     timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
     current_thread->state = THREAD_SLEEPING;
+    KTRACE_THREAD_BLOCK(current_thread, NULL);
     thread_resched();
     THREAD_UNLOCK(state);
 }
@@ -783,6 +787,8 @@ void thread_init_early(void) {
 
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
+    spin_lock_set_name(&thread_lock, "thread_lock");
+
     /* initialize the run queues */
     for (i=0; i < NUM_PRIORITIES; i++)
         list_initialize(&run_queue[i]);
@@ -1110,6 +1116,7 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
     current_thread->state = THREAD_BLOCKED;
     current_thread->blocking_wait_queue = wait;
     current_thread->wait_queue_block_ret = NO_ERROR;
+    KTRACE_THREAD_BLOCK(current_thread, wait);
 
     /* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
     if (timeout != INFINITE_TIME) {
@@ -1155,6 +1162,7 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
     if (t) {
         wait->count--;
         DEBUG_ASSERT(t->state == THREAD_BLOCKED);
+        KTRACE_THREAD_WAKEUP(t, wait);
         t->state = THREAD_READY;
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
@@ -1218,6 +1226,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
     while ((t = list_remove_head_type(&wait->list, thread_t, queue_node))) {
         wait->count--;
         DEBUG_ASSERT(t->state == THREAD_BLOCKED);
+        KTRACE_THREAD_WAKEUP(t, wait);
         t->state = THREAD_READY;
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
@@ -1282,6 +1291,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     DEBUG_ASSERT(t->blocking_wait_queue->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(list_in_list(&t->queue_node));
 
+    KTRACE_THREAD_WAKEUP(t, t->blocking_wait_queue);
     list_delete(&t->queue_node);
     t->blocking_wait_queue->count--;
     t->blocking_wait_queue = NULL;
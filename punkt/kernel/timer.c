@@ -22,7 +22,7 @@
 #include <kernel/timer.h>
 
 #include <assert.h>
-#include <kernel/debug.h>
+#include <kernel/ktrace.h>
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
 #include <lk/debug.h>
@@ -200,7 +200,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
     DEBUG_ASSERT(arch_ints_disabled());
 
     THREAD_STATS_INC(timer_ints);
-//  KEVLOG_TIMER_TICK(); // enable only if necessary
+    KTRACE_TIMER_TICK();
 
     uint cpu = arch_curr_cpu_num();
 
@@ -232,7 +232,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
         bool periodic = timer->periodic_time > 0;
 
         LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
-        KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+        KTRACE_TIMER_CALL(timer->callback, timer->arg);
         if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
             ret = INT_RESCHEDULE;
 
@@ -282,6 +282,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 
 void timer_init(void) {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
+    spin_lock_set_name(&timer_lock, "timer_lock");
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
         list_initialize(&timers[i].timer_queue);
     }
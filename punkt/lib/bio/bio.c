@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <lk/list.h>
 #include <lk/pow2.h>
+#include <kernel/ktrace.h>
 #include <kernel/mutex.h>
 #include <lk/init.h>
 #include <arch/atomic.h>
@@ -271,6 +272,19 @@ static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len) {
     return erased;
 }
 
+static status_t bio_default_read_async(struct bdev *dev, void *buf, off_t offset, size_t len,
+                                       bio_async_callback_t callback, void *callback_context) {
+    /* no native support, do the transfer now and complete it inline */
+    callback(callback_context, dev, dev->read(dev, buf, offset, len));
+    return NO_ERROR;
+}
+
+static status_t bio_default_write_async(struct bdev *dev, const void *buf, off_t offset, size_t len,
+                                        bio_async_callback_t callback, void *callback_context) {
+    callback(callback_context, dev, dev->write(dev, buf, offset, len));
+    return NO_ERROR;
+}
+
 static ssize_t bio_default_read_block(struct bdev *dev, void *buf, bnum_t block, uint count) {
     return ERR_NOT_SUPPORTED;
 }
@@ -366,7 +380,11 @@ ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len) {
     if (len == 0)
         return 0;
 
-    return dev->read(dev, buf, offset, len);
+    KTRACE_BIO_READ(dev, offset, len);
+    ssize_t ret = dev->read(dev, buf, offset, len);
+    KTRACE_BIO_COMPLETE(dev, offset, ret);
+
+    return ret;
 }
 
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count) {
@@ -380,7 +398,11 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count) {
     if (count == 0)
         return 0;
 
-    return dev->read_block(dev, buf, block, count);
+    KTRACE_BIO_READ(dev, (off_t)block * dev->block_size, count * dev->block_size);
+    ssize_t ret = dev->read_block(dev, buf, block, count);
+    KTRACE_BIO_COMPLETE(dev, (off_t)block * dev->block_size, ret);
+
+    return ret;
 }
 
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len) {
@@ -394,7 +416,11 @@ ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len) {
     if (len == 0)
         return 0;
 
-    return dev->write(dev, buf, offset, len);
+    KTRACE_BIO_WRITE(dev, offset, len);
+    ssize_t ret = dev->write(dev, buf, offset, len);
+    KTRACE_BIO_COMPLETE(dev, offset, ret);
+
+    return ret;
 }
 
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count) {
@@ -408,7 +434,11 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
     if (count == 0)
         return 0;
 
-    return dev->write_block(dev, buf, block, count);
+    KTRACE_BIO_WRITE(dev, (off_t)block * dev->block_size, count * dev->block_size);
+    ssize_t ret = dev->write_block(dev, buf, block, count);
+    KTRACE_BIO_COMPLETE(dev, (off_t)block * dev->block_size, ret);
+
+    return ret;
 }
 
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len) {
@@ -421,7 +451,58 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len) {
     if (len == 0)
         return 0;
 
-    return dev->erase(dev, offset, len);
+    KTRACE_BIO_ERASE(dev, offset, len);
+    ssize_t ret = dev->erase(dev, offset, len);
+    KTRACE_BIO_COMPLETE(dev, offset, ret);
+
+    return ret;
+}
+
+/* drivers only need to handle whole block transfers in their async hooks */
+static bool bio_is_block_aligned(const bdev_t *dev, off_t offset, size_t len) {
+    return IS_ALIGNED(offset, dev->block_size) && IS_ALIGNED(len, dev->block_size);
+}
+
+status_t bio_read_async(bdev_t *dev, void *buf, off_t offset, size_t len,
+                        bio_async_callback_t callback, void *callback_context) {
+    LTRACEF("dev '%s', buf %p, offset %lld, len %zd\n", dev->name, buf, offset, len);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(buf);
+    DEBUG_ASSERT(callback);
+
+    /* range check */
+    len = bio_trim_range(dev, offset, len);
+    if (len == 0) {
+        callback(callback_context, dev, 0);
+        return NO_ERROR;
+    }
+
+    if (!bio_is_block_aligned(dev, offset, len))
+        return bio_default_read_async(dev, buf, offset, len, callback, callback_context);
+
+    return dev->read_async(dev, buf, offset, len, callback, callback_context);
+}
+
+status_t bio_write_async(bdev_t *dev, const void *buf, off_t offset, size_t len,
+                         bio_async_callback_t callback, void *callback_context) {
+    LTRACEF("dev '%s', buf %p, offset %lld, len %zd\n", dev->name, buf, offset, len);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(buf);
+    DEBUG_ASSERT(callback);
+
+    /* range check */
+    len = bio_trim_range(dev, offset, len);
+    if (len == 0) {
+        callback(callback_context, dev, 0);
+        return NO_ERROR;
+    }
+
+    if (!bio_is_block_aligned(dev, offset, len))
+        return bio_default_write_async(dev, buf, offset, len, callback, callback_context);
+
+    return dev->write_async(dev, buf, offset, len, callback, callback_context);
 }
 
 int bio_ioctl(bdev_t *dev, int request, void *argp) {
@@ -506,6 +587,8 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write = bio_default_write;
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
+    dev->read_async = bio_default_read_async;
+    dev->write_async = bio_default_write_async;
     dev->close = NULL;
 }
 
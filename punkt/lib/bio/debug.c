@@ -14,7 +14,12 @@
 #include <lk/console_cmd.h>
 #include <lib/bio.h>
 #include <platform.h>
+#include <platform/time.h>
 #include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <inttypes.h>
+#include <lk/pow2.h>
 
 #if WITH_LIB_CKSUM
 #include <lib/cksum.h>
@@ -30,6 +35,7 @@
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const console_cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench(bdev_t *device, const char *mode, size_t block_size, uint queue_depth, uint count);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -50,6 +56,7 @@ usage:
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s bench <device> <seqread|seqwrite|randread|randwrite> [block size] [queue depth] [count]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -207,6 +214,21 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) goto notenoughargs;
+
+        size_t block_size = (argc > 4) ? argv[4].u : 4096;
+        uint queue_depth = (argc > 5) ? argv[5].u : 1;
+        uint count = (argc > 6) ? argv[6].u : 0;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_bench(dev, argv[3].str, block_size, queue_depth, count);
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
@@ -536,3 +558,254 @@ static int bio_test_device(bdev_t *device) {
 
     return 0;
 }
+
+#define BIO_BENCH_MAX_QUEUE_DEPTH (64)
+#define BIO_BENCH_DEFAULT_BYTES (64 * 1024 * 1024)
+#define BIO_BENCH_HISTOGRAM_BUCKETS (32)
+
+struct bio_bench_state;
+
+struct bio_bench_slot {
+    struct bio_bench_state *state;
+    void *buf;
+    lk_bigtime_t start;
+};
+
+struct bio_bench_state {
+    spin_lock_t lock;
+    event_t event;
+
+    size_t block_size;
+
+    /* stack of idle slots */
+    struct bio_bench_slot *idle[BIO_BENCH_MAX_QUEUE_DEPTH];
+    uint idle_count;
+
+    /* per request latency in microseconds, in completion order */
+    uint32_t *latency;
+    uint completed;
+    ssize_t error;
+};
+
+/* may be called from interrupt context */
+static void bio_bench_callback(void *context, bdev_t *dev, ssize_t result) {
+    struct bio_bench_slot *slot = context;
+    struct bio_bench_state *state = slot->state;
+    lk_bigtime_t now = current_time_hires();
+
+    spin_lock_saved_state_t lock_state;
+    spin_lock_irqsave(&state->lock, lock_state);
+
+    state->latency[state->completed++] = (uint32_t)MIN(now - slot->start, UINT32_MAX);
+    if (result != (ssize_t)state->block_size && state->error == 0)
+        state->error = (result < 0) ? result : ERR_IO;
+    state->idle[state->idle_count++] = slot;
+
+    spin_unlock_irqrestore(&state->lock, lock_state);
+
+    event_signal(&state->event, false);
+}
+
+static int bio_bench_compare_latency(const void *a, const void *b) {
+    uint32_t la = *(const uint32_t *)a;
+    uint32_t lb = *(const uint32_t *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+static void bio_bench_report(const struct bio_bench_state *state, uint count, lk_bigtime_t elapsed) {
+    uint64_t bytes = (uint64_t)count * state->block_size;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    /* MB/s with two decimals, without touching the fpu */
+    uint64_t kb_per_sec = bytes * 1000000 / elapsed / 1024;
+    printf("%u ops, %" PRIu64 " bytes in %" PRIu64 " usecs: %" PRIu64 ".%02" PRIu64 " MB/s, %" PRIu64 " IOPS\n",
+           count, bytes, (uint64_t)elapsed, kb_per_sec / 1024, (kb_per_sec % 1024) * 100 / 1024,
+           (uint64_t)count * 1000000 / elapsed);
+
+    /* percentiles from the sorted latencies */
+    uint32_t *sorted = state->latency;
+    qsort(sorted, count, sizeof(uint32_t), &bio_bench_compare_latency);
+
+#define PERCENTILE(permille) sorted[MIN((uint64_t)count * (permille) / 1000, (uint64_t)count - 1)]
+    printf("latency usecs: min %u p50 %u p99 %u p999 %u max %u\n",
+           sorted[0], PERCENTILE(500), PERCENTILE(990), PERCENTILE(999), sorted[count - 1]);
+#undef PERCENTILE
+
+    /* power of two histogram */
+    uint buckets[BIO_BENCH_HISTOGRAM_BUCKETS] = { 0 };
+    uint max_bucket = 0;
+    for (uint i = 0; i < count; i++) {
+        uint b = (sorted[i] == 0) ? 0 : MIN(log2_uint(sorted[i]) + 1, BIO_BENCH_HISTOGRAM_BUCKETS - 1);
+        buckets[b]++;
+        max_bucket = MAX(max_bucket, buckets[b]);
+    }
+
+    for (uint b = 0; b < BIO_BENCH_HISTOGRAM_BUCKETS; b++) {
+        if (buckets[b] == 0)
+            continue;
+
+        uint lo = (b == 0) ? 0 : (1u << (b - 1));
+        uint hi = (b == 0) ? 0 : (1u << b) - 1;
+        printf("  %8u - %8u: %8u |", lo, hi, buckets[b]);
+        for (uint i = 0; i < buckets[b] * 40 / max_bucket; i++)
+            putchar('*');
+        putchar('\n');
+    }
+}
+
+// Runs count requests of block_size bytes, keeping up to queue_depth of them in flight.
+static int bio_bench(bdev_t *device, const char *mode, size_t block_size, uint queue_depth, uint count) {
+    bool write;
+    bool random;
+    if (!strcmp(mode, "seqread")) {
+        write = false;
+        random = false;
+    } else if (!strcmp(mode, "seqwrite")) {
+        write = true;
+        random = false;
+    } else if (!strcmp(mode, "randread")) {
+        write = false;
+        random = true;
+    } else if (!strcmp(mode, "randwrite")) {
+        write = true;
+        random = true;
+    } else {
+        printf("unknown mode '%s'\n", mode);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (block_size == 0 || block_size % device->block_size != 0) {
+        printf("block size must be a multiple of the device block size (%zu)\n", device->block_size);
+        return ERR_INVALID_ARGS;
+    }
+    if (queue_depth == 0 || queue_depth > BIO_BENCH_MAX_QUEUE_DEPTH) {
+        printf("queue depth must be between 1 and %u\n", BIO_BENCH_MAX_QUEUE_DEPTH);
+        return ERR_INVALID_ARGS;
+    }
+
+    uint64_t span_blocks = (uint64_t)device->total_size / block_size;
+    if (span_blocks == 0) {
+        printf("device is smaller than the block size\n");
+        return ERR_INVALID_ARGS;
+    }
+    if (count == 0)
+        count = MAX(1u, (uint)(MIN((uint64_t)device->total_size, BIO_BENCH_DEFAULT_BYTES) / block_size));
+
+    struct bio_bench_state state = {
+        .lock = SPIN_LOCK_INITIAL_VALUE,
+        .block_size = block_size,
+    };
+    struct bio_bench_slot slots[BIO_BENCH_MAX_QUEUE_DEPTH] = { 0 };
+    int rc = NO_ERROR;
+
+    event_init(&state.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    state.latency = malloc(count * sizeof(uint32_t));
+    if (!state.latency) {
+        rc = ERR_NO_MEMORY;
+        goto out;
+    }
+    for (uint i = 0; i < queue_depth; i++) {
+        slots[i].state = &state;
+        slots[i].buf = memalign(DMA_ALIGNMENT, block_size);
+        if (!slots[i].buf) {
+            rc = ERR_NO_MEMORY;
+            goto out;
+        }
+        memset(slots[i].buf, write ? (0x55 + i) : 0, block_size);
+        state.idle[state.idle_count++] = &slots[i];
+    }
+
+    printf("%s %s: block size %zu, queue depth %u, %u ops\n", device->name, mode, block_size, queue_depth, count);
+
+    uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+    lk_bigtime_t start = current_time_hires();
+
+    spin_lock_saved_state_t lock_state;
+    for (uint issued = 0; issued < count; ) {
+        /* wait for an idle slot */
+        spin_lock_irqsave(&state.lock, lock_state);
+        while (state.idle_count == 0) {
+            spin_unlock_irqrestore(&state.lock, lock_state);
+            event_wait(&state.event);
+            spin_lock_irqsave(&state.lock, lock_state);
+        }
+        if (state.error != 0) {
+            spin_unlock_irqrestore(&state.lock, lock_state);
+            break;
+        }
+        struct bio_bench_slot *slot = state.idle[--state.idle_count];
+        spin_unlock_irqrestore(&state.lock, lock_state);
+
+        uint64_t block;
+        if (random) {
+            /* fixed seed xorshift so runs are repeatable */
+            rand_state ^= rand_state << 13;
+            rand_state ^= rand_state >> 7;
+            rand_state ^= rand_state << 17;
+            block = rand_state % span_blocks;
+        } else {
+            block = issued % span_blocks;
+        }
+        off_t offset = block * block_size;
+
+        slot->start = current_time_hires();
+        status_t err;
+        if (write) {
+            err = bio_write_async(device, slot->buf, offset, block_size, &bio_bench_callback, slot);
+        } else {
+            err = bio_read_async(device, slot->buf, offset, block_size, &bio_bench_callback, slot);
+        }
+
+        if (err == ERR_BUSY) {
+            /* the device queue is full, retry once something completes */
+            spin_lock_irqsave(&state.lock, lock_state);
+            state.idle[state.idle_count++] = slot;
+            bool others_busy = state.idle_count < queue_depth;
+            spin_unlock_irqrestore(&state.lock, lock_state);
+            if (others_busy) {
+                event_wait(&state.event);
+            } else {
+                thread_yield();
+            }
+            continue;
+        }
+        if (err < 0) {
+            printf("error %d submitting request at offset %" PRIu64 "\n", err, (uint64_t)offset);
+            spin_lock_irqsave(&state.lock, lock_state);
+            state.idle[state.idle_count++] = slot;
+            if (state.error == 0)
+                state.error = err;
+            spin_unlock_irqrestore(&state.lock, lock_state);
+            break;
+        }
+        issued++;
+    }
+
+    /* drain */
+    spin_lock_irqsave(&state.lock, lock_state);
+    while (state.idle_count < queue_depth) {
+        spin_unlock_irqrestore(&state.lock, lock_state);
+        event_wait(&state.event);
+        spin_lock_irqsave(&state.lock, lock_state);
+    }
+    spin_unlock_irqrestore(&state.lock, lock_state);
+
+    lk_bigtime_t elapsed = current_time_hires() - start;
+
+    if (state.error != 0) {
+        printf("benchmark failed with error %zd after %u ops\n", state.error, state.completed);
+        rc = state.error;
+    } else {
+        bio_bench_report(&state, state.completed, elapsed);
+    }
+
+out:
+    for (uint i = 0; i < queue_depth; i++)
+        free(slots[i].buf);
+    free(state.latency);
+    event_destroy(&state.event);
+
+    return rc;
+}
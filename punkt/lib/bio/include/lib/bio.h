@@ -26,6 +26,12 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bdev;
+
+/* completion routine for asynchronous io, result is the number of bytes transferred or an error.
+ * May be called from interrupt context. */
+typedef void (*bio_async_callback_t)(void *callback_context, struct bdev *dev, ssize_t result);
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -51,6 +57,10 @@ typedef struct bdev {
     ssize_t (*write)(struct bdev *, const void *buf, off_t offset, size_t len);
     ssize_t (*write_block)(struct bdev *, const void *buf, bnum_t block, uint count);
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
+    status_t (*read_async)(struct bdev *, void *buf, off_t offset, size_t len,
+                           bio_async_callback_t callback, void *callback_context);
+    status_t (*write_async)(struct bdev *, const void *buf, off_t offset, size_t len,
+                            bio_async_callback_t callback, void *callback_context);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
 } bdev_t;
@@ -65,6 +75,13 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* asynchronous io. Devices without native support complete the request synchronously,
+ * calling the callback before returning. If an error is returned the callback is not called. */
+status_t bio_read_async(bdev_t *dev, void *buf, off_t offset, size_t len,
+                        bio_async_callback_t callback, void *callback_context);
+status_t bio_write_async(bdev_t *dev, const void *buf, off_t offset, size_t len,
+                         bio_async_callback_t callback, void *callback_context);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
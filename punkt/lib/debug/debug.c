@@ -17,6 +17,7 @@
 #include <platform.h>
 #include <platform/debug.h>
 #include <kernel/spinlock.h>
+#include <lib/io.h>
 
 void spin(uint32_t usecs) {
     lk_bigtime_t start = current_time_hires();
@@ -26,6 +27,7 @@ void spin(uint32_t usecs) {
 }
 
 void panic(const char *fmt, ...) {
+    console_output_sync();
     printf("panic (caller %p): ", __GET_CALLER());
 
     va_list ap;
@@ -37,6 +39,7 @@ void panic(const char *fmt, ...) {
 }
 
 void assert_fail_msg(const char* file, int line, const char* expression, const char* fmt, ...) {
+    console_output_sync();
 
     // Print the user message.
     printf("ASSERT FAILED at (%s:%d): %s\n", file, line, expression);
@@ -49,6 +52,7 @@ void assert_fail_msg(const char* file, int line, const char* expression, const c
 }
 
 void assert_fail(const char* file, int line, const char* expression) {
+    console_output_sync();
     printf("ASSERT FAILED at (%s:%d): %s\n", file, line, expression);
     platform_halt(HALT_ACTION_HALT, HALT_REASON_SW_PANIC);
 }
@@ -20,6 +20,7 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
     int err;
     uint8_t *buf;
     size_t namelen = strlen(name);
+    struct cache_block ind_cache[EXT2_MAP_CACHE_LEVELS] = {};
 
     if (!S_ISDIR(dir_inode->i_mode))
         return ERR_NOT_DIR;
@@ -29,8 +30,10 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
     file_blocknum = 0;
     for (;;) {
         /* read in the offset */
-        err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+        err = ext2_read_inode_cached(ext2, dir_inode, ind_cache, buf,
+                                     file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
         if (err <= 0) {
+            ext2_free_ind_cache(ind_cache);
             free(buf);
             return -1;
         }
@@ -52,6 +55,7 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
                 // match
                 *inum = LE32(ent->inode);
                 LTRACEF("match: inode %d\n", *inum);
+                ext2_free_ind_cache(ind_cache);
                 free(buf);
                 return 1;
             }
@@ -63,6 +67,7 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 
         /* sanity check the directory. 4MB should be enough */
         if (file_blocknum > 1024) {
+            ext2_free_ind_cache(ind_cache);
             free(buf);
             return -1;
         }
@@ -55,6 +55,7 @@ static void endian_swap_superblock(struct ext2_super_block *sb) {
     LE32SWAP(sb->s_journal_inum);
     LE32SWAP(sb->s_journal_dev);
     LE32SWAP(sb->s_last_orphan);
+    LE16SWAP(sb->s_desc_size);
     LE32SWAP(sb->s_default_mount_opts);
     LE32SWAP(sb->s_first_meta_bg);
 }
@@ -137,22 +138,44 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
     }
 
     /* make sure it doesn't have any ro features we don't support */
-    if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+    if (ext2->sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_UNSUPPORTED) {
         err = -3;
         return err;
     }
 
-    /* read in all the group descriptors */
-    ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
-    err = bio_read(ext2->dev, (void *)ext2->gd,
-                   (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
-                   sizeof(struct ext2_group_desc) * ext2->s_group_count);
+    /* incompat features change the on disk layout, refuse anything we can't read */
+    if (ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_UNSUPPORTED) {
+        LTRACEF("unsupported incompat features 0x%x\n",
+                ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_UNSUPPORTED);
+        err = -3;
+        return err;
+    }
+
+    size_t desc_size = EXT2_DESC_SIZE(ext2->sb);
+    if (desc_size < sizeof(struct ext2_group_desc)) {
+        err = -4;
+        return err;
+    }
+
+    /* read in all the group descriptors, which start in the block after the superblock */
+    uint8_t *gd_raw = malloc(desc_size * ext2->s_group_count);
+    err = bio_read(ext2->dev, gd_raw,
+                   (off_t)(ext2->sb.s_first_data_block + 1) * EXT2_BLOCK_SIZE(ext2->sb),
+                   desc_size * ext2->s_group_count);
     if (err < 0) {
+        free(gd_raw);
         err = -4;
         return err;
     }
 
+    /* only the low 32 bytes of a 64bit descriptor are used, compact them into the table */
+    ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
     int i;
+    for (i=0; i < ext2->s_group_count; i++) {
+        memcpy(&ext2->gd[i], gd_raw + i * desc_size, sizeof(struct ext2_group_desc));
+    }
+    free(gd_raw);
+
     for (i=0; i < ext2->s_group_count; i++) {
         endian_swap_group_desc(&ext2->gd[i]);
         LTRACEF("group %d:\n", i);
@@ -282,7 +282,7 @@ struct ext2_super_block {
     uint32_t    s_hash_seed[4];     /* HTREE hash seed */
     uint8_t s_def_hash_version; /* Default hash version to use */
     uint8_t s_reserved_char_pad;
-    uint16_t    s_reserved_word_pad;
+    uint16_t    s_desc_size;        /* Group descriptor size (64bit feature) */
     uint32_t    s_default_mount_opts;
     uint32_t    s_first_meta_bg;    /* First metablock block group */
     uint32_t    s_reserved[190];    /* Padding to the end of the block */
@@ -342,6 +342,11 @@ struct ext2_super_block {
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
 #define EXT2_FEATURE_RO_COMPAT_BTREE_DIR    0x0004
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE    0x0008
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM     0x0010
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK    0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE  0x0040
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
 #define EXT2_FEATURE_RO_COMPAT_ANY      0xffffffff
 
 #define EXT2_FEATURE_INCOMPAT_COMPRESSION   0x0001
@@ -349,17 +354,37 @@ struct ext2_super_block {
 #define EXT3_FEATURE_INCOMPAT_RECOVER       0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV   0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG       0x0010
+#define EXT4_FEATURE_INCOMPAT_EXTENTS       0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT         0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG       0x0200
 #define EXT2_FEATURE_INCOMPAT_ANY       0xffffffff
 
 #define EXT2_FEATURE_COMPAT_SUPP    EXT2_FEATURE_COMPAT_EXT_ATTR
+/* there is no journal replay, so RECOVER (a dirty journal) fails the mount */
 #define EXT2_FEATURE_INCOMPAT_SUPP  (EXT2_FEATURE_INCOMPAT_FILETYPE| \
-                     EXT2_FEATURE_INCOMPAT_META_BG)
+                     EXT2_FEATURE_INCOMPAT_META_BG| \
+                     EXT4_FEATURE_INCOMPAT_EXTENTS| \
+                     EXT4_FEATURE_INCOMPAT_64BIT| \
+                     EXT4_FEATURE_INCOMPAT_FLEX_BG)
 #define EXT2_FEATURE_RO_COMPAT_SUPP (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER| \
                      EXT2_FEATURE_RO_COMPAT_LARGE_FILE| \
-                     EXT2_FEATURE_RO_COMPAT_BTREE_DIR)
+                     EXT2_FEATURE_RO_COMPAT_BTREE_DIR| \
+                     EXT4_FEATURE_RO_COMPAT_HUGE_FILE| \
+                     EXT4_FEATURE_RO_COMPAT_GDT_CSUM| \
+                     EXT4_FEATURE_RO_COMPAT_DIR_NLINK| \
+                     EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE| \
+                     EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)
 #define EXT2_FEATURE_RO_COMPAT_UNSUPPORTED  ~EXT2_FEATURE_RO_COMPAT_SUPP
 #define EXT2_FEATURE_INCOMPAT_UNSUPPORTED   ~EXT2_FEATURE_INCOMPAT_SUPP
 
+/*
+ * Group descriptor size. The 64bit feature makes it variable and records it
+ * in the superblock, otherwise it is the classic 32 byte descriptor.
+ */
+#define EXT4_MIN_DESC_SIZE_64BIT    64
+#define EXT2_DESC_SIZE(s)   (((s).s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) ? \
+                 (s).s_desc_size : sizeof(struct ext2_group_desc))
+
 /*
  * Default values for user and/or group using reserved blocks
  */
@@ -380,6 +405,40 @@ struct ext2_super_block {
 #define EXT3_DEFM_JMODE_ORDERED 0x0040
 #define EXT3_DEFM_JMODE_WBACK   0x0060
 
+/*
+ * ext4 extent tree. An inode with EXT4_EXTENTS_FL set stores the root of the
+ * tree in i_block[] instead of the classic direct/indirect block map. Each
+ * node starts with a header, followed by either index entries (interior
+ * nodes, eh_depth > 0) or extents (leaves, eh_depth == 0).
+ */
+#define EXT4_EXTENTS_FL         0x00080000 /* Inode uses extents */
+
+#define EXT4_EXT_MAGIC          0xf30a
+#define EXT4_EXT_MAX_DEPTH      5
+#define EXT4_EXT_INIT_MAX_LEN   (1U << 15) /* longer lengths mark uninitialized extents */
+
+struct ext4_extent_header {
+    uint16_t    eh_magic;       /* EXT4_EXT_MAGIC */
+    uint16_t    eh_entries;     /* number of valid entries */
+    uint16_t    eh_max;         /* capacity of store in entries */
+    uint16_t    eh_depth;       /* has tree real underlying blocks? */
+    uint32_t    eh_generation;  /* generation of the tree */
+};
+
+struct ext4_extent {
+    uint32_t    ee_block;       /* first logical block extent covers */
+    uint16_t    ee_len;         /* number of blocks covered by extent */
+    uint16_t    ee_start_hi;    /* high 16 bits of physical block */
+    uint32_t    ee_start_lo;    /* low 32 bits of physical block */
+};
+
+struct ext4_extent_idx {
+    uint32_t    ei_block;       /* index covers logical blocks from 'block' */
+    uint32_t    ei_leaf_lo;     /* pointer to the physical block of the next level */
+    uint16_t    ei_leaf_hi;     /* high 16 bits of physical block */
+    uint16_t    ei_unused;
+};
+
 /*
  * Structure of a directory entry
  */
@@ -31,11 +31,17 @@ struct cache_block {
     void *ptr;
 };
 
+/* one slot per level of indirect block or extent tree node */
+#define EXT2_MAP_CACHE_LEVELS EXT4_EXT_MAX_DEPTH
+
+/* runs at least this many blocks long are read straight into the caller's buffer */
+#define EXT2_DIRECT_READ_MIN_BLOCKS 4
+
 /* open file handle */
 typedef struct {
     ext2_t *ext2;
 
-    struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+    struct cache_block ind_cache[EXT2_MAP_CACHE_LEVELS]; // cache of indirect blocks as they're scanned
     struct ext2_inode inode;
 } ext2_file_t;
 
@@ -50,6 +56,9 @@ int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
 ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+ssize_t ext2_read_inode_cached(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                               void *buf, off_t offset, size_t len);
+void ext2_free_ind_cache(struct cache_block *ind_cache);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* fs api */
@@ -53,8 +53,8 @@ ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
         return -1;
     }
 
-    // read from the inode
-    err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+    // read from the inode, keeping the indirect tables around for the next read
+    err = ext2_read_inode_cached(file->ext2, &file->inode, file->ind_cache, buf, offset, len);
 
     return err;
 }
@@ -63,12 +63,7 @@ int ext2_close_file(filecookie *fcookie) {
     ext2_file_t *file = (ext2_file_t *)fcookie;
 
     // see if we need to free any of the cache blocks
-    int i;
-    for (i=0; i < 3; i++) {
-        if (file->ind_cache[i].num != 0) {
-            free(file->ind_cache[i].ptr);
-        }
-    }
+    ext2_free_ind_cache(file->ind_cache);
 
     free(file);
 
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
 #include "ext2_priv.h"
 
@@ -29,8 +30,6 @@ int ext2_put_block(ext2_t *ext2, blocknum_t bnum) {
 static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_find, uint32_t *level, uint32_t pos[]) {
     uint32_t block_ptr_per_block, block_ptr_per_2nd_block;
 
-    // XXX optimize this
-
     // See if it's in the direct blocks
     if (block_to_find < EXT2_NDIR_BLOCKS) {
         *level = 0;
@@ -74,96 +73,249 @@ static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_fi
     return -1;
 }
 
-// This function returns a pointer to the cache block that corresponds to the indirect block pointer.
-static int ext2_get_indirect_block_pointer_cache_block(ext2_t *ext2, struct ext2_inode *inode,
-        blocknum_t **cache_block, uint32_t level, uint32_t pos[], uint *block_loaded) {
-    uint32_t current_level = 0;
-    uint current_block = 0, last_block;
-    blocknum_t *block = NULL;
-    int err;
+/* Return a pointer to a private copy of a mapping block (indirect table or extent tree node),
+ * keeping one copy per level so sequential lookups don't go back to the block cache. */
+static int ext2_get_map_block(ext2_t *ext2, struct cache_block *ind_cache, uint32_t level,
+                              blocknum_t bnum, void **ptr) {
+    DEBUG_ASSERT(level < EXT2_MAP_CACHE_LEVELS);
 
-    if ((level > 3) || (level == 0)) {
-        err = -1;
-        goto error;
+    struct cache_block *cb = &ind_cache[level];
+    if (cb->ptr && cb->num == bnum) {
+        *ptr = cb->ptr;
+        return 0;
     }
 
-    // Dig down into the indirect blocks. When done, current_block should point to the target.
-    while (current_level < level) {
-        if (current_level == 0) {
-            // read the direct block, simulates a prior loop
-            current_block = LE32(inode->i_block[pos[0]]);
-        }
+    if (!cb->ptr) {
+        cb->ptr = malloc(EXT2_BLOCK_SIZE(ext2->sb));
+        if (!cb->ptr)
+            return ERR_NO_MEMORY;
+    }
 
-        if (current_block == 0) {
-            err = -1;
-            goto error;
-        }
+    int err = ext2_read_block(ext2, cb->ptr, bnum);
+    if (err < 0) {
+        cb->num = 0;
+        return err;
+    }
 
-        last_block = current_block;
-        current_level++;
-        *block_loaded = current_block;
+    LTRACEF("level %u: loaded block %u\n", level, bnum);
 
-        err = ext2_get_block(ext2, (void **)(void *)&block, current_block);
-        if (err < 0) {
-            goto error;
-        }
+    cb->num = bnum;
+    *ptr = cb->ptr;
+    return 0;
+}
 
-        if (current_level < level) {
-            current_block = LE32(block[pos[current_level]]);
-            ext2_put_block(ext2, last_block);
-        }
+void ext2_free_ind_cache(struct cache_block *ind_cache) {
+    for (uint i = 0; i < EXT2_MAP_CACHE_LEVELS; i++) {
+        free(ind_cache[i].ptr);
+        ind_cache[i].ptr = NULL;
+        ind_cache[i].num = 0;
+    }
+}
+
+/* translate a file block to a physical block using the classic direct/indirect block map */
+static int ext2_blockmap_lookup(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                                uint fileblock, blocknum_t *block) {
+    uint32_t pos[4];
+    uint32_t level = 0;
+    if (ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos) < 0)
+        return ERR_OUT_OF_RANGE;
+
+    LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
+
+    /* direct block, or the top level indirect table */
+    blocknum_t current_block = LE32(inode->i_block[pos[0]]);
+
+    /* dig down into the indirect blocks */
+    for (uint32_t current_level = 0; current_level < level; current_level++) {
+        if (current_block == 0)
+            break; // sparse
+
+        blocknum_t *table;
+        int err = ext2_get_map_block(ext2, ind_cache, current_level, current_block, (void **)&table);
+        if (err < 0)
+            return err;
+
+        current_block = LE32(table[pos[current_level + 1]]);
     }
 
-    *cache_block = block;
+    *block = current_block;
     return 0;
+}
 
-error:
-    *cache_block = NULL;
-    *block_loaded = 0;
-    return err;
+/* Translate a file block through an ext4 extent tree. Returns the physical block
+ * (0 for a hole or an uninitialized extent) and how many blocks the mapping covers. */
+static int ext2_extent_lookup(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                              uint fileblock, blocknum_t *block, uint *count) {
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)inode->i_block;
+    size_t node_size = sizeof(inode->i_block);
+
+    for (uint32_t level = 0;; level++) {
+        uint entries = LE16(eh->eh_entries);
+        if (LE16(eh->eh_magic) != EXT4_EXT_MAGIC || entries > LE16(eh->eh_max) ||
+                sizeof(*eh) + entries * sizeof(struct ext4_extent) > node_size) {
+            LTRACEF("bad extent header at level %u\n", level);
+            return ERR_BAD_STATE;
+        }
+
+        if (LE16(eh->eh_depth) == 0) {
+            struct ext4_extent *ex = (struct ext4_extent *)(eh + 1);
+
+            /* binary search for the last extent starting at or before the file block */
+            uint lo = 0, hi = entries;
+            while (lo < hi) {
+                uint mid = (lo + hi) / 2;
+                if (LE32(ex[mid].ee_block) <= fileblock)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            if (lo > 0) {
+                struct ext4_extent *e = &ex[lo - 1];
+                uint start = LE32(e->ee_block);
+                uint len = LE16(e->ee_len);
+                bool uninit = len > EXT4_EXT_INIT_MAX_LEN;
+                if (uninit)
+                    len -= EXT4_EXT_INIT_MAX_LEN;
+
+                if (fileblock - start < len) {
+                    if (LE16(e->ee_start_hi) != 0)
+                        return ERR_NOT_SUPPORTED; // beyond 32bit block numbers
+
+                    *block = uninit ? 0 : LE32(e->ee_start_lo) + (fileblock - start);
+                    *count = len - (fileblock - start);
+                    return 0;
+                }
+            }
+
+            /* a hole, which extends up to the next extent in this leaf */
+            *block = 0;
+            *count = (lo < entries) ? LE32(ex[lo].ee_block) - fileblock : 1;
+            return 0;
+        }
+
+        /* interior node, find the last index covering the file block */
+        struct ext4_extent_idx *ix = (struct ext4_extent_idx *)(eh + 1);
+        uint i = 0;
+        while (i + 1 < entries && LE32(ix[i + 1].ei_block) <= fileblock)
+            i++;
+
+        if (entries == 0 || LE32(ix[i].ei_block) > fileblock) {
+            *block = 0;
+            *count = entries ? LE32(ix[0].ei_block) - fileblock : 1;
+            return 0;
+        }
+
+        if (level >= EXT2_MAP_CACHE_LEVELS || LE16(ix[i].ei_leaf_hi) != 0)
+            return ERR_NOT_SUPPORTED;
+
+        int err = ext2_get_map_block(ext2, ind_cache, level, LE32(ix[i].ei_leaf_lo), (void **)&eh);
+        if (err < 0)
+            return err;
+        node_size = EXT2_BLOCK_SIZE(ext2->sb);
+    }
 }
 
-/* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock) {
+/* Map a run of file blocks starting at fileblock onto a physically contiguous range
+ * of at most max blocks. A physical block of 0 means the whole run is sparse. */
+static int ext2_map_block_run(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                              uint fileblock, uint max, blocknum_t *block, uint *count) {
     int err;
-    blocknum_t block;
 
-    LTRACEF("inode %p, fileblock %u\n", inode, fileblock);
+    LTRACEF("inode %p, fileblock %u, max %u\n", inode, fileblock, max);
 
-    uint32_t pos[4];
-    uint32_t level = 0;
-    ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+    DEBUG_ASSERT(max > 0);
 
-    LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
-
-    if (level == 0) {
-        /* direct block, just return it directly */
-        block = LE32(inode->i_block[fileblock]);
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        err = ext2_extent_lookup(ext2, inode, ind_cache, fileblock, block, count);
+        if (err < 0)
+            return err;
+        *count = MIN(*count, max);
     } else {
-        /* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
-        blocknum_t *ind_table;
-        blocknum_t phys_block;
-        err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block);
+        blocknum_t first;
+        err = ext2_blockmap_lookup(ext2, inode, ind_cache, fileblock, &first);
         if (err < 0)
-            return 0;
+            return err;
+
+        /* extend the run while the block map stays contiguous, the tables are cached so this is cheap */
+        uint n = 1;
+        while (n < max) {
+            blocknum_t next;
+            if (ext2_blockmap_lookup(ext2, inode, ind_cache, fileblock + n, &next) < 0)
+                break;
+            if (first == 0 ? next != 0 : next != first + n)
+                break;
+            n++;
+        }
 
-        /* dereference the final entry in the final table */
-        block = LE32(ind_table[pos[level]]);
-        LTRACEF("block %u, indirect_block %u\n", block, phys_block);
+        *block = first;
+        *count = n;
+    }
+
+    LTRACEF("returning block %u, count %u\n", *block, *count);
+
+    return 0;
+}
 
-        /* release the ref on the cache block */
-        ext2_put_block(ext2, phys_block);
+/* read a physically contiguous run of file system blocks, bypassing the block cache if the device allows it */
+static int ext2_read_block_run(ext2_t *ext2, void *_buf, blocknum_t block, uint count) {
+    uint8_t *buf = _buf;
+    bdev_t *dev = ext2->dev;
+    size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+    bool direct = (count >= EXT2_DIRECT_READ_MIN_BLOCKS) &&
+                  (block_size % dev->block_size) == 0 &&
+                  !((dev->flags & BIO_FLAG_CACHE_ALIGNED_READS) && !IS_ALIGNED((uintptr_t)buf, CACHE_LINE));
+    if (direct) {
+        uint shift = EXT2_BLOCK_SIZE_BITS(ext2->sb) - dev->block_shift;
+        uint64_t dev_block = (uint64_t)block << shift;
+        uint64_t dev_count = (uint64_t)count << shift;
+        if (dev_block + dev_count <= dev->block_count) {
+            LTRACEF("direct read block %u, count %u\n", block, count);
+
+            ssize_t err = bio_read_block(dev, buf, (bnum_t)dev_block, (uint)dev_count);
+            if (err < 0)
+                return err;
+            if ((size_t)err != count * block_size)
+                return ERR_IO;
+            return 0;
+        }
     }
 
-    LTRACEF("returning %u\n", block);
+    /* small or unaligned transfer, go through the cache one block at a time */
+    for (uint i = 0; i < count; i++) {
+        int err = ext2_read_block(ext2, buf, block + i);
+        if (err < 0)
+            return err;
+        buf += block_size;
+    }
 
-    return block;
+    return 0;
 }
 
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len) {
+/* read a single file block, zero filling holes */
+static int ext2_read_file_block(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                                void *buf, uint fileblock) {
+    blocknum_t phys_block;
+    uint count;
+    int err = ext2_map_block_run(ext2, inode, ind_cache, fileblock, 1, &phys_block, &count);
+    if (err < 0)
+        return err;
+
+    if (phys_block == 0) {
+        memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+        return 0;
+    }
+
+    return ext2_read_block(ext2, buf, phys_block);
+}
+
+ssize_t ext2_read_inode_cached(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                               void *_buf, off_t offset, size_t len) {
     int err = 0;
     size_t bytes_read = 0;
     uint8_t *buf = _buf;
+    const size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
 
     /* calculate the file size */
     off_t file_size = ext2_file_len(ext2, inode);
@@ -179,23 +331,20 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         return 0;
 
     /* calculate the starting file block */
-    uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+    uint file_block = offset / block_size;
 
     /* handle partial first block */
-    if ((offset % EXT2_BLOCK_SIZE(ext2->sb)) != 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+    if ((offset % block_size) != 0) {
+        uint8_t temp[block_size];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
+        err = ext2_read_file_block(ext2, inode, ind_cache, temp, file_block);
+        if (err < 0)
+            goto done;
 
         /* copy out what we need */
-        size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
-        size_t tocopy = MIN(len, EXT2_BLOCK_SIZE(ext2->sb) - block_offset);
+        size_t block_offset = offset % block_size;
+        size_t tocopy = MIN(len, block_size - block_offset);
         memcpy(buf, temp + block_offset, tocopy);
 
         /* increment our stuff */
@@ -205,34 +354,37 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         buf += tocopy;
     }
 
-    /* handle middle blocks */
-    while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+    /* handle middle blocks, one physically contiguous run at a time */
+    while (len >= block_size) {
+        blocknum_t phys_block;
+        uint count;
+        err = ext2_map_block_run(ext2, inode, ind_cache, file_block, len / block_size, &phys_block, &count);
+        if (err < 0)
+            goto done;
+
         if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+            memset(buf, 0, count * block_size);
         } else {
-            ext2_read_block(ext2, buf, phys_block);
+            err = ext2_read_block_run(ext2, buf, phys_block, count);
+            if (err < 0)
+                goto done;
         }
 
         /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
+        file_block += count;
+        len -= count * block_size;
+        bytes_read += count * block_size;
+        buf += count * block_size;
     }
 
     /* handle partial last block */
     if (len > 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+        uint8_t temp[block_size];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
+        err = ext2_read_file_block(ext2, inode, ind_cache, temp, file_block);
+        if (err < 0)
+            goto done;
 
         /* copy out what we need */
         memcpy(buf, temp, len);
@@ -241,8 +393,18 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         bytes_read += len;
     }
 
+done:
     LTRACEF("err %d, bytes_read %zu\n", err, bytes_read);
 
     return (err < 0) ? err : (ssize_t)bytes_read;
 }
 
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len) {
+    struct cache_block ind_cache[EXT2_MAP_CACHE_LEVELS] = {};
+
+    ssize_t err = ext2_read_inode_cached(ext2, inode, ind_cache, buf, offset, len);
+
+    ext2_free_ind_cache(ind_cache);
+
+    return err;
+}
@@ -837,6 +837,7 @@ void cmpct_init(void) {
 
     // Create a mutex.
     mutex_init(&theheap.lock);
+    mutex_set_name(&theheap.lock, "theheap.lock");
 
     // Initialize the free list.
     for (int i = 0; i < NUMBER_OF_BUCKETS; i++) {
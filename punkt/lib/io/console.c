@@ -17,8 +17,12 @@
 #include <arch/ops.h>
 #include <platform.h>
 #include <platform/debug.h>
+#include <kernel/event.h>
 #include <kernel/thread.h>
+#include <lk/console_cmd.h>
 #include <lk/init.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 /* routines for dealing with main console io */
 #define PRINT_LOCK_FLAGS SPIN_LOCK_FLAG_INTERRUPTS
@@ -36,8 +40,8 @@ cbuf_t console_input_cbuf;
 static uint8_t console_cbuf_buf[CONSOLE_BUF_LEN];
 #endif // CONSOLE_HAS_INPUT_BUFFER
 
-/* print lock must be held when invoking out, outs, outc */
-static void out_count(const char *str, size_t len) {
+/* hand output to the registered loggers and the platform's putc */
+static void console_emit(const char *str, size_t len) {
     print_callback_t *cb;
 
     /* print to any registered loggers */
@@ -62,6 +66,203 @@ static void out_count(const char *str, size_t len) {
 #endif
 }
 
+#if CONSOLE_ASYNC_OUTPUT
+/*
+ * Asynchronous console output. Writes are copied into a ring for the cpu
+ * doing the writing, with interrupts off and no lock, and a low priority
+ * thread drains the rings out to console_emit(). Writers with interrupts off,
+ * in irq handlers or holding spin locks, never wait on the uart: a write that
+ * doesn't fit is dropped whole and counted. Until the drain thread is up, and
+ * for good once a panic starts, output goes straight out as before.
+ *
+ * Each cpu's output stays in order, though writes from different cpus may come
+ * out in a different order than they were made.
+ */
+
+/* bytes buffered per cpu, a power of two */
+#ifndef CONSOLE_ASYNC_BUF_LEN
+#define CONSOLE_ASYNC_BUF_LEN 4096
+#endif
+
+/* how often the drain thread looks for output written with interrupts off,
+ * which can't wake it */
+#ifndef CONSOLE_ASYNC_POLL_MSECS
+#define CONSOLE_ASYNC_POLL_MSECS 10
+#endif
+
+STATIC_ASSERT((CONSOLE_ASYNC_BUF_LEN & (CONSOLE_ASYNC_BUF_LEN - 1)) == 0);
+
+static struct console_outbuf {
+    char *buf;
+    uint head;          // written by the owning cpu
+    uint tail;          // written by the drain side
+    uint dropped;       // bytes dropped since the last report
+    uint64_t dropped_total;
+    int draining;       // claimed by whoever is writing it out
+} console_outbufs[SMP_MAX_CPUS];
+
+static volatile bool console_async;
+static int console_drain_pending;
+static event_t console_drain_event = EVENT_INITIAL_VALUE(console_drain_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+/* write out everything buffered on one cpu, false if someone else already is */
+static bool console_drain_cpu(struct console_outbuf *ob, uint cpu) {
+    if (__atomic_exchange_n(&ob->draining, 1, __ATOMIC_ACQUIRE))
+        return false;
+
+    uint tail = ob->tail;
+    uint head = __atomic_load_n(&ob->head, __ATOMIC_ACQUIRE);
+    while (tail != head) {
+        uint off = tail & (CONSOLE_ASYNC_BUF_LEN - 1);
+        size_t len = MIN((size_t)(head - tail), (size_t)(CONSOLE_ASYNC_BUF_LEN - off));
+        console_emit(&ob->buf[off], len);
+        tail += len;
+        __atomic_store_n(&ob->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    uint dropped = __atomic_exchange_n(&ob->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "\n[console: cpu %u dropped %u bytes]\n", cpu, dropped);
+        console_emit(msg, MIN((size_t)len, sizeof(msg) - 1));
+    }
+
+    __atomic_store_n(&ob->draining, 0, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* queue the write on this cpu's ring, false if output has to go out directly.
+ * A write that doesn't fit is dropped if interrupts are off; an ordinary
+ * thread writes the ring out itself to make room instead. */
+static bool console_buffer(const char *str, size_t len) {
+    bool can_wait = !arch_ints_disabled();
+
+    for (;;) {
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        /* checked again with interrupts off, against a panic on this cpu */
+        if (!console_async) {
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+            return false;
+        }
+
+        uint cpu = arch_curr_cpu_num();
+        struct console_outbuf *ob = &console_outbufs[cpu];
+        uint head = ob->head;
+        uint used = head - __atomic_load_n(&ob->tail, __ATOMIC_ACQUIRE);
+        if (len <= CONSOLE_ASYNC_BUF_LEN - used) {
+            uint off = head & (CONSOLE_ASYNC_BUF_LEN - 1);
+            size_t first = MIN(len, (size_t)(CONSOLE_ASYNC_BUF_LEN - off));
+            memcpy(&ob->buf[off], str, first);
+            memcpy(ob->buf, str + first, len - first);
+            __atomic_store_n(&ob->head, head + len, __ATOMIC_RELEASE);
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+            break;
+        }
+        if (!can_wait) {
+            __atomic_fetch_add(&ob->dropped, len, __ATOMIC_RELAXED);
+            ob->dropped_total += len;
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+            break;
+        }
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (!console_drain_cpu(ob, cpu)) {
+            /* the drain thread has it, give it a moment */
+            thread_sleep(1);
+        } else if (len > CONSOLE_ASYNC_BUF_LEN) {
+            /* will never fit, but everything before it is out now */
+            return false;
+        }
+    }
+
+    /* waking the drain thread takes the thread lock, which may be what the
+     * writer is holding with interrupts off; the poll covers those */
+    if (can_wait && !__atomic_exchange_n(&console_drain_pending, 1, __ATOMIC_ACQ_REL))
+        event_signal(&console_drain_event, false);
+
+    return true;
+}
+
+static void console_drain_all(void) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (console_outbufs[i].buf)
+            console_drain_cpu(&console_outbufs[i], i);
+    }
+}
+
+static int console_drain_thread(void *arg) {
+    for (;;) {
+        event_wait_timeout(&console_drain_event, CONSOLE_ASYNC_POLL_MSECS);
+        __atomic_store_n(&console_drain_pending, 0, __ATOMIC_RELEASE);
+
+        if (!console_async)
+            break;
+        console_drain_all();
+    }
+    return 0;
+}
+
+void console_output_sync(void) {
+    if (!console_async)
+        return;
+
+    console_async = false;
+    console_drain_all();
+}
+
+static void console_async_init(uint level) {
+    char *bufs = malloc(CONSOLE_ASYNC_BUF_LEN * SMP_MAX_CPUS);
+    if (!bufs)
+        return;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        console_outbufs[i].buf = bufs + i * CONSOLE_ASYNC_BUF_LEN;
+    }
+
+    thread_t *t = thread_create("console out", &console_drain_thread, NULL, LOW_PRIORITY,
+                                DEFAULT_STACK_SIZE);
+    if (!t) {
+        free(bufs);
+        return;
+    }
+    console_async = true;
+    thread_detach_and_resume(t);
+}
+
+LK_INIT_HOOK(console_async, console_async_init, LK_INIT_LEVEL_THREADING);
+
+static int cmd_conout(int argc, const console_cmd_args *argv) {
+    printf("console output is %s\n", console_async ? "buffered" : "synchronous");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const struct console_outbuf *ob = &console_outbufs[i];
+        if (ob->buf && (ob->head || ob->dropped_total)) {
+            printf("cpu %u: %u bytes written, %u buffered, %llu dropped\n", i, ob->head,
+                   ob->head - ob->tail, ob->dropped_total);
+        }
+    }
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("conout", "console output buffering stats", &cmd_conout)
+STATIC_COMMAND_END(conout);
+
+#else
+
+void console_output_sync(void) {}
+
+#endif // CONSOLE_ASYNC_OUTPUT
+
+static void out_count(const char *str, size_t len) {
+#if CONSOLE_ASYNC_OUTPUT
+    if (console_async && console_buffer(str, len))
+        return;
+#endif
+    console_emit(str, len);
+}
+
 void register_print_callback(print_callback_t *cb) {
     spin_lock_saved_state_t state;
     spin_lock_save(&print_spin_lock, &state, PRINT_LOCK_FLAGS);
@@ -54,6 +54,15 @@ static inline void io_handle_init(io_handle_t *io, io_handle_hooks_t *hooks) {
 /* the main console io handle */
 extern io_handle_t console_io;
 
+/* write out any buffered console output and stay synchronous from then on,
+ * for the way into a panic or a fatal exception */
+void console_output_sync(void);
+
+/* buffer console output per cpu and write it out from a thread */
+#ifndef CONSOLE_ASYNC_OUTPUT
+#define CONSOLE_ASYNC_OUTPUT 0
+#endif
+
 /* should the console also output to the platform's putc (usually UART) */
 #ifndef CONSOLE_OUTPUT_TO_PLATFORM_PUTC
 #define CONSOLE_OUTPUT_TO_PLATFORM_PUTC 1
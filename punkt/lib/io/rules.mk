@@ -3,12 +3,14 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 CONSOLE_OUTPUT_TO_PLATFORM_PUTC ?= 1
+CONSOLE_ASYNC_OUTPUT ?= 0
 
 MODULE_DEPS := \
 	lib/cbuf
 
 MODULE_DEFINES += \
-	CONSOLE_OUTPUT_TO_PLATFORM_PUTC=$(CONSOLE_OUTPUT_TO_PLATFORM_PUTC)
+	CONSOLE_OUTPUT_TO_PLATFORM_PUTC=$(CONSOLE_OUTPUT_TO_PLATFORM_PUTC) \
+	CONSOLE_ASYNC_OUTPUT=$(CONSOLE_ASYNC_OUTPUT)
 
 MODULE_SRCS += \
    $(LOCAL_DIR)/console.c \
@@ -18,10 +18,32 @@
 
 #define KLOG_CURRENT_BUFFER -1
 
+/*
+ * Binary logs store each klog_printf() as its format string's offset in
+ * .rodata, a timestamp and the raw arguments, with %s arguments copied in.
+ * Nothing is formatted until the log is read or dumped, when each line also
+ * gets its timestamp. Formats that aren't in .rodata, and ones taking %n or
+ * floating point arguments, are stored as text instead, as is everything
+ * written with klog_puts() and klog_putchar().
+ *
+ * A recovered binary log checks that .rodata matches the running image; if it
+ * doesn't, records that referred to a format string read back as stale.
+ * klog_get_buffer() hands back the raw records for binary logs.
+ */
+#ifndef KLOG_BINARY
+#define KLOG_BINARY 0
+#endif
+
+/* flags for klog_create_etc */
+#define KLOG_FLAG_BINARY (1 << 0)
+
 void klog_init(void);
 
 ssize_t klog_recover(void *ptr);
+
+/* creates a binary log if KLOG_BINARY is set */
 status_t klog_create(void *ptr, size_t len, uint count);
+status_t klog_create_etc(void *ptr, size_t len, uint count, uint flags);
 
 uint klog_buffer_count(void);
 uint klog_current_buffer(void);
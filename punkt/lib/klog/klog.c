@@ -17,6 +17,7 @@
 #include <platform.h>
 #include <lib/cksum.h>
 #include <lk/console_cmd.h>
+#include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
 
@@ -32,6 +33,8 @@ struct klog_buffer_header {
     uint32_t log_count;
     uint32_t current_log;
     uint32_t total_size;
+    uint32_t flags;       // KLOG_FLAG_*
+    uint32_t image_crc32; // binary logs: crc of the .rodata their formats point into
 };
 
 #define KLOG_HEADER_MAGIC 'KLOG'
@@ -51,6 +54,13 @@ static struct klog_buffer_header *klog_buf;
 /* current klog */
 static struct klog_header *klog;
 
+static bool klog_binary(void) {
+    return klog_buf->flags & KLOG_FLAG_BINARY;
+}
+
+static uint32_t klog_image_crc32(void);
+static status_t klog_bin_recover(struct klog_header *k, bool same_image);
+
 static struct klog_header *find_nth_log(uint log) {
     DEBUG_ASSERT(klog_buf);
     DEBUG_ASSERT(klog_buf->magic == KLOG_BUFFER_HEADER_MAGIC);
@@ -106,9 +116,13 @@ static void checksum_klog_data(struct klog_header *k) {
 void klog_init(void) {
 }
 
-status_t klog_create(void *_ptr, size_t len, uint count) {
+status_t klog_create(void *ptr, size_t len, uint count) {
+    return klog_create_etc(ptr, len, count, KLOG_BINARY ? KLOG_FLAG_BINARY : 0);
+}
+
+status_t klog_create_etc(void *_ptr, size_t len, uint count, uint flags) {
     uint8_t *ptr = _ptr;
-    LTRACEF("ptr %p len %zu count %u\n", ptr, len, count);
+    LTRACEF("ptr %p len %zu count %u flags %#x\n", ptr, len, count, flags);
 
     /* check args */
     if (!ptr)
@@ -126,6 +140,8 @@ status_t klog_create(void *_ptr, size_t len, uint count) {
     klog_buf->log_count = count;
     klog_buf->current_log = 0;
     klog_buf->total_size = len;
+    klog_buf->flags = flags & KLOG_FLAG_BINARY;
+    klog_buf->image_crc32 = (flags & KLOG_FLAG_BINARY) ? klog_image_crc32() : 0;
     checksum_klog_buffer_header(klog_buf);
     ptr += sizeof(struct klog_buffer_header);
 
@@ -174,6 +190,8 @@ ssize_t klog_recover(void *_ptr) {
         return ERR_NOT_FOUND;
     if (kbuf->current_log >= kbuf->log_count)
         return ERR_NOT_FOUND;
+    if (kbuf->flags & ~KLOG_FLAG_BINARY)
+        return ERR_NOT_FOUND;
 
     /* walk the list of klogs, validating */
     ptr += sizeof(struct klog_buffer_header);
@@ -204,6 +222,25 @@ ssize_t klog_recover(void *_ptr) {
         ptr += sizeof(struct klog_header) + k->size;
     }
 
+    /* binary logs must be whole records, whose formats may be for another image */
+    if (kbuf->flags & KLOG_FLAG_BINARY) {
+        bool same_image = (kbuf->image_crc32 == klog_image_crc32());
+
+        ptr = (uint8_t *)(kbuf + 1);
+        for (uint i = 0; i < kbuf->log_count; i++) {
+            struct klog_header *k = (struct klog_header *)ptr;
+            status_t err = klog_bin_recover(k, same_image);
+            if (err < 0)
+                return err;
+            ptr += sizeof(struct klog_header) + k->size;
+        }
+
+        if (!same_image) {
+            kbuf->image_crc32 = klog_image_crc32();
+            checksum_klog_buffer_header(kbuf);
+        }
+    }
+
     /* everything checks out */
     klog_buf = kbuf;
     klog_set_current_buffer(klog_buf->current_log);
@@ -258,6 +295,567 @@ status_t klog_set_current_buffer(uint buffer) {
 
 #include <arch/ops.h>
 
+/*
+ * Binary logs. Each klog is a ring of records, each a multiple of 4 bytes
+ * long so that the ring never splits a record header's length field. The
+ * ring keeps a word free so a full ring doesn't look empty, and the oldest
+ * records are evicted whole to make room.
+ */
+#ifndef KLOG_RECORD_MAX
+#define KLOG_RECORD_MAX 256
+#endif
+
+/* longest formatted record, the rest is cut off */
+#ifndef KLOG_LINE_MAX
+#define KLOG_LINE_MAX 256
+#endif
+
+enum klog_record_type {
+    KLOG_RECORD_TEXT = 1,
+    KLOG_RECORD_FORMAT,
+    KLOG_RECORD_STALE,  // a format record from another image
+};
+
+struct klog_record {
+    uint16_t len;       // of the whole record, a multiple of 4
+    uint8_t type;
+    uint8_t pad;        // text records: bytes after the text
+    uint32_t format;    // format records: offset of the format string in .rodata
+    uint64_t time;      // current_time_hires() when it was logged
+};
+
+STATIC_ASSERT(sizeof(struct klog_record) == 16);
+STATIC_ASSERT((KLOG_RECORD_MAX & 3) == 0 && KLOG_RECORD_MAX <= UINT16_MAX);
+
+/* the class of argument a format conversion takes */
+enum klog_arg {
+    KLOG_ARG_END,
+    KLOG_ARG_NONE,
+    KLOG_ARG_INT,
+    KLOG_ARG_LONG,
+    KLOG_ARG_LONGLONG,
+    KLOG_ARG_SIZE,
+    KLOG_ARG_INTMAX,
+    KLOG_ARG_PTRDIFF,
+    KLOG_ARG_STRING,
+    KLOG_ARG_UNSUPPORTED,
+};
+
+/* protects the binary ring's head and tail against writers on other cpus */
+static spin_lock_t klog_lock = SPIN_LOCK_INITIAL_VALUE;
+
+extern char __rodata_start[];
+extern char __rodata_end[];
+
+static uint32_t klog_image_crc32(void) {
+    static uint32_t crc;
+
+    if (!crc)
+        crc = crc32(0, (const void *)__rodata_start, __rodata_end - __rodata_start);
+    return crc;
+}
+
+/*
+ * Finds the next conversion in *fmt, walking its flags the way _printf_engine
+ * does so that both agree on which arguments are taken. On return *spec
+ * points at the conversion's '%' and *fmt just past it.
+ */
+static enum klog_arg klog_next_arg(const char **fmt, const char **spec) {
+    const char *f = *fmt;
+    bool l = false, ll = false, h = false, z = false, j = false, t = false;
+
+    while (*f && *f != '%')
+        f++;
+    *spec = f;
+    if (!*f) {
+        *fmt = f;
+        return KLOG_ARG_END;
+    }
+    f++;
+
+    for (;;) {
+        char c = *f++;
+        switch (c) {
+            case 0:
+                *fmt = f - 1;
+                return KLOG_ARG_NONE;
+            case '0'...'9':
+            case '.':
+            case '-':
+            case '+':
+            case ' ':
+            case '#':
+                continue;
+            case 'l':
+                if (l)
+                    ll = true;
+                l = true;
+                continue;
+            case 'h':
+                h = true;
+                continue;
+            case 'z':
+                z = true;
+                continue;
+            case 'j':
+                j = true;
+                continue;
+            case 't':
+                t = true;
+                continue;
+            case 'c':
+                *fmt = f;
+                return KLOG_ARG_INT;
+            case 's':
+                *fmt = f;
+                return KLOG_ARG_STRING;
+            case 'p':
+                z = true;
+            /* fallthrough */
+            case 'i':
+            case 'd':
+            case 'u':
+            case 'x':
+            case 'X':
+                *fmt = f;
+                return ll ? KLOG_ARG_LONGLONG :
+                       l ? KLOG_ARG_LONG :
+                       h ? KLOG_ARG_INT :
+                       z ? KLOG_ARG_SIZE :
+                       j ? KLOG_ARG_INTMAX :
+                       t ? KLOG_ARG_PTRDIFF :
+                       KLOG_ARG_INT;
+            case 'n':
+#if !WITH_NO_FP
+            case 'f':
+            case 'F':
+            case 'a':
+            case 'A':
+#endif
+                *fmt = f;
+                return KLOG_ARG_UNSUPPORTED;
+            default:
+                *fmt = f;
+                return KLOG_ARG_NONE;
+        }
+    }
+}
+
+static uint32_t klog_used(const struct klog_header *k) {
+    return (k->head >= k->tail) ? k->head - k->tail : k->size - k->tail + k->head;
+}
+
+static void klog_ring_read(const struct klog_header *k, uint32_t off, void *buf, size_t len) {
+    size_t first = MIN(len, k->size - off);
+
+    memcpy(buf, &k->data[off], first);
+    memcpy((uint8_t *)buf + first, &k->data[0], len - first);
+}
+
+/* stores into the ring at off, keeping the data checksum up to date */
+static void klog_ring_write(struct klog_header *k, uint32_t off, const void *buf, size_t len) {
+    const uint8_t *src = buf;
+    uint32_t deltasum = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        deltasum += src[i] - k->data[off];
+        k->data[off] = src[i];
+        if (++off == k->size)
+            off = 0;
+    }
+    k->data_checksum += deltasum;
+}
+
+static void klog_bin_append(struct klog_header *k, struct klog_record *r) {
+    r->time = current_time_hires();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&klog_lock, state);
+
+    if (r->len <= k->size - 4) {
+        /* evict from the tail until it fits */
+        uint32_t used = klog_used(k);
+        while (k->size - 4 - used < r->len) {
+            uint16_t len;
+            klog_ring_read(k, k->tail, &len, sizeof(len));
+            k->tail = (k->tail + len) % k->size;
+            used -= len;
+        }
+
+        klog_ring_write(k, k->head, r, r->len);
+        k->head = (k->head + r->len) % k->size;
+    }
+
+    spin_unlock_irqrestore(&klog_lock, state);
+}
+
+static size_t klog_bin_text(const char *str, size_t len) {
+    struct {
+        struct klog_record r;
+        char text[KLOG_RECORD_MAX - sizeof(struct klog_record)];
+    } rec;
+
+    size_t count = 0;
+    while (count < len) {
+        size_t n = MIN(len - count, sizeof(rec.text));
+        memcpy(rec.text, str + count, n);
+
+        rec.r.type = KLOG_RECORD_TEXT;
+        rec.r.len = ROUNDUP(sizeof(rec.r) + n, 4);
+        rec.r.pad = rec.r.len - sizeof(rec.r) - n;
+        rec.r.format = 0;
+        klog_bin_append(klog, &rec.r);
+
+        count += n;
+    }
+
+    return count;
+}
+
+/* stores the arguments fmt takes, or returns false if it has to be logged as text */
+static bool klog_bin_vprintf(const char *fmt, va_list ap) {
+    if (fmt < __rodata_start || fmt >= __rodata_end)
+        return false;
+
+    union {
+        struct klog_record r;
+        uint8_t buf[KLOG_RECORD_MAX];
+    } rec;
+    size_t pos = sizeof(rec.r);
+    bool stored = false;
+
+    va_list args;
+    va_copy(args, ap);
+
+#define KLOG_STORE_ARG(type) do { \
+        type v = va_arg(args, type); \
+        if (pos + sizeof(v) > sizeof(rec.buf)) \
+            goto done; \
+        memcpy(&rec.buf[pos], &v, sizeof(v)); \
+        pos += ROUNDUP(sizeof(v), 4); \
+    } while (0)
+
+    const char *f = fmt;
+    const char *spec;
+    for (;;) {
+        enum klog_arg arg = klog_next_arg(&f, &spec);
+        switch (arg) {
+            case KLOG_ARG_END:
+                stored = true;
+                goto done;
+            case KLOG_ARG_NONE:
+                break;
+            case KLOG_ARG_INT:
+                KLOG_STORE_ARG(int);
+                break;
+            case KLOG_ARG_LONG:
+                KLOG_STORE_ARG(long);
+                break;
+            case KLOG_ARG_LONGLONG:
+                KLOG_STORE_ARG(long long);
+                break;
+            case KLOG_ARG_SIZE:
+                KLOG_STORE_ARG(size_t);
+                break;
+            case KLOG_ARG_INTMAX:
+                KLOG_STORE_ARG(intmax_t);
+                break;
+            case KLOG_ARG_PTRDIFF:
+                KLOG_STORE_ARG(ptrdiff_t);
+                break;
+            case KLOG_ARG_STRING: {
+                const char *s = va_arg(args, const char *);
+                if (!s)
+                    s = "<null>";
+                size_t len = strlen(s) + 1;
+                if (pos + len > sizeof(rec.buf))
+                    goto done;
+                memcpy(&rec.buf[pos], s, len);
+                pos = ROUNDUP(pos + len, 4);
+                break;
+            }
+            case KLOG_ARG_UNSUPPORTED:
+                goto done;
+        }
+    }
+#undef KLOG_STORE_ARG
+
+done:
+    va_end(args);
+    if (!stored)
+        return false;
+
+    rec.r.type = KLOG_RECORD_FORMAT;
+    rec.r.len = pos;
+    rec.r.pad = 0;
+    rec.r.format = fmt - __rodata_start;
+    klog_bin_append(klog, &rec.r);
+
+    return true;
+}
+
+/* formatted output of one record, timestamping each line it starts */
+struct klog_out {
+    char *buf;
+    size_t len;
+    size_t pos;
+    bool line_start;
+    lk_bigtime_t time;
+};
+
+static void klog_out(struct klog_out *o, const char *str, size_t len) {
+    while (len > 0 && o->pos < o->len) {
+        if (o->line_start) {
+            int n = snprintf(o->buf + o->pos, o->len - o->pos, "[%5llu.%06llu] ",
+                             o->time / 1000000, o->time % 1000000);
+            o->pos = MIN(o->pos + n, o->len);
+            o->line_start = false;
+        }
+
+        const char *nl = memchr(str, '\n', len);
+        size_t n = nl ? (size_t)(nl - str) + 1 : len;
+        size_t copy = MIN(n, o->len - o->pos);
+        memcpy(o->buf + o->pos, str, copy);
+        o->pos += copy;
+        if (nl)
+            o->line_start = true;
+
+        str += n;
+        len -= n;
+    }
+}
+
+/* formats a whole record into buf, returning how much was written */
+static size_t klog_bin_format(const struct klog_record *r, char *buf, size_t len, bool *line_start) {
+    struct klog_out o = {
+        .buf = buf,
+        .len = len,
+        .line_start = *line_start,
+        .time = r->time,
+    };
+    const uint8_t *payload = (const uint8_t *)(r + 1);
+    const uint8_t *end = (const uint8_t *)r + r->len;
+    char tmp[KLOG_RECORD_MAX];
+
+    if (r->type == KLOG_RECORD_TEXT) {
+        klog_out(&o, (const char *)payload, end - payload - MIN(r->pad, 3));
+    } else if (r->type == KLOG_RECORD_FORMAT && r->format < (size_t)(__rodata_end - __rodata_start)) {
+        const char *f = __rodata_start + r->format;
+        const char *literal = f;
+        const char *spec;
+
+#define KLOG_FORMAT_ARG(type) ({ \
+        type v = 0; \
+        if (payload + sizeof(v) <= end) \
+            memcpy(&v, payload, sizeof(v)); \
+        payload += ROUNDUP(sizeof(v), 4); \
+        snprintf(tmp, sizeof(tmp), specbuf, v); \
+    })
+
+        for (;;) {
+            enum klog_arg arg = klog_next_arg(&f, &spec);
+            klog_out(&o, literal, spec - literal);
+            literal = f;
+            if (arg == KLOG_ARG_END)
+                break;
+
+            /* format each conversion on its own with the stored argument */
+            char specbuf[32];
+            size_t speclen = f - spec;
+            if (speclen >= sizeof(specbuf))
+                speclen = sizeof(specbuf) - 1;
+            memcpy(specbuf, spec, speclen);
+            specbuf[speclen] = 0;
+
+            int n;
+            switch (arg) {
+                case KLOG_ARG_INT:
+                    n = KLOG_FORMAT_ARG(int);
+                    break;
+                case KLOG_ARG_LONG:
+                    n = KLOG_FORMAT_ARG(long);
+                    break;
+                case KLOG_ARG_LONGLONG:
+                    n = KLOG_FORMAT_ARG(long long);
+                    break;
+                case KLOG_ARG_SIZE:
+                    n = KLOG_FORMAT_ARG(size_t);
+                    break;
+                case KLOG_ARG_INTMAX:
+                    n = KLOG_FORMAT_ARG(intmax_t);
+                    break;
+                case KLOG_ARG_PTRDIFF:
+                    n = KLOG_FORMAT_ARG(ptrdiff_t);
+                    break;
+                case KLOG_ARG_STRING: {
+                    const char *s = (const char *)payload;
+                    size_t slen = (payload < end) ? strnlen(s, end - payload) : 0;
+                    payload = (const uint8_t *)ROUNDUP((uintptr_t)payload + slen + 1, 4);
+                    n = snprintf(tmp, sizeof(tmp), specbuf, (payload <= end) ? s : "");
+                    break;
+                }
+                default:
+                    n = snprintf(tmp, sizeof(tmp), specbuf, 0);
+                    break;
+            }
+            klog_out(&o, tmp, MIN((size_t)MAX(n, 0), sizeof(tmp) - 1));
+        }
+#undef KLOG_FORMAT_ARG
+    } else {
+        int n = snprintf(tmp, sizeof(tmp), "<format at .rodata+%#x from another image>\n", r->format);
+        klog_out(&o, tmp, n);
+    }
+
+    *line_start = o.line_start;
+    return o.pos;
+}
+
+/* copies out the record at off if it is still in the ring, returning its length */
+static uint32_t klog_bin_fetch(const struct klog_header *k, uint32_t off, struct klog_record *r) {
+    uint32_t len = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&klog_lock, state);
+
+    uint32_t from_tail = (off >= k->tail) ? off - k->tail : k->size - k->tail + off;
+    if (from_tail < klog_used(k)) {
+        klog_ring_read(k, off, r, sizeof(r->len));
+        if (r->len >= sizeof(*r) && r->len <= KLOG_RECORD_MAX) {
+            len = r->len;
+            klog_ring_read(k, off, r, len);
+        }
+    }
+
+    spin_unlock_irqrestore(&klog_lock, state);
+
+    return len;
+}
+
+/*
+ * Formatted text is handed out of a staging buffer, and the record it came
+ * from only leaves the ring once all of it has been read.
+ */
+static struct {
+    const struct klog_header *k;
+    uint32_t tail;      // the record staged
+    bool staged;
+    bool line_start;    // at the start of the staged record
+    bool next_line_start;
+    size_t len;
+    size_t pos;
+    char text[KLOG_LINE_MAX];
+} klog_reader;
+
+static ssize_t klog_bin_read(struct klog_header *k, char *buf, size_t len) {
+    union {
+        struct klog_record r;
+        uint8_t buf[KLOG_RECORD_MAX];
+    } rec;
+    size_t offset = 0;
+
+    if (klog_reader.k != k) {
+        klog_reader.k = k;
+        klog_reader.staged = false;
+        klog_reader.line_start = true;
+    }
+
+    while (offset < len) {
+        /* the staged record may have been evicted by new ones */
+        if (klog_reader.staged && klog_reader.tail != k->tail)
+            klog_reader.staged = false;
+
+        if (!klog_reader.staged) {
+            klog_reader.tail = k->tail;
+            if (!klog_bin_fetch(k, klog_reader.tail, &rec.r))
+                break;
+
+            klog_reader.next_line_start = klog_reader.line_start;
+            klog_reader.len = klog_bin_format(&rec.r, klog_reader.text, sizeof(klog_reader.text),
+                                              &klog_reader.next_line_start);
+            klog_reader.pos = 0;
+            klog_reader.staged = true;
+        }
+
+        size_t n = MIN(len - offset, klog_reader.len - klog_reader.pos);
+        memcpy(buf + offset, klog_reader.text + klog_reader.pos, n);
+        klog_reader.pos += n;
+        offset += n;
+
+        if (klog_reader.pos == klog_reader.len) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&klog_lock, state);
+            if (k->tail == klog_reader.tail) {
+                uint16_t reclen;
+                klog_ring_read(k, k->tail, &reclen, sizeof(reclen));
+                k->tail = (k->tail + reclen) % k->size;
+            }
+            spin_unlock_irqrestore(&klog_lock, state);
+
+            klog_reader.line_start = klog_reader.next_line_start;
+            klog_reader.staged = false;
+        }
+    }
+
+    return offset;
+}
+
+static void klog_bin_dump(const struct klog_header *k) {
+    union {
+        struct klog_record r;
+        uint8_t buf[KLOG_RECORD_MAX];
+    } rec;
+    char text[KLOG_LINE_MAX];
+    bool line_start = true;
+
+    uint32_t off = k->tail;
+    while (off != k->head) {
+        uint32_t len = klog_bin_fetch(k, off, &rec.r);
+        if (!len) {
+            if (off == k->tail)
+                break;
+
+            /* overtaken by the writers, carry on from the oldest record */
+            off = k->tail;
+            continue;
+        }
+
+        size_t n = klog_bin_format(&rec.r, text, sizeof(text), &line_start);
+        for (size_t i = 0; i < n; i++)
+            putchar(text[i]);
+
+        off = (off + len) % k->size;
+    }
+}
+
+/* checks that a recovered log is whole records, marking formats that can't be trusted */
+static status_t klog_bin_recover(struct klog_header *k, bool same_image) {
+    if ((k->head | k->tail) & 3)
+        return ERR_NOT_FOUND;
+
+    uint32_t off = k->tail;
+    uint32_t left = klog_used(k);
+    while (left > 0) {
+        struct klog_record r;
+        if (left < sizeof(r))
+            return ERR_NOT_FOUND;
+        klog_ring_read(k, off, &r, sizeof(r));
+        if (r.len < sizeof(r) || r.len > KLOG_RECORD_MAX || (r.len & 3) || r.len > left)
+            return ERR_NOT_FOUND;
+
+        if (r.type == KLOG_RECORD_FORMAT && !same_image) {
+            uint8_t type = KLOG_RECORD_STALE;
+            klog_ring_write(k, (off + offsetof(struct klog_record, type)) % k->size, &type, 1);
+        } else if (r.type < KLOG_RECORD_TEXT || r.type > KLOG_RECORD_STALE) {
+            return ERR_NOT_FOUND;
+        }
+
+        off = (off + r.len) % k->size;
+        left -= r.len;
+    }
+
+    return NO_ERROR;
+}
+
 ssize_t klog_read(char *buf, size_t len, int buf_id) {
     size_t offset = 0;
     size_t tmp_len;
@@ -267,6 +865,12 @@ ssize_t klog_read(char *buf, size_t len, int buf_id) {
     DEBUG_ASSERT(klog);
     DEBUG_ASSERT(klog->magic == KLOG_HEADER_MAGIC);
 
+    if (klog_binary()) {
+        if (buf_id >= 0 && (uint)buf_id >= klog_buf->log_count)
+            return ERR_INVALID_ARGS;
+        return klog_bin_read((buf_id < 0) ? klog : find_nth_log(buf_id), buf, len);
+    }
+
     /* If a klog wraps around at the end then it becomes two iovecs with
      * tail being the start of 1 and head being the end of 0. This means we
      * need to check where we are in the overall klog to properly determine
@@ -318,6 +922,9 @@ static size_t klog_puts_len(const char *str, size_t len) {
     DEBUG_ASSERT(klog);
     DEBUG_ASSERT(klog->magic == KLOG_HEADER_MAGIC);
 
+    if (klog_binary())
+        return klog_bin_text(str, strnlen(str, len));
+
     LTRACEF("before write head %u tail %u size %u\n", klog->head, klog->tail, klog->size);
     uint32_t deltasum = 0;
     size_t count = 0;
@@ -379,7 +986,7 @@ void klog_printf(const char *fmt, ...) {
 
     va_list ap;
     va_start(ap, fmt);
-    _printf_engine(&_klog_output_func, NULL, fmt, ap);
+    klog_vprintf(fmt, ap);
     va_end(ap);
 }
 
@@ -387,6 +994,9 @@ void klog_vprintf(const char *fmt, va_list ap) {
     if (!klog_buf)
         return;
 
+    if (klog_binary() && klog_bin_vprintf(fmt, ap))
+        return;
+
     _printf_engine(&_klog_output_func, NULL, fmt, ap);
 }
 
@@ -429,6 +1039,13 @@ int klog_get_buffer(int buffer, iovec_t *vec) {
 void klog_dump(int buffer) {
     iovec_t vec[2];
 
+    if (klog_buf && klog_binary()) {
+        if (buffer >= 0 && (uint)buffer >= klog_buf->log_count)
+            return;
+        klog_bin_dump((buffer < 0) ? klog : find_nth_log(buffer));
+        return;
+    }
+
     int err = klog_get_buffer(buffer, vec);
     if (err <= 0)
         return;
@@ -455,7 +1072,7 @@ static int cmd_klog(int argc, const console_cmd_args *argv) {
 notenoughargs:
         printf("ERROR not enough arguments\n");
 usage:
-        printf("usage: %s create <size> <count>\n", argv[0].str);
+        printf("usage: %s create <size> <count> [binary]\n", argv[0].str);
 #if KLOG_RETENTION_TEST
         printf("usage: %s createret \n", argv[0].str);
         printf("usage: %s recoverret \n", argv[0].str);
@@ -477,13 +1094,16 @@ usage:
 
         uint size = argv[2].u;
         uint count = argv[3].u;
+        uint flags = KLOG_BINARY ? KLOG_FLAG_BINARY : 0;
+        if (argc >= 5 && !strcmp(argv[4].str, "binary"))
+            flags = KLOG_FLAG_BINARY;
 
         void *ptr = malloc(size);
         if (!ptr) {
             printf("error allocating memory for klog\n");
             return -1;
         }
-        err = klog_create(ptr, size, count);
+        err = klog_create_etc(ptr, size, count, flags);
         printf("klog_create returns %d\n", err);
         if (err < 0)
             free(ptr);
@@ -539,6 +1159,8 @@ usage:
         klog_printf("a plain string\n");
         klog_printf("numbers: %d %d %d %u\n", 1, 2, 3, 99);
         klog_printf("strings: '%s' '%s'\n", "a little string", "another one");
+        klog_printf("wide: %#llx %zu %ld %-5d| %5s|\n", 0x123456789abcdefull, sizeof(struct klog_header),
+                    -1l, -7, "ab");
     } else if (!strcmp(argv[1].str, "dump")) {
         int buffer = -1;
 
@@ -5,6 +5,10 @@ MODULE := $(LOCAL_DIR)
 MODULE_DEPS := \
     lib/cksum
 
+KLOG_BINARY ?= 0
+
+MODULE_DEFINES += KLOG_BINARY=$(KLOG_BINARY)
+
 MODULE_SRCS := \
 	$(LOCAL_DIR)/klog.c \
 
@@ -11,6 +11,7 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <platform/debug.h>
 
@@ -24,6 +25,11 @@
 #define FLOAT_PRINTF 1
 #endif
 
+/* bytes the engine gathers on the stack before calling its output routine */
+#ifndef PRINTF_OUT_BUFFER_LEN
+#define PRINTF_OUT_BUFFER_LEN 128
+#endif
+
 int sprintf(char *str, const char *fmt, ...) {
     int err;
 
@@ -59,19 +65,15 @@ struct _output_args {
 static int _vsnprintf_output(const char *str, size_t len, void *state) {
     struct _output_args *args = state;
 
-    size_t count = 0;
-    while (count < len) {
-        if (args->pos < args->len) {
-            args->outstr[args->pos++] = *str;
-        }
-
-        str++;
-        count++;
+    if (args->pos < args->len) {
+        size_t count = MIN(len, args->len - args->pos);
+        memcpy(&args->outstr[args->pos], str, count);
+        args->pos += count;
     }
 
     // Return the count of the number of bytes that would be written even if the buffer
     // wasn't large enough.
-    return (int)count;
+    return (int)len;
 }
 
 int vsnprintf(char *str, size_t len, const char *fmt, va_list ap) {
@@ -139,6 +141,19 @@ int vprintf(const char *fmt, va_list ap) {
 #define LEADZEROFLAG   0x00001000
 #define BLANKPOSFLAG   0x00002000
 
+/* pairs of decimal digits, so the conversion below divides half as often */
+static const char decimal_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
 __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, size_t len, uint flag, char *signchar) {
     size_t pos = len;
     bool negative = false;
@@ -150,15 +165,31 @@ __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, siz
 
     buf[--pos] = 0;
 
-    /* only do the math if the number is >= 10 */
-    while (n >= 10) {
+    /* 64 bit division is a libgcc call on 32 bit cpus, so only do the
+     * digits that need it that way */
+    while (n > ULONG_MAX) {
         unsigned int digit = n % 10;
 
         n /= 10;
 
         buf[--pos] = (char)digit + '0';
     }
-    buf[--pos] = (char)n + '0';
+
+    unsigned long u = n;
+    while (u >= 100) {
+        unsigned long pair = u % 100;
+
+        u /= 100;
+
+        buf[--pos] = decimal_pairs[pair * 2 + 1];
+        buf[--pos] = decimal_pairs[pair * 2];
+    }
+    if (u >= 10) {
+        buf[--pos] = decimal_pairs[u * 2 + 1];
+        buf[--pos] = decimal_pairs[u * 2];
+    } else {
+        buf[--pos] = (char)u + '0';
+    }
 
     if (negative) {
         *signchar = '-';
@@ -182,10 +213,8 @@ __NO_INLINE static char *longlong_to_hexstring(char *buf, unsigned long long u,
 
     buf[--pos] = 0;
     do {
-        unsigned int digit = u % 16;
-        u /= 16;
-
-        buf[--pos] = table[digit];
+        buf[--pos] = table[u & 0xf];
+        u >>= 4;
     } while (u != 0);
 
     return &buf[pos];
@@ -432,8 +461,40 @@ int _printf_engine(_printf_engine_output_func out, void *state, const char *fmt,
     size_t chars_written = 0;
     char num_buffer[32];
 
-#define OUTPUT_STRING(str, len) do { err = out(str, len, state); if (err < 0) { goto exit; } else { chars_written += err; } } while(0)
-#define OUTPUT_CHAR(c) do { char __temp[1] = { c }; OUTPUT_STRING(__temp, 1); } while (0)
+    /* output is gathered here and handed on in as few calls as possible,
+     * instead of a call for every literal run, field and pad character */
+    char out_buffer[PRINTF_OUT_BUFFER_LEN];
+    size_t out_pos = 0;
+
+#define FLUSH_OUTPUT() \
+    do { \
+        if (out_pos > 0) { \
+            err = out(out_buffer, out_pos, state); \
+            out_pos = 0; \
+            if (err < 0) { goto exit; } else { chars_written += err; } \
+        } \
+    } while (0)
+#define OUTPUT_STRING(str, len) \
+    do { \
+        size_t __len = (len); \
+        if (out_pos + __len > sizeof(out_buffer)) { \
+            FLUSH_OUTPUT(); \
+        } \
+        if (__len > sizeof(out_buffer)) { \
+            err = out(str, __len, state); \
+            if (err < 0) { goto exit; } else { chars_written += err; } \
+        } else { \
+            memcpy(&out_buffer[out_pos], (str), __len); \
+            out_pos += __len; \
+        } \
+    } while (0)
+#define OUTPUT_CHAR(c) \
+    do { \
+        if (out_pos == sizeof(out_buffer)) { \
+            FLUSH_OUTPUT(); \
+        } \
+        out_buffer[out_pos++] = (c); \
+    } while (0)
 
     for (;;) {
         /* reset the format state */
@@ -569,6 +630,7 @@ hex:
 
                 goto _output_string;
             case 'n':
+                FLUSH_OUTPUT();
                 ptr = va_arg(ap, void *);
                 if (flags & LONGLONGFLAG)
                     *(long long *)ptr = chars_written;
@@ -616,8 +678,12 @@ _output_string:
 
         if (flags & LEFTFORMATFLAG) {
             /* left justify the text */
+            size_t written = string_len;
+            if (signchar != '\0') {
+                OUTPUT_CHAR(signchar);
+                written++;
+            }
             OUTPUT_STRING(s, string_len);
-            uint written = err;
 
             /* pad to the right (if necessary) */
             for (; format_num > written; format_num--)
@@ -658,6 +724,9 @@ _output_string:
         }
     }
 
+    FLUSH_OUTPUT();
+
+#undef FLUSH_OUTPUT
 #undef OUTPUT_STRING
 #undef OUTPUT_CHAR
 
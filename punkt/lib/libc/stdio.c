@@ -59,6 +59,10 @@ FILE *fopen(const char *filename, const char *mode) {
         return NULL;
     }
 
+    if (strchr(mode, 'w')) {
+        fs_truncate_file(stream->fs_handle.handle, 0);
+    }
+
     if (strchr(mode, 'a')) {
         struct file_stat stat;
         if (NO_ERROR == fs_stat_file(stream->fs_handle.handle, &stat)) {
@@ -73,7 +77,7 @@ FILE *fopen(const char *filename, const char *mode) {
 
 int fclose(FILE *stream) {
 #if defined(WITH_LIB_FS)
-    if (stream && !stream->use_fs) {
+    if (stream && stream->use_fs) {
         fs_close_file(stream->fs_handle.handle);
         free(stream);
     }
@@ -1,11 +1,13 @@
 LOCAL_DIR := $(GET_LOCAL_DIR)
 
-ASM_STRING_OPS := #bcopy bzero memcpy memmove memset
+ifeq ($(SUBARCH),x86-64)
+
+ASM_STRING_OPS := bcopy bzero memcpy memmove memset
 
 MODULE_SRCS += \
-	#$(LOCAL_DIR)/memcpy.S \
-	#$(LOCAL_DIR)/memset.S
+	$(LIBC_STRING_C_DIR)/arch/x86-64/memcpy.S \
+	$(LIBC_STRING_C_DIR)/arch/x86-64/memset.S
 
 # filter out the C implementation
 C_STRING_OPS := $(filter-out $(ASM_STRING_OPS),$(C_STRING_OPS))
-
+endif
@@ -12,18 +12,29 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "wordops.h"
+
 void *
 memchr(void const *buf, int c, size_t len) {
-    size_t i;
-    unsigned char const *b= buf;
-    unsigned char        x= (c&0xff);
+    unsigned char const *b = buf;
+    unsigned char        x = (c&0xff);
+
+    for (; len > 0 && !word_aligned(b); b++, len--) {
+        if (*b == x)
+            return (void *)b;
+    }
 
-    for (i= 0; i< len; i++) {
-        if (b[i]== x) {
-            return (void *)(b+i);
-        }
+    // a byte matches where the word xor the pattern has a zero byte
+    word_t pattern = word_splat(x);
+    for (; len >= WORD_SIZE; b += WORD_SIZE, len -= WORD_SIZE) {
+        if (word_has_zero(*(const word_t *)b ^ pattern))
+            break;
+    }
+
+    for (; len > 0; b++, len--) {
+        if (*b == x)
+            return (void *)b;
     }
 
     return NULL;
 }
-
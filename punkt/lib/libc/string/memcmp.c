@@ -12,13 +12,29 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "wordops.h"
+
 int
 memcmp(const void *cs, const void *ct, size_t count) {
-    const unsigned char *su1, *su2;
-    signed char res = 0;
+    const unsigned char *su1 = cs, *su2 = ct;
+
+    // a word at a time while the two are aligned alike, up to the first word
+    // that differs
+    if (count >= WORD_SIZE && (((uintptr_t)su1 ^ (uintptr_t)su2) & WORD_MASK) == 0) {
+        for (; !word_aligned(su1); ++su1, ++su2, count--) {
+            if (*su1 != *su2)
+                return *su1 - *su2;
+        }
+        for (; count >= WORD_SIZE; su1 += WORD_SIZE, su2 += WORD_SIZE, count -= WORD_SIZE) {
+            if (*(const word_t *)su1 != *(const word_t *)su2)
+                break;
+        }
+    }
+
+    for (; count > 0; ++su1, ++su2, count--) {
+        if (*su1 != *su2)
+            return *su1 - *su2;
+    }
 
-    for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
-        if ((res = *su1 - *su2) != 0)
-            break;
-    return res;
+    return 0;
 }
@@ -12,14 +12,33 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "wordops.h"
+
 int
 strcmp(char const *cs, char const *ct) {
-    signed char __res;
+    const unsigned char *s1 = (const unsigned char *)cs;
+    const unsigned char *s2 = (const unsigned char *)ct;
+
+    // a word at a time while the two are aligned alike, up to the first word
+    // that differs or holds the terminator
+    if ((((uintptr_t)s1 ^ (uintptr_t)s2) & WORD_MASK) == 0) {
+        for (; !word_aligned(s1); s1++, s2++) {
+            if (*s1 != *s2 || !*s1)
+                return *s1 - *s2;
+        }
 
-    while (1) {
-        if ((__res = *cs - *ct++) != 0 || !*cs++)
-            break;
+        const word_t *w1 = (const word_t *)s1;
+        const word_t *w2 = (const word_t *)s2;
+        while (*w1 == *w2 && !word_has_zero(*w1)) {
+            w1++;
+            w2++;
+        }
+        s1 = (const unsigned char *)w1;
+        s2 = (const unsigned char *)w2;
     }
 
-    return __res;
+    for (; *s1 == *s2 && *s1; s1++, s2++)
+        ;
+
+    return *s1 - *s2;
 }
@@ -12,14 +12,25 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "wordops.h"
+
 size_t
 strlen(char const *s) {
-    size_t i;
+    const char *p = s;
 
-    i= 0;
-    while (s[i]) {
-        i+= 1;
+    // bytes up to a word boundary
+    for (; !word_aligned(p); p++) {
+        if (!*p)
+            return p - s;
     }
 
-    return i;
+    // whole words until one holds the terminator
+    const word_t *w = (const word_t *)p;
+    while (!word_has_zero(*w))
+        w++;
+
+    for (p = (const char *)w; *p; p++)
+        ;
+
+    return p - s;
 }
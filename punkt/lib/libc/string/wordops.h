@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Helpers for the string routines that scan a word at a time.
+ *
+ * Aligned word loads never cross a page, so reading the whole word holding
+ * the end of a string or buffer is safe even though some of it lies past the
+ * end.
+ */
+typedef unsigned long __attribute__((__may_alias__)) word_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_MASK (WORD_SIZE - 1)
+
+#define WORD_ONES ((word_t)-1 / 0xff) // 0x01 in every byte
+#define WORD_HIGHS (WORD_ONES * 0x80) // 0x80 in every byte
+
+/* nonzero if any byte of w is zero */
+static inline word_t word_has_zero(word_t w) {
+    return (w - WORD_ONES) & ~w & WORD_HIGHS;
+}
+
+/* c in every byte of a word */
+static inline word_t word_splat(unsigned char c) {
+    return WORD_ONES * c;
+}
+
+static inline int word_aligned(const void *p) {
+    return ((uintptr_t)p & WORD_MASK) == 0;
+}
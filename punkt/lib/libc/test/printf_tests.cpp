@@ -180,6 +180,8 @@ bool formatting() {
   EXPECT_TRUE(test_printf("      test", "%010s", "test"));
   EXPECT_TRUE(test_printf("test      ", "%-10s", "test"));
   EXPECT_TRUE(test_printf("test      ", "%-010s", "test"));
+  EXPECT_TRUE(test_printf("a-12345678 a", "a%-10da", -12345678));
+  EXPECT_TRUE(test_printf("a+2  a", "a%-+4da", 2));
 
   END_TEST;
 }
@@ -139,7 +139,7 @@ int arp_send_request(uint32_t addr) {
     minip_get_macaddr(arp->sha);
     mac_addr_copy(arp->tha, bcast_mac);
 
-    minip_tx_handler(minip_tx_arg, p);
+    minip_tx_driver(p);
     return 0;
 }
 
@@ -156,6 +156,10 @@ const uint8_t *arp_get_dest_mac(uint32_t host) {
         return bcast_mac;
     }
 
+    if (minip_is_local_addr(host)) {
+        return minip_local_mac();
+    }
+
     dst_mac = arp_cache_lookup(host);
     if (dst_mac == NULL) {
         arp_send_request(host);
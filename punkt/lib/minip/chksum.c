@@ -8,42 +8,130 @@
 
 #include "minip-internal.h"
 
-/* XXX alternate implementation, merge */
-uint16_t ones_sum16(uint32_t sum, const void *_buf, int len) {
-    const uint16_t *buf = _buf;
+/*
+ * The ones complement sum is endian and word size neutral, so the buffer is summed
+ * 32 bits at a time into a 64 bit accumulator and folded down to 16 bits once at
+ * the end. The accumulator can't overflow for anything shorter than 16GB.
+ *
+ * Words are loaded with memcpy, which is a plain load on machines that don't mind
+ * misalignment, and keeps the pairing of bytes relative to the start of the buffer.
+ */
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline uint16_t fold64(uint64_t acc) {
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffff) + (acc >> 16);
+    acc = (acc & 0xffff) + (acc >> 16);
+    acc = (acc & 0xffff) + (acc >> 16);
+    return acc;
+}
+
+/* a trailing odd byte is the first half of a zero padded word */
+static inline uint16_t odd_byte(uint8_t b) {
+    uint8_t w[2] = { b, 0 };
+    uint16_t v;
+    memcpy(&v, w, sizeof(v));
+    return v;
+}
 
-    while (len >= 2) {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xffff) + (sum >> 16);
+uint16_t ones_sum16(uint32_t sum, const void *_buf, int len) {
+    const uint8_t *buf = _buf;
+    uint64_t acc = sum;
+
+    while (len >= 32) {
+        acc += load32(buf);
+        acc += load32(buf + 4);
+        acc += load32(buf + 8);
+        acc += load32(buf + 12);
+        acc += load32(buf + 16);
+        acc += load32(buf + 20);
+        acc += load32(buf + 24);
+        acc += load32(buf + 28);
+        buf += 32;
+        len -= 32;
+    }
+    while (len >= 4) {
+        acc += load32(buf);
+        buf += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, buf, sizeof(w));
+        acc += w;
+        buf += 2;
         len -= 2;
     }
-
     if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
-        sum += temp;
+        acc += odd_byte(*buf);
     }
 
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
-
-    return sum;
+    return fold64(acc);
 }
 
-uint16_t rfc1701_chksum(const uint8_t *buf, size_t len) {
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    const uint16_t *p = (const uint16_t *) buf;
-
-    // Length is in bytes
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
+uint16_t ones_sum16_copy(void *_dst, const void *_src, size_t len) {
+    uint8_t *dst = _dst;
+    const uint8_t *src = _src;
+    uint64_t acc = 0;
+
+    while (len >= 16) {
+        uint32_t w0 = load32(src);
+        uint32_t w1 = load32(src + 4);
+        uint32_t w2 = load32(src + 8);
+        uint32_t w3 = load32(src + 12);
+        memcpy(dst, &w0, 4);
+        memcpy(dst + 4, &w1, 4);
+        memcpy(dst + 8, &w2, 4);
+        memcpy(dst + 12, &w3, 4);
+        acc += w0;
+        acc += w1;
+        acc += w2;
+        acc += w3;
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        uint32_t w = load32(src);
+        memcpy(dst, &w, 4);
+        acc += w;
+        src += 4;
+        dst += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, src, sizeof(w));
+        memcpy(dst, &w, sizeof(w));
+        acc += w;
+        src += 2;
+        dst += 2;
+        len -= 2;
+    }
+    if (len) {
+        *dst = *src;
+        acc += odd_byte(*src);
     }
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+    return fold64(acc);
+}
 
-    return chksum;
+uint16_t ones_sum16_add(uint16_t a, uint16_t b, bool odd) {
+    /* a sum that starts on an odd byte has its halves the other way around */
+    if (odd)
+        b = (uint16_t)((b << 8) | (b >> 8));
+
+    uint32_t sum = (uint32_t)a + b;
+    return (sum & 0xffff) + (sum >> 16);
+}
+
+uint16_t rfc1701_chksum(const uint8_t *buf, size_t len) {
+    return ~ones_sum16(0, buf, len);
 }
 
 #if MINIP_USE_UDP_CHECKSUM
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "minip-internal.h"
+
+#include <assert.h>
+#include <lk/debug.h>
+#include <lk/trace.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Software receive offload for bulk tcp. Back to back segments of one flow
+ * are chained into the first as frags, with its ip length grown to cover
+ * them, so tcp_input looks up the socket, takes its lock and acks once for
+ * the lot. Only segments the nic has already checked the tcp sum of are
+ * merged, since the merged packet goes up without a valid one.
+ */
+
+/* the merged packet still has to fit the 16 bit ip length */
+#define GRO_MAX_IP_LEN 0xffff
+
+/* return the tcp header of p if it is a plain data segment gro could merge,
+ * filling in the length of its payload */
+static tcp_header_t *gro_tcp_header(pktbuf_t *p, uint32_t *payload) {
+    if (p->nfrags || !(p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD))
+        return NULL;
+    if (p->dlen < sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr) + sizeof(tcp_header_t))
+        return NULL;
+
+    const struct eth_hdr *eth = (const struct eth_hdr *)p->data;
+    if (eth->type != htons(ETH_TYPE_IPV4))
+        return NULL;
+
+    /* no ip options or fragments */
+    struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+    if (ip->ver_ihl != 0x45 || ip->proto != IP_PROTO_TCP || (ntohs(ip->flags_frags) & 0x3fff))
+        return NULL;
+
+    uint32_t ip_len = ntohs(ip->len);
+    if (ip_len > p->dlen - sizeof(struct eth_hdr))
+        return NULL;
+
+    tcp_header_t *tcp = (tcp_header_t *)(ip + 1);
+    uint16_t length_flags = ntohs(tcp->length_flags);
+    uint32_t header_len = sizeof(struct ipv4_hdr) + (length_flags >> 12) * 4;
+    if (header_len < sizeof(struct ipv4_hdr) + sizeof(tcp_header_t) || header_len >= ip_len)
+        return NULL;
+    if ((length_flags & 0x3f & ~PKT_PSH) != PKT_ACK)
+        return NULL;
+
+    /* the header gets reused for the whole packet, so it has to check out */
+    if (!(p->flags & PKTBUF_FLAG_CKSUM_IP_GOOD) && rfc1701_chksum((const uint8_t *)ip, sizeof(*ip)) != 0)
+        return NULL;
+
+    *payload = ip_len - header_len;
+    return tcp;
+}
+
+static struct ipv4_hdr *gro_ip_header(pktbuf_t *p) {
+    return (struct ipv4_hdr *)(p->data + sizeof(struct eth_hdr));
+}
+
+void minip_gro_init(minip_gro_t *g) {
+    memset(g, 0, sizeof(*g));
+}
+
+void minip_gro_flush(minip_gro_t *g) {
+    pktbuf_t *head = g->head;
+    if (!head)
+        return;
+
+    LTRACEF("head %p, %u frags\n", head, head->nfrags);
+
+    g->head = NULL;
+    minip_rx_driver_callback(head);
+    pktbuf_free(head, true);
+}
+
+/* try to chain p onto the held packet */
+static bool gro_merge(minip_gro_t *g, pktbuf_t *p, tcp_header_t *tcp, uint32_t payload) {
+    pktbuf_t *head = g->head;
+    struct ipv4_hdr *hip = gro_ip_header(head);
+    tcp_header_t *htcp = (tcp_header_t *)(hip + 1);
+    struct ipv4_hdr *ip = (struct ipv4_hdr *)((uint8_t *)tcp - sizeof(struct ipv4_hdr));
+
+    /* same flow, picking up right where the last segment left off */
+    if (ip->src_addr != hip->src_addr || ip->dst_addr != hip->dst_addr ||
+            tcp->source_port != htcp->source_port || tcp->dest_port != htcp->dest_port ||
+            ntohl(tcp->seq_num) != g->next_seq)
+        return false;
+
+    /* and saying the same thing, down to the options */
+    size_t header_len = (ntohs(htcp->length_flags) >> 12) * 4;
+    if (tcp->length_flags != htcp->length_flags && (tcp->length_flags ^ htcp->length_flags) != htons(PKT_PSH))
+        return false;
+    if (tcp->ack_num != htcp->ack_num || tcp->win_size != htcp->win_size ||
+            memcmp(tcp + 1, htcp + 1, header_len - sizeof(tcp_header_t)) != 0)
+        return false;
+
+    /* a short segment ends what the sender had */
+    if (payload > g->seg_len || g->last_len < g->seg_len)
+        return false;
+    if (head->nfrags == PKTBUF_MAX_FRAGS || ntohs(hip->len) + payload > GRO_MAX_IP_LEN)
+        return false;
+
+    pktbuf_t *q = pktbuf_detach(p);
+    if (!q)
+        return false;
+
+    /* keep just the payload of it */
+    pktbuf_consume(q, sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr) + header_len);
+    pktbuf_consume_tail(q, q->dlen - payload);
+    pktbuf_add_frag(head, q);
+
+    hip->len = htons(ntohs(hip->len) + payload);
+    htcp->length_flags |= tcp->length_flags;
+    g->next_seq += payload;
+    g->last_len = payload;
+
+    LTRACEF("merged %u bytes, %u frags\n", payload, head->nfrags);
+
+    return true;
+}
+
+void minip_gro_receive(minip_gro_t *g, pktbuf_t *p) {
+    DEBUG_ASSERT(g && p);
+
+    uint32_t payload;
+    tcp_header_t *tcp = gro_tcp_header(p, &payload);
+    if (!tcp) {
+        /* keep everything in order behind what is held */
+        minip_gro_flush(g);
+        minip_rx_driver_callback(p);
+        return;
+    }
+
+    if (g->head && gro_merge(g, p, tcp, payload)) {
+        if (tcp->length_flags & htons(PKT_PSH))
+            minip_gro_flush(g);
+        return;
+    }
+
+    minip_gro_flush(g);
+
+    /* start a new packet off p, unless it is the last of a burst already */
+    pktbuf_t *q = NULL;
+    if (!(tcp->length_flags & htons(PKT_PSH)))
+        q = pktbuf_detach(p);
+    if (!q) {
+        minip_rx_driver_callback(p);
+        return;
+    }
+
+    /* trim any ethernet padding, the ip length is about to grow past dlen */
+    struct ipv4_hdr *ip = gro_ip_header(q);
+    pktbuf_consume_tail(q, q->dlen - sizeof(struct eth_hdr) - ntohs(ip->len));
+    q->flags |= PKTBUF_FLAG_CKSUM_IP_GOOD;
+
+    g->head = q;
+    g->next_seq = ntohl(tcp->seq_num) + payload;
+    g->seg_len = payload;
+    g->last_len = payload;
+}
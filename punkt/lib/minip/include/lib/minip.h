@@ -23,7 +23,18 @@ __BEGIN_CDECLS
 #define IPV4_PACK(a) (a[3] << 24 | a[2] << 16 | a[1] << 8 | a[0])
 #define IPV4_BCAST (0xFFFFFFFF)
 #define IPV4_NONE (0)
+#define IPV4_LOOPBACK IPV4(127, 0, 0, 1)
 
+/* 127.0.0.0/8, turned around by the loopback interface */
+static inline bool ipv4_is_loopback(uint32_t addr) {
+    return (addr & 0xff) == 127;
+}
+
+/* the driver is handed one reference to p, which it drops with pktbuf_free once
+ * sent. tcp may hold another while p sits on its send queue, so p->data, p->dlen
+ * and p->flags are only stable during the call and p->list is off limits while p
+ * is shared. The same goes for the frags of p, which only show up on packets of
+ * an offload the driver asked for. */
 typedef int (*tx_func_t)(void *arg, pktbuf_t *p);
 typedef void (*udp_callback_t)(void *data, size_t len,
                                uint32_t srcaddr, uint16_t srcport, void *arg);
@@ -40,6 +51,13 @@ void minip_start_dhcp(void);
 /* ethernet driver install hook */
 void minip_set_eth(tx_func_t tx_handler, void *tx_arg, const uint8_t *macaddr);
 
+/* work the ethernet driver can finish for the stack on transmit */
+#define MINIP_OFFLOAD_TX_TCP_CKSUM  (1<<0) // completes PKTBUF_FLAG_CKSUM_TCP_PARTIAL packets
+#define MINIP_OFFLOAD_TX_TCP_TSO    (1<<1) // segments PKTBUF_FLAG_GSO_TCP packets of up to 64K
+
+void minip_set_eth_offloads(uint32_t offloads);
+uint32_t minip_get_eth_offloads(void);
+
 /* check or wait for minip to be configured */
 bool minip_is_configured(void);
 status_t minip_wait_for_configured(lk_time_t timeout);
@@ -47,6 +65,22 @@ status_t minip_wait_for_configured(lk_time_t timeout);
 /* packet rx hook to hand to ethernet driver */
 void minip_rx_driver_callback(pktbuf_t *p);
 
+/* generic receive offload. A driver draining a batch of received packets may pass
+ * them through minip_gro_receive instead of minip_rx_driver_callback, which holds
+ * back in order tcp segments of a flow and hands them up as one packet once a
+ * segment doesn't fit on, or at minip_gro_flush after the last of the batch. As
+ * with minip_rx_driver_callback p is the driver's again on return. */
+typedef struct minip_gro {
+    pktbuf_t *head;    // the packet being built up, or NULL
+    uint32_t next_seq; // where the next segment of the flow has to start
+    uint32_t seg_len;  // payload of the first segment, none after it may be longer
+    uint32_t last_len; // payload of the last segment merged
+} minip_gro_t;
+
+void minip_gro_init(minip_gro_t *g);
+void minip_gro_receive(minip_gro_t *g, pktbuf_t *p);
+void minip_gro_flush(minip_gro_t *g);
+
 /* global configuration state */
 void minip_get_macaddr(uint8_t *addr);
 void minip_set_macaddr(const uint8_t *addr);
@@ -75,11 +109,28 @@ status_t udp_close(udp_socket_t *handle);
 typedef struct tcp_socket tcp_socket_t;
 
 status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port);
+/* as tcp_connect, with buffer sizes in bytes, 0 for the default */
+status_t tcp_connect_etc(tcp_socket_t **handle, uint32_t addr, uint16_t port, size_t rx_size, size_t tx_size);
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port);
+/* buffer sizes for connections accepted on a listening socket, 0 keeps the default */
+status_t tcp_set_buffer_sizes(tcp_socket_t *listen_socket, size_t rx_size, size_t tx_size);
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout);
 status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
+/* zero copy variants. tcp_read_pktbuf returns the next received pktbuf, trimmed
+ * to its payload, for the caller to pktbuf_free. tcp_write_pktbuf queues a pktbuf
+ * from pktbuf_alloc holding up to one mss of payload to be sent as is, copying
+ * anything else. It takes ownership of p either way. Both return the byte count. */
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p);
+ssize_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p);
+#if WITH_LIB_FS
+/* send len bytes of a lib/fs file from offset on, or up to its end. The data is
+ * read straight into buffers the tx queue sends out of in place, with the nic or
+ * the copy into a frame working out the checksum. Returns the byte count. */
+struct filehandle;
+ssize_t tcp_sendfile(tcp_socket_t *socket, struct filehandle *handle, off_t offset, size_t len);
+#endif
 
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket) {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
@@ -15,29 +15,47 @@ __BEGIN_CDECLS
 
 /* PAGE_SIZE minus 16 bytes of metadata in pktbuf_buf */
 #ifndef PKTBUF_POOL_SIZE
-#define PKTBUF_POOL_SIZE 256
+#define PKTBUF_POOL_SIZE 512
+#endif
+
+/* the pool grows by PKTBUF_POOL_GROW entries when it runs out, up to PKTBUF_POOL_MAX */
+#ifndef PKTBUF_POOL_MAX
+#define PKTBUF_POOL_MAX (PKTBUF_POOL_SIZE * 4)
+#endif
+#ifndef PKTBUF_POOL_GROW
+#define PKTBUF_POOL_GROW 128
 #endif
 
 #ifndef PKTBUF_SIZE
 #define PKTBUF_SIZE     1536
 #endif
 
-/* How much space pktbuf_alloc should save for IP headers in the front of the buffer */
-#define PKTBUF_MAX_HDR  64
+/* How much space pktbuf_alloc should save for IP headers in the front of the buffer,
+ * enough for ethernet + ip + tcp with the timestamp option */
+#define PKTBUF_MAX_HDR  72
 /* The remaining space in the buffer */
 #define PKTBUF_MAX_DATA (PKTBUF_SIZE - PKTBUF_MAX_HDR)
 
+/* Most pktbufs a packet may continue into, enough for 64K of tcp payload */
+#define PKTBUF_MAX_FRAGS 48
+
 typedef void (*pktbuf_free_callback)(void *buf, void *arg);
 typedef struct pktbuf {
     u8 *data;
     u32 blen;
     u32 dlen;
     paddr_t phys_base;
-    struct list_node list;
+    struct list_node list; // only usable by the holder of the last reference
     u32 flags;
+    u16 csum; // ones complement sum of the data, if PKTBUF_FLAG_DATA_CSUM
+    volatile int ref;
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
+    u16 gso_size; // tx: payload per segment, if PKTBUF_FLAG_GSO_TCP
+    u16 nfrags;
+    // the packet continues in these, each holding a reference dropped along with p
+    struct pktbuf *frags[PKTBUF_MAX_FRAGS];
 } pktbuf_t;
 
 typedef struct pktbuf_pool_object {
@@ -47,17 +65,40 @@ typedef struct pktbuf_pool_object {
     };
 } pktbuf_pool_object_t;
 
+/* rx: the nic has verified these checksums */
 #define PKTBUF_FLAG_CKSUM_IP_GOOD  (1<<0)
 #define PKTBUF_FLAG_CKSUM_TCP_GOOD (1<<1)
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
 #define PKTBUF_FLAG_EOF            (1<<3)
 #define PKTBUF_FLAG_CACHED         (1<<4)
+/* tx: the tcp checksum field holds the pseudo header sum, for the nic to finish */
+#define PKTBUF_FLAG_CKSUM_TCP_PARTIAL (1<<5)
+/* csum is valid for data/dlen, cleared by anything but _append_data_csum */
+#define PKTBUF_FLAG_DATA_CSUM      (1<<6)
+/* tx: a tcp packet for the nic to cut into gso_size segments, implies _CKSUM_TCP_PARTIAL */
+#define PKTBUF_FLAG_GSO_TCP        (1<<7)
+/* rx: sent by this host and turned around by the loopback interface */
+#define PKTBUF_FLAG_LOOPBACK       (1<<8)
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p) {
     return p->phys_base + (p->data - p->buffer);
 }
 
+// true if more than one party holds a reference to the pktbuf, in which
+// case neither the buffer contents nor the list node may be touched
+static inline bool pktbuf_is_shared(pktbuf_t *p) {
+    return p->ref > 1;
+}
+
+// length of the whole packet, p and its frags
+static inline u32 pktbuf_total_len(pktbuf_t *p) {
+    u32 len = p->dlen;
+    for (uint i = 0; i < p->nfrags; i++)
+        len += p->frags[i]->dlen;
+    return len;
+}
+
 // number of bytes available for _prepend
 static inline u32 pktbuf_avail_head(pktbuf_t *p) {
     return p->data - p->buffer;
@@ -72,17 +113,43 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p) {
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
+// as pktbuf_alloc, but returns NULL instead of blocking if the pool is empty
+pktbuf_t *pktbuf_alloc_nowait(void);
+
+// allocate up to count packet buffers into pkts without blocking, returning
+// how many were, for refilling rx rings
+size_t pktbuf_alloc_batch(pktbuf_t **pkts, size_t count);
+
+// move the pool backed buffer of p, and its data, into a new pktbuf owned by
+// the caller. p is given a fresh empty buffer in its place, so a driver can
+// requeue it as usual. Any frags stay with p. Returns NULL without blocking if
+// p's buffer did not come from the pool, p is shared, or the pool is empty.
+pktbuf_t *pktbuf_detach(pktbuf_t *p);
+
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
 
-// return packet buffer to buffer pool
-// returns number of threads woken up
+// take another reference to the packet buffer, each one is dropped with pktbuf_free
+void pktbuf_ref(pktbuf_t *p);
+
+// continue the packet in p into frag, handing p the caller's reference to it
+void pktbuf_add_frag(pktbuf_t *p, pktbuf_t *frag);
+
+// drop a reference, returning the packet buffer to the pool with the last one,
+// which also drops the references to any frags
+// returns 1 if the buffer went back to the pool, 0 if references remain
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
+// drop a reference to each of count packet buffers
+void pktbuf_free_batch(pktbuf_t **pkts, size_t count, bool reschedule);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
+// as pktbuf_append_data, summing the data as it is copied to keep p->csum up to date
+void pktbuf_append_data_csum(pktbuf_t *p, const void *data, size_t sz);
+
 // extend buffer by sz bytes, returning a pointer to the
 // start of the newly appended region
 void *pktbuf_append(pktbuf_t *p, size_t sz);
@@ -115,4 +182,7 @@ void pktbuf_create_bufs(void *ptr, size_t size);
 
 void pktbuf_dump(pktbuf_t *p);
 
+// print the pool size and the per cpu cache counters
+void pktbuf_dump_stats(void);
+
 __END_CDECLS
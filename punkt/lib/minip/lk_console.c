@@ -66,6 +66,8 @@ static int cmd_minip(int argc, const console_cmd_args *argv) {
 minip_usage:
         printf("minip commands\n");
         printf("mi [a]rp                        dump arp table\n");
+        printf("mi [l]oopback                   print loopback interface stats\n");
+        printf("mi [p]ktbuf                     print pktbuf pool stats\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est [dest] [port] [cnt]   send <cnt> test packets to the dest:port\n");
     } else {
@@ -75,12 +77,25 @@ minip_usage:
                 arp_cache_dump();
                 break;
 
+            case 'l':
+                minip_loopback_dump();
+                break;
+
+            case 'p':
+                pktbuf_dump_stats();
+                break;
+
             case 's': {
                 printf("hostname: %s\n", minip_get_hostname());
                 printf("ip: %u.%u.%u.%u\n", IPV4_SPLIT(minip_get_ipaddr()));
                 printf("netmask: %u.%u.%u.%u\n", IPV4_SPLIT(minip_get_netmask()));
                 printf("broadcast: %u.%u.%u.%u\n", IPV4_SPLIT(minip_get_broadcast()));
                 printf("gateway: %u.%u.%u.%u\n", IPV4_SPLIT(minip_get_gateway()));
+                uint32_t offloads = minip_get_eth_offloads();
+                printf("offloads:%s%s%s\n",
+                       (offloads & MINIP_OFFLOAD_TX_TCP_CKSUM) ? " tx-tcp-cksum" : "",
+                       (offloads & MINIP_OFFLOAD_TX_TCP_TSO) ? " tx-tcp-tso" : "",
+                       offloads ? "" : " none");
             }
             break;
             case 't': {
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "minip-internal.h"
+
+#include <assert.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/list.h>
+#include <lk/trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * The loopback interface. Frames to 127.0.0.0/8 or our own address are queued
+ * here instead of going to the driver, and a thread hands them back up through
+ * minip_rx_driver_callback. Going by way of the thread keeps tcp from coming
+ * back into itself with socket locks held.
+ *
+ * The tx contract holds here like anywhere else, so a frame that tcp still has
+ * a reference to, or any of whose frags it does, is copied and the rest are
+ * queued as they are. Nothing can damage a frame on the way around, so it goes
+ * up with every checksum marked good. That is what finishes the partial sums,
+ * and lets gso packets up whole without being cut into segments first.
+ */
+
+/* frames beyond this many waiting are dropped, for tcp to send again */
+#ifndef MINIP_LOOPBACK_QUEUE_LEN
+#define MINIP_LOOPBACK_QUEUE_LEN 512
+#endif
+
+static spin_lock_t lo_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node lo_queue = LIST_INITIAL_VALUE(lo_queue);
+static uint lo_queue_len;
+static event_t lo_event = EVENT_INITIAL_VALUE(lo_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+static struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t copied; // frames copied because they were still shared
+    uint64_t drops;
+} lo_counters;
+
+/* copy all of p into fresh pktbufs, each filled before moving on to the next
+ * as a frag of the first */
+static pktbuf_t *loopback_copy(pktbuf_t *p) {
+    uint32_t len = pktbuf_total_len(p);
+    size_t count = MAX(1u, (len + PKTBUF_MAX_DATA - 1) / PKTBUF_MAX_DATA);
+    if (count > PKTBUF_MAX_FRAGS + 1)
+        return NULL;
+
+    pktbuf_t *bufs[PKTBUF_MAX_FRAGS + 1];
+    size_t got = pktbuf_alloc_batch(bufs, count);
+    if (got < count) {
+        pktbuf_free_batch(bufs, got, false);
+        return NULL;
+    }
+
+    pktbuf_t *q = bufs[0];
+    pktbuf_t *dst = q;
+    size_t next = 1;
+    for (uint i = 0; i <= p->nfrags; i++) {
+        const pktbuf_t *src = i ? p->frags[i - 1] : p;
+        const u8 *data = src->data;
+        u32 left = src->dlen;
+
+        while (left > 0) {
+            u32 room = pktbuf_avail_tail(dst);
+            if (room == 0) {
+                DEBUG_ASSERT(next < count);
+                dst = bufs[next++];
+                pktbuf_add_frag(q, dst);
+                room = pktbuf_avail_tail(dst);
+            }
+
+            u32 n = MIN(left, room);
+            pktbuf_append_data(dst, data, n);
+            data += n;
+            left -= n;
+        }
+    }
+
+    return q;
+}
+
+static bool loopback_owns(pktbuf_t *p) {
+    if (pktbuf_is_shared(p))
+        return false;
+    for (uint i = 0; i < p->nfrags; i++) {
+        if (pktbuf_is_shared(p->frags[i]))
+            return false;
+    }
+    return true;
+}
+
+int minip_loopback_tx(void *arg, pktbuf_t *p) {
+    DEBUG_ASSERT(p);
+
+    uint32_t len = pktbuf_total_len(p);
+    KTRACE_NET_TX(p, len);
+
+    pktbuf_t *q = p;
+    bool copied = false;
+    if (!loopback_owns(p)) {
+        q = loopback_copy(p);
+        pktbuf_free(p, false);
+        copied = true;
+    }
+
+    LTRACEF("p %p len %u q %p\n", p, len, q);
+
+    if (q) {
+        q->flags &= ~(PKTBUF_FLAG_CKSUM_TCP_PARTIAL | PKTBUF_FLAG_GSO_TCP | PKTBUF_FLAG_DATA_CSUM);
+        q->flags |= PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD |
+                    PKTBUF_FLAG_CKSUM_UDP_GOOD | PKTBUF_FLAG_LOOPBACK;
+        q->gso_size = 0;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lo_lock, state);
+    if (q && lo_queue_len < MINIP_LOOPBACK_QUEUE_LEN) {
+        list_add_tail(&lo_queue, &q->list);
+        lo_queue_len++;
+        lo_counters.packets++;
+        lo_counters.bytes += len;
+        if (copied)
+            lo_counters.copied++;
+        q = NULL;
+    } else {
+        lo_counters.drops++;
+    }
+    spin_unlock_irqrestore(&lo_lock, state);
+
+    if (q) {
+        pktbuf_free(q, false);
+        return ERR_NO_MEMORY;
+    }
+
+    event_signal(&lo_event, false);
+    return NO_ERROR;
+}
+
+static int loopback_thread(void *arg) {
+    for (;;) {
+        event_wait(&lo_event);
+
+        for (;;) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&lo_lock, state);
+            pktbuf_t *p = list_remove_head_type(&lo_queue, pktbuf_t, list);
+            if (p)
+                lo_queue_len--;
+            spin_unlock_irqrestore(&lo_lock, state);
+
+            if (!p)
+                break;
+
+            minip_rx_driver_callback(p);
+            pktbuf_free(p, true);
+        }
+    }
+
+    return 0;
+}
+
+void minip_loopback_dump(void) {
+    printf("loopback: packets %llu bytes %llu copied %llu drops %llu queued %u\n",
+           lo_counters.packets, lo_counters.bytes, lo_counters.copied, lo_counters.drops, lo_queue_len);
+}
+
+void minip_loopback_init(void) {
+    thread_detach_and_resume(thread_create("minip loopback", &loopback_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+}
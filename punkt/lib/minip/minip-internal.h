@@ -11,6 +11,7 @@
 #include <lib/minip.h>
 
 #include <lk/compiler.h>
+#include <kernel/ktrace.h>
 #include <endian.h>
 #include <lk/list.h>
 #include <stdint.h>
@@ -62,6 +63,17 @@ struct eth_hdr {
     uint16_t type;
 };
 
+typedef struct tcp_header {
+    uint16_t source_port;
+    uint16_t dest_port;
+    uint32_t seq_num;
+    uint32_t ack_num;
+    uint16_t length_flags;
+    uint16_t win_size;
+    uint16_t checksum;
+    uint16_t urg_pointer;
+} tcp_header_t;
+
 #pragma pack(pop)
 
 enum {
@@ -86,9 +98,24 @@ enum {
     ARP_OPER_REPLY   = 0x0002,
 };
 
+typedef enum tcp_flags {
+    PKT_FIN = 1,
+    PKT_SYN = 2,
+    PKT_RST = 4,
+    PKT_PSH = 8,
+    PKT_ACK = 16,
+    PKT_URG = 32
+} tcp_flags_t;
+
 extern tx_func_t minip_tx_handler;
 extern void *minip_tx_arg;
 
+/* hand a finished frame to the driver */
+static inline void minip_tx_driver(pktbuf_t *p) {
+    KTRACE_NET_TX(p, pktbuf_total_len(p));
+    minip_tx_handler(minip_tx_arg, p);
+}
+
 typedef struct udp_hdr udp_hdr_t;
 static const uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 typedef uint32_t ipv4_addr;
@@ -108,6 +135,11 @@ const uint8_t *arp_get_dest_mac(uint32_t host);
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
 uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp);
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
+/* copy len bytes, returning the ones_sum16 of them */
+uint16_t ones_sum16_copy(void *dst, const void *src, size_t len);
+/* combine the sum a of one run of bytes with the sum b of the run right after it,
+ * odd if the first run has an odd length */
+uint16_t ones_sum16_add(uint16_t a, uint16_t b, bool odd);
 
 // Helper methods for building headers
 void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
@@ -115,7 +147,30 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
 
+/* routing, such as it is. Packets to a local address go out the loopback
+ * interface, from the address they were sent to if it is in 127.0.0.0/8 */
+bool minip_is_local_addr(uint32_t addr);
+uint32_t minip_src_addr(uint32_t dest_addr);
+const uint8_t *minip_local_mac(void);
+/* the MINIP_OFFLOAD_* flags of the interface dest_addr goes out of */
+uint32_t minip_route_offloads(uint32_t dest_addr);
+/* hand a built frame to the interface dest_addr goes out of */
+void minip_tx(pktbuf_t *p, uint32_t dest_addr);
+
+// loopback interface
+void minip_loopback_init(void);
+int minip_loopback_tx(void *arg, pktbuf_t *p);
+void minip_loopback_dump(void);
+
+void tcp_init(void);
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
+void tcp_get_seg_counts(uint64_t *segs_in, uint64_t *segs_out);
+/* the mss of a connected socket, 0 if it isn't */
+uint32_t tcp_get_mss(tcp_socket_t *s);
+/* queue a list of len bytes of payload pktbufs of up to one mss each, as they
+ * are, waiting for room for all of them. Takes ownership of the list either way. */
+ssize_t tcp_write_segs(tcp_socket_t *s, struct list_node *segs, size_t len);
+void udp_init(void);
 void udp_input(pktbuf_t *p, uint32_t src_ip);
 
 const uint8_t *get_dest_mac(uint32_t host);
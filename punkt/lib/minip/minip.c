@@ -39,6 +39,8 @@ static uint8_t minip_mac[6] = {0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC};
 
 static char minip_hostname[32] = "";
 
+static uint32_t minip_offloads;
+
 static volatile bool minip_configured = false;
 static event_t minip_configured_event = EVENT_INITIAL_VALUE(minip_configured_event, false, 0);
 
@@ -146,6 +148,41 @@ void minip_start_static(uint32_t ip, uint32_t mask, uint32_t gateway) {
     minip_set_gateway(gateway);
 }
 
+void minip_set_eth_offloads(uint32_t offloads) {
+    minip_offloads = offloads;
+}
+
+uint32_t minip_get_eth_offloads(void) {
+    return minip_offloads;
+}
+
+bool minip_is_local_addr(uint32_t addr) {
+    return ipv4_is_loopback(addr) || (minip_ip != IPV4_NONE && addr == minip_ip);
+}
+
+uint32_t minip_src_addr(uint32_t dest_addr) {
+    return ipv4_is_loopback(dest_addr) ? dest_addr : minip_ip;
+}
+
+const uint8_t *minip_local_mac(void) {
+    return minip_mac;
+}
+
+uint32_t minip_route_offloads(uint32_t dest_addr) {
+    /* loopback passes everything up whole and never needs a checksum */
+    if (minip_is_local_addr(dest_addr))
+        return MINIP_OFFLOAD_TX_TCP_CKSUM | MINIP_OFFLOAD_TX_TCP_TSO;
+    return minip_offloads;
+}
+
+void minip_tx(pktbuf_t *p, uint32_t dest_addr) {
+    if (minip_is_local_addr(dest_addr)) {
+        minip_loopback_tx(NULL, p);
+    } else {
+        minip_tx_driver(p);
+    }
+}
+
 void minip_set_eth(tx_func_t tx_handler, void *tx_arg, const uint8_t *macaddr) {
     LTRACEF("handler %p, arg %p, macaddr %p\n", tx_handler, tx_arg, macaddr);
 
@@ -179,7 +216,7 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
     ipv4->ttl           = 64;
     ipv4->proto         = proto;
     ipv4->dst_addr      = dst;
-    ipv4->src_addr      = minip_ip;
+    ipv4->src_addr      = minip_src_addr(dst);
 
     /* This may be unnecessary if the controller supports checksum offloading */
     ipv4->chksum = 0;
@@ -209,7 +246,7 @@ static int send_arp_request(uint32_t addr) {
     mac_addr_copy(arp->sha, minip_mac);
     mac_addr_copy(arp->tha, bcast_mac);
 
-    minip_tx_handler(minip_tx_arg, p);
+    minip_tx_driver(p);
     return 0;
 }
 
@@ -245,12 +282,18 @@ const uint8_t *get_dest_mac(uint32_t host) {
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto) {
     status_t ret = 0;
-    size_t data_len = p->dlen;
+    size_t data_len = pktbuf_total_len(p);
     const uint8_t *dst_mac;
 
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
 
+    // is it for us?
+    if (minip_is_local_addr(dest_addr)) {
+        dst_mac = minip_mac;
+        goto ready;
+    }
+
     // are we sending a broadcast packet?
     if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
         dst_mac = bcast_mac;
@@ -262,6 +305,7 @@ status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto) {
     if ((dest_addr & minip_netmask) != (minip_ip & minip_netmask)) {
         // need to use the gateway
         if (minip_gateway == IPV4_NONE) {
+            pktbuf_free(p, true);
             return ERR_NOT_FOUND; // TODO: better error code
         }
 
@@ -283,7 +327,7 @@ ready:
     minip_build_mac_hdr(eth, dst_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
 
-    minip_tx_handler(minip_tx_arg, p);
+    minip_tx(p, dest_addr);
 
 err:
     return ret;
@@ -299,6 +343,12 @@ static void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdat
     struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     struct icmp_pkt *icmp;
+    const uint8_t *dst_mac;
+
+    dst_mac = minip_is_local_addr(ipaddr) ? minip_mac : arp_cache_lookup(ipaddr);
+    if (dst_mac == NULL) {
+        return;
+    }
 
     if ((p = pktbuf_alloc()) == NULL) {
         return;
@@ -311,7 +361,7 @@ static void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdat
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    minip_build_mac_hdr(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
+    minip_build_mac_hdr(eth, dst_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
@@ -320,7 +370,7 @@ static void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdat
     icmp->chksum = 0;
     icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
 
-    minip_tx_handler(minip_tx_arg, p);
+    minip_tx(p, ipaddr);
 }
 
 static void dump_ipv4_addr(uint32_t addr) {
@@ -364,21 +414,26 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
         return;
     }
 
-    /* compute checksum */
-    if (rfc1701_chksum((void *)ip, header_len) != 0) {
+    /* compute checksum, unless the nic already has */
+    if ((p->flags & PKTBUF_FLAG_CKSUM_IP_GOOD) == 0 && rfc1701_chksum((void *)ip, header_len) != 0) {
         /* bad checksum */
         LTRACEF("REJECT: bad checksum\n");
         return;
     }
 
     /* is the pkt_buf large enough to hold the length the header says the packet is? */
-    if (htons(ip->len) > p->dlen) {
-        LTRACEF("REJECT: packet exceeds size of buffer (header %d, dlen %d)\n", htons(ip->len), p->dlen);
+    size_t total_len = pktbuf_total_len(p);
+    if (htons(ip->len) > total_len) {
+        LTRACEF("REJECT: packet exceeds size of buffer (header %d, dlen %zu)\n", htons(ip->len), total_len);
         return;
     }
 
-    /* trim any excess bytes at the end of the packet */
-    if (p->dlen > htons(ip->len)) {
+    /* trim any excess bytes at the end of the packet, only short frames are padded */
+    if (total_len > htons(ip->len)) {
+        if (p->nfrags) {
+            LTRACEF("REJECT: padding after frags\n");
+            return;
+        }
         pktbuf_consume_tail(p, p->dlen - htons(ip->len));
     }
 
@@ -388,10 +443,18 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
     }
 
     /* the packet is good, we can use it to populate our arp cache */
-    arp_cache_update(ip->src_addr, src_mac);
+    bool loopback = p->flags & PKTBUF_FLAG_LOOPBACK;
+    if (!loopback) {
+        arp_cache_update(ip->src_addr, src_mac);
+    }
 
-    /* see if it's for us */
-    if (ip->dst_addr != IPV4_BCAST) {
+    /* see if it's for us, 127.0.0.0/8 only ever comes over loopback */
+    if (ipv4_is_loopback(ip->dst_addr) || ipv4_is_loopback(ip->src_addr)) {
+        if (!loopback) {
+            LTRACEF("REJECT: loopback address off the wire\n");
+            return;
+        }
+    } else if (ip->dst_addr != IPV4_BCAST) {
         if (minip_ip != IPV4_NONE && ip->dst_addr != minip_ip && ip->dst_addr != minip_broadcast) {
             LTRACEF("REJECT: for another host\n");
             return;
@@ -459,7 +522,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p) {
                 mac_addr_copy(rarp->tha, arp->sha);
                 rarp->tpa = arp->spa;
 
-                minip_tx_handler(minip_tx_arg, rp);
+                minip_tx_driver(rp);
             }
         }
         break;
@@ -486,6 +549,8 @@ static void dump_eth_packet(const struct eth_hdr *eth) {
 void minip_rx_driver_callback(pktbuf_t *p) {
     struct eth_hdr *eth;
 
+    KTRACE_NET_RX(p, pktbuf_total_len(p));
+
     if ((eth = (void *) pktbuf_consume(p, sizeof(struct eth_hdr))) == NULL) {
         return;
     }
@@ -557,6 +622,9 @@ void printip_named(const char *s, uint32_t x) {
 static void minip_init(uint level) {
     arp_cache_init();
     net_timer_init();
+    minip_loopback_init();
+    tcp_init();
+    udp_init();
 }
 
 
@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "minip-internal.h"
+
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <lk/console_cmd.h>
+#include <lk/err.h>
+#include <lk/trace.h>
+#include <malloc.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * In kernel network benchmark. Runs parallel bulk tcp streams, or udp request
+ * and response loops, against the netbench server of this host over loopback or
+ * of another across a nic, and reports throughput, latency and what it cost in
+ * cpu cycles.
+ */
+
+#define NETBENCH_TCP_PORT 5001
+#define NETBENCH_UDP_PORT 5002
+
+#define NETBENCH_MAX_THREADS 16
+#define NETBENCH_BUFFER_SIZE (256 * 1024)
+#define NETBENCH_WRITE_SIZE (64 * 1024)
+#define NETBENCH_UDP_MAX_SIZE 1400
+
+/* rtt samples kept per udp loop, picked evenly from the whole run once full */
+#define NETBENCH_MAX_SAMPLES 4096
+
+/* how long a udp request waits on its response before being counted lost */
+#define NETBENCH_UDP_TIMEOUT 100
+
+/* the server side, started on first use and left running */
+static mutex_t server_lock = MUTEX_INITIAL_VALUE(server_lock);
+static bool server_running;
+
+/* udp sockets to send echoes back on, one per peer seen */
+#define NETBENCH_UDP_PEERS 32
+static struct netbench_peer {
+    uint32_t host;
+    uint16_t port;
+    udp_socket_t *socket;
+} udp_peers[NETBENCH_UDP_PEERS];
+static mutex_t udp_peers_lock = MUTEX_INITIAL_VALUE(udp_peers_lock);
+
+static int tcp_sink_thread(void *arg) {
+    tcp_socket_t *s = arg;
+    pktbuf_t *p;
+
+    while (tcp_read_pktbuf(s, &p) > 0)
+        pktbuf_free(p, true);
+
+    tcp_close(s);
+    return 0;
+}
+
+static int tcp_listen_thread(void *arg) {
+    tcp_socket_t *listen_socket = arg;
+
+    for (;;) {
+        tcp_socket_t *s;
+        if (tcp_accept(listen_socket, &s) < 0)
+            continue;
+
+        thread_t *t = thread_create("netbench sink", &tcp_sink_thread, s, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t) {
+            tcp_close(s);
+            continue;
+        }
+        thread_detach_and_resume(t);
+    }
+
+    return 0;
+}
+
+static udp_socket_t *udp_peer_socket(uint32_t host, uint16_t port) {
+    struct netbench_peer *free_peer = NULL;
+
+    for (size_t i = 0; i < countof(udp_peers); i++) {
+        struct netbench_peer *peer = &udp_peers[i];
+        if (!peer->socket) {
+            if (!free_peer)
+                free_peer = peer;
+        } else if (peer->host == host && peer->port == port) {
+            return peer->socket;
+        }
+    }
+
+    /* reuse the first slot once they are all taken */
+    if (!free_peer) {
+        free_peer = &udp_peers[0];
+        udp_close(free_peer->socket);
+        free_peer->socket = NULL;
+    }
+
+    if (udp_open(host, NETBENCH_UDP_PORT, port, &free_peer->socket) < 0)
+        return NULL;
+    free_peer->host = host;
+    free_peer->port = port;
+
+    return free_peer->socket;
+}
+
+static void udp_echo_callback(void *data, size_t len, uint32_t srcaddr, uint16_t srcport, void *arg) {
+    mutex_acquire(&udp_peers_lock);
+    udp_socket_t *s = udp_peer_socket(srcaddr, srcport);
+    if (s)
+        udp_send(data, len, s);
+    mutex_release(&udp_peers_lock);
+}
+
+static status_t netbench_server_start(void) {
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&server_lock);
+    if (server_running)
+        goto done;
+
+    tcp_socket_t *listen_socket;
+    err = tcp_open_listen(&listen_socket, NETBENCH_TCP_PORT);
+    if (err < 0) {
+        printf("netbench: error %d listening on tcp port %u\n", err, NETBENCH_TCP_PORT);
+        goto done;
+    }
+    tcp_set_buffer_sizes(listen_socket, NETBENCH_BUFFER_SIZE, NETBENCH_BUFFER_SIZE);
+
+    if (udp_listen(NETBENCH_UDP_PORT, &udp_echo_callback, NULL) < 0) {
+        printf("netbench: error listening on udp port %u\n", NETBENCH_UDP_PORT);
+        tcp_close(listen_socket);
+        err = ERR_ALREADY_EXISTS;
+        goto done;
+    }
+
+    thread_detach_and_resume(thread_create("netbench listen", &tcp_listen_thread, listen_socket,
+                                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+
+    printf("netbench: server on tcp port %u, udp port %u\n", NETBENCH_TCP_PORT, NETBENCH_UDP_PORT);
+    server_running = true;
+
+done:
+    mutex_release(&server_lock);
+    return err;
+}
+
+/* time the active cpus have spent not idle since boot, summed over them */
+static lk_bigtime_t netbench_busy_time(void) {
+    lk_bigtime_t busy = 0;
+#if THREAD_STATS
+    lk_bigtime_t now = current_time_hires();
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        lk_bigtime_t idle = thread_stats[i].idle_time;
+        if (mp_is_cpu_idle(i))
+            idle += now - thread_stats[i].last_idle_timestamp;
+        busy += now - idle;
+    }
+#endif
+    return busy;
+}
+
+/* what the whole host did over a run */
+struct netbench_run {
+    lk_bigtime_t start_time;
+    lk_bigtime_t start_busy;
+    ulong start_cycles;
+    uint64_t start_segs_in;
+    uint64_t start_segs_out;
+
+    lk_bigtime_t usecs;
+    lk_bigtime_t busy_usecs;
+    uint64_t cycles; // by all the cpus while busy
+    uint64_t segs;   // tcp segments in and out
+};
+
+static void netbench_run_start(struct netbench_run *run) {
+    memset(run, 0, sizeof(*run));
+    tcp_get_seg_counts(&run->start_segs_in, &run->start_segs_out);
+    run->start_busy = netbench_busy_time();
+    run->start_cycles = arch_cycle_count();
+    run->start_time = current_time_hires();
+}
+
+static void netbench_run_stop(struct netbench_run *run) {
+    lk_bigtime_t now = current_time_hires();
+    ulong cycles = arch_cycle_count() - run->start_cycles;
+    uint64_t segs_in, segs_out;
+
+    run->usecs = MAX(now - run->start_time, 1);
+    run->busy_usecs = netbench_busy_time() - run->start_busy;
+    run->cycles = run->busy_usecs * (cycles / run->usecs);
+    tcp_get_seg_counts(&segs_in, &segs_out);
+    run->segs = (segs_in - run->start_segs_in) + (segs_out - run->start_segs_out);
+}
+
+static void netbench_print_rate(const char *what, uint64_t bytes, uint64_t packets, const struct netbench_run *run) {
+    uint64_t mbits = bytes * 8 / run->usecs;
+    uint64_t pps = packets * 1000000 / run->usecs;
+
+    printf("%s: %llu bytes in %llu usecs, %llu.%03llu Gbit/s, %llu pkts/s\n",
+           what, bytes, run->usecs, mbits / 1000, mbits % 1000, pps);
+    if (run->cycles && bytes) {
+        uint64_t cpb = run->cycles * 100 / bytes;
+        printf("%s: cpu busy %llu usecs, %llu.%02llu cycles/byte\n",
+               what, run->busy_usecs, cpb / 100, cpb % 100);
+    }
+}
+
+struct netbench_stream {
+    uint32_t host;
+    lk_time_t deadline;
+    thread_t *thread;
+    uint64_t bytes;
+    status_t err;
+};
+
+static int tcp_stream_thread(void *arg) {
+    struct netbench_stream *st = arg;
+
+    void *buf = malloc(NETBENCH_WRITE_SIZE);
+    if (!buf) {
+        st->err = ERR_NO_MEMORY;
+        return 0;
+    }
+    memset(buf, 0x5a, NETBENCH_WRITE_SIZE);
+
+    tcp_socket_t *s;
+    st->err = tcp_connect_etc(&s, st->host, NETBENCH_TCP_PORT, NETBENCH_BUFFER_SIZE, NETBENCH_BUFFER_SIZE);
+    if (st->err < 0)
+        goto out;
+
+    while (current_time() < st->deadline) {
+        ssize_t ret = tcp_write(s, buf, NETBENCH_WRITE_SIZE);
+        if (ret < 0) {
+            st->err = ret;
+            break;
+        }
+        st->bytes += ret;
+    }
+
+    tcp_close(s);
+out:
+    free(buf);
+    return 0;
+}
+
+static int netbench_tcp(uint32_t host, uint streams, lk_time_t duration) {
+    struct netbench_stream st[NETBENCH_MAX_THREADS];
+    struct netbench_run run;
+
+    memset(st, 0, sizeof(st));
+    netbench_run_start(&run);
+
+    lk_time_t deadline = current_time() + duration;
+    for (uint i = 0; i < streams; i++) {
+        st[i].host = host;
+        st[i].deadline = deadline;
+        st[i].thread = thread_create("netbench tcp", &tcp_stream_thread, &st[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (st[i].thread)
+            thread_resume(st[i].thread);
+    }
+
+    uint64_t bytes = 0;
+    for (uint i = 0; i < streams; i++) {
+        if (!st[i].thread) {
+            printf("stream %u: could not create thread\n", i);
+            continue;
+        }
+        thread_join(st[i].thread, NULL, INFINITE_TIME);
+        if (st[i].err < 0)
+            printf("stream %u: error %d\n", i, st[i].err);
+        bytes += st[i].bytes;
+    }
+
+    netbench_run_stop(&run);
+
+    printf("tcp %u stream(s) to %u.%u.%u.%u:%u\n", streams, IPV4_SPLIT(host), NETBENCH_TCP_PORT);
+    netbench_print_rate("tcp", bytes, run.segs, &run);
+
+    return 0;
+}
+
+struct netbench_loop {
+    uint32_t host;
+    uint16_t port;
+    size_t size;
+    lk_time_t deadline;
+    thread_t *thread;
+    event_t reply;
+    volatile uint32_t reply_seq;
+
+    uint64_t transactions;
+    uint64_t lost;
+    uint32_t nsamples;
+    uint32_t samples[NETBENCH_MAX_SAMPLES]; // rtt in usecs
+    status_t err;
+};
+
+static void udp_reply_callback(void *data, size_t len, uint32_t srcaddr, uint16_t srcport, void *arg) {
+    struct netbench_loop *loop = arg;
+    uint32_t seq;
+
+    if (len < sizeof(seq))
+        return;
+    memcpy(&seq, data, sizeof(seq));
+    loop->reply_seq = seq;
+    event_signal(&loop->reply, false);
+}
+
+static void udp_add_sample(struct netbench_loop *loop, uint32_t rtt) {
+    /* reservoir sampling, so a long run is represented evenly */
+    if (loop->nsamples < NETBENCH_MAX_SAMPLES) {
+        loop->samples[loop->nsamples++] = rtt;
+    } else {
+        uint64_t i = (uint64_t)rand() % loop->transactions;
+        if (i < NETBENCH_MAX_SAMPLES)
+            loop->samples[i] = rtt;
+    }
+}
+
+static int udp_loop_thread(void *arg) {
+    struct netbench_loop *loop = arg;
+    uint8_t buf[NETBENCH_UDP_MAX_SIZE];
+    udp_socket_t *s;
+
+    memset(buf, 0xa5, loop->size);
+
+    if (udp_listen(loop->port, &udp_reply_callback, loop) < 0) {
+        loop->err = ERR_ALREADY_EXISTS;
+        return 0;
+    }
+
+    loop->err = udp_open(loop->host, loop->port, NETBENCH_UDP_PORT, &s);
+    if (loop->err < 0)
+        goto out;
+
+    for (uint32_t seq = 1; current_time() < loop->deadline; seq++) {
+        memcpy(buf, &seq, sizeof(seq));
+
+        lk_bigtime_t t = current_time_hires();
+        if (udp_send(buf, loop->size, s) < 0) {
+            loop->lost++;
+            continue;
+        }
+
+        /* skip over any replies that turn up after their request was given up on */
+        status_t err;
+        do {
+            err = event_wait_timeout(&loop->reply, NETBENCH_UDP_TIMEOUT);
+        } while (err == NO_ERROR && loop->reply_seq != seq);
+
+        if (err < 0) {
+            loop->lost++;
+            continue;
+        }
+
+        loop->transactions++;
+        udp_add_sample(loop, current_time_hires() - t);
+    }
+
+    udp_close(s);
+out:
+    udp_listen(loop->port, NULL, NULL);
+    return 0;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int netbench_udp(uint32_t host, uint loops, lk_time_t duration, size_t size) {
+    struct netbench_loop *loop = calloc(loops, sizeof(*loop));
+    if (!loop)
+        return ERR_NO_MEMORY;
+
+    struct netbench_run run;
+    netbench_run_start(&run);
+
+    lk_time_t deadline = current_time() + duration;
+    for (uint i = 0; i < loops; i++) {
+        loop[i].host = host;
+        loop[i].port = NETBENCH_UDP_PORT + 1 + i;
+        loop[i].size = size;
+        loop[i].deadline = deadline;
+        event_init(&loop[i].reply, false, EVENT_FLAG_AUTOUNSIGNAL);
+        loop[i].thread = thread_create("netbench udp", &udp_loop_thread, &loop[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (loop[i].thread)
+            thread_resume(loop[i].thread);
+    }
+
+    uint64_t transactions = 0, lost = 0;
+    uint32_t nsamples = 0;
+    for (uint i = 0; i < loops; i++) {
+        if (!loop[i].thread) {
+            printf("loop %u: could not create thread\n", i);
+            continue;
+        }
+        thread_join(loop[i].thread, NULL, INFINITE_TIME);
+        if (loop[i].err < 0)
+            printf("loop %u: error %d\n", i, loop[i].err);
+        transactions += loop[i].transactions;
+        lost += loop[i].lost;
+        nsamples += loop[i].nsamples;
+    }
+
+    netbench_run_stop(&run);
+
+    printf("udp %u loop(s) of %zu bytes to %u.%u.%u.%u:%u\n", loops, size, IPV4_SPLIT(host), NETBENCH_UDP_PORT);
+    printf("udp: %llu transactions/s, %llu lost\n", transactions * 1000000 / run.usecs, lost);
+    netbench_print_rate("udp", transactions * 2 * size, transactions * 2, &run);
+
+    /* merge the samples of all the loops for the percentiles */
+    uint32_t *samples = nsamples ? malloc(nsamples * sizeof(uint32_t)) : NULL;
+    if (samples) {
+        uint32_t n = 0;
+        for (uint i = 0; i < loops; i++) {
+            memcpy(&samples[n], loop[i].samples, loop[i].nsamples * sizeof(uint32_t));
+            n += loop[i].nsamples;
+        }
+        qsort(samples, n, sizeof(uint32_t), &compare_u32);
+        printf("udp: rtt usecs min %u p50 %u p99 %u max %u\n",
+               samples[0], samples[n / 2], samples[(uint64_t)n * 99 / 100], samples[n - 1]);
+        free(samples);
+    }
+
+    for (uint i = 0; i < loops; i++)
+        event_destroy(&loop[i].reply);
+    free(loop);
+
+    return 0;
+}
+
+static void netbench_usage(void) {
+    printf("netbench server                                 run the tcp sink and udp echo server\n");
+    printf("netbench tcp [streams] [secs] [host]            bulk tcp streams to host's server\n");
+    printf("netbench udp [loops] [secs] [host] [size]       udp request and response loops\n");
+    printf("host defaults to 127.0.0.1, whose server is started as needed\n");
+}
+
+static int cmd_netbench(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+        netbench_usage();
+        return -1;
+    }
+
+    const char *cmd = argv[1].str;
+    if (!strcmp(cmd, "server")) {
+        return netbench_server_start();
+    }
+
+    bool tcp = !strcmp(cmd, "tcp");
+    if (!tcp && strcmp(cmd, "udp")) {
+        netbench_usage();
+        return -1;
+    }
+
+    uint threads = (argc > 2) ? argv[2].u : 1;
+    lk_time_t duration = ((argc > 3) ? argv[3].u : 10) * 1000;
+    uint32_t host = (argc > 4) ? minip_parse_ipaddr(argv[4].str, strlen(argv[4].str)) : IPV4_LOOPBACK;
+    size_t size = (argc > 5) ? argv[5].u : 64;
+
+    if (threads < 1 || threads > NETBENCH_MAX_THREADS) {
+        printf("netbench: 1 to %u streams or loops\n", NETBENCH_MAX_THREADS);
+        return -1;
+    }
+    if (size < sizeof(uint32_t) || size > NETBENCH_UDP_MAX_SIZE) {
+        printf("netbench: udp size %zu to %u\n", sizeof(uint32_t), NETBENCH_UDP_MAX_SIZE);
+        return -1;
+    }
+
+    if (minip_is_local_addr(host)) {
+        status_t err = netbench_server_start();
+        if (err < 0)
+            return err;
+    }
+
+    if (tcp)
+        return netbench_tcp(host, threads, duration);
+    return netbench_udp(host, threads, duration, size);
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("netbench", "network throughput and latency benchmark", &cmd_netbench)
+STATIC_COMMAND_END(netbench);
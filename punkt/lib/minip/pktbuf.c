@@ -11,47 +11,249 @@
 #include <lk/debug.h>
 #include <lk/trace.h>
 #include <printf.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 
 #include <kernel/thread.h>
+#include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
+#include <arch/atomic.h>
+#include <arch/ops.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
 #include <lk/init.h>
 #include <vm/vm.h>
 
+#include "minip-internal.h"
+
 #define LOCAL_TRACE 0
 
+/*
+ * pktbuf headers and buffers are both pool objects. Each cpu keeps a cache of
+ * free ones, refilled from and flushed to a shared depot half a cache at a
+ * time, so the common case takes no lock shared with other cpus. The depot
+ * grows by PKTBUF_POOL_GROW objects at a time when it runs dry, up to
+ * PKTBUF_POOL_MAX, and only past that do allocations block or fail.
+ */
+#ifndef PKTBUF_CPU_CACHE_SIZE
+#define PKTBUF_CPU_CACHE_SIZE 64
+#endif
+#define PKTBUF_CPU_CACHE_BATCH (PKTBUF_CPU_CACHE_SIZE / 2)
+
+struct pktbuf_cpu_cache {
+    uint count;
+    void *objs[PKTBUF_CPU_CACHE_SIZE];
+
+    /* stats */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t refills;
+    uint64_t flushes;
+} __ALIGNED(CACHE_LINE);
+
+static struct pktbuf_cpu_cache pktbuf_cache[SMP_MAX_CPUS];
+
+/* the depot, and the threads waiting on it to have something */
+static spin_lock_t lock;
 static pool_t pktbuf_pool;
+static uint pktbuf_depot_count;
+static uint pktbuf_total_count;
+static uint pktbuf_waiters;
 static semaphore_t pktbuf_sem;
-static spin_lock_t lock;
+static mutex_t pktbuf_grow_lock = MUTEX_INITIAL_VALUE(pktbuf_grow_lock);
 
+static struct {
+    uint64_t grows;
+    uint64_t grow_failures;
+    uint64_t waits;
+    uint64_t alloc_failures;
+} pktbuf_stats;
 
-/* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
-static void *get_pool_object(void) {
-    pool_t *entry;
+/* take up to count objects from the depot */
+static uint depot_get(void **objs, uint count) {
     spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock, state);
+
+    uint n = 0;
+    while (n < count) {
+        void *o = pool_alloc(&pktbuf_pool);
+        if (!o)
+            break;
+        objs[n++] = o;
+    }
+    pktbuf_depot_count -= n;
+
+    spin_unlock_irqrestore(&lock, state);
+
+    return n;
+}
 
-    sem_wait(&pktbuf_sem);
+static void depot_put(void **objs, uint count, bool reschedule) {
+    spin_lock_saved_state_t state;
     spin_lock_irqsave(&lock, state);
-    entry = pool_alloc(&pktbuf_pool);
+
+    for (uint i = 0; i < count; i++)
+        pool_free(&pktbuf_pool, objs[i]);
+    pktbuf_depot_count += count;
+    uint wake = MIN(pktbuf_waiters, count);
+
     spin_unlock_irqrestore(&lock, state);
 
-    return (pktbuf_pool_object_t *) entry;
+    for (uint i = 0; i < wake; i++)
+        sem_post(&pktbuf_sem, reschedule);
+}
+
+/* take up to count objects from this cpu's cache, refilling it from the depot */
+static uint cache_get(void **objs, uint count) {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pktbuf_cpu_cache *c = &pktbuf_cache[arch_curr_cpu_num()];
+    uint n = 0;
+    while (n < count) {
+        if (c->count == 0) {
+            c->count = depot_get(c->objs, PKTBUF_CPU_CACHE_BATCH);
+            if (c->count == 0)
+                break;
+            c->refills++;
+        }
+        objs[n++] = c->objs[--c->count];
+    }
+    c->allocs += n;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
+    return n;
 }
 
-/* Return an object to thje pktbuf object pool. */
-static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule) {
-    DEBUG_ASSERT(entry);
+static void cache_put(void **objs, uint count, bool reschedule) {
+    /* with threads blocked, go where they can get at it */
+    if (pktbuf_waiters) {
+        depot_put(objs, count, reschedule);
+        return;
+    }
+
     spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pktbuf_cpu_cache *c = &pktbuf_cache[arch_curr_cpu_num()];
+    for (uint i = 0; i < count; i++) {
+        if (c->count == PKTBUF_CPU_CACHE_SIZE) {
+            c->count -= PKTBUF_CPU_CACHE_BATCH;
+            depot_put(&c->objs[c->count], PKTBUF_CPU_CACHE_BATCH, false);
+            c->flushes++;
+        }
+        c->objs[c->count++] = objs[i];
+    }
+    c->frees += count;
 
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* add another slab of objects to the depot, false if the pool is at its limit
+ * or this isn't a context that can allocate */
+static bool pktbuf_grow(void) {
+    if (arch_ints_disabled() || pktbuf_total_count >= PKTBUF_POOL_MAX)
+        return false;
+
+    mutex_acquire(&pktbuf_grow_lock);
+
+    /* someone else may have just done it */
+    if (pktbuf_depot_count > 0) {
+        mutex_release(&pktbuf_grow_lock);
+        return true;
+    }
+
+    uint count = MIN(PKTBUF_POOL_GROW, PKTBUF_POOL_MAX - pktbuf_total_count);
+    void *slab;
+    if (count == 0 || vmm_alloc_contiguous(vmm_get_kernel_aspace(), "pktbuf",
+                                           count * sizeof(struct pktbuf_pool_object),
+                                           &slab, 0, 0, ARCH_MMU_FLAG_CACHED) < 0) {
+        pktbuf_stats.grow_failures++;
+        mutex_release(&pktbuf_grow_lock);
+        return false;
+    }
+
+    LTRACEF("adding %u objects to %u\n", count, pktbuf_total_count);
+
+    spin_lock_saved_state_t state;
     spin_lock_irqsave(&lock, state);
-    pool_free(&pktbuf_pool, entry);
+
+    for (uint i = 0; i < count; i++)
+        pool_free(&pktbuf_pool, (struct pktbuf_pool_object *)slab + i);
+    pktbuf_depot_count += count;
+    pktbuf_total_count += count;
+    pktbuf_stats.grows++;
+
     spin_unlock_irqrestore(&lock, state);
-    sem_post(&pktbuf_sem, reschedule);
+
+    mutex_release(&pktbuf_grow_lock);
+
+    return true;
+}
+
+/* Take count objects from the pool to act as headers or buffers, returning how
+ * many were taken, which is only short of count if wait is false.
+ */
+static uint get_pool_objects(void **objs, uint count, bool wait) {
+    uint n = 0;
+
+    for (;;) {
+        n += cache_get(objs + n, count - n);
+        if (n == count)
+            return n;
+
+        if (pktbuf_grow())
+            continue;
+
+        if (!wait) {
+            pktbuf_stats.alloc_failures++;
+            return n;
+        }
+
+        /* sleep until something is freed to the depot, rechecking now and then
+         * for objects that went to a cache as we got here */
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&lock, state);
+        bool empty = (pktbuf_depot_count == 0);
+        if (empty) {
+            pktbuf_waiters++;
+            pktbuf_stats.waits++;
+        }
+        spin_unlock_irqrestore(&lock, state);
+
+        if (empty) {
+            sem_timedwait(&pktbuf_sem, 10);
+
+            spin_lock_irqsave(&lock, state);
+            pktbuf_waiters--;
+            spin_unlock_irqrestore(&lock, state);
+        }
+    }
+}
+
+static void *get_pool_object(bool wait) {
+    void *entry;
+
+    if (get_pool_objects(&entry, 1, wait) == 0)
+        return NULL;
+
+    return entry;
+}
+
+/* Return objects to the pktbuf object pool. */
+static void free_pool_objects(void **objs, uint count, bool reschedule) {
+    cache_put(objs, count, reschedule);
+}
+
+static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule) {
+    DEBUG_ASSERT(entry);
+
+    void *obj = entry;
+    free_pool_objects(&obj, 1, reschedule);
 }
 
 /* Callback used internally to place a pktbuf_pool_object back in the pool after
@@ -85,24 +287,91 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz, uint32
     p->phys_base = vaddr_to_paddr(buf) | (uintptr_t) buf % PAGE_SIZE;
 }
 
+/* set up a header object p around buffer object buf */
+static pktbuf_t *pktbuf_init_pool_pktbuf(void *p, void *buf) {
+    pktbuf_t *pkt = p;
+
+    /* the frag array is only valid up to nfrags */
+    memset(pkt, 0, offsetof(pktbuf_t, frags));
+    pkt->ref = 1;
+    pktbuf_add_buffer(pkt, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
+    return pkt;
+}
+
+static pktbuf_t *pktbuf_alloc_etc(bool wait) {
+    void *objs[2];
+
+    uint n = get_pool_objects(objs, 2, wait);
+    if (n < 2) {
+        free_pool_objects(objs, n, false);
+        return NULL;
+    }
+
+    return pktbuf_init_pool_pktbuf(objs[0], objs[1]);
+}
+
+/* at most how many pktbufs the batch calls deal with in one go */
+#define PKTBUF_BATCH 32
+
+size_t pktbuf_alloc_batch(pktbuf_t **pkts, size_t count) {
+    size_t done = 0;
+
+    while (done < count) {
+        void *objs[PKTBUF_BATCH * 2];
+        uint want = MIN(count - done, PKTBUF_BATCH);
+
+        uint n = get_pool_objects(objs, want * 2, false);
+        if (n & 1)
+            free_pool_object(objs[--n], false);
+
+        for (uint i = 0; i < n; i += 2)
+            pkts[done++] = pktbuf_init_pool_pktbuf(objs[i], objs[i + 1]);
+
+        if (n < want * 2)
+            break;
+    }
+
+    return done;
+}
+
 pktbuf_t *pktbuf_alloc(void) {
-    pktbuf_t *p = NULL;
-    void *buf = NULL;
+    return pktbuf_alloc_etc(true);
+}
+
+pktbuf_t *pktbuf_alloc_nowait(void) {
+    return pktbuf_alloc_etc(false);
+}
 
-    p = get_pool_object();
-    if (!p) {
+/* Swap the buffer out from under a pktbuf a driver owns, so the stack can hold
+ * on to received data without copying it.
+ */
+pktbuf_t *pktbuf_detach(pktbuf_t *p) {
+    DEBUG_ASSERT(p);
+
+    if (p->cb != free_pktbuf_buf_cb || pktbuf_is_shared(p)) {
         return NULL;
     }
 
-    buf = get_pool_object();
-    if (!buf) {
-        free_pool_object((pktbuf_pool_object_t *)p, false);
+    pktbuf_t *np = pktbuf_alloc_nowait();
+    if (!np) {
         return NULL;
     }
 
-    memset(p, 0, sizeof(pktbuf_t));
+    /* trade buffers */
+    u8 *buf = np->buffer;
+    u8 *data = p->data;
+    u32 dlen = p->dlen;
+
+    np->buffer = p->buffer;
+    np->blen = p->blen;
+    np->phys_base = p->phys_base;
+    np->data = data;
+    np->dlen = dlen;
+    np->flags = p->flags;
+
     pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
-    return p;
+
+    return np;
 }
 
 void pktbuf_reset(pktbuf_t *p, uint32_t header_sz) {
@@ -112,26 +381,87 @@ void pktbuf_reset(pktbuf_t *p, uint32_t header_sz) {
 
     p->data = p->buffer + header_sz;
     p->dlen = 0;
+    p->flags &= ~PKTBUF_FLAG_DATA_CSUM;
 }
 
 pktbuf_t *pktbuf_alloc_empty(void) {
-    pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    pktbuf_t *p = (pktbuf_t *) get_pool_object(true);
 
     p->flags = PKTBUF_FLAG_EOF;
+    p->ref = 1;
+    p->nfrags = 0;
     return p;
 }
 
-int pktbuf_free(pktbuf_t *p, bool reschedule) {
+void pktbuf_ref(pktbuf_t *p) {
+    DEBUG_ASSERT(p);
+
+    __UNUSED int oldval = atomic_add(&p->ref, 1);
+    DEBUG_ASSERT(oldval > 0);
+}
+
+void pktbuf_add_frag(pktbuf_t *p, pktbuf_t *frag) {
+    DEBUG_ASSERT(p && frag);
+    DEBUG_ASSERT(p->nfrags < PKTBUF_MAX_FRAGS);
+    DEBUG_ASSERT(frag->nfrags == 0);
+
+    p->frags[p->nfrags++] = frag;
+}
+
+/* drop a reference to p, and with the last one collect its pool objects in
+ * objs for the caller to free, returning how many there were */
+static uint pktbuf_release(pktbuf_t *p, void **objs, bool reschedule) {
     DEBUG_ASSERT(p);
 
-    if (p->cb) {
+    int oldval = atomic_add(&p->ref, -1);
+    DEBUG_ASSERT(oldval > 0);
+    if (oldval > 1) {
+        return 0;
+    }
+
+    if (p->nfrags) {
+        pktbuf_free_batch(p->frags, p->nfrags, reschedule);
+    }
+
+    uint count = 0;
+    if (p->cb == free_pktbuf_buf_cb) {
+        objs[count++] = p->buffer;
+    } else if (p->cb) {
         p->cb(p->buffer, p->cb_args);
     }
-    free_pool_object((pktbuf_pool_object_t *)p, false);
+    objs[count++] = p;
+
+    return count;
+}
+
+int pktbuf_free(pktbuf_t *p, bool reschedule) {
+    void *objs[2];
+
+    uint count = pktbuf_release(p, objs, reschedule);
+    if (count == 0) {
+        return 0;
+    }
+
+    free_pool_objects(objs, count, reschedule);
 
     return 1;
 }
 
+void pktbuf_free_batch(pktbuf_t **pkts, size_t count, bool reschedule) {
+    void *objs[PKTBUF_BATCH * 2];
+    uint n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (n > (PKTBUF_BATCH - 1) * 2) {
+            free_pool_objects(objs, n, reschedule);
+            n = 0;
+        }
+        n += pktbuf_release(pkts[i], objs + n, reschedule);
+    }
+
+    free_pool_objects(objs, n, reschedule);
+}
+
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
     if (pktbuf_avail_tail(p) < sz) {
         panic("pktbuf_append_data: overflow");
@@ -139,6 +469,22 @@ void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
 
     memcpy(p->data + p->dlen, data, sz);
     p->dlen += sz;
+    p->flags &= ~PKTBUF_FLAG_DATA_CSUM;
+}
+
+void pktbuf_append_data_csum(pktbuf_t *p, const void *data, size_t sz) {
+    if (pktbuf_avail_tail(p) < sz) {
+        panic("pktbuf_append_data_csum: overflow");
+    }
+
+    uint16_t sum = ones_sum16_copy(p->data + p->dlen, data, sz);
+    if (p->dlen == 0) {
+        p->csum = sum;
+        p->flags |= PKTBUF_FLAG_DATA_CSUM;
+    } else if (p->flags & PKTBUF_FLAG_DATA_CSUM) {
+        p->csum = ones_sum16_add(p->csum, sum, p->dlen & 1);
+    }
+    p->dlen += sz;
 }
 
 void *pktbuf_append(pktbuf_t *p, size_t sz) {
@@ -148,6 +494,7 @@ void *pktbuf_append(pktbuf_t *p, size_t sz) {
 
     void *data = p->data + p->dlen;
     p->dlen += sz;
+    p->flags &= ~PKTBUF_FLAG_DATA_CSUM;
 
     return data;
 }
@@ -159,6 +506,7 @@ void *pktbuf_prepend(pktbuf_t *p, size_t sz) {
 
     p->dlen += sz;
     p->data -= sz;
+    p->flags &= ~PKTBUF_FLAG_DATA_CSUM;
 
     return p->data;
 }
@@ -172,11 +520,13 @@ void *pktbuf_consume(pktbuf_t *p, size_t sz) {
 
     p->data += sz;
     p->dlen -= sz;
+    p->flags &= ~PKTBUF_FLAG_DATA_CSUM;
 
     return data;
 }
 
 void pktbuf_consume_tail(pktbuf_t *p, size_t sz) {
+    p->flags &= ~PKTBUF_FLAG_DATA_CSUM;
     if (sz > p->dlen) {
         p->dlen = 0;
         return;
@@ -186,18 +536,35 @@ void pktbuf_consume_tail(pktbuf_t *p, size_t sz) {
 }
 
 void pktbuf_dump(pktbuf_t *p) {
-    printf("pktbuf data %p, buffer %p, dlen %u, data offset %lu, phys_base %p\n",
+    printf("pktbuf data %p, buffer %p, dlen %u, data offset %lu, phys_base %p, ref %d, frags %u\n",
            p->data, p->buffer, p->dlen, (uintptr_t) p->data - (uintptr_t) p->buffer,
-           (void *)p->phys_base);
+           (void *)p->phys_base, p->ref, p->nfrags);
+}
+
+void pktbuf_dump_stats(void) {
+    printf("pktbuf: %u objects of %zu bytes (max %u), %u in the depot\n", pktbuf_total_count,
+           sizeof(struct pktbuf_pool_object), PKTBUF_POOL_MAX, pktbuf_depot_count);
+    printf("\t%llu grows, %llu grow failures, %llu waits, %llu nowait failures\n",
+           pktbuf_stats.grows, pktbuf_stats.grow_failures, pktbuf_stats.waits, pktbuf_stats.alloc_failures);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const struct pktbuf_cpu_cache *c = &pktbuf_cache[i];
+        if (c->allocs == 0 && c->frees == 0)
+            continue;
+        printf("\tcpu %u: %u cached, %llu allocs, %llu frees, %llu refills, %llu flushes\n",
+               i, c->count, c->allocs, c->frees, c->refills, c->flushes);
+    }
 }
 
 static void pktbuf_init(uint level) {
     void *slab;
 
+    static_assert(sizeof(pktbuf_t) <= sizeof(pktbuf_pool_object_t), "");
+
 #if LK_DEBUGLEVEL > 0
-    printf("pktbuf: creating %u pktbuf entries of size %zu (total %zu)\n",
+    printf("pktbuf: creating %u pktbuf entries of size %zu (total %zu), growing to %u\n",
            PKTBUF_POOL_SIZE, sizeof(struct pktbuf_pool_object),
-           PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object));
+           PKTBUF_POOL_SIZE * sizeof(struct pktbuf_pool_object), PKTBUF_POOL_MAX);
 #endif
 
     if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "pktbuf",
@@ -208,7 +575,8 @@ static void pktbuf_init(uint level) {
     }
 
     pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
-    sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
+    pktbuf_depot_count = pktbuf_total_count = PKTBUF_POOL_SIZE;
+    sem_init(&pktbuf_sem, 0);
 }
 
 LK_INIT_HOOK(pktbuf, pktbuf_init, LK_INIT_LEVEL_THREADING);
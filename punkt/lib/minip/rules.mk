@@ -12,10 +12,14 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/arp.c \
 	$(LOCAL_DIR)/chksum.c \
 	$(LOCAL_DIR)/dhcp.cpp \
+	$(LOCAL_DIR)/gro.c \
 	$(LOCAL_DIR)/lk_console.c \
+	$(LOCAL_DIR)/loopback.c \
 	$(LOCAL_DIR)/minip.c \
 	$(LOCAL_DIR)/net_timer.c \
+	$(LOCAL_DIR)/netbench.c \
 	$(LOCAL_DIR)/pktbuf.c \
+	$(LOCAL_DIR)/sendfile.c \
 	$(LOCAL_DIR)/tcp.c \
 	$(LOCAL_DIR)/udp.c
 
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "minip-internal.h"
+
+#include <arch/atomic.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <lk/err.h>
+#include <lk/list.h>
+#include <lk/trace.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <vm/vm.h>
+
+#if WITH_LIB_FS
+#include <lib/fs.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * tcp_sendfile. File data is read into physically contiguous chunks, which the
+ * block device can usually fill directly, and each chunk is lent to the socket
+ * a segment at a time as pktbuf external buffers. The pktbuf free callback hands
+ * the chunk back once the last of its segments is acked, which can happen in a
+ * driver's interrupt handler, so spent chunks go on a free list to be reused
+ * rather than back to the heap.
+ */
+
+#define SENDFILE_CHUNK_SIZE (64 * 1024)
+#define SENDFILE_MAX_CHUNKS 16
+
+struct sendfile_chunk {
+    struct list_node node;
+    volatile int ref; // segments holding on to it, plus one while they are being made
+    u8 *buf;
+};
+
+static spin_lock_t chunk_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node free_chunks = LIST_INITIAL_VALUE(free_chunks);
+static event_t chunk_event = EVENT_INITIAL_VALUE(chunk_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+static mutex_t chunk_grow_lock = MUTEX_INITIAL_VALUE(chunk_grow_lock);
+static uint chunk_count;
+
+static void sendfile_chunk_release(void *buf, void *arg) {
+    struct sendfile_chunk *c = arg;
+
+    if (atomic_add(&c->ref, -1) > 1)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&chunk_lock, state);
+    list_add_head(&free_chunks, &c->node);
+    spin_unlock_irqrestore(&chunk_lock, state);
+
+    event_signal(&chunk_event, false);
+}
+
+/* take a free chunk, making a new one while under the limit and otherwise
+ * waiting on one to come back */
+static struct sendfile_chunk *sendfile_chunk_alloc(void) {
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&chunk_lock, state);
+        struct sendfile_chunk *c = list_remove_head_type(&free_chunks, struct sendfile_chunk, node);
+        spin_unlock_irqrestore(&chunk_lock, state);
+        if (c)
+            return c;
+
+        mutex_acquire(&chunk_grow_lock);
+        if (chunk_count < SENDFILE_MAX_CHUNKS) {
+            c = malloc(sizeof(*c));
+            if (!c) {
+                mutex_release(&chunk_grow_lock);
+                return NULL;
+            }
+            void *buf;
+            if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "sendfile", SENDFILE_CHUNK_SIZE,
+                                     &buf, 0, 0, ARCH_MMU_FLAG_CACHED) < 0) {
+                mutex_release(&chunk_grow_lock);
+                free(c);
+                return NULL;
+            }
+            c->buf = buf;
+            chunk_count++;
+            mutex_release(&chunk_grow_lock);
+
+            LTRACEF("new chunk %p, %u total\n", c->buf, chunk_count);
+            return c;
+        }
+        mutex_release(&chunk_grow_lock);
+
+        event_wait(&chunk_event);
+    }
+}
+
+ssize_t tcp_sendfile(tcp_socket_t *socket, filehandle *handle, off_t offset, size_t len) {
+    LTRACEF("socket %p, handle %p, offset %lld, len %zu\n", socket, handle, offset, len);
+    if (!socket || !handle)
+        return ERR_INVALID_ARGS;
+
+    uint32_t mss = tcp_get_mss(socket);
+    if (mss == 0)
+        return ERR_CHANNEL_CLOSED;
+
+    ssize_t err = 0;
+    size_t sent = 0;
+    while (sent < len) {
+        size_t want = MIN(len - sent, SENDFILE_CHUNK_SIZE);
+
+        struct sendfile_chunk *c = sendfile_chunk_alloc();
+        if (!c) {
+            err = ERR_NO_MEMORY;
+            break;
+        }
+
+        c->ref = 1;
+        ssize_t n = fs_read_file(handle, c->buf, offset + sent, want);
+        if (n <= 0) {
+            sendfile_chunk_release(c->buf, c);
+            err = n;
+            break;
+        }
+
+        /* lend it out a segment at a time, each holding a reference to it */
+        struct list_node segs = LIST_INITIAL_VALUE(segs);
+        for (size_t pos = 0; pos < (size_t)n; pos += mss) {
+            u32 seg_len = MIN(mss, (size_t)n - pos);
+            pktbuf_t *p = pktbuf_alloc_empty();
+
+            atomic_add(&c->ref, 1);
+            pktbuf_add_buffer(p, c->buf + pos, seg_len, 0, 0, &sendfile_chunk_release, c);
+            pktbuf_append(p, seg_len);
+            list_add_tail(&segs, &p->list);
+        }
+        sendfile_chunk_release(c->buf, c);
+
+        ssize_t ret = tcp_write_segs(socket, &segs, n);
+        if (ret < 0) {
+            err = ret;
+            break;
+        }
+        sent += n;
+
+        /* the end of the file */
+        if ((size_t)n < want)
+            break;
+    }
+
+    return (sent > 0 || err == 0) ? (ssize_t)sent : err;
+}
+
+#endif // WITH_LIB_FS
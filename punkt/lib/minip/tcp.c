@@ -16,26 +16,16 @@
 #include <string.h>
 #include <sys/types.h>
 #include <lk/console_cmd.h>
-#include <lib/cbuf.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <arch/ops.h>
 #include <platform.h>
 #include <arch/atomic.h>
+#include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
 
-typedef struct tcp_header {
-    uint16_t source_port;
-    uint16_t dest_port;
-    uint32_t seq_num;
-    uint32_t ack_num;
-    uint16_t length_flags;
-    uint16_t win_size;
-    uint16_t checksum;
-    uint16_t urg_pointer;
-} __PACKED tcp_header_t;
-
 typedef struct tcp_pseudo_header {
     ipv4_addr source_addr;
     ipv4_addr dest_addr;
@@ -44,11 +34,33 @@ typedef struct tcp_pseudo_header {
     uint16_t tcp_length;
 } __PACKED tcp_pseudo_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+/* option kinds */
+#define TCP_OPT_END         0
+#define TCP_OPT_NOP         1
+#define TCP_OPT_MSS         2
+#define TCP_OPT_WSCALE      3
+#define TCP_OPT_TIMESTAMP   8
+
+#define TCP_TS_OPTION_LEN   12 // NOP NOP TS, sent on every segment once negotiated
+#define TCP_MAX_WSCALE      14
+
+/* room queued tx segments need in front of their payload to be sent in place */
+#define TCP_SEG_HEADROOM    (sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr) + sizeof(tcp_header_t) + TCP_TS_OPTION_LEN)
+static_assert(PKTBUF_MAX_HDR >= TCP_SEG_HEADROOM, "");
+
+/* most payload in one run of segments handed to a nic doing tso, bounded by
+ * the 16 bit ip length */
+#define TCP_GSO_MAX_DATA (0xffff - sizeof(struct ipv4_hdr) - sizeof(tcp_header_t) - TCP_TS_OPTION_LEN)
+
+/* options parsed out of an incoming segment */
+typedef struct tcp_options {
+    uint16_t mss;       // 0 if not present
+    bool ws;
+    uint8_t wscale;
+    bool ts;
+    uint32_t tsval;
+    uint32_t tsecr;
+} tcp_options_t;
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -64,17 +76,10 @@ typedef enum tcp_state {
     STATE_TIME_WAIT
 } tcp_state_t;
 
-typedef enum tcp_flags {
-    PKT_FIN = 1,
-    PKT_SYN = 2,
-    PKT_RST = 4,
-    PKT_PSH = 8,
-    PKT_ACK = 16,
-    PKT_URG = 32
-} tcp_flags_t;
-
 typedef struct tcp_socket {
-    struct list_node node;
+    struct list_node node;      // in tcp_socket_list
+    struct list_node hash_node; // in a connection or listen hash bucket
+    bool listener;              // which of the two tables hash_node is in
 
     mutex_t lock;
     volatile int ref;
@@ -85,14 +90,21 @@ typedef struct tcp_socket {
     uint16_t local_port;
     uint16_t remote_port;
 
-    uint32_t mss;
+    uint32_t mss; // largest payload we send, after per segment options
+
+    /* rfc 7323 options, decided during the handshake */
+    bool     ws_ok;      // window scaling in use in both directions
+    uint8_t  rx_wscale;  // shift applied to the windows we advertise
+    uint8_t  tx_wscale;  // shift applied to the windows they advertise
+    bool     ts_ok;      // timestamps on every segment
+    uint32_t ts_recent;  // their last timestamp, echoed back
 
     /* rx */
     uint32_t rx_win_size;
     uint32_t rx_win_low;
     uint32_t rx_win_high;
-    uint8_t  *rx_buffer_raw;
-    cbuf_t   rx_buffer;
+    struct list_node rx_queue; // in order pktbufs waiting to be read, trimmed to the payload
+    uint32_t rx_queued;  // bytes in rx_queue
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
@@ -100,13 +112,36 @@ typedef struct tcp_socket {
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
-    uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer;  // our outgoing buffer
-    uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    uint32_t tx_highest_seq; // next sequence to send, pulled back to tx_win_low on timeout
+    uint32_t tx_max_seq; // highest sequence ever sent
+    struct list_node tx_queue; // pktbuf segments holding everything from tx_win_low on
+    pktbuf_t *tx_next;    // send cursor, the segment holding tx_next_seq, or NULL
+    uint32_t tx_next_seq; // first sequence of tx_next
+    uint32_t tx_buffer_size; // most bytes tx_queue may hold
+    uint32_t tx_buffer_offset; // bytes in tx_queue
     event_t  tx_event;
     net_timer_t retransmit_timer;
 
+    /* our FIN goes out after the last byte of tx_queue */
+    bool     fin_queued;
+    bool     fin_sent;
+    uint32_t fin_seq;
+
+    /* round trip estimation and retransmit timeout (rfc 6298), in msecs */
+    int32_t  srtt;       // smoothed rtt << 3
+    int32_t  rttvar;     // rtt variance << 2
+    uint32_t rto;
+    bool     rtt_timing; // timing rtt_seq when timestamps are not in use
+    uint32_t rtt_seq;
+    lk_time_t rtt_start;
+
+    /* congestion control, NewReno (rfc 5681 and 6582), in bytes */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t dupacks;
+    bool     in_recovery;
+    uint32_t recover;
+
     /* listen accept */
     semaphore_t accept_sem;
     struct tcp_socket *accepted;
@@ -118,10 +153,14 @@ typedef struct tcp_socket {
 } tcp_socket_t;
 
 #define DEFAULT_MSS (1460)
-#define DEFAULT_RX_WINDOW_SIZE (8192)
-#define DEFAULT_TX_BUFFER_SIZE (8192)
-
-#define RETRANSMIT_TIMEOUT (50)
+#define MIN_MSS (536)
+#define DEFAULT_RX_WINDOW_SIZE (65536)
+#define DEFAULT_TX_BUFFER_SIZE (65536)
+#define MAX_BUFFER_SIZE (4 * 1024 * 1024)
+
+#define INITIAL_RTO (1000)
+#define MIN_RTO (200)   // rfc 6298 asks for 1 second, which is far too long on a lan
+#define MAX_RTO (60000)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
@@ -132,22 +171,68 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
+/* every socket, only walked by the debug console */
 static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
 
+/*
+ * Sockets are also hashed for tcp_input. Connected sockets are keyed on the full
+ * 4-tuple, listening sockets on the local port only. Each bucket has its own
+ * spinlock, held just long enough to find the socket and take a ref.
+ */
+#define TCP_CONN_HASH_SIZE (256)
+#define TCP_LISTEN_HASH_SIZE (32)
+
+typedef struct tcp_hash_bucket {
+    spin_lock_t lock;
+    struct list_node list;
+} tcp_hash_bucket_t;
+
+static tcp_hash_bucket_t tcp_conn_hash[TCP_CONN_HASH_SIZE];
+static tcp_hash_bucket_t tcp_listen_hash[TCP_LISTEN_HASH_SIZE];
+
 static bool tcp_debug = false;
 
+/* global counters, bumped without locking so only approximately exact */
+static struct tcp_counters {
+    uint64_t segs_in;
+    uint64_t segs_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t retransmit_segs;
+    uint64_t retransmit_bytes;
+    uint64_t fast_retransmits;
+    uint64_t timeouts;
+    uint64_t dupacks_in;
+    uint64_t out_of_order;
+    uint64_t resets_out;
+    uint64_t active_opens;
+    uint64_t passive_opens;
+    uint64_t zero_copy_out; // segments sent straight out of tx_queue
+    uint64_t copied_out;    // segments copied because they were still in flight or split
+    uint64_t zero_copy_in;  // segments queued in the buffer they arrived in
+    uint64_t copied_in;     // segments copied out of a driver buffer or onto a queued one
+    uint64_t rx_no_pktbuf;  // in order segments dropped for lack of a pktbuf
+    uint64_t gso_out;       // runs of segments left to the nic to cut up
+    uint64_t frags_in;      // packets that came in spread over several pktbufs
+} tcp_counters;
+
 /* local routines */
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
+static tcp_socket_t *create_tcp_socket(void);
+static void tcp_size_buffers(tcp_socket_t *s);
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
                          size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
+static status_t tcp_send_pktbuf(pktbuf_t *p, ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port,
+                                tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
 static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+static status_t tcp_socket_send_pktbuf(tcp_socket_t *s, pktbuf_t *p, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, bool pure_ack, const tcp_options_t *opts);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
@@ -155,12 +240,28 @@ static void tcp_remote_close(tcp_socket_t *s);
 static void tcp_wakeup_waiters(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
+static void tcp_timer_set(tcp_socket_t *s, net_timer_t *timer, net_timer_callback_t cb, lk_time_t delay);
+static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer);
 
 static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *buf, size_t len) {
     uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
     return ~ones_sum16(checksum, buf, len);
 }
 
+/* as cksum_pheader, over p and the frags it continues into */
+static uint16_t cksum_pheader_pktbuf(const tcp_pseudo_header_t *pheader, pktbuf_t *p) {
+    uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
+    checksum = ones_sum16(checksum, p->data, p->dlen);
+
+    size_t offset = p->dlen;
+    for (uint i = 0; i < p->nfrags; i++) {
+        pktbuf_t *f = p->frags[i];
+        checksum = ones_sum16_add(checksum, ones_sum16(0, f->data, f->dlen), offset & 1);
+        offset += f->dlen;
+    }
+    return ~checksum;
+}
+
 __NO_INLINE static void dump_tcp_header(const tcp_header_t *header) {
     printf("TCP: src_port %u, dest_port %u, seq %u, ack %u, win %u, flags %c%c%c%c%c%c\n",
            ntohs(header->source_port), ntohs(header->dest_port), ntohl(header->seq_num), ntohl(header->ack_num),
@@ -206,58 +307,225 @@ static void dump_socket(tcp_socket_t *s) {
            s, s->state, tcp_state_to_string(s->state),
            s->local_ip, s->local_port, s->remote_ip, s->remote_port, s->ref);
     if (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) {
-        printf("\trx: wsize %u wlo %u whi %u (%u)\n",
+        printf("\trx: wsize %u wlo %u whi %u (%u) queued %u\n",
                s->rx_win_size, s->rx_win_low, s->rx_win_high,
-               s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
+               s->rx_win_high - s->rx_win_low, s->rx_queued);
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u queued %u\n",
                s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
                s->tx_buffer_size, s->tx_buffer_offset);
+        printf("\tmss %u wscale %s rx %u tx %u timestamps %s\n",
+               s->mss, s->ws_ok ? "on" : "off", s->rx_wscale, s->tx_wscale, s->ts_ok ? "on" : "off");
+        printf("\tcwnd %u ssthresh %u%s srtt %d rttvar %d rto %u\n",
+               s->cwnd, s->ssthresh, s->in_recovery ? " (recovery)" : "",
+               s->srtt >> 3, s->rttvar >> 2, s->rto);
     }
 }
 
-static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port) {
-    LTRACEF_LEVEL(2, "remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
+void tcp_get_seg_counts(uint64_t *segs_in, uint64_t *segs_out) {
+    *segs_in = tcp_counters.segs_in;
+    *segs_out = tcp_counters.segs_out;
+}
 
-    mutex_acquire(&tcp_socket_list_lock);
+static void dump_counters(void) {
+    printf("segments in %llu out %llu\n", tcp_counters.segs_in, tcp_counters.segs_out);
+    printf("payload bytes in %llu out %llu\n", tcp_counters.bytes_in, tcp_counters.bytes_out);
+    printf("retransmitted segments %llu bytes %llu\n", tcp_counters.retransmit_segs, tcp_counters.retransmit_bytes);
+    printf("fast retransmits %llu, timeouts %llu, dupacks in %llu\n",
+           tcp_counters.fast_retransmits, tcp_counters.timeouts, tcp_counters.dupacks_in);
+    printf("out of order segments dropped %llu, resets sent %llu\n",
+           tcp_counters.out_of_order, tcp_counters.resets_out);
+    printf("active opens %llu, passive opens %llu\n", tcp_counters.active_opens, tcp_counters.passive_opens);
+    printf("segments out in place %llu copied %llu, in in place %llu copied %llu, dropped for no pktbuf %llu\n",
+           tcp_counters.zero_copy_out, tcp_counters.copied_out,
+           tcp_counters.zero_copy_in, tcp_counters.copied_in, tcp_counters.rx_no_pktbuf);
+    printf("segmentation offload sends %llu, multi buffer packets in %llu\n",
+           tcp_counters.gso_out, tcp_counters.frags_in);
+}
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
+static void parse_options(const uint8_t *opt, size_t len, tcp_options_t *out) {
+    memset(out, 0, sizeof(*out));
+
+    size_t i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == TCP_OPT_END)
+            break;
+        if (kind == TCP_OPT_NOP) {
+            i++;
             continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                    s->local_ip == local_ip &&
-                    s->remote_port == remote_port &&
-                    s->local_port == local_port) {
-                goto out;
-            }
         }
-    }
 
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+        /* everything else is kind, length, data */
+        if (i + 1 >= len)
+            break;
+        uint8_t olen = opt[i + 1];
+        if (olen < 2 || i + olen > len)
+            break;
+
+        switch (kind) {
+            case TCP_OPT_MSS:
+                if (olen == 4)
+                    out->mss = (opt[i + 2] << 8) | opt[i + 3];
+                break;
+            case TCP_OPT_WSCALE:
+                if (olen == 3) {
+                    out->ws = true;
+                    out->wscale = MIN(opt[i + 2], TCP_MAX_WSCALE);
+                }
+                break;
+            case TCP_OPT_TIMESTAMP:
+                if (olen == 10) {
+                    uint32_t val, ecr;
+                    memcpy(&val, &opt[i + 2], 4);
+                    memcpy(&ecr, &opt[i + 6], 4);
+                    out->ts = true;
+                    out->tsval = ntohl(val);
+                    out->tsecr = ntohl(ecr);
+                }
+                break;
         }
+        i += olen;
     }
+}
 
-    /* fall through case returns null */
-    s = NULL;
+static size_t build_ts_option(uint8_t *buf, uint32_t tsecr) {
+    uint32_t val = htonl((uint32_t)current_time());
+    uint32_t ecr = htonl(tsecr);
 
-out:
-    /* bump the ref before returning it */
-    if (s)
-        inc_socket_ref(s);
+    buf[0] = TCP_OPT_NOP;
+    buf[1] = TCP_OPT_NOP;
+    buf[2] = TCP_OPT_TIMESTAMP;
+    buf[3] = 10;
+    memcpy(&buf[4], &val, 4);
+    memcpy(&buf[8], &ecr, 4);
 
-    mutex_release(&tcp_socket_list_lock);
+    return TCP_TS_OPTION_LEN;
+}
 
-    return s;
+/* options for SYN and SYN|ACK. buf needs room for 20 bytes */
+static size_t build_syn_options(tcp_socket_t *s, uint8_t *buf, bool ws, bool ts) {
+    size_t len = 0;
+
+    buf[len++] = TCP_OPT_MSS;
+    buf[len++] = 4;
+    buf[len++] = DEFAULT_MSS >> 8;
+    buf[len++] = DEFAULT_MSS & 0xff;
+
+    if (ws) {
+        buf[len++] = TCP_OPT_NOP;
+        buf[len++] = TCP_OPT_WSCALE;
+        buf[len++] = 3;
+        buf[len++] = s->rx_wscale;
+    }
+
+    if (ts) {
+        len += build_ts_option(&buf[len], s->ts_recent);
+    }
+
+    return len;
+}
+
+/* settle on the send mss once we know what options are in use */
+static void tcp_set_mss(tcp_socket_t *s, uint16_t their_mss) {
+    s->mss = MIN(their_mss ? their_mss : MIN_MSS, DEFAULT_MSS);
+    if (s->ts_ok)
+        s->mss -= TCP_TS_OPTION_LEN;
+
+    /* initial window, rfc 6928 */
+    s->cwnd = MIN(10 * s->mss, MAX(2 * s->mss, 14600u));
+    s->ssthresh = UINT32_MAX;
+}
+
+static uint32_t tcp_tx_flight(const tcp_socket_t *s) {
+    return s->tx_highest_seq - s->tx_win_low;
+}
+
+/* feed a round trip sample into the rto calculation (rfc 6298 section 2) */
+static void tcp_rtt_sample(tcp_socket_t *s, int32_t rtt) {
+    if (rtt < 0)
+        return;
+
+    if (s->srtt == 0 && s->rttvar == 0) {
+        s->srtt = rtt << 3;
+        s->rttvar = rtt << 1;
+    } else {
+        int32_t delta = rtt - (s->srtt >> 3);
+        s->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        s->rttvar += delta - (s->rttvar >> 2);
+    }
+
+    uint32_t rto = (s->srtt >> 3) + MAX(1, s->rttvar);
+    s->rto = MIN(MAX(rto, MIN_RTO), MAX_RTO);
+}
+
+/* (re)start the retransmit timer if there is anything unacked */
+static void tcp_rearm_retransmit(tcp_socket_t *s) {
+    if (tcp_tx_flight(s) == 0) {
+        tcp_timer_cancel(s, &s->retransmit_timer);
+    } else {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+    }
+}
+
+static tcp_hash_bucket_t *conn_hash_bucket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port) {
+    uint32_t h = remote_ip ^ (local_ip * 0x9e3779b1) ^ (((uint32_t)remote_port << 16) | local_port);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+
+    return &tcp_conn_hash[h % TCP_CONN_HASH_SIZE];
+}
+
+static tcp_hash_bucket_t *listen_hash_bucket(uint16_t local_port) {
+    return &tcp_listen_hash[local_port % TCP_LISTEN_HASH_SIZE];
+}
+
+static tcp_hash_bucket_t *socket_hash_bucket(tcp_socket_t *s) {
+    if (s->listener)
+        return listen_hash_bucket(s->local_port);
+
+    return conn_hash_bucket(s->remote_ip, s->local_ip, s->remote_port, s->local_port);
+}
+
+static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port) {
+    LTRACEF_LEVEL(2, "remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
+
+    tcp_socket_t *s;
+    spin_lock_saved_state_t state;
+
+    /* look for an exact match first */
+    tcp_hash_bucket_t *b = conn_hash_bucket(remote_ip, local_ip, remote_port, local_port);
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, hash_node) {
+        if (s->state != STATE_CLOSED &&
+                s->remote_ip == remote_ip &&
+                s->local_ip == local_ip &&
+                s->remote_port == remote_port &&
+                s->local_port == local_port) {
+            /* bump the ref before returning it */
+            inc_socket_ref(s);
+            spin_unlock_irqrestore(&b->lock, state);
+            return s;
+        }
+    }
+    spin_unlock_irqrestore(&b->lock, state);
+
+    /* sockets in listen state only care about local port */
+    b = listen_hash_bucket(local_port);
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, hash_node) {
+        if (s->state == STATE_LISTEN && s->local_port == local_port) {
+            inc_socket_ref(s);
+            spin_unlock_irqrestore(&b->lock, state);
+            return s;
+        }
+    }
+    spin_unlock_irqrestore(&b->lock, state);
+
+    return NULL;
 }
 
 static void add_socket_to_list(tcp_socket_t *s) {
@@ -268,6 +536,15 @@ static void add_socket_to_list(tcp_socket_t *s) {
 
     list_add_head(&tcp_socket_list, &s->node);
 
+    /* the addressing of a socket is fixed by the time it gets here */
+    s->listener = (s->state == STATE_LISTEN);
+    tcp_hash_bucket_t *b = socket_hash_bucket(s);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&b->lock, state);
+    list_add_head(&b->list, &s->hash_node);
+    spin_unlock_irqrestore(&b->lock, state);
+
     mutex_release(&tcp_socket_list_lock);
 }
 
@@ -280,9 +557,23 @@ static void remove_socket_from_list(tcp_socket_t *s) {
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
 
+    tcp_hash_bucket_t *b = socket_hash_bucket(s);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&b->lock, state);
+    DEBUG_ASSERT(list_in_list(&s->hash_node));
+    list_delete(&s->hash_node);
+    spin_unlock_irqrestore(&b->lock, state);
+
     mutex_release(&tcp_socket_list_lock);
 }
 
+static void free_pktbuf_list(struct list_node *list) {
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(list, pktbuf_t, list)) != NULL)
+        pktbuf_free(p, false);
+}
+
 static void inc_socket_ref(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
 
@@ -303,8 +594,8 @@ static bool dec_socket_ref(tcp_socket_t *s) {
         event_destroy(&s->rx_event);
         event_destroy(&s->connect_event);
 
-        free(s->rx_buffer_raw);
-        free(s->tx_buffer);
+        free_pktbuf_list(&s->rx_queue);
+        free_pktbuf_list(&s->tx_queue);
 
         free(s);
     }
@@ -328,6 +619,17 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer) {
         dec_socket_ref(s);
 }
 
+void tcp_init(void) {
+    for (size_t i = 0; i < countof(tcp_conn_hash); i++) {
+        tcp_conn_hash[i].lock = SPIN_LOCK_INITIAL_VALUE;
+        list_initialize(&tcp_conn_hash[i].list);
+    }
+    for (size_t i = 0; i < countof(tcp_listen_hash); i++) {
+        tcp_listen_hash[i].lock = SPIN_LOCK_INITIAL_VALUE;
+        list_initialize(&tcp_listen_hash[i].list);
+    }
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
     if (unlikely(tcp_debug))
         TRACEF("p %p (len %u), src_ip 0x%x, dst_ip 0x%x\n", p, p->dlen, src_ip, dst_ip);
@@ -349,8 +651,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         return;
     }
 
-    /* checksum */
-    if (FORCE_TCP_CHECKSUM || (p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD) == 0) {
+    /* checksum. segments merged by gro only have the nic's word for it, theirs
+     * no longer covers the packet */
+    size_t total_len = pktbuf_total_len(p);
+    if ((FORCE_TCP_CHECKSUM && p->nfrags == 0) || (p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD) == 0) {
         tcp_pseudo_header_t pheader;
 
         // set up the pseudo header for checksum purposes
@@ -358,9 +662,9 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         pheader.dest_addr = dst_ip;
         pheader.zero = 0;
         pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+        pheader.tcp_length = htons(total_len);
 
-        uint16_t checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        uint16_t checksum = cksum_pheader_pktbuf(&pheader, p);
         if (checksum != 0) {
             TRACEF("REJECT: failed checksum, header says 0x%x, we got 0x%x\n", header->checksum, checksum);
             return;
@@ -378,8 +682,17 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
 
     /* get some data from the packet */
     uint8_t packet_flags = header->length_flags & 0x3f;
-    size_t data_len = p->dlen - header_len;
+    size_t data_len = total_len - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
+    bool pure_ack = (data_len == 0) && !(packet_flags & (PKT_SYN | PKT_FIN | PKT_RST));
+
+    tcp_options_t opts;
+    parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &opts);
+
+    tcp_counters.segs_in++;
+    tcp_counters.bytes_in += data_len;
+    if (p->nfrags)
+        tcp_counters.frags_in++;
 
     /* see if it matches a socket we have */
     tcp_socket_t *s = lookup_socket(src_ip, dst_ip, header->source_port, header->dest_port);
@@ -396,6 +709,15 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
 
     mutex_acquire(&s->lock);
 
+    /* windows are only scaled outside of the handshake */
+    uint32_t win_size = header->win_size;
+    if (s->ws_ok && !(packet_flags & PKT_SYN))
+        win_size <<= s->tx_wscale;
+
+    /* remember their timestamp if this segment is in order */
+    if (s->ts_ok && opts.ts && SEQUENCE_LTE(header->seq_num, s->rx_win_low))
+        s->ts_recent = opts.tsval;
+
     /* check to see if they're resetting us */
     if (packet_flags & PKT_RST) {
         if (s->state != STATE_CLOSED && s->state != STATE_LISTEN) {
@@ -421,21 +743,35 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             if (s->accepted != NULL)
                 goto done;
 
-            /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            /* make a new accept socket, with the buffer sizes set on the listener */
+            tcp_socket_t *accept_socket = create_tcp_socket();
             if (!accept_socket)
                 goto done;
 
+            accept_socket->rx_win_size = s->rx_win_size;
+            accept_socket->tx_buffer_size = s->tx_buffer_size;
+            tcp_size_buffers(accept_socket);
+
             /* set it up */
-            accept_socket->local_ip = minip_get_ipaddr();
+            accept_socket->local_ip = dst_ip;
             accept_socket->local_port = s->local_port;
             accept_socket->remote_ip = src_ip;
             accept_socket->remote_port = header->source_port;
             accept_socket->state = STATE_SYN_RCVD;
 
+            /* use the options they offered */
+            accept_socket->ws_ok = opts.ws;
+            accept_socket->tx_wscale = opts.ws ? opts.wscale : 0;
+            if (!opts.ws)
+                accept_socket->rx_wscale = 0;
+            accept_socket->ts_ok = opts.ts;
+            accept_socket->ts_recent = opts.tsval;
+            tcp_set_mss(accept_socket, opts.mss);
+
             mutex_acquire(&accept_socket->lock);
 
             add_socket_to_list(accept_socket);
+            tcp_counters.passive_opens++;
 
             /* remember their sequence */
             accept_socket->rx_win_low = header->seq_num + 1;
@@ -445,18 +781,18 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
 
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
-
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
+            uint8_t syn_options[20];
+            size_t syn_options_len = build_syn_options(accept_socket, syn_options, accept_socket->ws_ok, accept_socket->ts_ok);
+            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, syn_options, syn_options_len,
                             accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
             accept_socket->tx_win_low++;
+            accept_socket->tx_highest_seq = accept_socket->tx_win_low;
+            accept_socket->tx_max_seq = accept_socket->tx_win_low;
+            /* rfc 6582: recover starts at the ISS, so the first data segment can be fast retransmitted */
+            accept_socket->recover = accept_socket->tx_win_low - 1;
 
             mutex_release(&accept_socket->lock);
             break;
@@ -474,8 +810,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + win_size;
                 s->tx_highest_seq = s->tx_win_low;
+                s->tx_max_seq = s->tx_win_low;
+                s->recover = s->tx_win_low - 1;
 
                 s->state = STATE_ESTABLISHED;
             } else {
@@ -504,13 +842,24 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
                 goto send_reset;
             }
 
+            // see which of the options we offered they agreed to
+            s->ws_ok = opts.ws;
+            s->tx_wscale = opts.ws ? opts.wscale : 0;
+            if (!opts.ws)
+                s->rx_wscale = 0;
+            s->ts_ok = opts.ts;
+            s->ts_recent = opts.tsval;
+            tcp_set_mss(s, opts.mss);
+
             // remember their sequence
             s->rx_win_low = header->seq_num + 1;
             s->rx_win_high = s->rx_win_low + s->rx_win_size - 1;
 
             s->tx_win_low++;
-            s->tx_win_high = s->tx_win_low + header->win_size;
+            s->tx_win_high = s->tx_win_low + win_size;
             s->tx_highest_seq = s->tx_win_low;
+            s->tx_max_seq = s->tx_win_low;
+            s->recover = s->tx_win_low - 1;
 
             s->state = STATE_ESTABLISHED;
 
@@ -525,12 +874,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, win_size, pure_ack, &opts);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -551,7 +900,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, win_size, pure_ack, &opts);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -560,7 +909,11 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             break;
         case STATE_LAST_ACK:
             if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+                /* they may still be acking data queued ahead of our FIN */
+                handle_ack(s, header->ack_num, win_size, pure_ack, &opts);
+                if (!s->fin_sent || SEQUENCE_LTE(s->tx_win_low, s->fin_seq))
+                    break;
+
                 tcp_remote_close(s);
 
                 /* tcp_close() was already called on us, remove us from the list and drop the ref */
@@ -570,7 +923,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             break;
         case STATE_FIN_WAIT_1:
             if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+                handle_ack(s, header->ack_num, win_size, pure_ack, &opts);
+            }
+            if (s->fin_sent && SEQUENCE_GT(s->tx_win_low, s->fin_seq)) {
+                /* they've acked our FIN */
                 s->state = STATE_FIN_WAIT_2;
                 /* drop into fin_wait_2 state logic, in case they were FINning us too */
                 goto fin_wait_2;
@@ -595,7 +951,10 @@ fin_wait_2:
             break;
         case STATE_CLOSING:
             if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+                handle_ack(s, header->ack_num, win_size, pure_ack, &opts);
+            }
+            if (s->fin_sent && SEQUENCE_GT(s->tx_win_low, s->fin_seq)) {
+                /* they've acked our FIN */
                 s->state = STATE_TIME_WAIT;
 
                 /* set timed wait timer */
@@ -620,41 +979,112 @@ send_reset:
 
     LTRACEF("SEND RST\n");
     if (!(packet_flags & PKT_RST)) {
+        tcp_counters.resets_out++;
         tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
                  NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0);
     }
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence) {
+/* take the payload left in p onto the receive queue. p still belongs to the driver,
+ * so its buffer is either swapped out from under it or copied */
+static bool tcp_rx_enqueue(tcp_socket_t *s, pktbuf_t *p) {
+    uint32_t len = p->dlen;
+    pktbuf_t *tail = list_peek_tail_type(&s->rx_queue, pktbuf_t, list);
+
+    if (tail && len < s->mss && pktbuf_avail_tail(tail) >= len) {
+        /* pack small segments together instead of holding a buffer for each */
+        pktbuf_append_data(tail, p->data, len);
+        tcp_counters.copied_in++;
+    } else {
+        pktbuf_t *q = pktbuf_detach(p);
+        if (q) {
+            tcp_counters.zero_copy_in++;
+        } else {
+            /* the driver's buffer isn't from the pool, copy into one that is */
+            q = pktbuf_alloc_nowait();
+            if (!q)
+                return false;
+            if (pktbuf_avail_tail(q) < len)
+                pktbuf_reset(q, 0);
+            pktbuf_append_data(q, p->data, len);
+            tcp_counters.copied_in++;
+        }
+        list_add_tail(&s->rx_queue, &q->list);
+    }
+
+    s->rx_queued += len;
+    return true;
+}
+
+/* queue len bytes of the payload in p and the frags it continues into, starting
+ * offset bytes in, trimming each pktbuf to its share. Returns the bytes queued,
+ * short if the pool ran dry. */
+static size_t tcp_rx_enqueue_chain(tcp_socket_t *s, pktbuf_t *p, size_t offset, size_t len) {
+    size_t queued = 0;
+    for (uint i = 0; i <= p->nfrags && queued < len; i++) {
+        pktbuf_t *f = (i == 0) ? p : p->frags[i - 1];
+        if (offset >= f->dlen) {
+            offset -= f->dlen;
+            continue;
+        }
+
+        pktbuf_consume(f, offset);
+        offset = 0;
+        if (f->dlen > len - queued)
+            pktbuf_consume_tail(f, f->dlen - (len - queued));
+
+        size_t n = f->dlen;
+        if (!tcp_rx_enqueue(s, f))
+            break;
+        queued += n;
+    }
+    return queued;
+}
+
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence) {
     if (unlikely(tcp_debug))
-        TRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
+        TRACEF("data %p, len %u, sequence %u\n", p->data, p->dlen, sequence);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(data);
-    DEBUG_ASSERT(len > 0);
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(p->dlen > 0);
 
     /* see if it matches our current window */
+    size_t len = pktbuf_total_len(p);
     uint32_t sequence_top = sequence + len - 1;
     if (SEQUENCE_LTE(sequence, s->rx_win_low) && SEQUENCE_GTE(sequence_top, s->rx_win_low)) {
         /* it intersects the bottom of our window, so it's in order */
 
-        /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
+        /* trim the pktbuf down to the part we need */
+        size_t offset = s->rx_win_low - sequence;
         size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
 
         DEBUG_ASSERT(offset < len);
 
-        LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
+        LTRACEF("queueing from offset %zu, len %zu\n", offset, copy_len);
+
+        if (copy_len > 0) {
+            size_t queued = tcp_rx_enqueue_chain(s, p, offset, copy_len);
+            if (queued < copy_len) {
+                /* out of pktbufs, drop the rest and let them retransmit it */
+                tcp_counters.rx_no_pktbuf++;
+                s->rx_win_low += queued;
+                if (queued > 0)
+                    event_signal(&s->rx_event, true);
+                send_ack(s);
+                return;
+            }
+        }
 
         s->rx_win_low += copy_len;
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
         event_signal(&s->rx_event, true);
 
-        /* keep a counter if they've been sending a full mss */
+        /* keep a counter if they've been sending a full mss, a packet put
+         * together by gro counts for each segment in it */
         if (copy_len >= s->mss) {
-            s->rx_full_mss_count++;
+            s->rx_full_mss_count += copy_len / s->mss;
         } else {
             s->rx_full_mss_count = 0;
         }
@@ -670,25 +1100,41 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     } else {
         // either out of order or completely out of our window, drop
         // duplicately ack the last thing we really got
+        tcp_counters.out_of_order++;
         send_ack(s);
     }
 }
 
 static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
                                 const void *options, size_t options_length, uint32_t sequence) {
+    DEBUG_ASSERT(len == 0 || data);
+
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    if (len > 0)
+        pktbuf_append_data_csum(p, data, len);
+
+    return tcp_socket_send_pktbuf(s, p, flags, options, options_length, sequence);
+}
+
+/* send p, which holds just the payload, consuming a reference to it */
+static status_t tcp_socket_send_pktbuf(tcp_socket_t *s, pktbuf_t *p, tcp_flags_t flags,
+                                       const void *options, size_t options_length, uint32_t sequence) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(len == 0 || data);
+    DEBUG_ASSERT(p);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
     // calculate the new right edge of the rx window
-    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
+    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - s->rx_queued - 1;
 
-    LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
-            s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
+    LTRACEF("rx_win_low %u rx_win_size %u rx_queued %u, new win high %u\n",
+            s->rx_win_low, s->rx_win_size, s->rx_queued, rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win_size;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
         win_size = rx_win_high - s->rx_win_low;
@@ -698,13 +1144,25 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
         win_size = s->rx_win_high - s->rx_win_low;
     }
 
+    // the window in a SYN is never scaled
+    if (s->ws_ok && !(flags & PKT_SYN))
+        win_size >>= s->rx_wscale;
+    win_size = MIN(win_size, 0xffffu);
+
+    // once negotiated, every segment carries a timestamp
+    uint8_t ts_option[TCP_TS_OPTION_LEN];
+    if (s->ts_ok && !options) {
+        options_length = build_ts_option(ts_option, s->ts_recent);
+        options = ts_option;
+    }
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    status_t err = tcp_send_pktbuf(p, s->remote_ip, s->remote_port, s->local_ip, s->local_port, flags,
+                                   options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
 
     return err;
 }
@@ -713,22 +1171,41 @@ static void send_ack(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
-    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT &&
+            s->state != STATE_FIN_WAIT_1 && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_highest_seq);
 }
 
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
                          size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size) {
     DEBUG_ASSERT(len == 0 || buf);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
 
     pktbuf_t *p = pktbuf_alloc();
     if (!p)
         return ERR_NO_MEMORY;
 
+    /* append the data */
+    if (len > 0)
+        pktbuf_append_data_csum(p, buf, len);
+
+    return tcp_send_pktbuf(p, dest_ip, dest_port, src_ip, src_port, flags, options, options_length,
+                           ack, sequence, window_size);
+}
+
+/* put the tcp header in front of the payload in p and hand it to ip */
+static status_t tcp_send_pktbuf(pktbuf_t *p, ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port,
+                                tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size) {
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(options_length == 0 || options);
+    DEBUG_ASSERT((options_length % 4) == 0);
+
+    /* the payload may have been summed as it was copied in */
+    bool have_data_sum = p->flags & PKTBUF_FLAG_DATA_CSUM;
+    uint16_t data_sum = p->csum;
+    uint32_t data_len = p->dlen;
+
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
 
@@ -744,20 +1221,24 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
-
     /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
-
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(pktbuf_total_len(p));
+
+    if ((p->flags & PKTBUF_FLAG_GSO_TCP) ||
+            (!FORCE_TCP_CHECKSUM && (minip_route_offloads(dest_ip) & MINIP_OFFLOAD_TX_TCP_CKSUM))) {
+        /* seed the field with the pseudo header and let the nic sum the rest */
+        header->checksum = ones_sum16(0, &pheader, sizeof(pheader));
+        p->flags |= PKTBUF_FLAG_CKSUM_TCP_PARTIAL;
+    } else if (have_data_sum) {
+        /* the header is a whole number of words, so only it needs summing */
+        uint16_t sum = ones_sum16(data_sum, &pheader, sizeof(pheader));
+        header->checksum = ~ones_sum16(sum, header, p->dlen - data_len);
+    } else {
         header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
     }
 
@@ -766,12 +1247,195 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
         dump_tcp_header(header);
     }
 
+    tcp_counters.segs_out++;
+
     status_t err = minip_ipv4_send(p, dest_ip, IP_PROTO_TCP);
 
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
+/* find the queued segment holding sequence and the offset of it in there. The
+ * cursor makes walking forward through the queue as data goes out cheap. */
+static pktbuf_t *tcp_tx_find(tcp_socket_t *s, uint32_t sequence, uint32_t *offset) {
+    pktbuf_t *p = s->tx_next;
+    uint32_t start = s->tx_next_seq;
+    if (!p || SEQUENCE_LT(sequence, start)) {
+        p = list_peek_head_type(&s->tx_queue, pktbuf_t, list);
+        start = s->tx_win_low;
+    }
+
+    while (p && SEQUENCE_GTE(sequence, start + p->dlen)) {
+        start += p->dlen;
+        p = list_next_type(&s->tx_queue, &p->list, pktbuf_t, list);
+    }
+
+    if (p) {
+        s->tx_next = p;
+        s->tx_next_seq = start;
+        *offset = sequence - start;
+    }
+    return p;
+}
+
+/* send the whole queued segments from seg on that fit in len as one packet,
+ * for the nic to cut back into mss sized ones. The segments go along as frags,
+ * so they can still be in flight from an earlier send. Returns how much went
+ * out, or 0 if it would not have been more than one segment. */
+static uint32_t tcp_send_gso(tcp_socket_t *s, pktbuf_t *seg, uint32_t sequence, uint32_t len, tcp_flags_t flags) {
+    pktbuf_t *p = pktbuf_alloc_nowait();
+    if (!p)
+        return 0;
+
+    uint32_t total = 0;
+    while (seg && p->nfrags < PKTBUF_MAX_FRAGS && total + seg->dlen <= len) {
+        pktbuf_ref(seg);
+        pktbuf_add_frag(p, seg);
+        total += seg->dlen;
+        seg = list_next_type(&s->tx_queue, &seg->list, pktbuf_t, list);
+    }
+
+    if (total <= s->mss) {
+        pktbuf_free(p, false);
+        return 0;
+    }
+
+    if (sequence + total == s->tx_win_low + s->tx_buffer_offset)
+        flags |= PKT_PSH;
+
+    p->flags |= PKTBUF_FLAG_GSO_TCP;
+    p->gso_size = s->mss;
+    tcp_socket_send_pktbuf(s, p, flags, NULL, 0, sequence);
+    tcp_counters.gso_out++;
+
+    return total;
+}
+
+/* send up to len bytes of queued data starting at sequence, never crossing a
+ * segment boundary unless the nic does tso. Returns how much went out. */
+static uint32_t tcp_send_data(tcp_socket_t *s, uint32_t sequence, uint32_t len, tcp_flags_t flags) {
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    uint32_t offset;
+    pktbuf_t *seg = tcp_tx_find(s, sequence, &offset);
+    if (!seg)
+        return 0;
+
+    if (len > s->mss && offset == 0 && (minip_route_offloads(s->remote_ip) & MINIP_OFFLOAD_TX_TCP_TSO)) {
+        uint32_t sent = tcp_send_gso(s, seg, sequence, len, flags);
+        if (sent > 0)
+            return sent;
+    }
+
+    len = MIN(len, seg->dlen - offset);
+    if (sequence + len == s->tx_win_low + s->tx_buffer_offset)
+        flags |= PKT_PSH;
+
+    if (offset == 0 && len == seg->dlen && !pktbuf_is_shared(seg) &&
+            pktbuf_avail_head(seg) >= TCP_SEG_HEADROOM) {
+        /* build the headers in front of the queued payload and send the segment itself,
+         * the extra reference keeps it on the queue until it is acked */
+        u8 *data = seg->data;
+        u32 seg_flags = seg->flags;
+        pktbuf_ref(seg);
+        tcp_socket_send_pktbuf(s, seg, flags, NULL, 0, sequence);
+        seg->data = data;
+        seg->dlen = len;
+        seg->flags = seg_flags;
+        tcp_counters.zero_copy_out++;
+    } else {
+        /* the nic still has the last send of it, or only part of it is going */
+        tcp_socket_send(s, seg->data + offset, len, flags, NULL, 0, sequence);
+        tcp_counters.copied_out++;
+    }
+
+    return len;
+}
+
+/* drop len acked bytes off the front of the tx queue */
+static void tcp_tx_trim(tcp_socket_t *s, uint32_t len) {
+    DEBUG_ASSERT(len <= s->tx_buffer_offset);
+
+    s->tx_buffer_offset -= len;
+    while (len > 0) {
+        pktbuf_t *p = list_peek_head_type(&s->tx_queue, pktbuf_t, list);
+        DEBUG_ASSERT(p);
+
+        if (len < p->dlen) {
+            pktbuf_consume(p, len);
+            if (s->tx_next == p)
+                s->tx_next_seq += len;
+            break;
+        }
+
+        len -= p->dlen;
+        list_delete(&p->list);
+        if (s->tx_next == p)
+            s->tx_next = NULL;
+        pktbuf_free(p, false);
+    }
+}
+
+/* copy as much of buf as fits onto the end of the tx queue, topping up the last
+ * segment before starting new ones. *spare is used ahead of allocating. */
+static size_t tcp_tx_append(tcp_socket_t *s, const uint8_t *buf, size_t len, pktbuf_t **spare) {
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    size_t copied = 0;
+    pktbuf_t *tail = list_peek_tail_type(&s->tx_queue, pktbuf_t, list);
+    while (copied < len) {
+        /* a segment the nic still holds can't be written to */
+        uint32_t room = 0;
+        if (tail && !pktbuf_is_shared(tail) && tail->dlen < s->mss)
+            room = MIN(pktbuf_avail_tail(tail), s->mss - tail->dlen);
+
+        if (room == 0) {
+            if (*spare) {
+                tail = *spare;
+                *spare = NULL;
+            } else {
+                tail = pktbuf_alloc_nowait();
+                if (!tail)
+                    break;
+            }
+            list_add_tail(&s->tx_queue, &tail->list);
+            continue;
+        }
+
+        size_t n = MIN(room, len - copied);
+        pktbuf_append_data_csum(tail, buf + copied, n);
+        copied += n;
+    }
+
+    s->tx_buffer_offset += copied;
+    return copied;
+}
+
+/* resend the first unacked segment, or our FIN if that is all that is left */
+static void tcp_retransmit_first(tcp_socket_t *s) {
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    uint32_t len = MIN(s->mss, s->tx_buffer_offset);
+    LTRACEF("s %p, len %u seq %u\n", s, len, s->tx_win_low);
+
+    if (len > 0) {
+        len = tcp_send_data(s, s->tx_win_low, len, PKT_ACK|PKT_PSH);
+    } else if (s->fin_sent) {
+        tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->fin_seq);
+    } else {
+        return;
+    }
+
+    tcp_counters.retransmit_segs++;
+    tcp_counters.retransmit_bytes += len;
+
+    /* Karn: never time a retransmitted segment */
+    s->rtt_timing = false;
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, bool pure_ack, const tcp_options_t *opts) {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
     DEBUG_ASSERT(s);
@@ -779,39 +1443,92 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
 
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
             s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
-    } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
+    } else if (SEQUENCE_GT(sequence, s->tx_max_seq)) {
         /* they're acking stuff we haven't sent */
         return;
+    } else if (sequence == s->tx_win_low) {
+        /* nothing new acked, but the window may have moved */
+        uint32_t tx_win_high = s->tx_win_low + win_size;
+        bool window_update = (tx_win_high != s->tx_win_high);
+        s->tx_win_high = tx_win_high;
+
+        if (pure_ack && !window_update && tcp_tx_flight(s) > 0) {
+            /* duplicate ack, something in front of what they have was lost */
+            tcp_counters.dupacks_in++;
+            s->dupacks++;
+            if (!s->in_recovery && s->dupacks == 3 && SEQUENCE_GT(sequence - 1, s->recover)) {
+                /* fast retransmit, then fast recovery until everything sent so far is acked */
+                s->ssthresh = MAX(tcp_tx_flight(s) / 2, 2 * s->mss);
+                tcp_retransmit_first(s);
+                tcp_counters.fast_retransmits++;
+                s->cwnd = s->ssthresh + 3 * s->mss;
+                s->in_recovery = true;
+                s->recover = s->tx_highest_seq;
+            } else if (s->in_recovery) {
+                /* each dupack means a segment left the network */
+                s->cwnd += s->mss;
+            }
+        }
     } else {
         /* their ack is somewhere in our window */
-        uint32_t acked_len;
-
-        acked_len = (sequence - s->tx_win_low);
+        uint32_t acked_len = (sequence - s->tx_win_low);
 
         LTRACEF("acked len %u\n", acked_len);
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+        /* sample the round trip time */
+        if (s->ts_ok && opts->ts && opts->tsecr != 0) {
+            tcp_rtt_sample(s, (int32_t)((uint32_t)current_time() - opts->tsecr));
+        } else if (s->rtt_timing && SEQUENCE_GT(sequence, s->rtt_seq)) {
+            tcp_rtt_sample(s, (int32_t)(current_time() - s->rtt_start));
+            s->rtt_timing = false;
+        }
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+        /* a FIN past the end of the queue takes up a sequence too */
+        uint32_t data_acked = MIN(acked_len, s->tx_buffer_offset);
 
-        s->tx_buffer_offset -= acked_len;
+        tcp_tx_trim(s, data_acked);
         s->tx_win_low += acked_len;
         s->tx_win_high = s->tx_win_low + win_size;
 
-        /* cancel or reset our retransmit timer */
-        if (s->tx_win_low == s->tx_highest_seq) {
-            tcp_timer_cancel(s, &s->retransmit_timer);
+        /* after a timeout we may have pulled tx_highest_seq back below what they had */
+        if (SEQUENCE_LT(s->tx_highest_seq, s->tx_win_low))
+            s->tx_highest_seq = s->tx_win_low;
+
+        /* congestion window */
+        if (s->in_recovery) {
+            if (SEQUENCE_GTE(sequence, s->recover)) {
+                /* full ack, leave recovery */
+                s->cwnd = MIN(s->ssthresh, tcp_tx_flight(s) + s->mss);
+                s->in_recovery = false;
+                s->dupacks = 0;
+            } else {
+                /* partial ack, the next hole is lost too */
+                tcp_retransmit_first(s);
+                s->cwnd = (s->cwnd > acked_len ? s->cwnd - acked_len : 0) + s->mss;
+            }
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            s->dupacks = 0;
+            if (s->cwnd < s->ssthresh) {
+                /* slow start */
+                s->cwnd += MIN(acked_len, s->mss);
+            } else {
+                /* congestion avoidance, about one mss per round trip */
+                s->cwnd += MAX(1u, s->mss * s->mss / s->cwnd);
+            }
         }
 
+        /* cancel or reset our retransmit timer */
+        tcp_rearm_retransmit(s);
+
         /* we have opened the transmit buffer */
         event_signal(&s->tx_event, true);
     }
+
+    /* the ack clock lets more data out */
+    tcp_write_pending_data(s);
 }
 
 static ssize_t tcp_write_pending_data(tcp_socket_t *s) {
@@ -820,50 +1537,74 @@ static ssize_t tcp_write_pending_data(tcp_socket_t *s) {
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(s->tx_buffer_size > 0);
-    DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-
-    /* do we have any new data to send? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = s->tx_buffer_offset - outstanding;
-    LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
 
-    /* send packets that cover the pending area of the window */
-    uint32_t offset = 0;
-    while (offset < pending) {
-        uint32_t tosend = MIN(s->mss, pending - offset);
-
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
-        s->tx_highest_seq += tosend;
-        offset += tosend;
-    }
-
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
-    }
+    if (s->fin_sent || s->tx_buffer_size == 0)
+        return 0;
 
-    return offset;
-}
+    /* send as much of the pending data as the congestion and receive windows allow,
+     * in runs of segments at a time if the nic will cut them up */
+    uint32_t max_send = s->mss;
+    if (minip_route_offloads(s->remote_ip) & MINIP_OFFLOAD_TX_TCP_TSO)
+        max_send = TCP_GSO_MAX_DATA;
+
+    uint32_t sent = 0;
+    for (;;) {
+        uint32_t flight = tcp_tx_flight(s);
+        uint32_t pending = s->tx_buffer_offset - flight;
+        uint32_t window = SEQUENCE_GT(s->tx_win_high, s->tx_win_low) ? s->tx_win_high - s->tx_win_low : 0;
+        window = MIN(window, s->cwnd);
+        LTRACEF("flight %u, pending %u, window %u\n", flight, pending, window);
+
+        if (pending == 0) {
+            /* everything is out, follow it with our FIN if close has been called */
+            if (s->fin_queued) {
+                s->fin_seq = s->tx_highest_seq;
+                tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->fin_seq);
+                s->fin_sent = true;
+                s->tx_highest_seq++;
+                if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+                    s->tx_max_seq = s->tx_highest_seq;
+                sent++;
+            }
+            break;
+        }
 
-static ssize_t tcp_retransmit(tcp_socket_t *s) {
-    DEBUG_ASSERT(s);
-    DEBUG_ASSERT(is_mutex_held(&s->lock));
+        if (flight >= window)
+            break;
 
-    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
-        return 0;
+        /* don't send a runt while there is more data waiting for the window to open */
+        uint32_t tosend = MIN(MIN(max_send, pending), window - flight);
+        if (tosend < s->mss && tosend < pending && flight > 0)
+            break;
 
-    /* how much data have we sent but not gotten an ack for? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    if (outstanding == 0)
-        return 0;
+        bool new_data = SEQUENCE_GTE(s->tx_highest_seq, s->tx_max_seq);
+        if (new_data && !s->ts_ok && !s->rtt_timing) {
+            s->rtt_timing = true;
+            s->rtt_seq = s->tx_highest_seq;
+            s->rtt_start = current_time();
+        }
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+        tosend = tcp_send_data(s, s->tx_highest_seq, tosend, PKT_ACK);
+        if (tosend == 0)
+            break;
+        s->tx_highest_seq += tosend;
+        if (new_data) {
+            s->tx_max_seq = s->tx_highest_seq;
+            tcp_counters.bytes_out += tosend;
+        } else {
+            tcp_counters.retransmit_segs++;
+            tcp_counters.retransmit_bytes += tosend;
+        }
+        sent += tosend;
+    }
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    /* make sure the retransmit timer is running if we have anything outstanding,
+     * or a zero window to probe */
+    if (sent > 0 || (s->tx_buffer_offset > 0 && tcp_tx_flight(s) == 0)) {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+    }
 
-    return tosend;
+    return sent;
 }
 
 static void handle_retransmit_timeout(void *_s) {
@@ -875,10 +1616,40 @@ static void handle_retransmit_timeout(void *_s) {
 
     mutex_acquire(&s->lock);
 
-    if (tcp_retransmit(s) == 0)
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT &&
+            s->state != STATE_FIN_WAIT_1 && s->state != STATE_CLOSING && s->state != STATE_LAST_ACK)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* back the timer off for whatever we do next */
+    s->rto = MIN(s->rto * 2, MAX_RTO);
+
+    uint32_t flight = tcp_tx_flight(s);
+    bool window_shut = (s->tx_win_high == s->tx_win_low);
+    if (flight == 0 || (window_shut && flight == 1 && !s->fin_sent)) {
+        if (s->tx_buffer_offset > 0 && !s->fin_sent) {
+            /* their window is shut, probe it with a byte, this is not a loss */
+            tcp_send_data(s, s->tx_win_low, 1, PKT_ACK);
+            s->tx_highest_seq = s->tx_win_low + 1;
+            if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+                s->tx_max_seq = s->tx_highest_seq;
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+        }
+        goto done;
+    }
+
+    tcp_counters.timeouts++;
+
+    /* rfc 5681 section 3.1: collapse to one segment and slow start from the first hole */
+    s->ssthresh = MAX(flight / 2, 2 * s->mss);
+    s->cwnd = s->mss;
+    s->dupacks = 0;
+    s->in_recovery = false;
+    s->recover = s->tx_max_seq;
+    s->rtt_timing = false;
+
+    s->tx_highest_seq = s->tx_win_low;
+    s->fin_sent = false;
+    tcp_write_pending_data(s);
 
 done:
     mutex_release(&s->lock);
@@ -945,7 +1716,7 @@ static void tcp_remote_close(tcp_socket_t *s) {
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers) {
+static tcp_socket_t *create_tcp_socket(void) {
     tcp_socket_t *s;
 
     s = calloc(1, sizeof(tcp_socket_t));
@@ -957,47 +1728,66 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers) {
 
     s->state = STATE_CLOSED;
     s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
+    list_initialize(&s->rx_queue);
     event_init(&s->rx_event, false, 0);
 
-    s->mss = DEFAULT_MSS;
+    tcp_set_mss(s, DEFAULT_MSS);
+    s->rto = INITIAL_RTO;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_max_seq = s->tx_win_low;
+    s->recover = s->tx_win_low;
+    s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
+    list_initialize(&s->tx_queue);
     event_init(&s->tx_event, true, 0);
 
-    if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
-    }
-
     sem_init(&s->accept_sem, 0);
     event_init(&s->connect_event, false, 0);
 
     return s;
 }
 
+/* clamp the rx and tx queue limits set in the socket, and pick the window scale
+ * needed to advertise all of the rx queue. The queues themselves are pktbufs
+ * taken from the pool as data comes and goes. */
+static void tcp_size_buffers(tcp_socket_t *s) {
+    s->rx_win_size = MIN(s->rx_win_size, MAX_BUFFER_SIZE);
+    s->tx_buffer_size = MIN(s->tx_buffer_size, MAX_BUFFER_SIZE);
+
+    s->rx_wscale = 0;
+    while ((s->rx_win_size >> s->rx_wscale) > 0xffff && s->rx_wscale < TCP_MAX_WSCALE)
+        s->rx_wscale++;
+}
+
 /* user api */
 status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port) {
+    return tcp_connect_etc(handle, addr, port, 0, 0);
+}
+
+status_t tcp_connect_etc(tcp_socket_t **handle, uint32_t addr, uint16_t port, size_t rx_size, size_t tx_size) {
     tcp_socket_t *s;
 
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(true);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
+    if (rx_size)
+        s->rx_win_size = rx_size;
+    if (tx_size)
+        s->tx_buffer_size = tx_size;
+    tcp_size_buffers(s);
+
     // XXX add some entropy to try to better randomize things
     lk_bigtime_t t = current_time_hires();
     rand_add_entropy(&t, sizeof(t));
 
     // set up the socket for outgoing connections
-    s->local_ip = minip_get_ipaddr();
+    s->local_ip = minip_src_addr(addr);
     s->local_port = (rand() + 1024) & 0xffff; // TODO: allocate sanely
     DEBUG_ASSERT(s->local_port <= 0xffff);
     s->remote_ip = addr;
@@ -1012,14 +1802,13 @@ status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port) {
 
     s->state = STATE_SYN_SENT;
     add_socket_to_list(s);
+    tcp_counters.active_opens++;
 
-    /* set up a mss option for sending back */
-    tcp_mss_option_t mss_option;
-    mss_option.kind = 0x2;
-    mss_option.len = 0x4;
-    mss_option.mss = ntohs(s->mss);
+    /* offer window scaling and timestamps, they get turned off if the SYN|ACK doesn't have them */
+    uint8_t syn_options[20];
+    size_t syn_options_len = build_syn_options(s, syn_options, true, true);
 
-    tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, NULL, 0, PKT_SYN, &mss_option, 0x4, 0, s->tx_win_low, s->rx_win_size);
+    tcp_socket_send(s, NULL, 0, PKT_SYN, syn_options, syn_options_len, s->tx_win_low);
 
     // TODO: handle retransmit
 
@@ -1048,7 +1837,7 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port) {
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1066,6 +1855,30 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port) {
     return NO_ERROR;
 }
 
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size) {
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&s->lock);
+
+    /* only the sizes for connections yet to be accepted can change */
+    if (s->state != STATE_LISTEN) {
+        err = ERR_BAD_STATE;
+    } else {
+        if (rx_size)
+            s->rx_win_size = MIN(rx_size, MAX_BUFFER_SIZE);
+        if (tx_size)
+            s->tx_buffer_size = MIN(tx_size, MAX_BUFFER_SIZE);
+    }
+
+    mutex_release(&s->lock);
+
+    return err;
+}
+
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout) {
     if (!listen_socket || !accept_socket)
         return ERR_INVALID_ARGS;
@@ -1092,6 +1905,41 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
     return NO_ERROR;
 }
 
+/* copy up to len bytes off the front of the rx queue */
+static size_t tcp_rx_copy(tcp_socket_t *s, uint8_t *buf, size_t len) {
+    size_t copied = 0;
+    pktbuf_t *p;
+    while (copied < len && (p = list_peek_head_type(&s->rx_queue, pktbuf_t, list)) != NULL) {
+        size_t n = MIN(p->dlen, len - copied);
+        memcpy(buf + copied, p->data, n);
+        pktbuf_consume(p, n);
+        copied += n;
+
+        if (p->dlen == 0) {
+            list_delete(&p->list);
+            pktbuf_free(p, false);
+        }
+    }
+
+    s->rx_queued -= copied;
+    return copied;
+}
+
+/* called after the reader has taken data off the rx queue */
+static void tcp_rx_consumed(tcp_socket_t *s) {
+    /* if we've used up the last byte in the read queue, unsignal the read event */
+    if (s->state == STATE_ESTABLISHED && s->rx_queued == 0) {
+        event_unsignal(&s->rx_event);
+    }
+
+    /* we've read something, make sure the other end knows that our window is opening */
+    uint32_t new_rx_win_size = s->rx_win_size - s->rx_queued;
+
+    /* if we've opened it enough, send an ack */
+    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
+        send_ack(s);
+}
+
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len) {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
     if (!socket)
@@ -1111,8 +1959,8 @@ retry:
 
     mutex_acquire(&s->lock);
 
-    /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
+    /* try to read some data from the receive queue, even if we're closed */
+    ret = tcp_rx_copy(s, buf, len);
     if (ret == 0) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED) {
@@ -1126,18 +1974,50 @@ retry:
         goto retry;
     }
 
-    /* if we've used up the last byte in the read buffer, unsignal the read event */
-    size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
-    if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
+    tcp_rx_consumed(s);
+
+out:
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return ret;
+}
+
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p) {
+    LTRACEF("socket %p\n", socket);
+    if (!socket || !p)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = 0;
+retry:
+    /* block on available data */
+    event_wait(&s->rx_event);
+
+    mutex_acquire(&s->lock);
+
+    /* hand over the first queued pktbuf, even if we're closed */
+    pktbuf_t *head = list_remove_head_type(&s->rx_queue, pktbuf_t, list);
+    if (!head) {
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED) {
+            ret = ERR_CHANNEL_CLOSED;
+            goto out;
+        }
+
+        /* we must have raced with another thread */
         event_unsignal(&s->rx_event);
+        mutex_release(&s->lock);
+        goto retry;
     }
 
-    /* we've read something, make sure the other end knows that our window is opening */
-    uint32_t new_rx_win_size = s->rx_win_size - remaining_bytes;
+    s->rx_queued -= head->dlen;
+    ret = head->dlen;
+    *p = head;
 
-    /* if we've opened it enough, send an ack */
-    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
-        send_ack(s);
+    tcp_rx_consumed(s);
 
 out:
     mutex_release(&s->lock);
@@ -1158,11 +2038,13 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
     tcp_socket_t *s = socket;
     inc_socket_ref(s);
 
+    ssize_t ret = len;
+    pktbuf_t *spare = NULL;
     size_t off = 0;
     while (off < len) {
         LTRACEF("off %zu, len %zu\n", off, len);
 
-        /* wait for the tx buffer to open up */
+        /* wait for the tx queue to open up */
         event_wait(&s->tx_event);
         LTRACEF("after event_wait\n");
 
@@ -1171,39 +2053,164 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
             mutex_release(&s->lock);
-            dec_socket_ref(s);
-            return ERR_CHANNEL_CLOSED;
+            ret = ERR_CHANNEL_CLOSED;
+            break;
         }
 
         DEBUG_ASSERT(s->tx_buffer_size > 0);
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
         /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
+        size_t space = (s->tx_buffer_offset < s->tx_buffer_size) ? s->tx_buffer_size - s->tx_buffer_offset : 0;
+        size_t to_copy = MIN(space, len - off);
         if (to_copy == 0) {
             mutex_release(&s->lock);
             continue;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
-        s->tx_buffer_offset += to_copy;
+        size_t copied = tcp_tx_append(s, (const uint8_t *)buf + off, to_copy, &spare);
 
         /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        if (s->tx_buffer_offset >= s->tx_buffer_size) {
             event_unsignal(&s->tx_event);
         }
 
         /* send as much data as we can */
         tcp_write_pending_data(s);
 
-        off += to_copy;
+        off += copied;
 
         mutex_release(&s->lock);
+
+        /* out of pktbufs, wait for one without holding up the socket */
+        if (copied < to_copy)
+            spare = pktbuf_alloc();
     }
 
+    if (spare)
+        pktbuf_free(spare, true);
+
     dec_socket_ref(s);
-    return len;
+    return ret;
+}
+
+ssize_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p) {
+    LTRACEF("socket %p, p %p\n", socket, p);
+    if (!socket || !p)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    size_t len = p->dlen;
+    if (len == 0) {
+        pktbuf_free(p, true);
+        return 0;
+    }
+
+    inc_socket_ref(s);
+
+    ssize_t ret = len;
+    for (;;) {
+        /* wait for the tx queue to open up */
+        event_wait(&s->tx_event);
+
+        mutex_acquire(&s->lock);
+
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+            mutex_release(&s->lock);
+            pktbuf_free(p, true);
+            ret = ERR_CHANNEL_CLOSED;
+            break;
+        }
+
+        /* it can only be queued as is if it can be sent as one segment, in place */
+        if (len > s->mss || pktbuf_avail_head(p) < TCP_SEG_HEADROOM || pktbuf_is_shared(p)) {
+            mutex_release(&s->lock);
+            ret = tcp_write(s, p->data, len);
+            pktbuf_free(p, true);
+            break;
+        }
+
+        /* wait for room for all of it, unless the queue is empty */
+        if (s->tx_buffer_offset > 0 && s->tx_buffer_offset + len > s->tx_buffer_size) {
+            event_unsignal(&s->tx_event);
+            mutex_release(&s->lock);
+            continue;
+        }
+
+        list_add_tail(&s->tx_queue, &p->list);
+        s->tx_buffer_offset += len;
+
+        if (s->tx_buffer_offset >= s->tx_buffer_size) {
+            event_unsignal(&s->tx_event);
+        }
+
+        /* send as much data as we can */
+        tcp_write_pending_data(s);
+
+        mutex_release(&s->lock);
+        break;
+    }
+
+    dec_socket_ref(s);
+    return ret;
+}
+
+uint32_t tcp_get_mss(tcp_socket_t *s) {
+    mutex_acquire(&s->lock);
+    uint32_t mss = (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) ? s->mss : 0;
+    mutex_release(&s->lock);
+    return mss;
+}
+
+ssize_t tcp_write_segs(tcp_socket_t *socket, struct list_node *segs, size_t len) {
+    LTRACEF("socket %p, len %zu\n", socket, len);
+    DEBUG_ASSERT(socket && segs);
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = len;
+    for (;;) {
+        /* wait for the tx queue to open up */
+        event_wait(&s->tx_event);
+
+        mutex_acquire(&s->lock);
+
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+            mutex_release(&s->lock);
+            free_pktbuf_list(segs);
+            ret = ERR_CHANNEL_CLOSED;
+            break;
+        }
+
+        /* wait for room for all of it, unless the queue is empty */
+        if (s->tx_buffer_offset > 0 && s->tx_buffer_offset + len > s->tx_buffer_size) {
+            event_unsignal(&s->tx_event);
+            mutex_release(&s->lock);
+            continue;
+        }
+
+        pktbuf_t *p;
+        while ((p = list_remove_head_type(segs, pktbuf_t, list)) != NULL) {
+            DEBUG_ASSERT(p->dlen <= s->mss);
+            list_add_tail(&s->tx_queue, &p->list);
+        }
+        s->tx_buffer_offset += len;
+
+        if (s->tx_buffer_offset >= s->tx_buffer_size) {
+            event_unsignal(&s->tx_event);
+        }
+
+        /* send as much data as we can */
+        tcp_write_pending_data(s);
+
+        mutex_release(&s->lock);
+        break;
+    }
+
+    dec_socket_ref(s);
+    return ret;
 }
 
 status_t tcp_close(tcp_socket_t *socket) {
@@ -1236,17 +2243,17 @@ status_t tcp_close(tcp_socket_t *socket) {
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
-            s->tx_win_low++;
+
+            /* the FIN goes out behind any data still queued */
+            s->fin_queued = true;
+            tcp_write_pending_data(s);
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
-            s->tx_win_low++;
-
-            // XXX set up fin retransmit timer here
+            s->fin_queued = true;
+            tcp_write_pending_data(s);
             break;
         case STATE_SYN_SENT:
         case STATE_FIN_WAIT_1:
@@ -1284,6 +2291,7 @@ usage:
         printf("usage: %s sockets\n", argv[0].str);
         printf("usage: %s listenclose <port>\n", argv[0].str);
         printf("usage: %s listen <port>\n", argv[0].str);
+        printf("usage: %s stats\n", argv[0].str);
         printf("usage: %s debug\n", argv[0].str);
         return ERR_INVALID_ARGS;
     }
@@ -1348,6 +2356,8 @@ usage:
 
         err = tcp_close(handle);
         printf("tcp_close returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "stats")) {
+        dump_counters();
     } else if (!strcmp(argv[1].str, "debug")) {
         tcp_debug = !tcp_debug;
         printf("tcp debug now %u\n", tcp_debug);
@@ -17,10 +17,12 @@
 #include <malloc.h>
 #include <stdint.h>
 #include <lk/trace.h>
+#include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
 
-static struct list_node udp_list = LIST_INITIAL_VALUE(udp_list);
+/* listeners hashed by local port, each bucket with its own lock */
+#define UDP_HASH_SIZE 32
 
 struct udp_listener {
     struct list_node list;
@@ -29,6 +31,22 @@ struct udp_listener {
     void *arg;
 };
 
+static struct udp_bucket {
+    spin_lock_t lock;
+    struct list_node list;
+} udp_hash[UDP_HASH_SIZE];
+
+static struct udp_bucket *udp_hash_bucket(uint16_t port) {
+    return &udp_hash[port % UDP_HASH_SIZE];
+}
+
+void udp_init(void) {
+    for (size_t i = 0; i < countof(udp_hash); i++) {
+        udp_hash[i].lock = SPIN_LOCK_INITIAL_VALUE;
+        list_initialize(&udp_hash[i].list);
+    }
+}
+
 typedef struct udp_socket {
     uint32_t host;
     uint16_t sport;
@@ -45,27 +63,42 @@ typedef struct udp_hdr {
 
 
 int udp_listen(uint16_t port, udp_callback_t cb, void *arg) {
-    struct udp_listener *entry, *temp;
+    struct udp_bucket *b = udp_hash_bucket(port);
+    struct udp_listener *entry, *new_entry = NULL;
+    spin_lock_saved_state_t state;
+
+    /* allocate outside of the lock */
+    if (cb != NULL) {
+        if ((new_entry = malloc(sizeof(struct udp_listener))) == NULL) {
+            return -1;
+        }
+
+        new_entry->port = port;
+        new_entry->callback = cb;
+        new_entry->arg = arg;
+    }
 
-    list_for_every_entry_safe(&udp_list, entry, temp, struct udp_listener, list) {
+    spin_lock_irqsave(&b->lock, state);
+
+    list_for_every_entry(&b->list, entry, struct udp_listener, list) {
         if (entry->port == port) {
             if (cb == NULL) {
                 list_delete(&entry->list);
+                spin_unlock_irqrestore(&b->lock, state);
+                free(entry);
                 return 0;
             }
+            spin_unlock_irqrestore(&b->lock, state);
+            free(new_entry);
             return -1;
         }
     }
 
-    if ((entry = malloc(sizeof(struct udp_listener))) == NULL) {
-        return -1;
+    if (new_entry) {
+        list_add_tail(&b->list, &new_entry->list);
     }
 
-    entry->port = port;
-    entry->callback = cb;
-    entry->arg = arg;
-
-    list_add_tail(&udp_list, &entry->list);
+    spin_unlock_irqrestore(&b->lock, state);
 
     return 0;
 }
@@ -150,7 +183,7 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
 
     LTRACEF("packet paylod len %ld\n", len);
 
-    minip_tx_handler(minip_tx_arg, p);
+    minip_tx(p, handle->host);
 
     return ret;
 }
@@ -174,6 +207,9 @@ void udp_input(pktbuf_t *p, uint32_t src_ip) {
     udp_hdr_t *udp;
     struct udp_listener *e;
     uint16_t port;
+    udp_callback_t callback = NULL;
+    void *arg = NULL;
+    spin_lock_saved_state_t state;
 
     if ((udp = pktbuf_consume(p, sizeof(udp_hdr_t))) == NULL) {
         return;
@@ -181,10 +217,19 @@ void udp_input(pktbuf_t *p, uint32_t src_ip) {
 
     port = ntohs(udp->dst_port);
 
-    list_for_every_entry(&udp_list, e, struct udp_listener, list) {
+    /* copy the callback out so it runs without the bucket locked */
+    struct udp_bucket *b = udp_hash_bucket(port);
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, e, struct udp_listener, list) {
         if (e->port == port) {
-            e->callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), e->arg);
-            return;
+            callback = e->callback;
+            arg = e->arg;
+            break;
         }
     }
+    spin_unlock_irqrestore(&b->lock, state);
+
+    if (callback) {
+        callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), arg);
+    }
 }
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/err.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* start sampling every cpu each period msecs, dropping any earlier samples */
+status_t profiler_start(lk_time_t period);
+void profiler_stop(void);
+
+/* the top pcs by sample count */
+void profiler_dump(uint top);
+
+/* every distinct backtrace and its sample count, one per line, outermost
+ * frame first, in the folded format flamegraph.pl takes */
+void profiler_dump_folded(void);
+
+__END_CDECLS
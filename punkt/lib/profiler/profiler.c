@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2021 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/profiler.h>
+
+#include <arch/ops.h>
+#include <arch/perf.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * A sampling profiler. A periodic timer on each cpu looks at what its tick
+ * interrupted and saves the pc, plus the return addresses found walking the
+ * frame pointer chain, in that cpu's sample buffer. Only the cpu itself writes
+ * its buffer, from its timer interrupt, so there is no locking on the way in.
+ *
+ * There is no symbol table in the kernel, so dumps are in addresses; feed them
+ * to addr2line -f -e lk.elf. The folded output is what flamegraph.pl takes
+ * once the addresses are swapped for names.
+ */
+
+/* samples kept per cpu, beyond which they are counted and dropped */
+#ifndef PROFILER_SAMPLES
+#define PROFILER_SAMPLES 8192
+#endif
+
+/* frames in each backtrace, including the interrupted pc */
+#ifndef PROFILER_MAX_DEPTH
+#define PROFILER_MAX_DEPTH 8
+#endif
+
+#define SAMPLE_FLAG_USER (1u << 0) // interrupted user code, so just the pc
+#define SAMPLE_FLAG_IDLE (1u << 1) // interrupted the idle thread
+
+struct profile_sample {
+    vaddr_t pc[PROFILER_MAX_DEPTH]; // innermost first
+    uint8_t depth;
+    uint8_t flags;
+};
+
+static struct profile_cpu {
+    timer_t timer;
+    struct profile_sample *samples;
+    uint count;
+    uint dropped; // buffer was full
+    uint missed;  // the timer didn't come by way of an interrupt we could see
+} profile_cpus[SMP_MAX_CPUS];
+
+static mutex_t profile_lock = MUTEX_INITIAL_VALUE(profile_lock);
+static volatile bool profiling;
+static lk_time_t profile_period;
+
+/* add the return addresses from the frame pointer chain starting at fp,
+ * trusting only frames that lie within the thread's stack and move up it */
+static void profile_unwind(struct profile_sample *s, vaddr_t fp, const thread_t *t) {
+    vaddr_t lo = (vaddr_t)t->stack;
+    vaddr_t hi = lo + t->stack_size;
+
+    while (s->depth < PROFILER_MAX_DEPTH) {
+        if (fp < lo || fp > hi - 2 * sizeof(vaddr_t) || (fp & (sizeof(vaddr_t) - 1)))
+            break;
+
+        const vaddr_t *frame = (const vaddr_t *)fp;
+        if (frame[1] == 0)
+            break;
+        s->pc[s->depth++] = frame[1];
+
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+}
+
+static enum handler_return profile_tick(struct timer *timer, lk_time_t now, void *arg) {
+    struct profile_cpu *cpu = arg;
+
+    if (!profiling)
+        return INT_NO_RESCHEDULE;
+
+    if (cpu->count >= PROFILER_SAMPLES) {
+        cpu->dropped++;
+        return INT_NO_RESCHEDULE;
+    }
+
+    vaddr_t pc, fp;
+    bool user;
+    if (!arch_perf_irq_context(&pc, &fp, &user)) {
+        cpu->missed++;
+        return INT_NO_RESCHEDULE;
+    }
+
+    thread_t *t = get_current_thread();
+    struct profile_sample *s = &cpu->samples[cpu->count];
+    s->pc[0] = pc;
+    s->depth = 1;
+    s->flags = 0;
+    if (t->flags & THREAD_FLAG_IDLE)
+        s->flags |= SAMPLE_FLAG_IDLE;
+    if (user)
+        s->flags |= SAMPLE_FLAG_USER;
+    else
+        profile_unwind(s, fp, t);
+
+    /* a dump can be looking at the samples while we run */
+    smp_wmb();
+    cpu->count++;
+
+    return INT_NO_RESCHEDULE;
+}
+
+/* start or stop the timer on the cpu this runs on, pinned there by profile_on_cpus */
+static int profile_cpu_thread(void *arg) {
+    struct profile_cpu *cpu = &profile_cpus[arch_curr_cpu_num()];
+
+    if (arg)
+        timer_set_periodic(&cpu->timer, profile_period, &profile_tick, cpu);
+    else
+        timer_cancel(&cpu->timer);
+
+    return 0;
+}
+
+static void profile_on_cpus(bool start) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i) || !profile_cpus[i].samples)
+            continue;
+
+        thread_t *t = thread_create("profiler", &profile_cpu_thread, start ? (void *)1 : NULL,
+                                    HIGHEST_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t)
+            continue;
+        thread_set_pinned_cpu(t, i);
+        thread_resume(t);
+        thread_join(t, NULL, INFINITE_TIME);
+    }
+}
+
+status_t profiler_start(lk_time_t period) {
+    mutex_acquire(&profile_lock);
+
+    if (profiling) {
+        mutex_release(&profile_lock);
+        return ERR_ALREADY_STARTED;
+    }
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct profile_cpu *cpu = &profile_cpus[i];
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        if (!cpu->samples) {
+            timer_initialize(&cpu->timer);
+            cpu->samples = malloc(PROFILER_SAMPLES * sizeof(struct profile_sample));
+            if (!cpu->samples) {
+                mutex_release(&profile_lock);
+                return ERR_NO_MEMORY;
+            }
+        }
+        cpu->count = cpu->dropped = cpu->missed = 0;
+    }
+
+    LTRACEF("period %u\n", period);
+
+    profile_period = period;
+    profiling = true;
+    profile_on_cpus(true);
+
+    mutex_release(&profile_lock);
+    return NO_ERROR;
+}
+
+void profiler_stop(void) {
+    mutex_acquire(&profile_lock);
+    if (profiling) {
+        profiling = false;
+        profile_on_cpus(false);
+    }
+    mutex_release(&profile_lock);
+}
+
+/* pointers to every kernel sample, or NULL if there are none */
+static struct profile_sample **profile_collect(size_t *countp) {
+    size_t total = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        total += profile_cpus[i].samples ? profile_cpus[i].count : 0;
+    }
+
+    struct profile_sample **v = total ? malloc(total * sizeof(*v)) : NULL;
+    size_t count = 0;
+    for (uint i = 0; v && i < SMP_MAX_CPUS; i++) {
+        for (uint j = 0; profile_cpus[i].samples && j < profile_cpus[i].count; j++) {
+            struct profile_sample *s = &profile_cpus[i].samples[j];
+            if (!(s->flags & (SAMPLE_FLAG_IDLE | SAMPLE_FLAG_USER)))
+                v[count++] = s;
+        }
+    }
+
+    *countp = count;
+    return v;
+}
+
+static int sample_pc_cmp(const void *a, const void *b) {
+    vaddr_t pa = (*(struct profile_sample * const *)a)->pc[0];
+    vaddr_t pb = (*(struct profile_sample * const *)b)->pc[0];
+    return (pa > pb) - (pa < pb);
+}
+
+/* by backtrace, outermost frame first so the folded lines come out sorted */
+static int sample_stack_cmp(const void *a, const void *b) {
+    const struct profile_sample *sa = *(struct profile_sample * const *)a;
+    const struct profile_sample *sb = *(struct profile_sample * const *)b;
+
+    for (int i = sa->depth - 1, j = sb->depth - 1; i >= 0 && j >= 0; i--, j--) {
+        if (sa->pc[i] != sb->pc[j])
+            return (sa->pc[i] > sb->pc[j]) - (sa->pc[i] < sb->pc[j]);
+    }
+    return (int)sa->depth - (int)sb->depth;
+}
+
+struct pc_count {
+    vaddr_t pc;
+    uint count;
+};
+
+static int pc_count_cmp(const void *a, const void *b) {
+    const struct pc_count *ca = a, *cb = b;
+    return (cb->count > ca->count) - (cb->count < ca->count);
+}
+
+static void profile_dump_summary(void) {
+    uint total = 0, idle = 0, user = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const struct profile_cpu *cpu = &profile_cpus[i];
+        if (!cpu->samples)
+            continue;
+
+        for (uint j = 0; j < cpu->count; j++) {
+            if (cpu->samples[j].flags & SAMPLE_FLAG_IDLE)
+                idle++;
+            else if (cpu->samples[j].flags & SAMPLE_FLAG_USER)
+                user++;
+        }
+        total += cpu->count;
+        printf("cpu %u: %u samples, %u dropped, %u missed\n", i, cpu->count, cpu->dropped, cpu->missed);
+    }
+    printf("%u samples every %u ms: %u kernel, %u user, %u idle\n",
+           total, profile_period, total - idle - user, user, idle);
+}
+
+void profiler_dump(uint top) {
+    mutex_acquire(&profile_lock);
+
+    profile_dump_summary();
+
+    size_t count;
+    struct profile_sample **v = profile_collect(&count);
+    if (!v) {
+        mutex_release(&profile_lock);
+        return;
+    }
+
+    /* sort by pc and squash each run into a count */
+    qsort(v, count, sizeof(*v), &sample_pc_cmp);
+    struct pc_count *pcs = malloc(count * sizeof(*pcs));
+    size_t npcs = 0;
+    for (size_t i = 0; pcs && i < count; i++) {
+        if (npcs > 0 && pcs[npcs - 1].pc == v[i]->pc[0]) {
+            pcs[npcs - 1].count++;
+        } else {
+            pcs[npcs].pc = v[i]->pc[0];
+            pcs[npcs].count = 1;
+            npcs++;
+        }
+    }
+
+    if (pcs) {
+        qsort(pcs, npcs, sizeof(*pcs), &pc_count_cmp);
+
+        printf("%8s %7s  %s\n", "samples", "percent", "pc");
+        for (size_t i = 0; i < npcs && i < top; i++) {
+            uint pct = pcs[i].count * 10000 / count;
+            printf("%8u %4u.%02u%%  %#lx\n", pcs[i].count, pct / 100, pct % 100, pcs[i].pc);
+        }
+    }
+
+    free(pcs);
+    free(v);
+    mutex_release(&profile_lock);
+}
+
+void profiler_dump_folded(void) {
+    mutex_acquire(&profile_lock);
+
+    size_t count;
+    struct profile_sample **v = profile_collect(&count);
+    if (!v) {
+        mutex_release(&profile_lock);
+        return;
+    }
+
+    qsort(v, count, sizeof(*v), &sample_stack_cmp);
+    for (size_t i = 0; i < count;) {
+        size_t run = 1;
+        while (i + run < count && sample_stack_cmp(&v[i], &v[i + run]) == 0)
+            run++;
+
+        const struct profile_sample *s = v[i];
+        for (int j = s->depth - 1; j >= 0; j--) {
+            printf("%#lx%s", s->pc[j], j ? ";" : "");
+        }
+        printf(" %zu\n", run);
+
+        i += run;
+    }
+
+    free(v);
+    mutex_release(&profile_lock);
+}
+
+static int cmd_profile(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s start [period msecs]\n", argv[0].str);
+        printf("%s stop\n", argv[0].str);
+        printf("%s dump [top count]\n", argv[0].str);
+        printf("%s folded\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "start")) {
+        lk_time_t period = (argc > 2) ? argv[2].u : 1;
+        status_t err = profiler_start(period);
+        if (err < 0) {
+            printf("error %d starting profiler\n", err);
+            return err;
+        }
+    } else if (!strcmp(argv[1].str, "stop")) {
+        profiler_stop();
+    } else if (!strcmp(argv[1].str, "dump")) {
+        profiler_dump((argc > 2) ? argv[2].u : 20);
+    } else if (!strcmp(argv[1].str, "folded")) {
+        profiler_dump_folded();
+    } else {
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("profile", "sampling profiler", &cmd_profile)
+STATIC_COMMAND_END(profiler);
@@ -0,0 +1,11 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS := \
+	$(LOCAL_DIR)/profiler.c \
+
+# the backtraces follow the frame pointer chain
+GLOBAL_COMPILEFLAGS += -fno-omit-frame-pointer
+
+include make/module.mk
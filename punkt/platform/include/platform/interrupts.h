@@ -34,6 +34,11 @@ void register_int_handler_msi(unsigned int vector, int_handler handler, void *ar
  */
 status_t platform_allocate_interrupts(size_t count, uint align_log2, bool msi, unsigned int *vector);
 
+/* Give back a run of interrupts from platform_allocate_interrupts, dropping any
+ * handler registered on them. The source should already be masked.
+ */
+status_t platform_free_interrupts(unsigned int vector, size_t count);
+
 /* Map the incoming interrupt line number from the pci bus config to raw
  * vector number, usable in the above apis.
  */
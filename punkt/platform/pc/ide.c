@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <lk/err.h>
 #include <malloc.h>
+#include <string.h>
 #include <arch/x86.h>
 #include <sys/types.h>
 #include <platform/interrupts.h>
@@ -21,6 +22,7 @@
 #include <dev/driver.h>
 #include <dev/class/block.h>
 #include <kernel/event.h>
+#include <vm/vm.h>
 
 #if WITH_DEV_BUS_PCI
 #include <dev/bus/pci.h>
@@ -79,6 +81,31 @@
 #define IDE_TIMEOUT         9
 #define IDE_DMAERROR        10
 
+// bus master ide registers, relative to the channel's base in BAR 4
+#define IDE_BM_REG_COMMAND  0
+#define IDE_BM_REG_STATUS   2
+#define IDE_BM_REG_PRDT     4
+
+#define IDE_BM_CMD_START    0x01
+#define IDE_BM_CMD_READ     0x08 // device to memory
+
+#define IDE_BM_STATUS_ACTIVE 0x01
+#define IDE_BM_STATUS_ERROR  0x02
+#define IDE_BM_STATUS_IRQ    0x04
+#define IDE_BM_STATUS_DRV_DMA 0x60 // drive 0/1 dma capable, read/write
+
+// physical region descriptor, entries may not cross a 64KB boundary
+struct ide_prd {
+    uint32_t addr;
+    uint16_t len; // 0 means 64KB
+    uint16_t flags;
+};
+#define IDE_PRD_EOT 0x8000
+
+#define IDE_PRD_MAX         64
+#define IDE_MAX_SECTORS     256
+#define IDE_DMA_BOUNCE_SIZE (IDE_MAX_SECTORS * 512)
+
 enum {
     IDE_REG_DATA            = 0,
     IDE_REG_ERROR           = 1,
@@ -135,11 +162,19 @@ struct ide_driver_state {
     const uint16_t *regs;
 
     event_t completion;
+    volatile uint8_t status; // status register as read by the irq handler
+
+    // bus master dma, bm_base is 0 if the channel has none
+    uint16_t bm_base;
+    struct ide_prd *prdt;
+    paddr_t prdt_phys;
+    uint8_t *bounce; // for buffers the controller cannot reach directly
 
     int type[2];
     struct {
         int sectors;
         int sector_size;
+        bool dma;
     } drive[2];
 };
 
@@ -200,6 +235,8 @@ static void ide_detect_drives(struct device *dev);
 static int ide_wait_for_completion(struct device *dev);
 static int ide_detect_ata(struct device *dev, int index);
 static void ide_lba_setup(struct device *dev, uint32_t addr, int index);
+static status_t ide_dma_init(struct ide_driver_state *state);
+static ssize_t ide_dma_rw(struct device *dev, int index, bool write, off_t offset, void *buf, size_t count);
 
 static status_t ide_init(struct device *dev) {
     status_t res = NO_ERROR;
@@ -254,6 +291,18 @@ static status_t ide_init(struct device *dev) {
         state->irq = ide_device_irqs[config->legacy_index & 0x7f];
         state->regs = ide_device_regs[config->legacy_index & 0x7f];
         state->type[0] = state->type[1] = TYPE_NONE;
+
+        // bus master registers are in the io bar 4, 8 bytes per channel
+        uint32_t bar4 = pci_config.type0.base_addresses[4];
+        if ((pci_config.program_interface & 0x80) && (bar4 & 1) && (bar4 & ~3U)) {
+            state->bm_base = (bar4 & ~3U) + 8 * (config->legacy_index & 0x7f);
+            if (ide_dma_init(state) == NO_ERROR) {
+                pci_bus_mgr_enable_device(loc);
+                LTRACEF("bus master dma at %#x\n", state->bm_base);
+            } else {
+                state->bm_base = 0;
+            }
+        }
 #else
         res = ERR_NOT_CONFIGURED;
         goto err;
@@ -293,15 +342,19 @@ static enum handler_return ide_irq_handler(void *arg) {
     struct ide_driver_state *state = dev->state;
     uint8_t val;
 
+    // reading the status register acks the drive
     val = ide_read_reg8(dev, IDE_REG_STATUS);
+    state->status = val;
 
-    if ((val & IDE_DRV_ERR) == 0) {
-        event_signal(&state->completion, false);
-
-        return INT_RESCHEDULE;
-    } else {
-        return INT_NO_RESCHEDULE;
+    if (state->bm_base) {
+        uint8_t bm_status = inp(state->bm_base + IDE_BM_REG_STATUS);
+        outp(state->bm_base + IDE_BM_REG_STATUS, (bm_status & IDE_BM_STATUS_DRV_DMA) | IDE_BM_STATUS_IRQ);
     }
+
+    // wake the waiter in either case, it looks at the saved status
+    event_signal(&state->completion, false);
+
+    return INT_RESCHEDULE;
 }
 
 static ssize_t ide_get_block_size(struct device *dev) {
@@ -332,6 +385,9 @@ static ssize_t ide_write(struct device *dev, off_t offset, const void *buf, size
     ssize_t ret = 0;
     int err;
 
+    if (state->bm_base && state->drive[index].dma)
+        return ide_dma_rw(dev, index, true, offset, (void *)buf, count);
+
     ide_device_select(dev, index);
     ide_delay_400ns(dev);
 
@@ -416,6 +472,9 @@ static ssize_t ide_read(struct device *dev, off_t offset, void *buf, size_t coun
     ssize_t ret = 0;
     int err;
 
+    if (state->bm_base && state->drive[index].dma)
+        return ide_dma_rw(dev, index, false, offset, buf, count);
+
     ide_device_select(dev, index);
     ide_delay_400ns(dev);
 
@@ -820,6 +879,9 @@ static int ide_wait_for_completion(struct device *dev) {
     if (err)
         return IDE_TIMEOUT;
 
+    if (state->status & IDE_DRV_ERR)
+        return ide_eval_error(dev);
+
     return IDE_NOERROR;
 }
 
@@ -896,6 +958,12 @@ static status_t ide_detect_ata(struct device *dev, int index) {
         state->drive[index].sector_size = 512;
     }
 
+    // word 49 bit 8: dma supported
+    state->drive[index].dma = (info[49] & (1<<8)) != 0;
+    if (state->drive[index].dma && state->bm_base) {
+        dprintf(INFO, "ide: Disk %d using bus master dma\n", index);
+    }
+
     dprintf(INFO, "ide: Disk %d supports %u sectors for a total of %u bytes\n", index, state->drive[index].sectors,
             state->drive[index].sectors * 512);
 
@@ -914,3 +982,154 @@ static void ide_lba_setup(struct device *dev, uint32_t addr, int drive) {
     ide_write_reg8(dev, IDE_REG_PRECOMP, 0xff);
 }
 
+
+// allocate the prd table and a bounce buffer, both must be reachable with 32bit addresses
+static status_t ide_dma_init(struct ide_driver_state *state) {
+    const size_t size = PAGE_SIZE + IDE_DMA_BOUNCE_SIZE;
+    void *ptr;
+
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "ide dma", size, &ptr, 0, 0, ARCH_MMU_FLAG_CACHED);
+    if (err != NO_ERROR)
+        return err;
+
+    paddr_t pa = vaddr_to_paddr(ptr);
+    if ((uint64_t)pa + size > 0x100000000ULL) {
+        LTRACEF("dma buffer at %#lx is above 4GB\n", (unsigned long)pa);
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+        return ERR_NO_RESOURCES;
+    }
+
+    state->prdt = ptr;
+    state->prdt_phys = pa;
+    state->bounce = (uint8_t *)ptr + PAGE_SIZE;
+
+    return NO_ERROR;
+}
+
+// describe buf in the prd table, merging physically contiguous pages.
+// returns false if the buffer cannot be reached by the controller.
+static bool ide_dma_build_prdt(struct ide_driver_state *state, const void *buf, size_t len) {
+    struct ide_prd *prdt = state->prdt;
+    vaddr_t va = (vaddr_t)buf;
+    size_t n = 0;
+
+    if (va & 1)
+        return false;
+
+    while (len > 0) {
+        size_t chunk = MIN(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+        paddr_t pa = vaddr_to_paddr((void *)va);
+        if (pa == 0 || (uint64_t)pa + chunk > 0x100000000ULL)
+            return false;
+
+        uint32_t prev_len = (n > 0) ? (prdt[n - 1].len ? prdt[n - 1].len : 0x10000) : 0;
+        if (n > 0 && prdt[n - 1].addr + prev_len == pa &&
+                (prdt[n - 1].addr & ~0xffffU) == ((pa + chunk - 1) & ~0xffffU)) {
+            // extend the previous entry, a length of 64KB wraps to 0
+            prdt[n - 1].len = (prev_len + chunk) & 0xffff;
+        } else {
+            if (n == IDE_PRD_MAX)
+                return false;
+            prdt[n].addr = pa;
+            prdt[n].len = chunk;
+            prdt[n].flags = 0;
+            n++;
+        }
+
+        va += chunk;
+        len -= chunk;
+    }
+
+    prdt[n - 1].flags = IDE_PRD_EOT;
+    return true;
+}
+
+// run a single dma command of up to IDE_MAX_SECTORS sectors
+static int ide_dma_transfer(struct device *dev, int index, bool write, uint32_t lba, void *buf, size_t sectors) {
+    struct ide_driver_state *state = dev->state;
+    const size_t len = sectors * 512;
+    const uint8_t dir = write ? 0 : IDE_BM_CMD_READ;
+    int err;
+
+    // go through the bounce buffer if the controller can't get at buf
+    bool bounce = !ide_dma_build_prdt(state, buf, len);
+    if (bounce) {
+        if (write)
+            memcpy(state->bounce, buf, len);
+        ide_dma_build_prdt(state, state->bounce, len);
+    }
+
+    err = ide_poll_status(dev, 0, IDE_CTRL_BSY);
+    if (err)
+        return err;
+
+    // stop the engine, load the table and clear the error and irq bits
+    outp(state->bm_base + IDE_BM_REG_COMMAND, dir);
+    outpd(state->bm_base + IDE_BM_REG_PRDT, state->prdt_phys);
+    uint8_t bm_status = inp(state->bm_base + IDE_BM_REG_STATUS);
+    outp(state->bm_base + IDE_BM_REG_STATUS,
+         (bm_status & IDE_BM_STATUS_DRV_DMA) | IDE_BM_STATUS_ERROR | IDE_BM_STATUS_IRQ);
+
+    ide_lba_setup(dev, lba, index);
+    ide_write_reg8(dev, IDE_REG_SECTOR_COUNT, (sectors == IDE_MAX_SECTORS) ? 0 : sectors);
+
+    err = ide_poll_status(dev, IDE_DRV_RDY, 0);
+    if (err)
+        return err;
+
+    // forget any interrupt left over from a previous pio transfer, a dma command
+    // raises exactly one when it is done
+    event_unsignal(&state->completion);
+
+    ide_write_reg8(dev, IDE_REG_COMMAND, write ? ATA_WRITE_DMA : ATA_READ_DMA);
+    outp(state->bm_base + IDE_BM_REG_COMMAND, dir | IDE_BM_CMD_START);
+
+    err = ide_wait_for_completion(dev);
+
+    outp(state->bm_base + IDE_BM_REG_COMMAND, dir);
+    bm_status = inp(state->bm_base + IDE_BM_REG_STATUS);
+
+    if (err)
+        return err;
+
+    if (bm_status & (IDE_BM_STATUS_ERROR | IDE_BM_STATUS_ACTIVE))
+        return IDE_DMAERROR;
+
+    if (bounce && !write)
+        memcpy(buf, state->bounce, len);
+
+    return IDE_NOERROR;
+}
+
+static ssize_t ide_dma_rw(struct device *dev, int index, bool write, off_t offset, void *buf, size_t count) {
+    uint8_t *ubuf = buf;
+    size_t sectors = count;
+    int err;
+
+    LTRACEF("%s offset %lld count %zu\n", write ? "write" : "read", (long long)offset, count);
+
+    ide_device_select(dev, index);
+    ide_delay_400ns(dev);
+
+    err = ide_poll_status(dev, 0, IDE_CTRL_BSY | IDE_DRV_DRQ);
+    if (err) {
+        LTRACEF("Error while waiting for controller: %s\n", ide_error_str[err]);
+        return ERR_GENERIC;
+    }
+
+    while (sectors > 0) {
+        size_t do_sectors = MIN(sectors, IDE_MAX_SECTORS);
+
+        err = ide_dma_transfer(dev, index, write, offset, ubuf, do_sectors);
+        if (err) {
+            LTRACEF("Error during dma transfer: %s\n", ide_error_str[err]);
+            return (err == IDE_TIMEOUT) ? ERR_TIMED_OUT : ERR_IO;
+        }
+
+        ubuf += do_sectors * 512;
+        sectors -= do_sectors;
+        offset += do_sectors;
+    }
+
+    return count;
+}
@@ -17,6 +17,7 @@
 #include <arch/ops.h>
 #include <arch/x86.h>
 #include <arch/x86/lapic.h>
+#include <arch/x86/mp.h>
 #include <kernel/spinlock.h>
 #include "platform_p.h"
 #include <platform/pc.h>
@@ -197,14 +198,38 @@ status_t platform_allocate_interrupts(size_t count, uint align_log2, bool msi, u
     return err;
 }
 
+status_t platform_free_interrupts(unsigned int vector, size_t count) {
+    LTRACEF("vector %#x count %zu\n", vector, count);
+
+    if (count == 0 || vector < INT_DYNAMIC_START || vector + count - 1 > INT_DYNAMIC_END) {
+        return ERR_INVALID_ARGS;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&lock, state);
+
+    for (unsigned int i = vector; i < vector + count; i++) {
+        int_table[i].handler = NULL;
+        int_table[i].arg = NULL;
+        int_table[i].flags.allocated = false;
+    }
+
+    spin_unlock_irqrestore(&lock, state);
+
+    return NO_ERROR;
+}
+
 status_t platform_compute_msi_values(unsigned int vector, unsigned int cpu, bool edge,
         uint64_t *msi_address_out, uint16_t *msi_data_out) {
 
     // only handle edge triggered at the moment
     DEBUG_ASSERT(edge);
 
+    // the destination field wants the local apic id, not the logical cpu number
+    const uint32_t apic_id = x86_get_percpu_for_cpu(cpu)->apic_id;
+
     *msi_data_out = (vector & 0xff) | (0<<15); // edge triggered
-    *msi_address_out = 0xfee00000 | (cpu << 12);
+    *msi_address_out = 0xfee00000 | (apic_id << 12);
 
     return NO_ERROR;
 }
@@ -34,6 +34,9 @@
 #if WITH_LIB_MINIP
 #include <lib/minip.h>
 #endif
+#if WITH_DEV_VIRTIO_NET
+#include <dev/virtio/net.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -274,6 +277,15 @@ void platform_init(void) {
 void _start_minip(uint level) {
     extern status_t e1000_register_with_minip(void);
     status_t err = e1000_register_with_minip();
+#if WITH_DEV_VIRTIO_NET
+    if (err != NO_ERROR && virtio_net_found() > 0) {
+        uint8_t mac_addr[6];
+        virtio_net_get_mac_addr(mac_addr);
+
+        minip_set_eth(virtio_net_send_minip_pkt, NULL, mac_addr);
+        err = virtio_net_start();
+    }
+#endif
     if (err == NO_ERROR) {
         minip_start_dhcp();
     }
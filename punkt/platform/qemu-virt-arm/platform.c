@@ -140,14 +140,14 @@ status_t platform_pci_int_to_vector(unsigned int pci_int, unsigned int *vector)
     return NO_ERROR;
 }
 
+// list of allocated msi interrupts
+static uint64_t msi_bitmap = 0;
+
 status_t platform_allocate_interrupts(size_t count, uint align_log2, bool msi, unsigned int *vector) {
     TRACEF("count %zu align %u msi %d\n", count, align_log2, msi);
 
     // TODO: handle nonzero alignment, count > 0, and add locking
 
-    // list of allocated msi interrupts
-    static uint64_t msi_bitmap = 0;
-
     // cannot handle allocating for anything but MSI interrupts
     if (!msi) {
         return ERR_NOT_SUPPORTED;
@@ -177,6 +177,19 @@ status_t platform_allocate_interrupts(size_t count, uint align_log2, bool msi, u
     return NO_ERROR;
 }
 
+status_t platform_free_interrupts(unsigned int vector, size_t count) {
+    if (vector < MSI_INT_BASE || vector - MSI_INT_BASE + count > sizeof(msi_bitmap) * 8) {
+        return ERR_INVALID_ARGS;
+    }
+
+    for (unsigned int i = vector; i < vector + count; i++) {
+        register_int_handler(i, NULL, NULL);
+        msi_bitmap &= ~(1ULL << (i - MSI_INT_BASE));
+    }
+
+    return NO_ERROR;
+}
+
 status_t platform_compute_msi_values(unsigned int vector, unsigned int cpu, bool edge,
                                      uint64_t *msi_address_out, uint16_t *msi_data_out) {
 
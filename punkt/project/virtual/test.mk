@@ -8,6 +8,7 @@ MODULES += \
   lib/aes/test \
   lib/cksum \
   lib/debugcommands \
+  lib/profiler \
   lib/unittest \
   lib/version \
 
@@ -22,7 +22,7 @@
 #define LOCAL_TRACE 0
 
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
-static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
+static mutex_t pmm_lock = MUTEX_INITIAL_VALUE(pmm_lock);
 
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
@@ -105,7 +105,7 @@ done_add:
 }
 
 vm_page_t *pmm_alloc_page(uint alloc_flags, paddr_t* pa) {
-    mutex_acquire(&lock);
+    mutex_acquire(&pmm_lock);
 
     /* walk the arenas in order until we find one with a free page */
     pmm_arena_t* a;
@@ -132,13 +132,13 @@ vm_page_t *pmm_alloc_page(uint alloc_flags, paddr_t* pa) {
 
         LTRACEF("allocating page %p, pa 0x%lx\n", page, PAGE_ADDRESS_FROM_ARENA(page, a));
 
-        mutex_release(&lock);
+        mutex_release(&pmm_lock);
         return page;
     }
 
     LTRACEF("failed to allocate page\n");
 
-    mutex_release(&lock);
+    mutex_release(&pmm_lock);
     return NULL;
 }
 
@@ -152,7 +152,7 @@ size_t pmm_alloc_pages(size_t count, uint alloc_flags, struct list_node *list) {
     if (count == 0)
         return 0;
 
-    mutex_acquire(&lock);
+    mutex_acquire(&pmm_lock);
 
     /* walk the arenas in order, allocating as many pages as we can from each */
     pmm_arena_t* a;
@@ -179,7 +179,7 @@ size_t pmm_alloc_pages(size_t count, uint alloc_flags, struct list_node *list) {
     }
 
 done:
-    mutex_release(&lock);
+    mutex_release(&pmm_lock);
     return allocated;
 }
 
@@ -194,7 +194,7 @@ size_t pmm_alloc_range(paddr_t address, size_t count, struct list_node *list) {
 
     address = ROUNDDOWN(address, PAGE_SIZE);
 
-    mutex_acquire(&lock);
+    mutex_acquire(&pmm_lock);
 
     /* walk through the arenas, looking to see if the physical page belongs to it */
     pmm_arena_t *a;
@@ -225,7 +225,7 @@ size_t pmm_alloc_range(paddr_t address, size_t count, struct list_node *list) {
             break;
     }
 
-    mutex_release(&lock);
+    mutex_release(&pmm_lock);
     return allocated;
 }
 
@@ -238,7 +238,7 @@ size_t pmm_alloc_contiguous(size_t count, uint alloc_flags, uint8_t align_log2,
     if (align_log2 < PAGE_SIZE_SHIFT)
         align_log2 = PAGE_SIZE_SHIFT;
 
-    mutex_acquire(&lock);
+    mutex_acquire(&pmm_lock);
 
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -300,14 +300,14 @@ retry:
             if (pa)
                 *pa = a->base + start * PAGE_SIZE;
 
-            mutex_release(&lock);
+            mutex_release(&pmm_lock);
             return count;
         }
     }
 
     LTRACEF("couldn't find run\n");
 
-    mutex_release(&lock);
+    mutex_release(&pmm_lock);
     return 0;
 }
 
@@ -316,7 +316,7 @@ size_t pmm_free(struct list_node *list) {
 
     DEBUG_ASSERT(list);
 
-    mutex_acquire(&lock);
+    mutex_acquire(&pmm_lock);
 
     size_t count = 0;
     while (!list_is_empty(list)) {
@@ -339,7 +339,7 @@ size_t pmm_free(struct list_node *list) {
         }
     }
 
-    mutex_release(&lock);
+    mutex_release(&pmm_lock);
     return count;
 }
 